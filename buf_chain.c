@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf_chain.h"
+#include "utils.h"
+
+BufChain *buf_chain_create(Slab *hdr_slab, Slab *data_slab, size_t len_hint) {
+	BufChain *c = must_malloc(sizeof(BufChain), "buf_chain_create");
+
+	size_t data_cap = slab_buf_cap(data_slab);
+	c->ref = 1;
+	c->len = 0;
+	c->hdr_slab = hdr_slab;
+	c->data_slab = data_slab;
+	c->cap = 1 + (len_hint + data_cap - 1) / data_cap;
+	c->bufs = must_malloc(c->cap * sizeof(BufRef *), "buf_chain_create bufs");
+	c->iov = must_malloc(c->cap * sizeof(struct iovec), "buf_chain_create iov");
+	memset(&c->msg, 0, sizeof(c->msg));
+
+	c->bufs[0] = slab_acquire(hdr_slab, 1);
+	c->iov[0].iov_base = c->bufs[0]->buf;
+	c->iov[0].iov_len = 0;
+	c->bufs_len = 1;
+
+	return c;
+}
+
+char *buf_chain_hdr(BufChain *c) {
+	return c->bufs[0]->buf;
+}
+
+void buf_chain_set_hdr_len(BufChain *c, size_t len) {
+	c->len = c->len - c->iov[0].iov_len + len;
+	c->iov[0].iov_len = len;
+}
+
+/* Returns the last buffer, acquiring a new one if it is full. */
+static struct iovec *tail(BufChain *c) {
+	struct iovec *last = &c->iov[c->bufs_len - 1];
+	if (c->bufs_len > 1 && last->iov_len < slab_buf_cap(c->data_slab)) {
+		return last;
+	}
+
+	if (c->bufs_len == c->cap) {
+		c->cap *= 2;
+		c->bufs = must_realloc(c->bufs, c->cap * sizeof(BufRef *), "buf_chain tail bufs");
+		c->iov = must_realloc(c->iov, c->cap * sizeof(struct iovec), "buf_chain tail iov");
+	}
+
+	BufRef *bref = slab_acquire(c->data_slab, 1);
+	c->bufs[c->bufs_len] = bref;
+	c->iov[c->bufs_len].iov_base = bref->buf;
+	c->iov[c->bufs_len].iov_len = 0;
+	c->bufs_len++;
+	return &c->iov[c->bufs_len - 1];
+}
+
+void buf_chain_append(BufChain *c, const char *data, size_t len) {
+	size_t data_cap = slab_buf_cap(c->data_slab);
+	while (len > 0) {
+		struct iovec *last = tail(c);
+		size_t n = data_cap - last->iov_len;
+		if (n > len) n = len;
+
+		memcpy((char *)last->iov_base + last->iov_len, data, n);
+		last->iov_len += n;
+		c->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+size_t buf_chain_data_len(BufChain *c) {
+	return c->len - c->iov[0].iov_len;
+}
+
+size_t buf_chain_iov_from(BufChain *c, size_t offset, struct iovec *iov) {
+	size_t i = 0;
+	while (i < c->bufs_len && offset >= c->iov[i].iov_len) {
+		offset -= c->iov[i].iov_len;
+		i++;
+	}
+
+	size_t n = 0;
+	for (; i < c->bufs_len; i++) {
+		iov[n].iov_base = (char *)c->iov[i].iov_base + offset;
+		iov[n].iov_len = c->iov[i].iov_len - offset;
+		offset = 0;
+		n++;
+	}
+	return n;
+}
+
+void buf_chain_seal(BufChain *c, size_t ref) {
+	c->ref = ref;
+	c->msg.msg_iov = c->iov;
+	c->msg.msg_iovlen = c->bufs_len;
+}
+
+void buf_chain_release(BufChain *c) {
+	c->ref--;
+	if (c->ref > 0) return;
+
+	slab_release(c->hdr_slab, c->bufs[0]);
+	for (size_t i = 1; i < c->bufs_len; i++) {
+		slab_release(c->data_slab, c->bufs[i]);
+	}
+	free(c->bufs);
+	free(c->iov);
+	free(c);
+}
@@ -0,0 +1,76 @@
+#ifndef BUF_CHAIN_H
+#define BUF_CHAIN_H
+
+/**
+ * Chain of slab buffers holding a frame which doesn't fit in a single buffer.
+ *
+ * The first buffer holds the frame header and comes from a small slab. The
+ * message is appended to buffers of a large slab and is never copied into one
+ * contiguous allocation. The chain keeps an iovec per buffer and a msghdr over
+ * all of them, so the whole frame goes out with a single sendmsg. Like BufRef,
+ * the chain is shared by every send of the frame and is reference counted.
+ */
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "slab.h"
+
+typedef struct buf_chain {
+	/**
+	 * Count of references to this chain. Its buffers are only returned to the
+	 * slabs once ref reaches 0.
+	 */
+	size_t ref;
+	/* Total number of bytes in the chain, including the header. */
+	size_t len;
+
+	Slab *hdr_slab;
+	Slab *data_slab;
+
+	/* cap & len for bufs and iov which always have the same length. */
+	size_t cap;
+	size_t bufs_len;
+	BufRef **bufs;
+	struct iovec *iov;
+
+	/* Covers the whole chain. Set by buf_chain_seal. */
+	struct msghdr msg;
+} BufChain;
+
+/**
+ * len_hint is the number of message bytes the chain is expected to hold, so that
+ * bufs and iov don't have to grow. The header buffer is acquired right away and
+ * ref is 1. Exits the program if memory allocation fails.
+ */
+BufChain *buf_chain_create(Slab *hdr_slab, Slab *data_slab, size_t len_hint);
+
+/* Returns the header buffer which can hold slab_buf_cap(hdr_slab) bytes. */
+char *buf_chain_hdr(BufChain *c);
+
+/* The header takes 0 bytes until its length is set. */
+void buf_chain_set_hdr_len(BufChain *c, size_t len);
+
+/* Copies data to the end of the chain and acquires buffers as they fill up. */
+void buf_chain_append(BufChain *c, const char *data, size_t len);
+
+/* Returns the number of message bytes in the chain, excluding the header. */
+size_t buf_chain_data_len(BufChain *c);
+
+/**
+ * Fills iov with the bytes of the chain after the first offset bytes and returns
+ * the number of iovecs used. iov must have room for c->bufs_len iovecs.
+ */
+size_t buf_chain_iov_from(BufChain *c, size_t offset, struct iovec *iov);
+
+/**
+ * Points c->msg to the iovecs of the whole chain and sets ref. The chain must not
+ * be appended to afterwards.
+ */
+void buf_chain_seal(BufChain *c, size_t ref);
+
+/* Decrements ref and only releases the buffers and the chain if ref reaches 0. */
+void buf_chain_release(BufChain *c);
+
+#endif
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "capacity.h"
+
+/**
+ * A group message holds its buffer until the send to every member completes,
+ * which under load takes up to about this long.
+ */
+#define MSG_IN_FLIGHT_MS 100
+
+static size_t round_up_pow2(size_t n) {
+	size_t p = 1;
+	while (p < n) p <<= 1;
+	return p;
+}
+
+static size_t *field(CapacityProfile *p, const char *name, size_t len) {
+	if (len == 5 && memcmp(name, "conns", 5) == 0) return &p->conns;
+	if (len == 6 && memcmp(name, "groups", 6) == 0) return &p->groups;
+	if (len == 8 && memcmp(name, "msg_rate", 8) == 0) return &p->msg_rate;
+	return NULL;
+}
+
+int capacity_parse(CapacityProfile *p, const char *spec) {
+	const char *s = spec;
+	while (*s != '\0') {
+		const char *eq = strchr(s, '=');
+		if (eq == NULL) return -1;
+
+		size_t *f = field(p, s, eq - s);
+		if (f == NULL) return -1;
+
+		char *end;
+		unsigned long long n = strtoull(eq + 1, &end, 10);
+		if (end == eq + 1 || (*end != ',' && *end != '\0')) return -1;
+
+		*f = n;
+		s = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
+
+void capacity_sizes(const CapacityProfile *p, bool batching, CapacitySizes *s) {
+	/**
+	 * A message to a group of every client prepares a send per member at once,
+	 * which is queued in the server past what the SQ holds.
+	 */
+	size_t sq = round_up_pow2(p->conns);
+	if (sq > CAPACITY_MAX_SQ_ENTRIES) sq = CAPACITY_MAX_SQ_ENTRIES;
+	s->sq_entries = p->conns == 0 ? 0 : sq;
+
+	/* Plus the entry of the connection being accepted. */
+	s->clients = p->conns + 1;
+	s->client_buckets = round_up_pow2(s->clients);
+	s->recv_rings = p->conns;
+
+	/* A recv and a send per client, and the accept. */
+	s->ops = 2 * p->conns + 1;
+
+	/**
+	 * Responses are small and sent one per request. Group messages take the large
+	 * buffers, and so do envelopes, one per client while they are kept open.
+	 */
+	s->slab64 = p->conns;
+	s->slab2k = p->msg_rate * MSG_IN_FLIGHT_MS / 1000;
+	if (batching) s->slab2k += p->conns;
+
+	s->groups = p->groups;
+}
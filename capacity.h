@@ -0,0 +1,49 @@
+#ifndef CAPACITY_H
+#define CAPACITY_H
+
+/**
+ * Capacity profile the server is sized for at startup.
+ *
+ * From the expected number of connections, groups and messages per second it
+ * derives how many entries each pool needs in steady state. main reserves and
+ * faults them in before serving, so that the first minutes after a deploy don't
+ * pay for growing the pools one malloc at a time.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Largest SQ io_uring allows. */
+#define CAPACITY_MAX_SQ_ENTRIES 32768
+
+typedef struct {
+	size_t conns;
+	size_t groups;
+	/* Messages per second sent to groups, across all clients. */
+	size_t msg_rate;
+} CapacityProfile;
+
+typedef struct {
+	/* Power of 2, 0 to keep the default. */
+	unsigned sq_entries;
+	/* Buckets of the client map, a power of 2. */
+	size_t client_buckets;
+	size_t clients;
+	size_t ops;
+	size_t slab64;
+	size_t slab2k;
+	size_t recv_rings;
+	size_t groups;
+} CapacitySizes;
+
+/**
+ * Parses comma separated `<name>=<count>` fields, with names conns, groups and
+ * msg_rate e.g. "conns=100000,groups=5000,msg_rate=20000". Fields left out keep
+ * their value. Returns -1 if spec is malformed.
+ */
+int capacity_parse(CapacityProfile *p, const char *spec);
+
+/* batching is whether BATCH envelopes are kept open across loop iterations. */
+void capacity_sizes(const CapacityProfile *p, bool batching, CapacitySizes *s);
+
+#endif
@@ -0,0 +1,70 @@
+#include <string.h>
+
+#include "capture.h"
+
+static size_t drain(void *arg) {
+	return capture_drain(arg);
+}
+
+int capture_init(Capture *c, FILE *out, size_t cap, uint64_t start_ns) {
+	memset(c, 0, sizeof(*c));
+	c->out = out;
+	c->start_ns = start_ns;
+
+	struct capture_hdr hdr = { .magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION };
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1) return -1;
+
+	spsc_ring_init(&c->ring, cap, drain, c);
+	return 0;
+}
+
+void capture_push(Capture *c, uint8_t kind, uint64_t client_id, uint64_t now_ns,
+				  const void *data, size_t len) {
+	/* now_ns may predate the capture while the first completions come in. */
+	struct capture_rec rec = {
+		.ts_ns = now_ns > c->start_ns ? now_ns - c->start_ns : 0,
+		.client_id = client_id,
+		.len = len,
+		.kind = kind,
+	};
+	if (spsc_ring_push(&c->ring, &rec, sizeof(rec), data, len)) c->records++;
+}
+
+size_t capture_drain(Capture *c) {
+	size_t pending = spsc_ring_len(&c->ring);
+	if (pending == 0) return 0;
+
+	/* At most two writes, the second one once the bytes wrap around. */
+	for (size_t left = pending; left > 0;) {
+		size_t len;
+		const char *span = spsc_ring_peek(&c->ring, left, &len);
+		if (!c->failed && fwrite(span, 1, len, c->out) != len) {
+			perror("capture write");
+			c->failed = true;
+		}
+		spsc_ring_consume(&c->ring, len);
+		left -= len;
+	}
+	/* The server usually stops on a signal, which would lose what stdio holds. */
+	if (!c->failed && fflush(c->out) != 0) {
+		perror("capture flush");
+		c->failed = true;
+	}
+	return pending;
+}
+
+void capture_start(Capture *c) {
+	spsc_ring_start(&c->ring, CAPTURE_FLUSH_INTERVAL_MS);
+}
+
+void capture_deinit(Capture *c) {
+	spsc_ring_deinit(&c->ring);
+}
+
+ssize_t capture_next(const char *buf, size_t len, struct capture_rec *rec) {
+	if (len == 0) return 0;
+	if (len < sizeof(*rec)) return -1;
+	memcpy(rec, buf, sizeof(*rec));
+	if (len - sizeof(*rec) < rec->len) return -1;
+	return sizeof(*rec) + rec->len;
+}
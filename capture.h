@@ -0,0 +1,109 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/**
+ * Capture of the traffic clients send, which replay drives other servers with.
+ *
+ * The event loop appends records to an SpscRing and its writer writes them to a
+ * file, like the Logger. When the ring is full records are dropped and counted
+ * rather than blocking the loop, and the replay of that capture is incomplete.
+ *
+ * The file starts with a capture_hdr and holds the records back to back, each a
+ * capture_rec followed by len bytes. Frames are captured once complete, stamped
+ * with the time they arrived, before rate limiting. Frames rejected with
+ * CODE_RATE_LIMITED are captured too, and deferred ones keep their arrival time.
+ * Records are in host byte order, the frames in them as received.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "spsc_ring.h"
+
+#define CAPTURE_MAGIC 0x31706163
+#define CAPTURE_VERSION 2
+/* Bytes in the ring. Must be a power of 2. */
+#define CAPTURE_RING_SIZE (16 << 20)
+/* How long the writer sleeps when the ring is empty. */
+#define CAPTURE_FLUSH_INTERVAL_MS 10
+
+enum capture_kind {
+	/* A frame the client sent. */
+	CAPTURE_FRAME,
+	/**
+	 * The gid handed out for a CREATE_GROUP of the client, in a capture_gid with
+	 * the seqid of the frame. Lets replay map the gids of the capture to the ones
+	 * it gets.
+	 */
+	CAPTURE_GID,
+	/* The client disconnected. No bytes. */
+	CAPTURE_CLOSE,
+};
+
+#pragma pack(push, 1)
+struct capture_hdr {
+	uint32_t magic;
+	uint32_t version;
+};
+
+/* ts_ns counts from the start of the capture. */
+struct capture_rec {
+	uint64_t ts_ns;
+	uint64_t client_id;
+	uint16_t len;
+	uint8_t kind;
+};
+
+/* Frames are captured as they arrive, so CAPTURE_GID names its CREATE_GROUP. */
+struct capture_gid {
+	uint64_t gid;
+	uint64_t seqid;
+};
+#pragma pack(pop)
+
+typedef struct {
+	FILE *out;
+	uint64_t start_ns;
+	/* Records pushed. Those dropped are counted in ring.dropped. */
+	uint64_t records;
+	/* Set by the writer once writing out fails. */
+	bool failed;
+	SpscRing ring;
+} Capture;
+
+/**
+ * cap must be a power of 2. Writes the header to out and counts timestamps from
+ * start_ns, in CLOCK_MONOTONIC. Returns -1 with errno set if out can't be written.
+ */
+int capture_init(Capture *c, FILE *out, size_t cap, uint64_t start_ns);
+
+/* Starts the writer thread. */
+void capture_start(Capture *c);
+
+/**
+ * Stops the writer, if running, after it has written every pending record. The
+ * caller closes out.
+ */
+void capture_deinit(Capture *c);
+
+/* Copies a record of len bytes at data into the ring, or drops it. Never blocks. */
+void capture_push(Capture *c, uint8_t kind, uint64_t client_id, uint64_t now_ns,
+				  const void *data, size_t len);
+
+/**
+ * Writes the bytes pending in the ring, flushes out and returns how many bytes
+ * there were. Once writing fails the bytes are discarded. Only one
+ * thread at a time may drain, which is the writer once started.
+ */
+size_t capture_drain(Capture *c);
+
+/**
+ * Parses the record at the start of the len bytes at buf. Returns its length with
+ * its bytes right after rec in buf, 0 if len is 0, or -1 if it is cut short.
+ */
+ssize_t capture_next(const char *buf, size_t len, struct capture_rec *rec);
+
+#endif
@@ -2,6 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #define INIT_CAP 8
 #define LOAD_FACTOR 0.75
 #define HASH_MULT 11400714819323198485llu
@@ -21,9 +25,20 @@ void cid_set_init(struct cid_set *set) {
 	set->len = 0;
 	set->cap = INIT_CAP;
 
-	for (size_t i = 0; i <= set->cap; i++) {
+	for (size_t i = 0; i < set->cap; i++) {
+		set->ids[i] = EMPTY_VAL;
+	}
+}
+
+void cid_set_deinit(struct cid_set *set) {
+	free(set->ids);
+}
+
+void cid_set_clear(struct cid_set *set) {
+	for (size_t i = 0; i < set->cap; i++) {
 		set->ids[i] = EMPTY_VAL;
 	}
+	set->len = 0;
 }
 
 bool cid_set_exists(struct cid_set *set, uint64_t id) {
@@ -91,16 +106,56 @@ void cid_set_insert(struct cid_set *set, uint64_t id) {
 	insert(set, id);
 }
 
+bool cid_set_remove(struct cid_set *set, uint64_t id) {
+	if (id == EMPTY_VAL) return false;
+
+	size_t mask = set->cap - 1;
+	size_t i = hash(id, set->cap);
+	while (set->ids[i] != id) {
+		if (set->ids[i] == EMPTY_VAL) return false;
+		i = (i + 1) & mask;
+	}
+
+	/**
+	 * i is now a hole. Move back every following id in the cluster whose home
+	 * slot doesn't lie cyclically within (i, j], otherwise it could no longer
+	 * be found by probing from its home slot.
+	 */
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (set->ids[j] == EMPTY_VAL) break;
+
+		size_t k = hash(set->ids[j], set->cap);
+		bool in_place = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+		if (in_place) continue;
+
+		set->ids[i] = set->ids[j];
+		i = j;
+	}
+
+	set->ids[i] = EMPTY_VAL;
+	set->len--;
+	return true;
+}
+
 void cid_set_iter(struct cid_set *set, struct cid_iter *iter) {
 	iter->idx = 0;
 	iter->len = set->cap;
 	iter->ids = set->ids;
 }
 
-size_t cid_iter_next_batch(struct cid_iter *iter, size_t batch_size,
-						   uint64_t batch[batch_size]) {
-	size_t i;
-	for (i = 0; iter->idx < iter->len && i < batch_size; iter->idx++) {
+/**
+ * Copies non-empty slots starting at iter->idx into batch[i..batch_size) one
+ * slot at a time. Returns the new number of filled entries in batch.
+ */
+static inline size_t next_batch_tail(
+	struct cid_iter *iter,
+	size_t i,
+	size_t batch_size,
+	uint64_t batch[batch_size]
+) {
+	for (; iter->idx < iter->len && i < batch_size; iter->idx++) {
 		if (iter->ids[iter->idx] == EMPTY_VAL) {
 			continue;
 		}
@@ -109,3 +164,119 @@ size_t cid_iter_next_batch(struct cid_iter *iter, size_t batch_size,
 	}
 	return i;
 }
+
+size_t cid_iter_next_batch_scalar(struct cid_iter *iter, size_t batch_size,
+								  uint64_t batch[batch_size]) {
+	return next_batch_tail(iter, 0, batch_size, batch);
+}
+
+#if defined(__x86_64__)
+
+/**
+ * For every 4-bit mask of non-empty lanes, the 32-bit lane indices which move
+ * the non-empty 64-bit lanes to the front of a __m256i.
+ */
+static const int32_t avx2_compact_lut[16][8] = {
+	{0, 1, 2, 3, 4, 5, 6, 7}, /* 0000 */
+	{0, 1, 2, 3, 4, 5, 6, 7}, /* 0001 */
+	{2, 3, 0, 1, 4, 5, 6, 7}, /* 0010 */
+	{0, 1, 2, 3, 4, 5, 6, 7}, /* 0011 */
+	{4, 5, 0, 1, 2, 3, 6, 7}, /* 0100 */
+	{0, 1, 4, 5, 2, 3, 6, 7}, /* 0101 */
+	{2, 3, 4, 5, 0, 1, 6, 7}, /* 0110 */
+	{0, 1, 2, 3, 4, 5, 6, 7}, /* 0111 */
+	{6, 7, 0, 1, 2, 3, 4, 5}, /* 1000 */
+	{0, 1, 6, 7, 2, 3, 4, 5}, /* 1001 */
+	{2, 3, 6, 7, 0, 1, 4, 5}, /* 1010 */
+	{0, 1, 2, 3, 6, 7, 4, 5}, /* 1011 */
+	{4, 5, 6, 7, 0, 1, 2, 3}, /* 1100 */
+	{0, 1, 4, 5, 6, 7, 2, 3}, /* 1101 */
+	{2, 3, 4, 5, 6, 7, 0, 1}, /* 1110 */
+	{0, 1, 2, 3, 4, 5, 6, 7}, /* 1111 */
+};
+
+/**
+ * Compares 4 slots per instruction against EMPTY_VAL and compacts the non-empty
+ * ids to the front of the vector. The whole vector is stored into batch, so this
+ * only runs while batch has room for 4 more ids; the rest is left to the tail.
+ */
+__attribute__((target("avx2")))
+static size_t next_batch_avx2(struct cid_iter *iter, size_t batch_size,
+							  uint64_t batch[batch_size]) {
+	const __m256i empty = _mm256_set1_epi64x(-1);
+	size_t i = 0;
+
+	while (iter->idx + 4 <= iter->len && i + 4 <= batch_size) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(iter->ids + iter->idx));
+		__m256i eq = _mm256_cmpeq_epi64(v, empty);
+		unsigned keep = ~(unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(eq)) & 0xF;
+		iter->idx += 4;
+
+		if (keep == 0) continue;
+
+		if (keep != 0xF) {
+			__m256i perm = _mm256_loadu_si256((const __m256i *)avx2_compact_lut[keep]);
+			v = _mm256_permutevar8x32_epi32(v, perm);
+		}
+		_mm256_storeu_si256((__m256i *)(batch + i), v);
+		i += __builtin_popcount(keep);
+	}
+
+	return next_batch_tail(iter, i, batch_size, batch);
+}
+
+/* Same as next_batch_avx2 with 2 slots per instruction. */
+__attribute__((target("sse4.2")))
+static size_t next_batch_sse42(struct cid_iter *iter, size_t batch_size,
+							   uint64_t batch[batch_size]) {
+	const __m128i empty = _mm_set1_epi64x(-1);
+	size_t i = 0;
+
+	while (iter->idx + 2 <= iter->len && i + 2 <= batch_size) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(iter->ids + iter->idx));
+		__m128i eq = _mm_cmpeq_epi64(v, empty);
+		unsigned keep = ~(unsigned)_mm_movemask_pd(_mm_castsi128_pd(eq)) & 0x3;
+		iter->idx += 2;
+
+		if (keep == 0) continue;
+
+		/* Move the upper lane down if it's the only non-empty one. */
+		if (keep == 0x2) {
+			v = _mm_unpackhi_epi64(v, v);
+		}
+		_mm_storeu_si128((__m128i *)(batch + i), v);
+		i += __builtin_popcount(keep);
+	}
+
+	return next_batch_tail(iter, i, batch_size, batch);
+}
+
+#endif
+
+typedef size_t (*next_batch_fn)(struct cid_iter *, size_t, uint64_t *);
+
+static size_t next_batch_resolve(struct cid_iter *iter, size_t batch_size,
+								 uint64_t batch[batch_size]);
+
+/* Resolved to the best implementation for this CPU on the first call. */
+static next_batch_fn next_batch_impl = next_batch_resolve;
+
+static size_t next_batch_resolve(struct cid_iter *iter, size_t batch_size,
+								 uint64_t batch[batch_size]) {
+	next_batch_fn impl = cid_iter_next_batch_scalar;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		impl = next_batch_avx2;
+	} else if (__builtin_cpu_supports("sse4.2")) {
+		impl = next_batch_sse42;
+	}
+#endif
+	next_batch_impl = impl;
+	return impl(iter, batch_size, batch);
+}
+
+size_t cid_iter_next_batch(struct cid_iter *iter, size_t batch_size,
+						   uint64_t batch[batch_size]) {
+	return next_batch_impl(iter, batch_size, batch);
+}
@@ -25,18 +25,34 @@ struct cid_iter {
 
 /* Returns NULL in case of error in the allocatin of struct cidset. */
 void cid_set_init(struct cid_set *set);
+void cid_set_deinit(struct cid_set *set);
+
+/* Removes every id but keeps the capacity, so that refilling the set doesn't allocate. */
+void cid_set_clear(struct cid_set *set);
 
 bool cid_set_exists(struct cid_set *set, uint64_t id);
 
 /* id cannot be UINT64_MAX. */
 void cid_set_insert(struct cid_set *set, uint64_t id);
 
+/**
+ * Returns false if id wasn't in the set. Uses backward shift deletion so that
+ * removals don't leave tombstones behind.
+ */
+bool cid_set_remove(struct cid_set *set, uint64_t id);
+
 void cid_set_iter(struct cid_set *set, struct cid_iter *iter);
 
 /** 
  * Tries to fill len number of client ids into the batch array. Returns the
  * number of client ids filled.
+ *
+ * Scans the slots with AVX2 or SSE4.2 when the CPU supports them, which is
+ * detected on the first call. Falls back to cid_iter_next_batch_scalar otherwise.
  */
 size_t cid_iter_next_batch(struct cid_iter *iter, size_t len, uint64_t batch[len]);
 
+/* Checks one slot at a time. Exposed for tests and benchmarks. */
+size_t cid_iter_next_batch_scalar(struct cid_iter *iter, size_t len, uint64_t batch[len]);
+
 #endif
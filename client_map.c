@@ -15,6 +15,7 @@ void client_map_init(ClientMap *cm, size_t cap) {
 		exit(EXIT_FAILURE);
 	}
 
+	cm->len = 0;
 	cm->buckets_cap = cap;
 	cm->buckets = calloc(cap, sizeof(ClientInfo *));
 
@@ -61,6 +62,7 @@ bool client_map_new_entry(ClientMap *cm, uint64_t client_id, ClientInfo **info)
 	node->next = old_head;
 	node->client_id = client_id;
 	*info = node;
+	cm->len++;
 
 	return true;
 }
@@ -75,6 +77,15 @@ ClientInfo *client_map_get(ClientMap *cm, uint64_t client_id) {
 	return NULL;
 }
 
+void client_map_prefetch_bucket(const ClientMap *cm, uint64_t client_id) {
+	__builtin_prefetch(&cm->buckets[hash(cm->buckets_cap, client_id)]);
+}
+
+void client_map_prefetch_info(const ClientMap *cm, uint64_t client_id) {
+	ClientInfo *node = cm->buckets[hash(cm->buckets_cap, client_id)];
+	if (node != NULL) __builtin_prefetch(node);
+}
+
 /**
  * This function zeores out the ClientInfo, so make sure to copy out 
  * the values you need such as next before calling this function.
@@ -94,6 +105,18 @@ void client_map_add_free(ClientMap *cm, ClientInfo *info) {
 	cm->free_len++;
 }
 
+void client_map_reserve(ClientMap *cm, size_t n) {
+	while (cm->free_len < n) {
+		ClientInfo *node = malloc(sizeof(ClientInfo));
+		if (node == NULL) {
+			perror("client_map_reserve: malloc");
+			exit(EXIT_FAILURE);
+		}
+		/* Zeroes node, which faults it in. */
+		client_map_add_free(cm, node);
+	}
+}
+
 bool client_map_delete(ClientMap *cm, uint64_t client_id) {
 	size_t i = hash(cm->buckets_cap, client_id);
 	ClientInfo *head = cm->buckets[i];
@@ -102,6 +125,7 @@ bool client_map_delete(ClientMap *cm, uint64_t client_id) {
 	if (head->client_id == client_id) {
 		cm->buckets[i] = head->next;
 		client_map_add_free(cm, head);
+		cm->len--;
 		return true;
 	}
 
@@ -111,6 +135,7 @@ bool client_map_delete(ClientMap *cm, uint64_t client_id) {
 		if (cur->client_id == client_id) {
 			prev->next = cur->next;
 			client_map_add_free(cm, cur);
+			cm->len--;
 			return true;
 		}
 		prev = cur;
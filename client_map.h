@@ -3,6 +3,10 @@
 
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "ratelimit.h"
+#include "slab.h"
 
 #define FREE_INIT_LEN 64
 
@@ -16,12 +20,54 @@ typedef struct client_info {
 	struct sockaddr_in client_addr;
 	socklen_t client_addr_len;
 	char username[16];
+	/**
+	 * Message being received in SEND_TO_GROUP_CHUNKs. NULL if there is none.
+	 * upload_len is the msg_len declared by SEND_TO_GROUP_START.
+	 */
+	struct buf_chain *upload;
+	uint64_t upload_gid;
+	uint32_t upload_len;
+	/* OPT_* bits set with SET_OPTIONS. */
+	uint8_t options;
+	/**
+	 * PRESENCE_* set with SET_PRESENCE, and the group the client is typing in, 0
+	 * if none.
+	 */
+	uint8_t presence;
+	uint64_t typing_gid;
+	/**
+	 * BATCH envelope being filled for this client. batch_len includes the header
+	 * of the envelope. NULL if there is none. batch_queued is set while the client_id is in
+	 * the pending envelopes of the server.
+	 */
+	BufRef *batch;
+	uint16_t batch_len;
+	bool batch_queued;
+	uint64_t batch_opened_ns;
+	/**
+	 * Sends waiting to go out, by pool_id, oldest at sendq_head. A client has at
+	 * most one send in flight, while send_busy is set, so that a short write is
+	 * finished before later frames go out. The ones queued meanwhile go out
+	 * together in one OP_WRITEV. send_queued is set while the client_id is in the
+	 * pending sends of the server.
+	 */
+	size_t *sendq;
+	size_t sendq_head;
+	size_t sendq_len;
+	size_t sendq_cap;
+	bool send_busy;
+	bool send_queued;
+	/* Checked against the rate limits of the server before each frame. */
+	TokenBuckets buckets;
+	/* Set for gateways on the shm transport, whose sends go through its rings. */
+	struct shm_client *shm;
 	struct client_info *next;
 } ClientInfo;
 
-/* TODO: keep track of total number of clients to limit 
- * the number of clients served per thread. */
 typedef struct {
+	/* Number of clients in the map, used to cap the clients served per thread. */
+	size_t len;
+
 	size_t buckets_cap;
 	ClientInfo **buckets;
 
@@ -46,6 +92,21 @@ bool client_map_new_entry(ClientMap *cm, uint64_t client_id, ClientInfo **info);
  */
 ClientInfo *client_map_get(ClientMap *cm, uint64_t client_id);
 
+/**
+ * Prefetch the bucket of client_id and, once the bucket is in the cache, the first
+ * ClientInfo in it, which is usually the one of client_id. Calling the first for a
+ * batch of ids, then the second, then client_map_get lets the cache misses of the
+ * lookups overlap.
+ */
+void client_map_prefetch_bucket(const ClientMap *cm, uint64_t client_id);
+void client_map_prefetch_info(const ClientMap *cm, uint64_t client_id);
+
+/**
+ * Allocates entries until at least n are on the free list, so that adding n
+ * clients doesn't allocate. The buckets are sized by client_map_init.
+ */
+void client_map_reserve(ClientMap *cm, size_t n);
+
 /* Returns true if deletion was successful, and false otherwise. */
 bool client_map_delete(ClientMap *cm, uint64_t client_id);
 
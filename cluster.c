@@ -0,0 +1,289 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cluster.h"
+#include "protocol.h"
+#include "utils.h"
+
+#define OWNED_INIT_CAP 1024
+#define PEER_BUF_INIT_CAP 65536
+
+/* splitmix64 finalizer, spreads consecutive ids over the whole ring. */
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+static int cmp_points(const void *a, const void *b) {
+	const struct ring_point *pa = a;
+	const struct ring_point *pb = b;
+	if (pa->hash != pb->hash) return pa->hash < pb->hash ? -1 : 1;
+	return (int)pa->node - (int)pb->node;
+}
+
+/* Parses "ip:port" of len bytes into addr. */
+static int parse_addr(struct sockaddr_in *addr, const char *s, size_t len) {
+	char buf[INET_ADDRSTRLEN + 8];
+	if (len >= sizeof(buf)) return -1;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	char *colon = strrchr(buf, ':');
+	if (colon == NULL) return -1;
+	*colon = '\0';
+
+	char *end;
+	unsigned long port = strtoul(colon + 1, &end, 10);
+	if (end == colon + 1 || *end != '\0' || port == 0 || port > 65535) return -1;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	if (inet_pton(AF_INET, buf, &addr->sin_addr) != 1) return -1;
+	return 0;
+}
+
+int cluster_init(Cluster *c, const char *nodes, uint32_t self) {
+	memset(c, 0, sizeof(*c));
+
+	const char *s = nodes;
+	while (*s != '\0') {
+		if (c->nodes_len == CLUSTER_MAX_NODES) return -1;
+		const char *end = strchr(s, ',');
+		size_t len = end == NULL ? strlen(s) : (size_t)(end - s);
+		if (parse_addr(&c->addrs[c->nodes_len], s, len) < 0) return -1;
+		c->nodes_len++;
+		s = end == NULL ? s + len : end + 1;
+	}
+	if (self >= c->nodes_len) return -1;
+	c->self = self;
+
+	/* A node keeps its points when others join, so only the groups it takes over move. */
+	c->points_len = (size_t)c->nodes_len * CLUSTER_VNODES;
+	c->points = must_malloc(c->points_len * sizeof(struct ring_point), "cluster_init points");
+	for (uint32_t n = 0; n < c->nodes_len; n++) {
+		for (uint32_t v = 0; v < CLUSTER_VNODES; v++) {
+			struct ring_point *p = &c->points[n * CLUSTER_VNODES + v];
+			p->hash = mix64(((uint64_t)n << 32) | v);
+			p->node = n;
+		}
+	}
+	qsort(c->points, c->points_len, sizeof(struct ring_point), cmp_points);
+
+	c->owned_cap = OWNED_INIT_CAP;
+	c->owned = must_calloc(c->owned_cap, sizeof(struct owned_group), "cluster_init owned");
+
+	for (uint32_t n = 0; n < CLUSTER_MAX_NODES; n++) c->links[n].fd = -1;
+	return 0;
+}
+
+void cluster_deinit(Cluster *c) {
+	for (uint32_t n = 0; n < c->nodes_len; n++) {
+		peer_buf_deinit(&c->links[n].out);
+		peer_buf_deinit(&c->links[n].inflight);
+		forward_queue_deinit(&c->links[n].forwards);
+	}
+	free(c->points);
+	free(c->owned);
+}
+
+uint32_t cluster_owner(const Cluster *c, uint64_t gid) {
+	uint64_t h = mix64(gid);
+
+	/* First point at or after h, wrapping around to the first one. */
+	size_t lo = 0;
+	size_t hi = c->points_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (c->points[mid].hash < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == c->points_len) lo = 0;
+	return c->points[lo].node;
+}
+
+static struct owned_group *owned_slot(struct owned_group *slots, size_t cap, uint64_t gid) {
+	size_t i = mix64(gid) & (cap - 1);
+	while (slots[i].gid != 0 && slots[i].gid != gid) i = (i + 1) & (cap - 1);
+	return &slots[i];
+}
+
+struct owned_group *cluster_owned(Cluster *c, uint64_t gid) {
+	struct owned_group *g = owned_slot(c->owned, c->owned_cap, gid);
+	if (g->gid == gid) return g;
+
+	/* Kept at most half full. */
+	if (2 * (c->owned_len + 1) > c->owned_cap) {
+		size_t cap = c->owned_cap * 2;
+		struct owned_group *slots = must_calloc(cap, sizeof(struct owned_group), "cluster_owned");
+		for (size_t i = 0; i < c->owned_cap; i++) {
+			if (c->owned[i].gid != 0) *owned_slot(slots, cap, c->owned[i].gid) = c->owned[i];
+		}
+		free(c->owned);
+		c->owned = slots;
+		c->owned_cap = cap;
+		g = owned_slot(c->owned, c->owned_cap, gid);
+	}
+
+	/* msgids start at 1 like the ones of local groups. */
+	g->gid = gid;
+	g->next_msgid = 1;
+	c->owned_len++;
+	return g;
+}
+
+void peer_buf_deinit(PeerBuf *b) {
+	free(b->data);
+	b->data = NULL;
+	b->len = 0;
+	b->cap = 0;
+}
+
+void forward_queue_deinit(ForwardQueue *q) {
+	free(q->fwd);
+	q->fwd = NULL;
+	q->head = 0;
+	q->len = 0;
+	q->cap = 0;
+}
+
+void forward_queue_push(ForwardQueue *q, uint64_t uid, uint64_t seqid, uint64_t due_ns) {
+	if (q->len == q->cap) {
+		/* Reuses the room of the popped forwards before growing. */
+		if (q->head > 0) {
+			memmove(q->fwd, q->fwd + q->head, (q->len - q->head) * sizeof(struct forward));
+			q->len -= q->head;
+			q->head = 0;
+		} else {
+			q->cap = q->cap == 0 ? 64 : q->cap * 2;
+			q->fwd = must_realloc(q->fwd, q->cap * sizeof(struct forward), "forward_queue_push");
+		}
+	}
+	q->fwd[q->len] = (struct forward){ .uid = uid, .seqid = seqid, .due_ns = due_ns };
+	q->len++;
+}
+
+size_t forward_queue_find(const ForwardQueue *q, uint64_t uid, uint64_t seqid) {
+	for (size_t i = q->head; i < q->len; i++) {
+		if (q->fwd[i].uid == uid && q->fwd[i].seqid == seqid) return i;
+	}
+	return q->len;
+}
+
+void forward_queue_pop(ForwardQueue *q, size_t n) {
+	q->head += n;
+	if (q->head == q->len) {
+		q->head = 0;
+		q->len = 0;
+	}
+}
+
+/* Returns room for len more bytes at the end of b, which the caller fills. */
+static char *peer_buf_reserve(PeerBuf *b, size_t len) {
+	if (b->len + len > b->cap) {
+		size_t cap = b->cap == 0 ? PEER_BUF_INIT_CAP : b->cap;
+		while (cap < b->len + len) cap *= 2;
+		b->data = must_realloc(b->data, cap, "peer_buf_reserve");
+		b->cap = cap;
+	}
+	char *p = b->data + b->len;
+	b->len += len;
+	return p;
+}
+
+void peer_put_add(PeerBuf *b, uint8_t type, uint64_t gid, uint64_t uid,
+				  uint8_t uids_len, const char *uids_raw) {
+	size_t uids_bytes = uids_len * sizeof(uint64_t);
+	size_t len = sizeof(struct peer_add) + uids_bytes;
+	char *p = peer_buf_reserve(b, len);
+
+	struct peer_add f = {
+		.hdr = { .len = htonl(len), .type = type },
+		.gid = htonll(gid),
+		.uid = htonll(uid),
+		.uids_len = uids_len,
+	};
+	memcpy(p, &f, sizeof(f));
+	memcpy(p + sizeof(f), uids_raw, uids_bytes);
+}
+
+void peer_put_msg(PeerBuf *b, uint8_t type, uint8_t flags, uint64_t gid,
+				  uint64_t msgid, uint64_t uid, uint64_t seqid,
+				  const struct iovec *iov, size_t iovcnt) {
+	size_t msg_len = 0;
+	for (size_t i = 0; i < iovcnt; i++) msg_len += iov[i].iov_len;
+	size_t len = sizeof(struct peer_msg) + msg_len;
+	char *p = peer_buf_reserve(b, len);
+
+	struct peer_msg f = {
+		.hdr = { .len = htonl(len), .type = type, .flags = flags },
+		.gid = htonll(gid),
+		.msgid = htonll(msgid),
+		.uid = htonll(uid),
+		.seqid = htonll(seqid),
+	};
+	memcpy(p, &f, sizeof(f));
+	p += sizeof(f);
+	for (size_t i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+}
+
+ssize_t peer_frame_parse(const char *buf, size_t len, PeerFrame *f) {
+	struct peer_hdr hdr;
+	if (len < sizeof(hdr)) return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+	size_t frame_len = ntohl(hdr.len);
+	if (frame_len < sizeof(hdr) || frame_len > CLUSTER_RING_SIZE) return -1;
+	if (len < frame_len) return 0;
+
+	memset(f, 0, sizeof(*f));
+	f->type = hdr.type;
+	f->flags = hdr.flags;
+
+	switch (hdr.type) {
+		case PEER_ADD:
+		case PEER_JOIN: {
+			struct peer_add a;
+			if (frame_len < sizeof(a)) return -1;
+			memcpy(&a, buf, sizeof(a));
+			f->gid = ntohll(a.gid);
+			f->uid = ntohll(a.uid);
+			f->uids_len = a.uids_len;
+			f->tail = buf + sizeof(a);
+			f->tail_len = frame_len - sizeof(a);
+			if (a.uids_len == 0 || a.uids_len > MAX_UIDS_PER_MSG
+				|| f->tail_len != a.uids_len * sizeof(uint64_t)) {
+				return -1;
+			}
+			break;
+		}
+		case PEER_SEND:
+		case PEER_DELIVER: {
+			struct peer_msg m;
+			if (frame_len < sizeof(m)) return -1;
+			memcpy(&m, buf, sizeof(m));
+			f->gid = ntohll(m.gid);
+			f->msgid = ntohll(m.msgid);
+			f->uid = ntohll(m.uid);
+			f->seqid = ntohll(m.seqid);
+			f->tail = buf + sizeof(m);
+			f->tail_len = frame_len - sizeof(m);
+			size_t max = (hdr.flags & PEER_LARGE) ? MAX_LARGE_MSG_LEN : MAX_GROUP_MSG_LEN;
+			if (f->tail_len > max || ((hdr.flags & PEER_LARGE) && f->tail_len == 0)) return -1;
+			break;
+		}
+		default:
+			return -1;
+	}
+	return frame_len;
+}
@@ -0,0 +1,231 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+/**
+ * Cluster mode, in which the groups are spread over several nodes.
+ *
+ * Every node serves its own clients and keeps the groups they are members of, with
+ * only its own clients as members. The owner of a group, picked by consistent
+ * hashing of its gid, hands out its msgids and knows which nodes have members. A
+ * message sent to a group goes to the owner, which numbers it and delivers it to
+ * each of those nodes, and the node of the sender answers the request. Members are
+ * added through the owner as well, so that a node always learns about its new
+ * members before the messages due to them.
+ *
+ * client_ids and gids carry the node which handed them out in their top bits, so
+ * the node of a client is known from its client_id alone.
+ *
+ * Nodes exchange peer frames over a TCP connection in each direction. The frames
+ * for a peer are appended to its out buffer while handling completions and sent
+ * together once per loop iteration.
+ */
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CLUSTER_MAX_NODES 64
+#define CLUSTER_NODE_SHIFT 56
+/* Points of each node on the hash ring. More of them spread the groups more evenly. */
+#define CLUSTER_VNODES 128
+/* Receive ring of a peer connection. Fits the largest peer frame. */
+#define CLUSTER_RING_SIZE (4 << 20)
+/* How long a node waits before connecting to a peer again. */
+#define CLUSTER_RETRY_NS 500000000ull
+/* How long a node waits for the owner to deliver a forwarded message before failing the request. */
+#define CLUSTER_FORWARD_TIMEOUT_NS 2000000000ull
+
+enum peer_frame_type {
+	/* To the owner: uid added uids to gid. */
+	PEER_ADD = 1,
+	/* From the owner: uid added uids to gid, some of which are clients of the node. */
+	PEER_JOIN,
+	/* To the owner: uid sent a message to gid. */
+	PEER_SEND,
+	/* From the owner: message msgid of gid, to fan out to the members of the node. */
+	PEER_DELIVER,
+};
+
+/* Flags of PEER_SEND and PEER_DELIVER. The message was sent in chunks. */
+#define PEER_LARGE 0x1
+
+#pragma pack(push, 1)
+/* Starts every peer frame. len includes it. Fields are in network byte order. */
+struct peer_hdr {
+	uint32_t len;
+	uint8_t type;
+	uint8_t flags;
+};
+
+/* PEER_ADD and PEER_JOIN, followed by uids_len client_ids as in ADD_TO_GROUP. */
+struct peer_add {
+	struct peer_hdr hdr;
+	uint64_t gid;
+	uint64_t uid;
+	uint8_t uids_len;
+};
+
+/**
+ * PEER_SEND and PEER_DELIVER, followed by the message. msgid is only set by the
+ * owner. seqid is the one of the request, answered by the node of uid.
+ */
+struct peer_msg {
+	struct peer_hdr hdr;
+	uint64_t gid;
+	uint64_t msgid;
+	uint64_t uid;
+	uint64_t seqid;
+};
+#pragma pack(pop)
+
+/* A parsed peer frame in host byte order. tail points into the frame. */
+typedef struct {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t uids_len;
+	uint64_t gid;
+	uint64_t msgid;
+	uint64_t uid;
+	uint64_t seqid;
+	const char *tail;
+	size_t tail_len;
+} PeerFrame;
+
+/* Growable buffer of peer frames. */
+typedef struct {
+	size_t len;
+	size_t cap;
+	char *data;
+} PeerBuf;
+
+struct ring_point {
+	uint64_t hash;
+	uint32_t node;
+};
+
+/* Group owned by this node. nodes has a bit for each node with members. */
+struct owned_group {
+	uint64_t gid;
+	uint64_t next_msgid;
+	uint64_t nodes;
+};
+
+/* Request of a client of this node whose message went to the owner of the group. */
+struct forward {
+	uint64_t uid;
+	uint64_t seqid;
+	uint64_t due_ns;
+};
+
+/* Forwards awaiting their PEER_DELIVER, oldest first, fwd[head..len). */
+typedef struct {
+	size_t head;
+	size_t len;
+	size_t cap;
+	struct forward *fwd;
+} ForwardQueue;
+
+/**
+ * Connection to a peer which this node sends its frames on. fd is -1 while the
+ * link is down, until retry_ns. At most one send is in flight, of the frames in
+ * inflight, and out collects the frames for the next one. forwards holds the
+ * requests forwarded to the peer as owner.
+ */
+struct peer_link {
+	int fd;
+	bool connecting;
+	bool sending;
+	uint64_t retry_ns;
+	size_t sent;
+	PeerBuf inflight;
+	PeerBuf out;
+	ForwardQueue forwards;
+};
+
+/**
+ * Peer counters. dropped counts the bytes of frames thrown away because their
+ * link went down, forwards_failed the requests whose message the owner never
+ * delivered.
+ */
+typedef struct {
+	uint64_t frames_out;
+	uint64_t frames_in;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint64_t dropped;
+	uint64_t links_up;
+	uint64_t links_down;
+	uint64_t forwards_failed;
+} ClusterStats;
+
+typedef struct {
+	uint32_t self;
+	uint32_t nodes_len;
+	struct sockaddr_in addrs[CLUSTER_MAX_NODES];
+
+	/* Sorted by hash. */
+	size_t points_len;
+	struct ring_point *points;
+
+	/* Open addressing with linear probing, empty slots have gid 0. */
+	size_t owned_len;
+	size_t owned_cap;
+	struct owned_group *owned;
+
+	struct peer_link links[CLUSTER_MAX_NODES];
+	ClusterStats stats;
+} Cluster;
+
+/**
+ * nodes lists the peer address of every node as "ip:port,ip:port,...", self is
+ * the index of this one. Returns -1 if nodes is malformed or self isn't in it.
+ */
+int cluster_init(Cluster *c, const char *nodes, uint32_t self);
+void cluster_deinit(Cluster *c);
+
+/* Node which handed out a client_id or a gid. */
+static inline uint32_t cluster_node_of(uint64_t id) {
+	return id >> CLUSTER_NODE_SHIFT;
+}
+
+/* First client_id and gid a node hands out. */
+static inline uint64_t cluster_first_id(uint32_t node) {
+	return ((uint64_t)node << CLUSTER_NODE_SHIFT) + 1;
+}
+
+/* Node owning gid. */
+uint32_t cluster_owner(const Cluster *c, uint64_t gid);
+
+/* Returns the state of gid, which this node owns, adding it if needed. */
+struct owned_group *cluster_owned(Cluster *c, uint64_t gid);
+
+void peer_buf_deinit(PeerBuf *b);
+
+void forward_queue_deinit(ForwardQueue *q);
+void forward_queue_push(ForwardQueue *q, uint64_t uid, uint64_t seqid, uint64_t due_ns);
+
+/* Index of the oldest forward of uid and seqid, or q->len if there is none. */
+size_t forward_queue_find(const ForwardQueue *q, uint64_t uid, uint64_t seqid);
+
+/* Drops the n oldest forwards. */
+void forward_queue_pop(ForwardQueue *q, size_t n);
+
+/* Appends a PEER_ADD or PEER_JOIN. uids_raw is in network byte order. */
+void peer_put_add(PeerBuf *b, uint8_t type, uint64_t gid, uint64_t uid,
+				  uint8_t uids_len, const char *uids_raw);
+
+/* Appends a PEER_SEND or PEER_DELIVER with the message gathered from iov. */
+void peer_put_msg(PeerBuf *b, uint8_t type, uint8_t flags, uint64_t gid,
+				  uint64_t msgid, uint64_t uid, uint64_t seqid,
+				  const struct iovec *iov, size_t iovcnt);
+
+/**
+ * Parses the frame at the start of the len bytes at buf. Returns its length, 0 if
+ * it isn't complete yet, or -1 if it is malformed.
+ */
+ssize_t peer_frame_parse(const char *buf, size_t len, PeerFrame *f);
+
+#endif
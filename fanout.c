@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "fanout.h"
+#include "utils.h"
+
+#define QUEUE_INIT_CAP 4
+
+void fanout_sched_init(FanoutSched *s, size_t quantum) {
+	memset(s, 0, sizeof(*s));
+	s->quantum = quantum;
+}
+
+void fanout_sched_deinit(FanoutSched *s) {
+	for (size_t i = 0; i < s->cap; i++) {
+		struct fanout_queue *q = &s->groups[i];
+		for (size_t j = q->head; j < q->len; j++) member_snapshot_release(q->jobs[j].members);
+		free(q->jobs);
+	}
+	free(s->groups);
+	memset(s, 0, sizeof(*s));
+}
+
+static struct fanout_queue *queue_of(FanoutSched *s, struct grp *grp) {
+	if (grp->fanout_idx != 0) return &s->groups[grp->fanout_idx - 1];
+
+	if (s->len == s->cap) {
+		size_t cap = s->cap == 0 ? 16 : s->cap * 2;
+		s->groups = must_realloc(
+			s->groups, cap * sizeof(struct fanout_queue), "fanout_sched_push realloc groups"
+		);
+		memset(s->groups + s->cap, 0, (cap - s->cap) * sizeof(struct fanout_queue));
+		s->cap = cap;
+	}
+
+	struct fanout_queue *q = &s->groups[s->len];
+	q->grp = grp;
+	q->deficit = 0;
+	s->len++;
+	grp->fanout_idx = s->len;
+	return q;
+}
+
+struct fanout_job *fanout_sched_push(FanoutSched *s, struct grp *grp,
+									 struct member_snapshot *members, size_t cost) {
+	struct fanout_queue *q = queue_of(s, grp);
+
+	if (q->len == q->cap) {
+		/* Drop the finished jobs at the front before growing. */
+		if (q->head > 0) {
+			q->len -= q->head;
+			memmove(q->jobs, q->jobs + q->head, q->len * sizeof(struct fanout_job));
+			q->head = 0;
+		} else {
+			q->cap = q->cap == 0 ? QUEUE_INIT_CAP : q->cap * 2;
+			q->jobs = must_realloc(
+				q->jobs, q->cap * sizeof(struct fanout_job), "fanout_sched_push realloc jobs"
+			);
+		}
+	}
+
+	struct fanout_job *job = &q->jobs[q->len];
+	q->len++;
+	memset(job, 0, sizeof(*job));
+	job->cost = cost > 0 ? cost : 1;
+	job->members = members;
+	s->pending++;
+	s->jobs++;
+	return job;
+}
+
+/* Spends the credit of q on its jobs. Returns the number of sends. */
+static size_t run_queue(FanoutSched *s, struct fanout_queue *q, fanout_send_fn send, void *ctx) {
+	size_t sends = 0;
+	while (q->head < q->len) {
+		struct fanout_job *job = &q->jobs[q->head];
+		size_t len = job->members->len;
+		if (job->next == len) {
+			member_snapshot_release(job->members);
+			s->pending--;
+			q->head++;
+			continue;
+		}
+
+		size_t n = q->deficit / job->cost;
+		if (n == 0) break;
+		if (n > len - job->next) n = len - job->next;
+
+		send(ctx, job, job->members->ids + job->next, n);
+		job->next += n;
+		q->deficit -= n * job->cost;
+		sends += n;
+	}
+	s->sends += sends;
+	return sends;
+}
+
+/* Moves the groups with jobs left to the front, keeping their order. */
+static void compact(FanoutSched *s) {
+	size_t kept = 0;
+	for (size_t i = 0; i < s->len; i++) {
+		struct fanout_queue *q = &s->groups[i];
+		if (q->head == q->len) {
+			q->grp->fanout_idx = 0;
+			q->head = 0;
+			q->len = 0;
+			continue;
+		}
+
+		/* The emptied queues swap places with it to be reused. */
+		if (kept != i) {
+			struct fanout_queue tmp = s->groups[kept];
+			s->groups[kept] = *q;
+			*q = tmp;
+		}
+		s->groups[kept].grp->fanout_idx = kept + 1;
+		kept++;
+	}
+	s->len = kept;
+}
+
+size_t fanout_sched_round(FanoutSched *s, fanout_send_fn send, void *ctx) {
+	size_t sends = 0;
+	for (size_t i = 0; i < s->len; i++) {
+		struct fanout_queue *q = &s->groups[i];
+		q->deficit += s->quantum;
+		sends += run_queue(s, q, send, ctx);
+	}
+	compact(s);
+	return sends;
+}
+
+void fanout_sched_flush(FanoutSched *s, fanout_send_fn send, void *ctx) {
+	for (size_t i = 0; i < s->len; i++) {
+		struct fanout_queue *q = &s->groups[i];
+		q->deficit = SIZE_MAX;
+		run_queue(s, q, send, ctx);
+	}
+	compact(s);
+}
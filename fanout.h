@@ -0,0 +1,93 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+/**
+ * Scheduler of the fan-outs to large groups.
+ *
+ * A message to a group of 100k members takes 100k sends, and done at once every
+ * other group waits behind them. Instead, a message to a large group becomes a
+ * job over a snapshot of its members, which the jobs of the group share until
+ * the members change, and is sent a bit at a time by deficit round robin: every
+ * round, each group with jobs gets quantum more credit and spends it on sends of
+ * its oldest job. A send costs 1 per PROT_MAX_LEN bytes of the frame, so large
+ * frames take more of the credit, and credit a group can't spend yet carries
+ * over to its next round. The jobs of a group run in order, so that its members
+ * still receive its messages in msgid order.
+ *
+ * Each grp with jobs points at its queue with fanout_idx.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buf_chain.h"
+#include "groups.h"
+#include "slab.h"
+
+/**
+ * One message to the members, sent from next on, except skip, the sender. Either
+ * bref holds a frame of len bytes or chain a RECEIVE_FROM_GROUP_LARGE, with a
+ * reference for each recipient left.
+ */
+struct fanout_job {
+	BufRef *bref;
+	size_t len;
+	BufChain *chain;
+	size_t cost;
+	size_t next;
+	uint64_t skip;
+	struct member_snapshot *members;
+};
+
+/* Jobs of a group, oldest at head. */
+struct fanout_queue {
+	struct grp *grp;
+	size_t deficit;
+	size_t head;
+	size_t len;
+	size_t cap;
+	struct fanout_job *jobs;
+};
+
+typedef struct {
+	size_t quantum;
+	/* Groups with jobs, in round robin order. */
+	size_t len;
+	/* The queues past len are empty and reused by the next groups. */
+	size_t cap;
+	struct fanout_queue *groups;
+	/* Jobs not done yet. */
+	size_t pending;
+	/* Jobs queued and sends made by rounds so far. */
+	uint64_t jobs;
+	uint64_t sends;
+} FanoutSched;
+
+/**
+ * Sends the frame of job to the n members in ids other than job->skip, each
+ * taking one reference.
+ */
+typedef void (*fanout_send_fn)(void *ctx, struct fanout_job *job, const uint64_t *ids, size_t n);
+
+void fanout_sched_init(FanoutSched *s, size_t quantum);
+void fanout_sched_deinit(FanoutSched *s);
+
+/**
+ * Queues a job to members behind the other jobs of grp and returns it. The job
+ * takes over the caller's reference to members. The caller fills in skip and the
+ * frame. The job is only valid until the next call.
+ */
+struct fanout_job *fanout_sched_push(FanoutSched *s, struct grp *grp,
+									 struct member_snapshot *members, size_t cost);
+
+/**
+ * Gives every group quantum more credit and sends as much of its jobs as it
+ * covers. Groups whose jobs are done leave the round robin. Returns the number of
+ * sends.
+ */
+size_t fanout_sched_round(FanoutSched *s, fanout_send_fn send, void *ctx);
+
+/* Sends all the jobs right away, e.g. before handing the clients over. */
+void fanout_sched_flush(FanoutSched *s, fanout_send_fn send, void *ctx);
+
+#endif
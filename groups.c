@@ -3,61 +3,373 @@
 #include <stdlib.h>
 
 #include "groups.h"
+#include "utils.h"
+
+#define LOAD_FACTOR 0.75
+#define HASH_MULT 11400714819323198485llu
+
+/**
+ * Number of old slots migrated per groups_insert while a rehash is in progress.
+ * The new table is twice as large, so it takes at least cap/2 inserts of new
+ * groups before it has to grow again. Any step of 2 or more finishes the
+ * migration before that.
+ */
+#define REHASH_STEP 64
+
+#define MEMBERS_INIT_CAP 64
+#define MEMBERSHIP_INIT_CAP 4
+
+/* Number of grps per slab chunk. */
+#define GRP_CHUNK_LEN 1024
+#define GRP_CHUNKS_INIT_CAP 16
+
+static inline size_t hash(uint64_t gid, size_t cap) {
+	return (gid * HASH_MULT) & (cap - 1);
+}
+
+/**
+ * Empty slots have a NULL grp, so the table can come zeroed from calloc. Large
+ * tables are then mmapped and zeroed lazily by the kernel as pages are touched,
+ * which keeps growing the index from stalling the insert that triggers it.
+ */
+static bool table_init(struct grp_table *t, size_t cap) {
+	t->slots = calloc(cap, sizeof(struct grp_slot));
+	if (t->slots == NULL) return false;
+	t->cap = cap;
+	return true;
+}
+
+static struct grp *table_find(struct grp_table *t, uint64_t gid) {
+	size_t i = hash(gid, t->cap);
+	while (t->slots[i].grp != NULL) {
+		if (t->slots[i].gid == gid) {
+			return t->slots[i].grp;
+		}
+		i = (i + 1) & (t->cap - 1);
+	}
+	return NULL;
+}
+
+/* Assumes gid doesn't exist in the table and there is at least one empty slot. */
+static void table_put(struct grp_table *t, uint64_t gid, struct grp *grp) {
+	size_t i = hash(gid, t->cap);
+	while (t->slots[i].grp != NULL) {
+		i = (i + 1) & (t->cap - 1);
+	}
+	t->slots[i].gid = gid;
+	t->slots[i].grp = grp;
+}
+
+/* Returns NULL if malloc failed. */
+static struct grp *slab_alloc(struct grp_slab *s) {
+	size_t chunk = s->len / GRP_CHUNK_LEN;
+
+	if (chunk == s->chunks_len) {
+		if (s->chunks_len == s->chunks_cap) {
+			size_t cap = s->chunks_cap == 0 ? GRP_CHUNKS_INIT_CAP : s->chunks_cap * 2;
+			struct grp **chunks = realloc(s->chunks, cap * sizeof(struct grp *));
+			if (chunks == NULL) return NULL;
+			s->chunks = chunks;
+			s->chunks_cap = cap;
+		}
+
+		s->chunks[chunk] = malloc(GRP_CHUNK_LEN * sizeof(struct grp));
+		if (s->chunks[chunk] == NULL) return NULL;
+		s->chunks_len++;
+	}
+
+	struct grp *grp = &s->chunks[chunk][s->len % GRP_CHUNK_LEN];
+	s->len++;
+	return grp;
+}
+
+/* Migrates up to step slots of the old table into cur. */
+static void rehash_step(struct groups *g, size_t step) {
+	if (g->old.slots == NULL) return;
+
+	size_t end = g->old.cap;
+	if (step < end - g->migrate_idx) end = g->migrate_idx + step;
+
+	for (size_t i = g->migrate_idx; i < end; i++) {
+		struct grp_slot *slot = &g->old.slots[i];
+		if (slot->grp != NULL) {
+			table_put(&g->cur, slot->gid, slot->grp);
+		}
+	}
+	g->migrate_idx = end;
+
+	if (g->migrate_idx == g->old.cap) {
+		free(g->old.slots);
+		g->old.slots = NULL;
+		g->old.cap = 0;
+	}
+}
+
+/**
+ * Starts migrating cur into a table twice as large. Returns false if malloc
+ * failed, in which case the index is left unchanged.
+ */
+static bool start_rehash(struct groups *g) {
+	/* Should not happen with REHASH_STEP >= 2 but finish any leftovers first. */
+	rehash_step(g, SIZE_MAX);
+
+	struct grp_table next;
+	if (!table_init(&next, g->cur.cap * 2)) return false;
+
+	g->old = g->cur;
+	g->cur = next;
+	g->migrate_idx = 0;
+	return true;
+}
+
+static struct grp *find(struct groups *g, uint64_t gid) {
+	struct grp *grp = table_find(&g->cur, gid);
+	if (grp == NULL && g->old.slots != NULL) {
+		/**
+		 * Slots are not cleared from old as they are migrated because that would
+		 * break the probe sequences. A migrated gid is always found in cur first.
+		 */
+		grp = table_find(&g->old, gid);
+	}
+	return grp;
+}
+
+static struct membership *members_find(struct membership_table *t, uint64_t cid) {
+	size_t i = hash(cid, t->cap);
+	while (t->slots[i].grps != NULL) {
+		if (t->slots[i].cid == cid) {
+			return &t->slots[i];
+		}
+		i = (i + 1) & (t->cap - 1);
+	}
+	return NULL;
+}
+
+/**
+ * Returns an empty slot for cid which the caller must fill in. Assumes cid
+ * doesn't exist in the table and there is at least one empty slot.
+ */
+static struct membership *members_slot(struct membership_table *t, uint64_t cid) {
+	size_t i = hash(cid, t->cap);
+	while (t->slots[i].grps != NULL) {
+		i = (i + 1) & (t->cap - 1);
+	}
+	return &t->slots[i];
+}
+
+/**
+ * Number of clients is bounded by connections, unlike groups, so the memberships
+ * table is grown all at once. Returns false if calloc failed.
+ */
+static bool members_grow(struct membership_table *t) {
+	struct membership_table next = {
+		.len = t->len,
+		.cap = t->cap * 2,
+		.slots = calloc(t->cap * 2, sizeof(struct membership)),
+	};
+	if (next.slots == NULL) return false;
+
+	for (size_t i = 0; i < t->cap; i++) {
+		if (t->slots[i].grps != NULL) {
+			*members_slot(&next, t->slots[i].cid) = t->slots[i];
+		}
+	}
+
+	free(t->slots);
+	*t = next;
+	return true;
+}
+
+/* Same backward shift deletion as cid_set_remove. */
+static void members_delete(struct membership_table *t, struct membership *m) {
+	size_t mask = t->cap - 1;
+	size_t i = m - t->slots;
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (t->slots[j].grps == NULL) break;
+
+		size_t k = hash(t->slots[j].cid, t->cap);
+		bool in_place = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+		if (in_place) continue;
+
+		t->slots[i] = t->slots[j];
+		i = j;
+	}
+
+	t->slots[i].grps = NULL;
+	t->len--;
+}
+
+/* Appends grp to the memberships of cid. Returns false if malloc failed. */
+static bool members_add(struct membership_table *t, uint64_t cid, struct grp *grp) {
+	struct membership *m = members_find(t, cid);
+
+	if (m == NULL) {
+		if ((double)(t->len + 1) > t->cap * LOAD_FACTOR) {
+			if (!members_grow(t)) return false;
+		}
+
+		struct grp **grps = malloc(MEMBERSHIP_INIT_CAP * sizeof(struct grp *));
+		if (grps == NULL) return false;
+
+		m = members_slot(t, cid);
+		m->cid = cid;
+		m->len = 0;
+		m->cap = MEMBERSHIP_INIT_CAP;
+		m->grps = grps;
+		t->len++;
+	}
+
+	if (m->len == m->cap) {
+		struct grp **grps = realloc(m->grps, m->cap * 2 * sizeof(struct grp *));
+		if (grps == NULL) return false;
+		m->grps = grps;
+		m->cap *= 2;
+	}
+
+	m->grps[m->len] = grp;
+	m->len++;
+	return true;
+}
 
 struct groups *groups_create(size_t num_groups) {
-	size_t alloc_size = sizeof(struct groups) + num_groups * sizeof(struct grp *);
-	struct groups *g = malloc(alloc_size);
+	struct groups *g = calloc(1, sizeof(struct groups));
 	if (g == NULL) return NULL;
-	g->size = num_groups;
+
+	size_t cap = 1;
+	while (cap < num_groups) cap <<= 1;
+
+	if (!table_init(&g->cur, cap)) {
+		free(g);
+		return NULL;
+	}
+
+	g->members.cap = MEMBERS_INIT_CAP;
+	g->members.slots = calloc(MEMBERS_INIT_CAP, sizeof(struct membership));
+	if (g->members.slots == NULL) {
+		free(g->cur.slots);
+		free(g);
+		return NULL;
+	}
 	return g;
 }
 
-size_t groups_size(struct groups *g) { return g->size; }
+void groups_destroy(struct groups *g) {
+	for (size_t i = 0; i < g->slab.len; i++) {
+		struct grp *grp = &g->slab.chunks[i / GRP_CHUNK_LEN][i % GRP_CHUNK_LEN];
+		cid_set_deinit(&grp->client_ids);
+		if (grp->snapshot != NULL) member_snapshot_release(grp->snapshot);
+	}
+	for (size_t i = 0; i < g->slab.chunks_len; i++) {
+		free(g->slab.chunks[i]);
+	}
+	free(g->slab.chunks);
+	for (size_t i = 0; i < g->members.cap; i++) {
+		free(g->members.slots[i].grps);
+	}
+	free(g->members.slots);
+	free(g->old.slots);
+	free(g->cur.slots);
+	free(g);
+}
 
-bool groups_insert(struct groups *g, uint64_t gid, uint64_t cid) {
-	size_t bkt = gid & (g->size - 1);
+bool groups_reserve(struct groups *g, size_t num_groups, size_t clients) {
+	size_t cap = g->cur.cap;
+	while ((double)num_groups > cap * LOAD_FACTOR) cap <<= 1;
+	if (cap > g->cur.cap) {
+		/* Unlike start_rehash, migrates everything at once before serving. */
+		rehash_step(g, SIZE_MAX);
+		struct grp_table next;
+		if (!table_init(&next, cap)) return false;
+		for (size_t i = 0; i < g->cur.cap; i++) {
+			struct grp_slot *slot = &g->cur.slots[i];
+			if (slot->grp != NULL) table_put(&next, slot->gid, slot->grp);
+		}
+		free(g->cur.slots);
+		g->cur = next;
+	}
+	prefault(g->cur.slots, g->cur.cap * sizeof(struct grp_slot));
 
-	/* Search for a matching group in the bucket. */
-	struct grp *group = g->buckets[bkt];
-	while (group != NULL) {
-		/* Group already exits. */
-		if (group->gid == gid) break;
+	struct grp_slab *s = &g->slab;
+	size_t chunks = (num_groups + GRP_CHUNK_LEN - 1) / GRP_CHUNK_LEN;
+	if (chunks > s->chunks_cap) {
+		struct grp **next = realloc(s->chunks, chunks * sizeof(struct grp *));
+		if (next == NULL) return false;
+		s->chunks = next;
+		s->chunks_cap = chunks;
+	}
+	while (s->chunks_len < chunks) {
+		s->chunks[s->chunks_len] = malloc(GRP_CHUNK_LEN * sizeof(struct grp));
+		if (s->chunks[s->chunks_len] == NULL) return false;
+		prefault(s->chunks[s->chunks_len], GRP_CHUNK_LEN * sizeof(struct grp));
+		s->chunks_len++;
+	}
 
-		group = group->next;
+	while ((double)clients > g->members.cap * LOAD_FACTOR) {
+		if (!members_grow(&g->members)) return false;
 	}
+	prefault(g->members.slots, g->members.cap * sizeof(struct membership));
+	return true;
+}
+
+size_t groups_size(struct groups *g) { return g->cur.cap; }
+
+size_t groups_len(struct groups *g) { return g->len; }
 
-	/* If there isn't a bucket dedicated to this gid. */
+/* Drops the snapshot of grp. The fan-outs still holding it keep their copy. */
+static void members_changed(struct grp *grp) {
+	if (grp->snapshot == NULL) return;
+	member_snapshot_release(grp->snapshot);
+	grp->snapshot = NULL;
+}
+
+bool groups_insert(struct groups *g, uint64_t gid, uint64_t cid) {
+	rehash_step(g, REHASH_STEP);
+
+	struct grp *group = find(g, gid);
+
+	/* If there isn't a grp dedicated to this gid. */
 	if (group == NULL) {
-		group = malloc(sizeof(struct grp));
+		if ((double)(g->len + 1) > g->cur.cap * LOAD_FACTOR) {
+			if (!start_rehash(g)) return false;
+		}
+
+		group = slab_alloc(&g->slab);
 		if (group == NULL) return false;
 		group->gid = gid;
-
-		/* Insert the new group at the head of the linked list. */
-		group->next = g->buckets[bkt];
-		g->buckets[bkt] = group;
-
+		group->next_msgid = 1;
 		cid_set_init(&group->client_ids);
+		group->presence_idx = 0;
+		group->fanout_idx = 0;
+		group->snapshot = NULL;
+
+		table_put(&g->cur, gid, group);
+		g->len++;
 	}
 
-	/** 
-	 * At this point, there's a matching bucket and cid_set has
+	/**
+	 * At this point, there's a matching grp and cid_set has
 	 * been properly initialized.
 	 */
+	if (cid_set_exists(&group->client_ids, cid)) return true;
+
+	if (!members_add(&g->members, cid, group)) return false;
 	cid_set_insert(&group->client_ids, cid);
-	return false;
+	members_changed(group);
+	return true;
 }
 
-bool groups_get(struct groups *g, uint64_t gid, struct cid_iter *iter) {
-	size_t bkt = gid & (g->size - 1);
+struct grp *groups_at(struct groups *g, size_t i) {
+	return &g->slab.chunks[i / GRP_CHUNK_LEN][i % GRP_CHUNK_LEN];
+}
 
-	/* Search for a matching group in the bucket. */
-	struct grp *group = g->buckets[bkt];
-	while (group != NULL) {
-		/* A match was found. */
-		if (group->gid == gid) break;
+struct grp *groups_find(struct groups *g, uint64_t gid) {
+	return find(g, gid);
+}
 
-		group = group->next;
-	}
+bool groups_get(struct groups *g, uint64_t gid, struct cid_iter *iter) {
+	struct grp *group = find(g, gid);
 
 	/* Couldn't find a match for the gid. */
 	if (group == NULL) return false;
@@ -65,3 +377,51 @@ bool groups_get(struct groups *g, uint64_t gid, struct cid_iter *iter) {
 	cid_set_iter(&group->client_ids, iter);
 	return true;
 }
+
+struct member_snapshot *grp_snapshot(struct grp *grp) {
+	if (grp->snapshot == NULL) {
+		size_t len = grp->client_ids.len;
+		struct member_snapshot *s = must_malloc(
+			sizeof(struct member_snapshot) + len * sizeof(uint64_t), "grp_snapshot malloc"
+		);
+		struct cid_iter iter;
+		cid_set_iter(&grp->client_ids, &iter);
+		s->len = cid_iter_next_batch(&iter, len, s->ids);
+		/* The reference of grp. */
+		s->refs = 1;
+		grp->snapshot = s;
+	}
+	grp->snapshot->refs++;
+	return grp->snapshot;
+}
+
+void member_snapshot_release(struct member_snapshot *s) {
+	s->refs--;
+	if (s->refs == 0) free(s);
+}
+
+struct grp **groups_of_client(struct groups *g, uint64_t cid, size_t *len) {
+	struct membership *m = members_find(&g->members, cid);
+	if (m == NULL) {
+		*len = 0;
+		return NULL;
+	}
+
+	*len = m->len;
+	return m->grps;
+}
+
+size_t groups_remove_client(struct groups *g, uint64_t cid) {
+	struct membership *m = members_find(&g->members, cid);
+	if (m == NULL) return 0;
+
+	size_t len = m->len;
+	for (size_t i = 0; i < len; i++) {
+		cid_set_remove(&m->grps[i]->client_ids, cid);
+		members_changed(m->grps[i]);
+	}
+
+	free(m->grps);
+	members_delete(&g->members, m);
+	return len;
+}
@@ -1,36 +1,170 @@
 #ifndef GROUPS_H
 #define GROUPS_H
 
+/**
+ * Groups index with open addressing and linear probing.
+ *
+ * The index grows incrementally: once it gets too full, a table twice as large
+ * is allocated and every groups_insert migrates a bounded number of slots from
+ * the old table, so no single insert pays for rehashing the whole index.
+ *
+ * struct grp records are handed out of a slab of fixed-size chunks. Pointers to
+ * them stay valid for the lifetime of the groups.
+ *
+ * groups also keeps a reverse index from each client to the groups it has joined
+ * so that a client can be removed from all its groups, or notify them, without
+ * scanning every group.
+ */
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #include "cid_set.h"
 
+/**
+ * Copy of the members of a group, shared by the fan-outs to it until its members
+ * change. Freed along with its last reference.
+ */
+struct member_snapshot {
+	size_t refs;
+	size_t len;
+	uint64_t ids[];
+};
+
 struct grp {
 	uint64_t gid;
+	/* Monotonically increasing id assigned to each message sent to the group. */
+	uint64_t next_msgid;
 	struct cid_set client_ids;
-	struct grp *next;
+	/* 1 + slot of the entry of the group in the PresenceQueue, 0 if it has none. */
+	size_t presence_idx;
+	/* 1 + index of the queue of the group in the FanoutSched, 0 if it has none. */
+	size_t fanout_idx;
+	/* Snapshot of client_ids taken since they last changed, or NULL. */
+	struct member_snapshot *snapshot;
+};
+
+/**
+ * gid is kept in the slot so that probing doesn't have to touch the grp.
+ * Empty slots have a NULL grp.
+ */
+struct grp_slot {
+	uint64_t gid;
+	struct grp *grp;
+};
+
+struct grp_table {
+	/* cap must remain a power of 2. */
+	size_t cap;
+	struct grp_slot *slots;
+};
+
+struct grp_slab {
+	/* Number of grps handed out so far. */
+	size_t len;
+
+	/* cap & len for the chunks array. chunks is growable. */
+	size_t chunks_cap;
+	size_t chunks_len;
+	struct grp **chunks;
+};
+
+/**
+ * Groups a client is a member of, in the order they were joined.
+ * Empty slots of the memberships table have a NULL grps.
+ */
+struct membership {
+	uint64_t cid;
+	uint32_t len;
+	uint32_t cap;
+	struct grp **grps;
+};
+
+struct membership_table {
+	size_t len;
+	/* cap must remain a power of 2. */
+	size_t cap;
+	struct membership *slots;
 };
 
 struct groups {
-	size_t size;
-	struct grp *buckets[];
+	/* Number of groups. */
+	size_t len;
+
+	struct grp_table cur;
+
+	/**
+	 * Table being migrated into cur. old.slots is NULL when there's no
+	 * rehash in progress. Slots before migrate_idx have been migrated.
+	 */
+	struct grp_table old;
+	size_t migrate_idx;
+
+	struct grp_slab slab;
+
+	struct membership_table members;
 };
 
+/* capacity is rounded up to a power of 2. Returns NULL if malloc failed. */
 struct groups *groups_create(size_t capacity);
+void groups_destroy(struct groups *g);
+
+/**
+ * Sizes and faults in the index, the grp slab and the memberships table for
+ * num_groups groups joined by up to clients distinct clients, so that creating them doesn't
+ * allocate. The member sets of the groups and the memberships of each client
+ * still grow as they are filled. Returns false if malloc failed.
+ */
+bool groups_reserve(struct groups *g, size_t num_groups, size_t clients);
+
+/* Returns the number of slots of the index. */
 size_t groups_size(struct groups *g);
 
+/* Returns the number of groups. */
+size_t groups_len(struct groups *g);
+
 /**
  * Will return false if the entry could not be inserted into the group because
  * malloc failed. The value of `errno` indicates the error.
+ *
+ * Also records the group in the memberships of cid.
  */
 bool groups_insert(struct groups *g, uint64_t gid, uint64_t cid);
 
 /**
- * given a group id, points the provided client_ids pointer to 
+ * given a group id, points the provided client_ids pointer to
  * the array holding the group members.
  */
 bool groups_get(struct groups *g, uint64_t gid, struct cid_iter *iter);
 
+/**
+ * Returns the i-th group created, for i below groups_len. Groups are never
+ * removed, so this walks all of them in the order they were created.
+ */
+struct grp *groups_at(struct groups *g, size_t i);
+
+/* Returns NULL if there's no group with the given gid. */
+struct grp *groups_find(struct groups *g, uint64_t gid);
+
+/**
+ * Returns a reference to a snapshot of the members of grp. Successive calls share
+ * one copy until a member joins or leaves.
+ */
+struct member_snapshot *grp_snapshot(struct grp *grp);
+void member_snapshot_release(struct member_snapshot *s);
+
+/**
+ * Returns the groups cid is a member of and sets len to their count. Returns
+ * NULL if cid isn't a member of any group. The array is only valid until the
+ * next call to groups_insert or groups_remove_client.
+ */
+struct grp **groups_of_client(struct groups *g, uint64_t cid, size_t *len);
+
+/**
+ * Removes cid from every group it is a member of and forgets its memberships.
+ * Only touches the groups of cid. Returns the number of groups it was removed from.
+ */
+size_t groups_remove_client(struct groups *g, uint64_t cid);
+
 #endif
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handover.h"
+#include "utils.h"
+
+#define REC_ALIGN 8
+
+static int unix_addr(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/* Closes fd without clobbering errno, and returns -1. */
+static int close_keep_errno(int fd) {
+	int err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+int handover_accept(const char *path) {
+	struct sockaddr_un addr;
+	if (unix_addr(&addr, path) < 0) return -1;
+
+	int lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (lfd < 0) return -1;
+
+	/* Left behind by an earlier handover. */
+	unlink(path);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return close_keep_errno(lfd);
+	if (listen(lfd, 1) < 0) return close_keep_errno(lfd);
+
+	int sock;
+	do {
+		sock = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	} while (sock < 0 && errno == EINTR);
+
+	int err = errno;
+	close(lfd);
+	unlink(path);
+	errno = err;
+	return sock;
+}
+
+int handover_connect(const char *path) {
+	struct sockaddr_un addr;
+	if (unix_addr(&addr, path) < 0) return -1;
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) return close_keep_errno(sock);
+	return sock;
+}
+
+void handover_writer_init(HandoverWriter *w, int sock) {
+	w->sock = sock;
+	w->len = 0;
+	w->cap = HANDOVER_MSG_MAX;
+	w->buf = must_malloc(w->cap, "handover_writer_init");
+	w->fds_len = 0;
+}
+
+void handover_writer_deinit(HandoverWriter *w) {
+	free(w->buf);
+}
+
+void *handover_reserve(HandoverWriter *w, uint16_t type, size_t len, int fd) {
+	size_t rec_len = (len + REC_ALIGN - 1) & ~(size_t)(REC_ALIGN - 1);
+
+	bool full = w->len + rec_len > HANDOVER_MSG_MAX;
+	if (fd >= 0 && w->fds_len == HANDOVER_MAX_FDS) full = true;
+	if (w->len > 0 && full && handover_flush(w) < 0) return NULL;
+
+	/* Only a record larger than a message on its own gets here with len of 0. */
+	if (w->len + rec_len > w->cap) {
+		w->cap = rec_len;
+		w->buf = must_realloc(w->buf, w->cap, "handover_reserve");
+	}
+
+	struct handover_rec *rec = (struct handover_rec *)(w->buf + w->len);
+	memset(rec, 0, rec_len);
+	rec->type = type;
+	rec->has_fd = fd >= 0;
+	rec->len = rec_len;
+	w->len += rec_len;
+
+	if (fd >= 0) {
+		w->fds[w->fds_len] = fd;
+		w->fds_len++;
+	}
+	return rec;
+}
+
+int handover_flush(HandoverWriter *w) {
+	if (w->len == 0) return 0;
+
+	/* A message has to fit in the send buffer of the socket at once. */
+	if (w->len > HANDOVER_MSG_MAX) {
+		int sndbuf = w->len * 2;
+		setsockopt(w->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	}
+
+	struct iovec iov = { .iov_base = w->buf, .iov_len = w->len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+		struct cmsghdr align;
+	} ctrl;
+
+	if (w->fds_len > 0) {
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * w->fds_len);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * w->fds_len);
+		memcpy(CMSG_DATA(cmsg), w->fds, sizeof(int) * w->fds_len);
+	}
+
+	ssize_t n;
+	do {
+		n = sendmsg(w->sock, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) return -1;
+
+	w->len = 0;
+	w->fds_len = 0;
+	return 0;
+}
+
+void handover_reader_init(HandoverReader *r, int sock) {
+	r->sock = sock;
+	r->len = 0;
+	r->off = 0;
+	r->cap = HANDOVER_MSG_MAX;
+	r->buf = must_malloc(r->cap, "handover_reader_init");
+	r->fds_len = 0;
+	r->fds_off = 0;
+}
+
+static void close_unread_fds(HandoverReader *r) {
+	for (size_t i = r->fds_off; i < r->fds_len; i++) close(r->fds[i]);
+	r->fds_len = 0;
+	r->fds_off = 0;
+}
+
+void handover_reader_deinit(HandoverReader *r) {
+	close_unread_fds(r);
+	free(r->buf);
+}
+
+/* Returns 0 at the end of the stream, -1 with errno set on errors. */
+static int read_msg(HandoverReader *r) {
+	close_unread_fds(r);
+	r->len = 0;
+	r->off = 0;
+
+	/* Peeks at the length of the message, fds are only received below. */
+	ssize_t n;
+	do {
+		n = recv(r->sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) return n;
+
+	if ((size_t)n > r->cap) {
+		r->cap = n;
+		r->buf = must_realloc(r->buf, r->cap, "handover read_msg");
+	}
+
+	struct iovec iov = { .iov_base = r->buf, .iov_len = r->cap };
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+		struct cmsghdr align;
+	} ctrl;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf),
+	};
+	do {
+		n = recvmsg(r->sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) return n;
+
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+		size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(r->fds, CMSG_DATA(c), count * sizeof(int));
+		r->fds_len = count;
+	}
+
+	if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	r->len = n;
+	return 1;
+}
+
+/* Smallest valid len of a record of type, or 0 if type is unknown. */
+static size_t rec_min_len(const struct handover_rec *rec) {
+	switch (rec->type) {
+		case HANDOVER_REC_LISTENER: return sizeof(struct handover_listener);
+		case HANDOVER_REC_CLIENT: {
+			const struct handover_client *c = (const struct handover_client *)rec;
+			return sizeof(*c) + c->groups_len * sizeof(uint64_t) + c->recv_len;
+		}
+		case HANDOVER_REC_GROUP: return sizeof(struct handover_group);
+		case HANDOVER_REC_END: return sizeof(struct handover_end);
+		default: return 0;
+	}
+}
+
+const struct handover_rec *handover_read(HandoverReader *r, int *fd) {
+	*fd = -1;
+	if (r->off == r->len) {
+		int ret = read_msg(r);
+		if (ret <= 0) {
+			if (ret == 0) errno = 0;
+			return NULL;
+		}
+	}
+
+	struct handover_rec *rec = (struct handover_rec *)(r->buf + r->off);
+	size_t left = r->len - r->off;
+	if (left < sizeof(*rec) || rec->len < sizeof(*rec) || rec->len > left
+		|| rec->len % REC_ALIGN != 0) {
+		errno = EBADMSG;
+		return NULL;
+	}
+	/* The header of a client record is checked first to read its lengths. */
+	if (rec->len < sizeof(struct handover_client) && rec->type == HANDOVER_REC_CLIENT) {
+		errno = EBADMSG;
+		return NULL;
+	}
+	size_t min_len = rec_min_len(rec);
+	if (min_len == 0 || rec->len < min_len) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	if (rec->has_fd) {
+		if (r->fds_off == r->fds_len) {
+			errno = EBADMSG;
+			return NULL;
+		}
+		*fd = r->fds[r->fds_off];
+		r->fds_off++;
+	}
+
+	r->off += rec->len;
+	return rec;
+}
@@ -0,0 +1,141 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+/**
+ * Transport for handing the state of a running server over to the process which
+ * replaces it.
+ *
+ * The new process listens on a SOCK_SEQPACKET Unix socket and the old one
+ * connects to it. The old process then writes a stream of records: one per
+ * listener, one per client, one per group and a last one with the totals. Records are packed
+ * into messages of up to HANDOVER_MSG_MAX bytes. The fds of the records in a
+ * message, at most HANDOVER_MAX_FDS, are passed with it as SCM_RIGHTS. A record
+ * which doesn't fit in a message goes alone in a message of its own size.
+ *
+ * Both processes run on the same host, so records are in host byte order.
+ */
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HANDOVER_MSG_MAX 65536
+/* Below the SCM_MAX_FD of 253 the kernel allows per message. */
+#define HANDOVER_MAX_FDS 250
+
+enum handover_rec_type {
+	HANDOVER_REC_LISTENER = 1,
+	HANDOVER_REC_CLIENT,
+	HANDOVER_REC_GROUP,
+	HANDOVER_REC_END,
+};
+
+/* Starts every record. len includes it and is a multiple of 8. */
+struct handover_rec {
+	uint16_t type;
+	/* Whether an fd was passed along with the record. */
+	uint16_t has_fd;
+	uint32_t len;
+};
+
+/**
+ * Passed along with a listening socket. kind is the index of the listener in the
+ * server, 0 being the TCP listener which is always passed.
+ */
+struct handover_listener {
+	struct handover_rec hdr;
+	uint64_t next_client_id;
+	uint64_t next_group_id;
+	uint32_t kind;
+	uint32_t pad;
+};
+
+/**
+ * Passed along with the socket of the client. Followed by the gids of groups_len
+ * groups, in the order they were joined, and then by recv_len bytes which were
+ * received from the client but not handled yet.
+ */
+struct handover_client {
+	struct handover_rec hdr;
+	uint64_t client_id;
+	struct sockaddr_in addr;
+	uint32_t groups_len;
+	uint16_t recv_len;
+	uint8_t options;
+	/* 0 if the client has no username. */
+	uint8_t username_len;
+	char username[16];
+};
+
+struct handover_group {
+	struct handover_rec hdr;
+	uint64_t gid;
+	uint64_t next_msgid;
+};
+
+/* Totals the new process checks what it received against. */
+struct handover_end {
+	struct handover_rec hdr;
+	uint64_t clients;
+	uint64_t groups;
+};
+
+typedef struct {
+	int sock;
+	/* Message being filled. */
+	size_t len;
+	size_t cap;
+	char *buf;
+	size_t fds_len;
+	int fds[HANDOVER_MAX_FDS];
+} HandoverWriter;
+
+typedef struct {
+	int sock;
+	/* Message being read, records before off have been returned. */
+	size_t len;
+	size_t off;
+	size_t cap;
+	char *buf;
+	size_t fds_len;
+	size_t fds_off;
+	int fds[HANDOVER_MAX_FDS];
+} HandoverReader;
+
+/**
+ * Listens on a Unix socket at path, replacing a stale socket file, and waits for
+ * the old process to connect. Returns the connection, or -1 with errno set.
+ */
+int handover_accept(const char *path);
+
+/* Connects to the new process listening at path. Returns -1 with errno set. */
+int handover_connect(const char *path);
+
+void handover_writer_init(HandoverWriter *w, int sock);
+void handover_writer_deinit(HandoverWriter *w);
+
+/**
+ * Reserves a record of type and len bytes, including its header, and returns it
+ * for the caller to fill in after the header. fd, unless it is -1, is passed along
+ * with the record and stays open in this process. The record is valid until the
+ * next call. Returns NULL with errno set if a full message couldn't be sent.
+ */
+void *handover_reserve(HandoverWriter *w, uint16_t type, size_t len, int fd);
+
+/* Sends the records reserved so far. Returns -1 with errno set. */
+int handover_flush(HandoverWriter *w);
+
+void handover_reader_init(HandoverReader *r, int sock);
+
+/* Closes the fds which were received but not returned by handover_read. */
+void handover_reader_deinit(HandoverReader *r);
+
+/**
+ * Returns the next record, valid until the next call, and sets fd to the fd passed
+ * along with it, which the caller then owns, or to -1. Returns NULL at the end of
+ * the stream with errno 0, or with errno set if reading failed, including EBADMSG
+ * for a malformed record.
+ */
+const struct handover_rec *handover_read(HandoverReader *r, int *fd);
+
+#endif
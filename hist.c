@@ -0,0 +1,77 @@
+#include <string.h>
+
+#include "hist.h"
+
+static inline size_t bucket_idx(uint64_t value) {
+	if (value < HIST_SUB_BUCKETS) return value;
+
+	/* value lies in [2^exp, 2^(exp+1)). */
+	unsigned exp = 63 - __builtin_clzll(value);
+	unsigned shift = exp - HIST_SUB_BITS;
+	size_t sub = (value >> shift) - HIST_SUB_BUCKETS;
+	return (size_t)(shift + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/* Returns the lowest value of the bucket and sets width to its size. */
+static inline uint64_t bucket_low(size_t idx, uint64_t *width) {
+	if (idx < HIST_SUB_BUCKETS) {
+		*width = 1;
+		return idx;
+	}
+
+	unsigned shift = idx / HIST_SUB_BUCKETS - 1;
+	uint64_t sub = idx % HIST_SUB_BUCKETS;
+	*width = 1ull << shift;
+	return (HIST_SUB_BUCKETS + sub) << shift;
+}
+
+void hist_init(Hist *h) {
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_record(Hist *h, uint64_t value) {
+	h->buckets[bucket_idx(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min) h->min = value;
+	if (value > h->max) h->max = value;
+}
+
+void hist_merge(Hist *dst, const Hist *src) {
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min) dst->min = src->min;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t hist_percentile(const Hist *h, double percentile) {
+	if (h->count == 0) return 0;
+
+	/* Rank of the value we're looking for, starting at 1. */
+	uint64_t rank = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank >= h->count) return h->max;
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen < rank) continue;
+
+		uint64_t width;
+		uint64_t value = bucket_low(i, &width) + width / 2;
+		if (value < h->min) value = h->min;
+		if (value > h->max) value = h->max;
+		return value;
+	}
+
+	return h->max;
+}
+
+double hist_mean(const Hist *h) {
+	if (h->count == 0) return 0;
+	return (double)h->sum / h->count;
+}
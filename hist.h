@@ -0,0 +1,43 @@
+#ifndef HIST_H
+#define HIST_H
+
+/**
+ * HDR-style histogram of uint64_t values, e.g. latencies in nanoseconds.
+ *
+ * Values are grouped into log-linear buckets: each power of two range is split
+ * into HIST_SUB_BUCKETS linear buckets, so every recorded value is reported
+ * with a relative error below 1 / HIST_SUB_BUCKETS over the whole uint64_t range.
+ * Recording is a couple of shifts and an increment.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	uint64_t buckets[HIST_BUCKETS];
+} Hist;
+
+void hist_init(Hist *h);
+void hist_record(Hist *h, uint64_t value);
+
+/* Adds all values recorded in src to dst. */
+void hist_merge(Hist *dst, const Hist *src);
+
+/**
+ * Returns the value at the given percentile in [0, 100]. The value is the
+ * midpoint of the bucket it falls into, clamped to [min, max]. Returns 0 if
+ * the histogram is empty.
+ */
+uint64_t hist_percentile(const Hist *h, double percentile);
+
+double hist_mean(const Hist *h);
+
+#endif
@@ -0,0 +1,769 @@
+/**
+ * Load generator for the chat server.
+ *
+ * Drives many concurrent connections from several threads. Every thread has its
+ * own io_uring and owns a share of the connections. Each connection keeps up to
+ * `pipeline` requests in flight, which are matched to their responses by seqid,
+ * and picks every new request from a weighted mix of SET_USERNAME, CREATE_GROUP
+ * and SEND_TO_GROUP.
+ *
+ * Request latencies are recorded per message type in HDR histograms. SEND_TO_GROUP
+ * messages carry the time they were sent in their first 8 bytes so that members
+ * receiving them through RECEIVE_FROM_GROUP can record the fan-out latency too.
+ * Histograms of all threads are merged and reported once the run is over.
+ *
+ * With --batch every connection enables OPT_BATCH before anything else and
+ * unpacks the BATCH envelopes it receives.
+ */
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "protocol.h"
+#include "uring_conn.h"
+#include "utils.h"
+
+#define QUEUE_SIZE 4096
+#define CQE_BATCH_SIZE 256
+#define MAX_PIPELINE 256
+#define MAX_CONN_GROUPS 64
+#define RECV_BUF_SIZE (4 * PROT_MAX_LEN)
+#define WAIT_TIMEOUT_NS 100000000ll
+#define DRAIN_TIMEOUT_NS 2000000000ull
+
+typedef enum {
+	REQ_SET_USERNAME,
+	REQ_CREATE_GROUP,
+	REQ_SEND_TO_GROUP,
+	REQ_TYPES,
+} ReqType;
+
+static const char *req_type_names[REQ_TYPES] = {
+	"SET_USERNAME",
+	"CREATE_GROUP",
+	"SEND_TO_GROUP",
+};
+
+typedef struct {
+	struct sockaddr_in addr;
+	unsigned threads;
+	unsigned conns;
+	unsigned pipeline;
+	unsigned duration_s;
+	unsigned group_size;
+	unsigned msg_size;
+	bool batch;
+	unsigned weights[REQ_TYPES];
+	unsigned weights_total;
+} Config;
+
+typedef struct {
+	/* 0 when the slot is free. seqids start at 1. */
+	uint64_t seqid;
+	uint64_t sent_at;
+	ReqType type;
+} Inflight;
+
+typedef struct {
+	int fd;
+	bool closed;
+
+	/* Assigned by the server in SET_USERNAME_RESPONSE. 0 until then. */
+	uint64_t uid;
+
+	uint64_t next_seqid;
+	unsigned inflight_len;
+	/**
+	 * Indexed by seqid % inflight_cap. inflight_cap is twice the pipeline so that
+	 * responses arriving out of order rarely keep a slot busy. A request is only
+	 * issued once its slot is free.
+	 */
+	size_t inflight_cap;
+	Inflight *inflight;
+
+	OutBuf out;
+
+	char in[RECV_BUF_SIZE];
+	size_t in_len;
+
+	/* Groups this connection created or joined. Oldest are overwritten. */
+	uint64_t gids[MAX_CONN_GROUPS];
+	size_t gids_len;
+} Conn;
+
+typedef struct {
+	unsigned id;
+	const Config *cfg;
+	pthread_t thread;
+	struct io_uring ring;
+
+	Conn *conns;
+	size_t conns_len;
+
+	/* uids of this thread's connections which CREATE_GROUP picks members from. */
+	uint64_t *uids;
+	size_t uids_len;
+
+	uint64_t rng;
+	bool stopping;
+	uint64_t stop_at;
+
+	Hist latency[REQ_TYPES];
+	Hist fanout;
+	uint64_t completed;
+	uint64_t received;
+	uint64_t server_errors;
+	uint64_t disconnects;
+	uint64_t elapsed_ns;
+} Worker;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t next_rand(Worker *w) {
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return w->rng * 2685821657736338717ull;
+}
+
+static void add_recv(Worker *w, size_t conn_idx) {
+	Conn *c = &w->conns[conn_idx];
+	struct io_uring_sqe *sqe = conn_get_sqe(&w->ring);
+	io_uring_prep_recv(sqe, c->fd, c->in + c->in_len, RECV_BUF_SIZE - c->in_len, 0);
+	io_uring_sqe_set_data64(sqe, USER_DATA(conn_idx, EV_RECV));
+}
+
+/* Hands every queued frame to the kernel unless a send is already in flight. */
+static void flush(Worker *w, size_t conn_idx) {
+	Conn *c = &w->conns[conn_idx];
+	if (!c->closed) out_buf_flush(&w->ring, &c->out, c->fd, conn_idx);
+}
+
+/**
+ * Reserves the inflight slot of the next seqid and returns it. Returns NULL if
+ * the slot is still held by an older request.
+ */
+static Inflight *reserve_inflight(Conn *c, ReqType type) {
+	Inflight *slot = &c->inflight[c->next_seqid % c->inflight_cap];
+	if (slot->seqid != 0) return NULL;
+
+	slot->seqid = c->next_seqid;
+	slot->sent_at = now_ns();
+	slot->type = type;
+	c->next_seqid++;
+	c->inflight_len++;
+	return slot;
+}
+
+static void complete_request(Worker *w, Conn *c, uint64_t seqid, bool ok) {
+	Inflight *slot = &c->inflight[seqid % c->inflight_cap];
+	if (slot->seqid != seqid) {
+		fprintf(stderr, "[thread %u] response for unknown seqid %lu\n", w->id, seqid);
+		exit(EXIT_FAILURE);
+	}
+
+	if (ok) {
+		hist_record(&w->latency[slot->type], now_ns() - slot->sent_at);
+		w->completed++;
+	} else {
+		w->server_errors++;
+	}
+
+	slot->seqid = 0;
+	c->inflight_len--;
+}
+
+static void add_gid(Conn *c, uint64_t gid) {
+	c->gids[c->gids_len % MAX_CONN_GROUPS] = gid;
+	c->gids_len++;
+}
+
+static bool issue_set_username(Worker *w, size_t conn_idx) {
+	Conn *c = &w->conns[conn_idx];
+	Inflight *slot = reserve_inflight(c, REQ_SET_USERNAME);
+	if (slot == NULL) return false;
+
+	char uname[MAX_UNAME_LEN + 1];
+	int ulen = snprintf(uname, sizeof(uname), "t%uc%zu", w->id, conn_idx);
+
+	c->out.len += ser_set_username(
+		c->out.cap - c->out.len, c->out.buf + c->out.len,
+		slot->seqid, ulen, uname
+	);
+	return true;
+}
+
+static bool issue_create_group(Worker *w, size_t conn_idx) {
+	Conn *c = &w->conns[conn_idx];
+	Inflight *slot = reserve_inflight(c, REQ_CREATE_GROUP);
+	if (slot == NULL) return false;
+
+	/* The server adds the creator itself, the rest are random peers. */
+	uint64_t uids[MAX_UIDS_PER_MSG];
+	uint8_t uids_len = 0;
+	size_t peers = w->cfg->group_size - 1;
+	for (size_t i = 0; i < peers && w->uids_len > 1; i++) {
+		uint64_t uid = w->uids[next_rand(w) % w->uids_len];
+		if (uid != c->uid) uids[uids_len++] = uid;
+	}
+
+	/* CREATE_GROUP must carry at least one uid. */
+	if (uids_len == 0) uids[uids_len++] = c->uid;
+
+	c->out.len += ser_create_group(
+		c->out.buf + c->out.len, c->out.cap - c->out.len,
+		slot->seqid, uids, uids_len
+	);
+	return true;
+}
+
+static bool issue_send_to_group(Worker *w, size_t conn_idx) {
+	Conn *c = &w->conns[conn_idx];
+	if (c->gids_len == 0) return issue_create_group(w, conn_idx);
+
+	Inflight *slot = reserve_inflight(c, REQ_SEND_TO_GROUP);
+	if (slot == NULL) return false;
+
+	size_t gids_len = c->gids_len < MAX_CONN_GROUPS ? c->gids_len : MAX_CONN_GROUPS;
+	uint64_t gid = c->gids[next_rand(w) % gids_len];
+
+	char msg[MAX_GROUP_MSG_LEN];
+	size_t msg_len = w->cfg->msg_size;
+	memset(msg, 'x', msg_len);
+	if (msg_len >= sizeof(uint64_t)) {
+		memcpy(msg, &slot->sent_at, sizeof(uint64_t));
+	}
+
+	c->out.len += ser_send_to_group(
+		c->out.cap - c->out.len, c->out.buf + c->out.len,
+		slot->seqid, gid, msg_len, msg
+	);
+	return true;
+}
+
+static ReqType pick_request(Worker *w) {
+	uint64_t r = next_rand(w) % w->cfg->weights_total;
+	for (int t = 0; t < REQ_TYPES; t++) {
+		if (r < w->cfg->weights[t]) return t;
+		r -= w->cfg->weights[t];
+	}
+	return REQ_SEND_TO_GROUP;
+}
+
+/* Issues requests until the pipeline of the connection is full. */
+static void fill_pipeline(Worker *w, size_t conn_idx) {
+	Conn *c = &w->conns[conn_idx];
+	if (w->stopping || c->closed || c->uid == 0) return;
+
+	while (c->inflight_len < w->cfg->pipeline) {
+		bool issued;
+		switch (pick_request(w)) {
+			case REQ_SET_USERNAME:
+				issued = issue_set_username(w, conn_idx);
+				break;
+			case REQ_CREATE_GROUP:
+				issued = issue_create_group(w, conn_idx);
+				break;
+			default:
+				issued = issue_send_to_group(w, conn_idx);
+				break;
+		}
+		if (!issued) break;
+	}
+
+	flush(w, conn_idx);
+}
+
+static void handle_frame(Worker *w, Conn *c, const char *frame, uint16_t len,
+						 uint8_t msgt, uint64_t seqid) {
+	switch (msgt) {
+		case MSGT_SERVER_ERROR: {
+			complete_request(w, c, seqid, false);
+			break;
+		}
+		case MSGT_SET_USERNAME_RESPONSE: {
+			uint64_t uid;
+			if (deser_set_username_response(len, frame, &uid) < 0) goto malformed;
+			if (c->uid == 0) {
+				c->uid = uid;
+				w->uids[w->uids_len++] = uid;
+			}
+			complete_request(w, c, seqid, true);
+			break;
+		}
+		case MSGT_CREATE_GROUP_RESONSE: {
+			uint64_t gid;
+			if (deser_create_group_response(len, frame, &gid) < 0) goto malformed;
+			add_gid(c, gid);
+			complete_request(w, c, seqid, true);
+			break;
+		}
+		case MSGT_SEND_TO_GROUP_RESPONSE: {
+			uint64_t gid, msgid;
+			if (deser_send_to_group_response(len, frame, &gid, &msgid) < 0) goto malformed;
+			complete_request(w, c, seqid, true);
+			break;
+		}
+		case MSGT_JOINED_GROUP: {
+			uint64_t uid, gid;
+			uint8_t uids_len;
+			const char *uids_raw;
+			if (deser_joined_group(len, frame, &uid, &gid, &uids_len, &uids_raw) < 0) {
+				goto malformed;
+			}
+			add_gid(c, gid);
+			break;
+		}
+		case MSGT_SET_OPTIONS_RESPONSE: {
+			/* SET_OPTIONS isn't tracked, its seqid is 0. */
+			uint8_t options;
+			if (deser_set_options_response(len, frame, &options) < 0) goto malformed;
+			break;
+		}
+		case MSGT_BATCH: {
+			const char *frames;
+			size_t frames_len;
+			if (deser_batch(len, frame, &frames, &frames_len) < 0) goto malformed;
+
+			while (frames_len > 0) {
+				uint16_t inner_len;
+				uint8_t inner_msgt;
+				uint64_t inner_seqid;
+				if (frames_len < PROT_HDR_LEN) goto malformed;
+				deser_header(frames, &inner_len, &inner_msgt, &inner_seqid);
+				if (inner_len < PROT_HDR_LEN || inner_len > frames_len) goto malformed;
+				if (inner_msgt == MSGT_BATCH) goto malformed;
+
+				handle_frame(w, c, frames, inner_len, inner_msgt, inner_seqid);
+				frames += inner_len;
+				frames_len -= inner_len;
+			}
+			break;
+		}
+		case MSGT_RECEIVE_FROM_GROUP: {
+			uint64_t gid, msgid, uid;
+			const char *msg;
+			size_t msg_len;
+			if (deser_receive_from_group(len, frame, &gid, &msgid, &uid, &msg, &msg_len) < 0) {
+				goto malformed;
+			}
+			w->received++;
+			if (msg_len >= sizeof(uint64_t)) {
+				uint64_t sent_at;
+				memcpy(&sent_at, msg, sizeof(sent_at));
+				hist_record(&w->fanout, now_ns() - sent_at);
+			}
+			break;
+		}
+		case MSGT_GROUP_STATUS: {
+			/* Sent once the other connections disconnect. */
+			uint64_t gid;
+			uint16_t count;
+			const char *records;
+			if (deser_group_status(len, frame, &gid, &count, &records) < 0) goto malformed;
+			break;
+		}
+		default:
+			goto malformed;
+	}
+	return;
+
+malformed:
+	fprintf(stderr, "[thread %u] malformed message type %u len %u\n", w->id, msgt, len);
+	exit(EXIT_FAILURE);
+}
+
+static void handle_recv(Worker *w, size_t conn_idx, int res) {
+	Conn *c = &w->conns[conn_idx];
+	if (res <= 0) {
+		if (!w->stopping) {
+			fprintf(stderr, "[thread %u] conn %zu closed by server: %s\n",
+				w->id, conn_idx, res == 0 ? "EOF" : strerror(-res));
+		}
+		c->closed = true;
+		w->disconnects++;
+		return;
+	}
+
+	c->in_len += res;
+	const char *frame = c->in;
+	size_t avail = c->in_len;
+	while (avail >= PROT_HDR_LEN) {
+		uint16_t len;
+		uint8_t msgt;
+		uint64_t seqid;
+		deser_header(frame, &len, &msgt, &seqid);
+		if (len < PROT_HDR_LEN || len > PROT_MAX_LEN) {
+			fprintf(stderr, "[thread %u] invalid frame len %u\n", w->id, len);
+			exit(EXIT_FAILURE);
+		}
+		if (avail < len) break;
+
+		handle_frame(w, c, frame, len, msgt, seqid);
+		frame += len;
+		avail -= len;
+	}
+
+	memmove(c->in, frame, avail);
+	c->in_len = avail;
+
+	add_recv(w, conn_idx);
+	fill_pipeline(w, conn_idx);
+}
+
+static void handle_send(Worker *w, size_t conn_idx, int res) {
+	Conn *c = &w->conns[conn_idx];
+	if (res < 0) {
+		fprintf(stderr, "[thread %u] send: %s\n", w->id, strerror(-res));
+		c->closed = true;
+		w->disconnects++;
+		return;
+	}
+
+	out_buf_sent(&c->out, res);
+	flush(w, conn_idx);
+}
+
+static void handle_connect(Worker *w, size_t conn_idx, int res) {
+	if (res < 0) {
+		fprintf(stderr, "[thread %u] connect: %s\n", w->id, strerror(-res));
+		exit(EXIT_FAILURE);
+	}
+
+	add_recv(w, conn_idx);
+
+	Conn *c = &w->conns[conn_idx];
+	if (w->cfg->batch) {
+		c->out.len += ser_set_options(c->out.cap - c->out.len, c->out.buf + c->out.len, 0, OPT_BATCH);
+	}
+
+	/* SET_USERNAME comes next as its response carries the uid of the connection. */
+	issue_set_username(w, conn_idx);
+	flush(w, conn_idx);
+}
+
+static void worker_init(Worker *w, unsigned id, const Config *cfg) {
+	memset(w, 0, sizeof(*w));
+	w->id = id;
+	w->cfg = cfg;
+	w->rng = 0x9E3779B97F4A7C15ull * (id + 1);
+
+	/* Spread the connections over the threads as evenly as possible. */
+	w->conns_len = cfg->conns / cfg->threads + (id < cfg->conns % cfg->threads);
+	w->conns = must_calloc(w->conns_len, sizeof(Conn), "worker_init calloc conns");
+	w->uids = must_calloc(w->conns_len, sizeof(uint64_t), "worker_init calloc uids");
+
+	size_t create_len = PROT_HDR_LEN + 1 + cfg->group_size * sizeof(uint64_t);
+	size_t send_len = PROT_HDR_LEN + sizeof(uint64_t) + cfg->msg_size;
+	size_t max_frame = create_len > send_len ? create_len : send_len;
+
+	for (size_t i = 0; i < w->conns_len; i++) {
+		Conn *c = &w->conns[i];
+		c->fd = -1;
+		c->next_seqid = 1;
+		c->inflight_cap = 2 * cfg->pipeline;
+		c->inflight = must_calloc(c->inflight_cap, sizeof(Inflight), "worker_init inflight");
+		/* Room for SET_OPTIONS too, which is sent once before the requests. */
+		out_buf_init(&c->out, cfg->pipeline * max_frame + PROT_HDR_LEN + 1);
+	}
+
+	for (int t = 0; t < REQ_TYPES; t++) {
+		hist_init(&w->latency[t]);
+	}
+	hist_init(&w->fanout);
+}
+
+static void worker_deinit(Worker *w) {
+	for (size_t i = 0; i < w->conns_len; i++) {
+		if (w->conns[i].fd >= 0) close(w->conns[i].fd);
+		free(w->conns[i].inflight);
+		out_buf_deinit(&w->conns[i].out);
+	}
+	free(w->conns);
+	free(w->uids);
+}
+
+static size_t inflight_total(Worker *w) {
+	size_t total = 0;
+	for (size_t i = 0; i < w->conns_len; i++) {
+		if (!w->conns[i].closed) total += w->conns[i].inflight_len;
+	}
+	return total;
+}
+
+static void *worker_run(void *arg) {
+	Worker *w = arg;
+	const Config *cfg = w->cfg;
+
+	int ret = io_uring_queue_init(QUEUE_SIZE, &w->ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t start = now_ns();
+	w->stop_at = start + (uint64_t)cfg->duration_s * 1000000000ull;
+
+	for (size_t i = 0; i < w->conns_len; i++) {
+		Conn *c = &w->conns[i];
+		c->fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (c->fd < 0) fatal_error("socket()");
+		set_nonblocking(c->fd);
+
+		struct io_uring_sqe *sqe = conn_get_sqe(&w->ring);
+		io_uring_prep_connect(
+			sqe, c->fd,
+			(struct sockaddr *)&cfg->addr, sizeof(cfg->addr)
+		);
+		io_uring_sqe_set_data64(sqe, USER_DATA(i, EV_CONNECT));
+	}
+
+	struct io_uring_cqe *cqes[CQE_BATCH_SIZE];
+	while (1) {
+		uint64_t now = now_ns();
+		if (!w->stopping && now >= w->stop_at) {
+			w->stopping = true;
+			w->elapsed_ns = now - start;
+		}
+		if (w->stopping) {
+			if (inflight_total(w) == 0 || now >= w->stop_at + DRAIN_TIMEOUT_NS) break;
+		}
+
+		if ((ret = io_uring_submit(&w->ring)) < 0) {
+			fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+
+		struct io_uring_cqe *cqe;
+		struct __kernel_timespec ts = { .tv_sec = 0, .tv_nsec = WAIT_TIMEOUT_NS };
+		ret = io_uring_wait_cqe_timeout(&w->ring, &cqe, &ts);
+		if (ret == -ETIME || ret == -EINTR) continue;
+		if (ret < 0) {
+			fprintf(stderr, "io_uring_wait_cqe_timeout: %s\n", strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+
+		unsigned count = io_uring_peek_batch_cqe(&w->ring, cqes, CQE_BATCH_SIZE);
+		for (unsigned i = 0; i < count; i++) {
+			uint64_t ud = io_uring_cqe_get_data64(cqes[i]);
+			int res = cqes[i]->res;
+			size_t conn_idx = USER_DATA_CONN(ud);
+
+			switch (USER_DATA_EV(ud)) {
+				case EV_CONNECT:
+					handle_connect(w, conn_idx, res);
+					break;
+				case EV_SEND:
+					handle_send(w, conn_idx, res);
+					break;
+				case EV_RECV:
+					handle_recv(w, conn_idx, res);
+					break;
+			}
+		}
+		io_uring_cq_advance(&w->ring, count);
+	}
+
+	io_uring_queue_exit(&w->ring);
+	return NULL;
+}
+
+static unsigned parse_uint(const char *name, const char *str, unsigned min, unsigned max) {
+	char *end_ptr;
+	long res = strtol(str, &end_ptr, 10);
+	if (*str == '\0' || *end_ptr != '\0' || res < min || res > max) {
+		fprintf(stderr, "Invalid %s: %s (expected %u..%u)\n", name, str, min, max);
+		exit(EXIT_FAILURE);
+	}
+	return res;
+}
+
+/* Parses weights such as "1:1:98" in the order of ReqType. */
+static void parse_mix(Config *cfg, const char *str) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s", str);
+
+	char *save;
+	char *tok = strtok_r(buf, ":", &save);
+	cfg->weights_total = 0;
+	for (int t = 0; t < REQ_TYPES; t++) {
+		if (tok == NULL) {
+			fprintf(stderr, "Invalid mix: %s (expected set_username:create_group:send)\n", str);
+			exit(EXIT_FAILURE);
+		}
+		cfg->weights[t] = parse_uint("mix weight", tok, 0, 1000000);
+		cfg->weights_total += cfg->weights[t];
+		tok = strtok_r(NULL, ":", &save);
+	}
+
+	if (cfg->weights_total == 0) {
+		fprintf(stderr, "Invalid mix: %s (all weights are 0)\n", str);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -a, --addr IP          server address (default 127.0.0.1)\n"
+		"  -p, --port PORT        server port (default 8080)\n"
+		"  -t, --threads N        threads, each with its own ring (default 4)\n"
+		"  -c, --conns N          total connections (default 1000)\n"
+		"  -P, --pipeline N       requests in flight per connection (default 8)\n"
+		"  -d, --duration SECS    duration of the run (default 10)\n"
+		"  -m, --mix A:B:C        weights of SET_USERNAME:CREATE_GROUP:SEND_TO_GROUP (default 1:1:98)\n"
+		"  -g, --group-size N     members of each created group (default 8)\n"
+		"  -s, --msg-size BYTES   size of SEND_TO_GROUP messages (default 64)\n"
+		"  -b, --batch            ask the server to batch frames with OPT_BATCH\n",
+		prog
+	);
+	exit(EXIT_FAILURE);
+}
+
+static void print_row(const char *name, const Hist *h) {
+	printf("%-22s %12lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		name, h->count,
+		hist_mean(h) / 1000.0,
+		hist_percentile(h, 50) / 1000.0,
+		hist_percentile(h, 99) / 1000.0,
+		hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0
+	);
+}
+
+/* fds for thousands of connections. */
+static void raise_nofile_limit(void) {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) fatal_error("getrlimit");
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0) fatal_error("setrlimit");
+}
+
+int main(int argc, char *argv[]) {
+	const char *ip_str = "127.0.0.1";
+	unsigned port = 8080;
+	Config cfg = {
+		.threads = 4,
+		.conns = 1000,
+		.pipeline = 8,
+		.duration_s = 10,
+		.group_size = 8,
+		.msg_size = 64,
+	};
+	parse_mix(&cfg, "1:1:98");
+
+	static const struct option opts[] = {
+		{"addr", required_argument, NULL, 'a'},
+		{"port", required_argument, NULL, 'p'},
+		{"threads", required_argument, NULL, 't'},
+		{"conns", required_argument, NULL, 'c'},
+		{"pipeline", required_argument, NULL, 'P'},
+		{"duration", required_argument, NULL, 'd'},
+		{"mix", required_argument, NULL, 'm'},
+		{"group-size", required_argument, NULL, 'g'},
+		{"msg-size", required_argument, NULL, 's'},
+		{"batch", no_argument, NULL, 'b'},
+		{NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "a:p:t:c:P:d:m:g:s:b", opts, NULL)) != -1) {
+		switch (opt) {
+			case 'a': ip_str = optarg; break;
+			case 'p': port = parse_uint("port", optarg, 1, 65535); break;
+			case 't': cfg.threads = parse_uint("threads", optarg, 1, 256); break;
+			case 'c': cfg.conns = parse_uint("conns", optarg, 1, 10000000); break;
+			case 'P': cfg.pipeline = parse_uint("pipeline", optarg, 1, MAX_PIPELINE); break;
+			case 'd': cfg.duration_s = parse_uint("duration", optarg, 1, 86400); break;
+			case 'm': parse_mix(&cfg, optarg); break;
+			case 'g': cfg.group_size = parse_uint("group size", optarg, 1, MAX_UIDS_PER_MSG + 1); break;
+			case 's': cfg.msg_size = parse_uint("msg size", optarg, 0, MAX_GROUP_MSG_LEN); break;
+			case 'b': cfg.batch = true; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (cfg.threads > cfg.conns) cfg.threads = cfg.conns;
+
+	cfg.addr.sin_family = AF_INET;
+	cfg.addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip_str, &cfg.addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid server ip: %s\n", ip_str);
+		exit(EXIT_FAILURE);
+	}
+
+	raise_nofile_limit();
+
+	printf("threads=%u conns=%u pipeline=%u duration=%us mix=%u:%u:%u group_size=%u msg_size=%u batch=%d\n",
+		cfg.threads, cfg.conns, cfg.pipeline, cfg.duration_s,
+		cfg.weights[REQ_SET_USERNAME], cfg.weights[REQ_CREATE_GROUP],
+		cfg.weights[REQ_SEND_TO_GROUP], cfg.group_size, cfg.msg_size, cfg.batch);
+
+	Worker *workers = must_malloc(cfg.threads * sizeof(Worker), "malloc workers");
+	for (unsigned i = 0; i < cfg.threads; i++) {
+		worker_init(&workers[i], i, &cfg);
+		if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+			fatal_error("pthread_create");
+		}
+	}
+
+	Hist *latency = must_malloc(REQ_TYPES * sizeof(Hist), "malloc latency");
+	Hist *all = must_malloc(sizeof(Hist), "malloc all");
+	Hist *fanout = must_malloc(sizeof(Hist), "malloc fanout");
+	for (int t = 0; t < REQ_TYPES; t++) hist_init(&latency[t]);
+	hist_init(all);
+	hist_init(fanout);
+
+	uint64_t completed = 0, received = 0, server_errors = 0, disconnects = 0;
+	uint64_t elapsed_ns = 0;
+	for (unsigned i = 0; i < cfg.threads; i++) {
+		Worker *w = &workers[i];
+		pthread_join(w->thread, NULL);
+
+		for (int t = 0; t < REQ_TYPES; t++) {
+			hist_merge(&latency[t], &w->latency[t]);
+			hist_merge(all, &w->latency[t]);
+		}
+		hist_merge(fanout, &w->fanout);
+		completed += w->completed;
+		received += w->received;
+		server_errors += w->server_errors;
+		disconnects += w->disconnects;
+		if (w->elapsed_ns > elapsed_ns) elapsed_ns = w->elapsed_ns;
+		worker_deinit(w);
+	}
+
+	double secs = elapsed_ns / 1e9;
+	printf("\n%-22s %12s %10s %10s %10s %10s %10s\n",
+		"latency (us)", "count", "mean", "p50", "p99", "p999", "max");
+	for (int t = 0; t < REQ_TYPES; t++) {
+		print_row(req_type_names[t], &latency[t]);
+	}
+	print_row("all requests", all);
+	print_row("RECEIVE_FROM_GROUP", fanout);
+
+	printf("\nthroughput: %.0f req/s, %.0f deliveries/s\n", completed / secs, received / secs);
+	printf("server errors: %lu, disconnects: %lu\n", server_errors, disconnects);
+
+	free(latency);
+	free(all);
+	free(fanout);
+	free(workers);
+	return disconnects == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,132 @@
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "log.h"
+#include "op.h"
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t drain(void *arg) {
+	return logger_drain(arg);
+}
+
+void logger_init(Logger *lg, FILE *out, size_t cap) {
+	memset(lg, 0, sizeof(*lg));
+	lg->out = out;
+	spsc_ring_init(&lg->ring, cap, drain, lg);
+}
+
+void log_push(Logger *lg, const LogRecord *r) {
+	LogRecord rec = *r;
+	rec.ts_ns = now_ns();
+	spsc_ring_push(&lg->ring, &rec, sizeof(rec), NULL, 0);
+}
+
+static void format_record(FILE *out, const LogRecord *r) {
+	time_t secs = r->ts_ns / 1000000000ull;
+	struct tm tm;
+	localtime_r(&secs, &tm);
+	char ts[16];
+	strftime(ts, sizeof(ts), "%H:%M:%S", &tm);
+
+	fprintf(out, "%s.%03lu %-5s ", ts, (r->ts_ns / 1000000) % 1000,
+		level_names[r->level < 4 ? r->level : LOG_LEVEL_ERROR]);
+
+	switch (r->event) {
+		case LOG_EV_CONNECTED:
+		case LOG_EV_DISCONNECTED:
+		case LOG_EV_SHORT_WRITE_0: {
+			char client_ip[INET_ADDRSTRLEN];
+			struct in_addr addr = { .s_addr = r->addr };
+			if (inet_ntop(AF_INET, &addr, client_ip, sizeof(client_ip)) == NULL) {
+				strcpy(client_ip, "?");
+			}
+			const char *msg = r->event == LOG_EV_CONNECTED ? "connected"
+				: r->event == LOG_EV_DISCONNECTED ? "disconnected"
+				: "SHORT_WRITE_0";
+			fprintf(out, "[%s:%d] client_id=%lu client_fd=%d => %s\n",
+				client_ip, ntohs(r->port), r->client_id, r->fd, msg);
+			break;
+		}
+		case LOG_EV_USERNAME_SET:
+			fprintf(out, "client_id=%lu username is %.15s\n", r->client_id, r->str);
+			break;
+		case LOG_EV_OP_FREED:
+			fprintf(out, "FREE OP %s client_id %lu\n", op_type_str(r->arg), r->client_id);
+			break;
+		case LOG_EV_OP_FAILED:
+			fprintf(out, "[fd=%d client_id=%lu] op %s failed: %s\n",
+				r->fd, r->client_id, op_type_str(r->arg), strerror(r->code));
+			break;
+		case LOG_EV_OP_AFTER_DISCONNECT:
+			fprintf(out, "[fd=%d client_id=%lu] successful op %s but client already disconnected.\n",
+				r->fd, r->client_id, op_type_str(r->arg));
+			break;
+		case LOG_EV_INVALID_OP_TYPE:
+			fprintf(out, "invalid operation type: %s\n", op_type_str(r->arg));
+			break;
+		case LOG_EV_RECV_RING_FAILED:
+			fprintf(out, "[fd=%d client_id=%lu] recv ring failed, dropping client: %s\n",
+				r->fd, r->client_id, strerror(r->code));
+			break;
+		case LOG_EV_RATE_LIMITED:
+			fprintf(out, "client_id=%lu rate limited on msgt %lu, %s\n",
+				r->client_id, r->arg, r->code ? "deferred" : "rejected");
+			break;
+		case LOG_EV_ACCEPT_PAUSED:
+			fprintf(out, "accept paused (%.15s), listen queue %d\n", r->str, r->code);
+			break;
+		case LOG_EV_ACCEPT_RESUMED:
+			fprintf(out, "accept resumed after %lu us, listen queue %d\n",
+				r->arg / 1000, r->code);
+			break;
+		case LOG_EV_HANDOVER_STARTED:
+			fprintf(out, "handover started with %lu clients\n", r->arg);
+			break;
+		case LOG_EV_HANDOVER_FAILED:
+			fprintf(out, "handover failed (%.15s): %s, serving on\n", r->str, strerror(r->code));
+			break;
+		case LOG_EV_PEER_UP:
+			fprintf(out, "link to node %lu up\n", r->arg);
+			break;
+		case LOG_EV_PEER_DOWN:
+			fprintf(out, "link to node %lu down: %s\n", r->arg, strerror(r->code));
+			break;
+		default:
+			fprintf(out, "unknown log event %u\n", r->event);
+	}
+}
+
+size_t logger_drain(Logger *lg) {
+	size_t n = spsc_ring_len(&lg->ring) / sizeof(LogRecord);
+
+	/* Records may wrap around the end of the ring. */
+	for (size_t i = 0; i < n; i++) {
+		LogRecord r;
+		spsc_ring_read(&lg->ring, &r, sizeof(r));
+		format_record(lg->out, &r);
+	}
+
+	uint64_t dropped = __atomic_load_n(&lg->ring.dropped, __ATOMIC_RELAXED);
+	if (dropped != lg->dropped_reported) {
+		fprintf(lg->out, "logger dropped %lu records, ring is full\n", dropped - lg->dropped_reported);
+		lg->dropped_reported = dropped;
+	}
+
+	if (n > 0) fflush(lg->out);
+	return n;
+}
+
+void logger_start(Logger *lg) {
+	spsc_ring_start(&lg->ring, LOG_FLUSH_INTERVAL_MS);
+}
+
+void logger_deinit(Logger *lg) {
+	spsc_ring_deinit(&lg->ring);
+}
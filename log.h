@@ -0,0 +1,136 @@
+#ifndef LOG_H
+#define LOG_H
+
+/**
+ * Asynchronous structured logger.
+ *
+ * The event loop pushes fixed-size binary records into an SpscRing and moves on.
+ * Its writer formats them, including inet_ntop of client addresses, and writes
+ * them out. When the ring is full records are dropped and counted rather than
+ * blocking the loop.
+ *
+ * Each level below LOG_MIN_LEVEL compiles out entirely. Build with
+ * -DLOG_MIN_LEVEL=LOG_LEVEL_DEBUG to get per-operation logs.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "client_map.h"
+#include "spsc_ring.h"
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+/* Bytes in the ring, about 18k records. Must be a power of 2. */
+#define LOG_RING_SIZE (1 << 20)
+
+/* How long the flusher sleeps when the ring is empty. */
+#define LOG_FLUSH_INTERVAL_MS 10
+
+typedef enum {
+	/* Client records: client_id, fd, addr and port. */
+	LOG_EV_CONNECTED,
+	LOG_EV_DISCONNECTED,
+	LOG_EV_SHORT_WRITE_0,
+	/* client_id and str. */
+	LOG_EV_USERNAME_SET,
+	/* client_id, fd and the OpType in arg. code is the errno of failures. */
+	LOG_EV_OP_FREED,
+	LOG_EV_OP_FAILED,
+	LOG_EV_OP_AFTER_DISCONNECT,
+	LOG_EV_INVALID_OP_TYPE,
+	/* client_id, fd and the errno in code. */
+	LOG_EV_RECV_RING_FAILED,
+	/* client_id and the msgt in arg. code is 1 if the frame was deferred. */
+	LOG_EV_RATE_LIMITED,
+	/**
+	 * The reason in str, or the time paused in ns in arg when resumed. code is
+	 * the length of the listen queue, -1 if unknown.
+	 */
+	LOG_EV_ACCEPT_PAUSED,
+	LOG_EV_ACCEPT_RESUMED,
+	/* The number of clients in arg. */
+	LOG_EV_HANDOVER_STARTED,
+	/* The step that failed in str and the errno in code. */
+	LOG_EV_HANDOVER_FAILED,
+	/* The node in arg, and for links going down the errno in code. */
+	LOG_EV_PEER_UP,
+	LOG_EV_PEER_DOWN,
+} LogEvent;
+
+/* Fields not used by an event are left 0. */
+typedef struct {
+	uint64_t ts_ns;
+	uint64_t client_id;
+	uint64_t arg;
+	/* Network byte order, formatted by the flusher. */
+	uint32_t addr;
+	int32_t fd;
+	int32_t code;
+	uint16_t port;
+	uint8_t level;
+	uint8_t event;
+	char str[16];
+} LogRecord;
+
+typedef struct {
+	FILE *out;
+	/* Written by the flusher only. */
+	uint64_t dropped_reported;
+	SpscRing ring;
+} Logger;
+
+/* cap is in bytes and must be a power of 2. Records are written to out. */
+void logger_init(Logger *lg, FILE *out, size_t cap);
+
+/* Starts the flusher thread. */
+void logger_start(Logger *lg);
+
+/* Stops the flusher, if running, after it has written every pending record. */
+void logger_deinit(Logger *lg);
+
+/* Copies r into the ring, or drops it if the ring is full. Never blocks. */
+void log_push(Logger *lg, const LogRecord *r);
+
+/**
+ * Formats and writes the records pending in the ring. Returns their number.
+ * Only one thread at a time may drain, which is the flusher once started.
+ */
+size_t logger_drain(Logger *lg);
+
+#define LOG(lg, lvl, ev, ...) \
+	do { \
+		if ((lvl) >= LOG_MIN_LEVEL) { \
+			LogRecord _rec = { .level = (lvl), .event = (ev), __VA_ARGS__ }; \
+			log_push((lg), &_rec); \
+		} \
+	} while (0)
+
+#define LOG_CLIENT(lg, lvl, ev, info) \
+	LOG((lg), (lvl), (ev), \
+		.client_id = (info)->client_id, \
+		.fd = (info)->client_fd, \
+		.addr = (info)->client_addr.sin_addr.s_addr, \
+		.port = (info)->client_addr.sin_port)
+
+/* str is truncated to 15 bytes. */
+#define LOG_STR(lg, lvl, ev, s, s_len, ...) \
+	do { \
+		if ((lvl) >= LOG_MIN_LEVEL) { \
+			LogRecord _rec = { .level = (lvl), .event = (ev), __VA_ARGS__ }; \
+			size_t _len = (s_len) < sizeof(_rec.str) ? (s_len) : sizeof(_rec.str) - 1; \
+			memcpy(_rec.str, (s), _len); \
+			log_push((lg), &_rec); \
+		} \
+	} while (0)
+
+#endif
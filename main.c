@@ -1,5 +1,7 @@
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
 #include <liburing.h>
 #include <netinet/in.h>
 #include <stdbool.h>
@@ -7,20 +9,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "client_map.h"
 #include "op_pool.h"
+#include "recv_ring.h"
 #include "slab.h"
+#include "groups.h"
+#include "uname_index.h"
+#include "log.h"
 #include "utils.h"
 #include "server.h"
+#include "handover.h"
+#include "capacity.h"
+#include "trace.h"
 
 #define QUEUE_SIZE 4096
-#define BACKLOG 10
+#define CQ_SIZE_FACTOR 4
+/**
+ * Connections wait here while admission control pauses accepting. The kernel
+ * caps it at net.core.somaxconn.
+ */
+#define BACKLOG 1024
 #define PORT 8080
+#define CLIENTS_INIT_CAP 1024
+#define GROUPS_INIT_CAP 1024
+#define UNAMES_INIT_CAP 1024
+/* How long presence and typing changes are collected before they are sent. */
+#define PRESENCE_WINDOW_MS 100
 
-int setup_server(int port) {
+/* fds kept free for the listener, logs and the memfd of each new recv ring. */
+#define FD_RESERVE 64
+/* Mappings kept free for the libraries, slabs and pools of the server. */
+#define MAP_RESERVE 4096
+
+/* vm.max_map_count, or 0 if it can't be read. */
+static size_t max_map_count(void) {
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f == NULL) return 0;
+	unsigned long count = 0;
+	if (fscanf(f, "%lu", &count) != 1) count = 0;
+	fclose(f);
+	return count;
+}
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Listens on addr, which the peer listener of a cluster node shares with setup_server. */
+int setup_tcp_server(const struct sockaddr_in *addr) {
 	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (server_fd == -1) fatal_error("setup_server socket()");
 
@@ -30,16 +75,10 @@ int setup_server(int port) {
 
 	set_nonblocking(server_fd);
 
-	struct sockaddr_in server_addr;
-	memset(&server_addr, 0, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(port);
-	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
 	int ret = bind(
 		server_fd, 
-		(struct sockaddr *)&server_addr,
-		sizeof(server_addr)
+		(const struct sockaddr *)addr,
+		sizeof(*addr)
 	);
 
 	if (ret == -1) fatal_error("setup_server bind");
@@ -49,23 +88,171 @@ int setup_server(int port) {
 	return server_fd;
 }
 
+int setup_server(int port) {
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	return setup_tcp_server(&server_addr);
+}
+
+/**
+ * Listens on a Unix stream socket at path, replacing the socket file a previous
+ * server left behind.
+ */
+int setup_unix_server(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Unix socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) fatal_error("setup_unix_server socket()");
+	set_nonblocking(fd);
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) fatal_error("setup_unix_server bind");
+	if (listen(fd, BACKLOG) == -1) fatal_error("setup_unix_server listen");
+	return fd;
+}
+
+/* SIGUSR1 flips tracing on and off while the server runs. */
+static void toggle_trace(int sig) {
+	(void)sig;
+	trace_enabled = !trace_enabled;
+}
+
+/* SIGUSR2 hands the clients over to the process waiting at CHAT_HANDOVER. */
+static void request_handover(int sig) {
+	(void)sig;
+	server_handover_requested = 1;
+}
+
+/* SIGINT and SIGTERM leave the event loop, which prints its counters. */
+static void request_stop(int sig) {
+	(void)sig;
+	server_stop_requested = 1;
+}
+
 int main() {
+	/* CHAT_TRACE=1 starts the server with tracing enabled. */
+	const char *trace_env = getenv("CHAT_TRACE");
+	trace_init(trace_env != NULL && strcmp(trace_env, "0") != 0);
+	if (signal(SIGUSR1, toggle_trace) == SIG_ERR) fatal_error("signal(SIGUSR1)");
+
+	/**
+	 * CHAT_HANDOVER=<path> lets SIGUSR2 hand the listeners and the clients over to
+	 * a new server started with CHAT_TAKEOVER=1 and the same path, which waits
+	 * there for them instead of listening on PORT. SIGUSR2 is only unblocked while
+	 * the loop waits for completions, so that it can't slip in just before.
+	 * Blocked before any thread starts, which would inherit the mask.
+	 */
+	const char *handover_path = getenv("CHAT_HANDOVER");
+	const char *takeover_env = getenv("CHAT_TAKEOVER");
+	bool takeover = takeover_env != NULL && strcmp(takeover_env, "0") != 0;
+	if (takeover && handover_path == NULL) {
+		fprintf(stderr, "CHAT_TAKEOVER needs CHAT_HANDOVER\n");
+		return EXIT_FAILURE;
+	}
+
+	sigset_t wait_sigmask;
+	if (handover_path != NULL) {
+		sigset_t usr2;
+		sigemptyset(&usr2);
+		sigaddset(&usr2, SIGUSR2);
+		if (sigprocmask(SIG_BLOCK, &usr2, &wait_sigmask) < 0) fatal_error("sigprocmask");
+		sigdelset(&wait_sigmask, SIGUSR2);
+		if (signal(SIGUSR2, request_handover) == SIG_ERR) fatal_error("signal(SIGUSR2)");
+	}
+
+	/**
+	 * CHAT_BATCH_US keeps BATCH envelopes open for up to that many microseconds.
+	 * By default they are sent at the end of every loop iteration.
+	 */
+	uint64_t batch_window_ns = 0;
+	const char *batch_env = getenv("CHAT_BATCH_US");
+	if (batch_env != NULL) batch_window_ns = strtoull(batch_env, NULL, 10) * 1000;
+
+	/**
+	 * CHAT_CAPACITY e.g. "conns=100000,groups=5000,msg_rate=20000" sizes the ring
+	 * and the pools for that load and faults them in before serving, see
+	 * capacity_parse. CHAT_MLOCK=1 then locks the memory of the process, including
+	 * what it allocates later, so that none of it is paged out.
+	 */
+	CapacityProfile profile = {0};
+	const char *capacity_env = getenv("CHAT_CAPACITY");
+	if (capacity_env != NULL && capacity_parse(&profile, capacity_env) < 0) {
+		fprintf(stderr, "Invalid CHAT_CAPACITY: %s\n", capacity_env);
+		return EXIT_FAILURE;
+	}
+	CapacitySizes sizes;
+	capacity_sizes(&profile, batch_window_ns > 0, &sizes);
+
+	unsigned queue_size = QUEUE_SIZE;
+	if (sizes.sq_entries > queue_size) queue_size = sizes.sq_entries;
+	size_t clients_cap = CLIENTS_INIT_CAP;
+	if (sizes.client_buckets > clients_cap) clients_cap = sizes.client_buckets;
+
+	/**
+	 * A fan-out can complete more operations than the SQ holds, so the CQ is
+	 * larger to make overflowing it rare. It is clamped to what io_uring allows
+	 * for the largest SQs.
+	 */
 	struct io_uring ring;
-	int ret = io_uring_queue_init(QUEUE_SIZE, &ring, 0);
+	struct io_uring_params params = {
+		.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP,
+		.cq_entries = queue_size * CQ_SIZE_FACTOR,
+	};
+	int ret = io_uring_queue_init_params(queue_size, &ring, &params);
 	if (ret < 0) {
-		perror("io_uring_queue_init");
+		fprintf(stderr, "io_uring_queue_init_params: %s\n", strerror(-ret));
 		return 1;
 	}
+	if (!(params.features & IORING_FEAT_NODROP)) {
+		fprintf(stderr, "warning: no IORING_FEAT_NODROP, completions overflowing the CQ are lost\n");
+	}
+	/* Without it, every wait with a timeout costs an extra timeout SQE. */
+	if (!(params.features & IORING_FEAT_EXT_ARG)) {
+		fprintf(stderr, "warning: no IORING_FEAT_EXT_ARG, waits with a timeout need a timeout SQE\n");
+	}
+
+	/**
+	 * CHAT_CLUSTER="ip:port,ip:port,..." runs the server as node CHAT_NODE of a
+	 * cluster, where the list holds the address every node accepts the others on.
+	 * Groups are spread over the nodes, see cluster.h. CHAT_PORT moves the client
+	 * port, e.g. to run several nodes on one host.
+	 */
+	int port = PORT;
+	const char *port_env = getenv("CHAT_PORT");
+	if (port_env != NULL) port = strtoul(port_env, NULL, 10);
+
+	Cluster cluster;
+	const char *cluster_env = getenv("CHAT_CLUSTER");
+	if (cluster_env != NULL) {
+		const char *node_env = getenv("CHAT_NODE");
+		uint32_t node = node_env != NULL ? strtoul(node_env, NULL, 10) : 0;
+		if (cluster_init(&cluster, cluster_env, node) < 0) {
+			fprintf(stderr, "Invalid CHAT_CLUSTER or CHAT_NODE: %s\n", cluster_env);
+			return EXIT_FAILURE;
+		}
+	}
 
-	int server_fd = setup_server(PORT);
-	printf("Server is listening\n");
+	/* With a takeover the listener comes from the old process. */
+	int server_fd = -1;
+	if (!takeover) {
+		server_fd = setup_server(port);
+		printf("Server is listening\n");
+	}
 
 	OpPool pool;
 	op_pool_init(&pool);
 
 	ClientMap clients;
 	// TODO: make new constructor without cap.
-	client_map_init(&clients, 1024);
+	client_map_init(&clients, clients_cap);
 
 	Slab slab64;
 	slab_init(&slab64, BUFFER_SIZE_64B);
@@ -73,19 +260,228 @@ int main() {
 	Slab slab2k;
 	slab_init(&slab2k, BUFFER_SIZE_2KB);
 
-	Server srv = server_init(&ring, &clients, &slab64, &slab2k, &pool, server_fd);
+	RecvRingPool recv_rings;
+	recv_ring_pool_init(&recv_rings, RECV_RING_SIZE);
+
+	struct groups *groups = groups_create(GROUPS_INIT_CAP);
+	if (groups == NULL) fatal_error("groups_create");
+
+	UnameIndex unames;
+	uname_index_init(&unames, UNAMES_INIT_CAP);
+
+	/* Formats and writes logs off the event loop. */
+	Logger log;
+	logger_init(&log, stdout, LOG_RING_SIZE);
+	logger_start(&log);
+
+	Server srv = server_init(
+		&ring, &clients, &slab64, &slab2k, &pool, &recv_rings, groups, &unames, &log,
+		server_fd
+	);
+
+	srv.batch_window_ns = batch_window_ns;
+
+	/* CHAT_PRESENCE_MS=0 sends presence and typing changes every loop iteration. */
+	uint64_t presence_window_ms = PRESENCE_WINDOW_MS;
+	const char *presence_env = getenv("CHAT_PRESENCE_MS");
+	if (presence_env != NULL) presence_window_ms = strtoull(presence_env, NULL, 10);
+	srv.presence_window_ns = presence_window_ms * 1000000;
+
+	/**
+	 * CHAT_FANOUT_INLINE sends messages to groups of up to that many recipients
+	 * right away, CHAT_FANOUT_QUANTUM is how many sends each larger group gets per
+	 * loop iteration.
+	 */
+	const char *inline_env = getenv("CHAT_FANOUT_INLINE");
+	if (inline_env != NULL) srv.fanout_inline_max = strtoull(inline_env, NULL, 10);
+	const char *quantum_env = getenv("CHAT_FANOUT_QUANTUM");
+	if (quantum_env != NULL) {
+		srv.fanout.quantum = strtoull(quantum_env, NULL, 10);
+		if (srv.fanout.quantum == 0) srv.fanout.quantum = 1;
+	}
 
-	if (server_start(&srv) < 0) {
+	if (capacity_env != NULL) {
+		uint64_t start_ns = monotonic_ns();
+		op_pool_reserve(&pool, sizes.ops);
+		client_map_reserve(&clients, sizes.clients);
+		slab_reserve(&slab64, sizes.slab64);
+		slab_reserve(&slab2k, sizes.slab2k);
+		uname_index_reserve(&unames, profile.conns);
+		if (!groups_reserve(groups, sizes.groups, profile.conns)) fatal_error("groups_reserve");
+		server_reserve(&srv, profile.conns);
+
+		/* Each ring takes two mappings, which vm.max_map_count may not allow. */
+		size_t rings = recv_ring_pool_reserve(&recv_rings, sizes.recv_rings);
+		if (rings < sizes.recv_rings) {
+			fprintf(stderr, "warning: only %zu of %zu recv rings could be mapped: %s\n",
+				rings, sizes.recv_rings, strerror(errno));
+		}
+		printf("Reserved for %zu connections and %zu groups in %.1f ms, SQ of %u entries\n",
+			profile.conns, profile.groups, (monotonic_ns() - start_ns) / 1e6, params.sq_entries);
+	}
+
+	const char *mlock_env = getenv("CHAT_MLOCK");
+	if (mlock_env != NULL && strcmp(mlock_env, "0") != 0) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) fatal_error("mlockall, see ulimit -l");
+	}
+
+	/**
+	 * The loop batches reaping on its own under load. CHAT_REAP_WAIT_US overrides
+	 * how long it waits for a batch, 0 turns batching off, and CHAT_REAP_BATCH
+	 * how many completions a batch has at most. CHAT_SPIN_US polls the CQ that
+	 * long before the loop goes to sleep.
+	 */
+	const char *reap_batch_env = getenv("CHAT_REAP_BATCH");
+	if (reap_batch_env != NULL) srv.reap_batch = strtoul(reap_batch_env, NULL, 10);
+	if (srv.reap_batch == 0) srv.reap_batch = 1;
+	const char *reap_wait_env = getenv("CHAT_REAP_WAIT_US");
+	if (reap_wait_env != NULL) srv.reap_wait_ns = strtoull(reap_wait_env, NULL, 10) * 1000;
+	const char *spin_env = getenv("CHAT_SPIN_US");
+	if (spin_env != NULL) srv.spin_ns = strtoull(spin_env, NULL, 10) * 1000;
+
+	/**
+	 * CHAT_RATE_LIMIT sets per-client limits e.g. "send_to_group=1000/100", see
+	 * rate_limits_parse. With CHAT_RATE_DEFER=1 frames over the limit wait instead
+	 * of failing with CODE_RATE_LIMITED.
+	 */
+	rate_limits_init(&srv.limits);
+	const char *limit_env = getenv("CHAT_RATE_LIMIT");
+	if (limit_env != NULL && rate_limits_parse(&srv.limits, limit_env) < 0) {
+		fprintf(stderr, "Invalid CHAT_RATE_LIMIT: %s\n", limit_env);
+		return EXIT_FAILURE;
+	}
+	const char *defer_env = getenv("CHAT_RATE_DEFER");
+	srv.limits.defer = defer_env != NULL && strcmp(defer_env, "0") != 0;
+
+	/**
+	 * CHAT_MAX_CONNS caps the clients of the server, by default at what the fd
+	 * limit and vm.max_map_count allow, the latter with RECV_RING_MAPS per client.
+	 * CHAT_ACCEPT_RATE e.g. "200/50" limits new connections to 200 per second with
+	 * bursts of 50. Connections beyond either wait in the listen backlog.
+	 */
+	struct rlimit nofile;
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY
+		&& nofile.rlim_cur > FD_RESERVE) {
+		srv.max_conns = nofile.rlim_cur - FD_RESERVE;
+	}
+	size_t maps = max_map_count();
+	if (maps > MAP_RESERVE) {
+		size_t map_conns = (maps - MAP_RESERVE) / RECV_RING_MAPS;
+		if (srv.max_conns == 0 || map_conns < srv.max_conns) srv.max_conns = map_conns;
+	}
+	const char *max_conns_env = getenv("CHAT_MAX_CONNS");
+	if (max_conns_env != NULL) srv.max_conns = strtoull(max_conns_env, NULL, 10);
+
+	const char *accept_env = getenv("CHAT_ACCEPT_RATE");
+	if (accept_env != NULL && rate_limit_parse(&srv.accept_limit, accept_env) < 0) {
+		fprintf(stderr, "Invalid CHAT_ACCEPT_RATE: %s\n", accept_env);
+		return EXIT_FAILURE;
+	}
+
+	if (handover_path != NULL) {
+		srv.handover_path = handover_path;
+		srv.wait_sigmask = &wait_sigmask;
+	}
+
+	/**
+	 * CHAT_CAPTURE=<path> records the frames clients send to path, which replay
+	 * drives another server with, see capture.h.
+	 */
+	Capture capture;
+	FILE *capture_file = NULL;
+	const char *capture_path = getenv("CHAT_CAPTURE");
+	if (capture_path != NULL) {
+		capture_file = fopen(capture_path, "w");
+		if (capture_file == NULL || capture_init(&capture, capture_file, CAPTURE_RING_SIZE,
+												 monotonic_ns()) < 0) {
+			fatal_error("CHAT_CAPTURE");
+		}
+		capture_start(&capture);
+		srv.capture = &capture;
+		printf("Capturing to %s\n", capture_path);
+	}
+
+	/* Before a takeover, which hands over ids of this node. */
+	if (cluster_env != NULL) server_join_cluster(&srv, &cluster);
+
+	if (takeover) {
+		printf("Waiting for the old server at %s\n", handover_path);
+		int sock = handover_accept(handover_path);
+		if (sock < 0) fatal_error("handover_accept");
+		if (server_takeover(&srv, sock) < 0) fatal_error("server_takeover");
+		must_close(sock, "takeover sock close");
+
+		HandoverStats *hs = &srv.handover_stats;
+		printf("Took over %lu clients and %lu groups in %.1f ms, %lu dropped\n",
+			hs->clients, hs->groups, hs->transfer_ns / 1e6, hs->dropped);
+	}
+
+	/**
+	 * Gateways on the same host can skip TCP. CHAT_UNIX=<path> accepts clients on
+	 * a Unix socket, with the same protocol. CHAT_SHM=<path> accepts gateways which
+	 * exchange frames with the server through shared memory instead, see
+	 * shm_ring.h. Either may already have been handed over.
+	 */
+	const char *unix_path = getenv("CHAT_UNIX");
+	if (unix_path != NULL && srv.listeners[LISTENER_UNIX].fd < 0) {
+		srv.listeners[LISTENER_UNIX].fd = setup_unix_server(unix_path);
+		printf("Listening on %s\n", unix_path);
+	}
+	const char *shm_path = getenv("CHAT_SHM");
+	if (shm_path != NULL && srv.listeners[LISTENER_SHM].fd < 0) {
+		srv.listeners[LISTENER_SHM].fd = setup_unix_server(shm_path);
+		printf("Listening for shm gateways on %s\n", shm_path);
+	}
+	if (cluster_env != NULL && srv.listeners[LISTENER_PEER].fd < 0) {
+		srv.listeners[LISTENER_PEER].fd = setup_tcp_server(&cluster.addrs[cluster.self]);
+		printf("Node %u of %u\n", cluster.self, cluster.nodes_len);
+	}
+
+	/* Only now, so that they still end a takeover waiting for the old server. */
+	if (signal(SIGINT, request_stop) == SIG_ERR) fatal_error("signal(SIGINT)");
+	if (signal(SIGTERM, request_stop) == SIG_ERR) fatal_error("signal(SIGTERM)");
+
+	ret = server_start(&srv);
+	if (ret < 0) {
 		fprintf(stderr, "failed to start server\n");
 		return EXIT_FAILURE;
 	}
+	server_print_stats(&srv, stdout);
 
-	must_shutdown(server_fd, "server_fd shutdown");
-	must_close(server_fd, "server_fd close");
+	/* server_start returns 0 once the clients are handed over, 1 on SIGINT or SIGTERM. */
+	if (ret == 0) {
+		HandoverStats *hs = &srv.handover_stats;
+		printf("Handed over %lu clients and %lu groups, drained in %.1f ms and sent in %.1f ms, "
+			"%lu dropped\n", hs->clients, hs->groups, hs->drain_ns / 1e6, hs->transfer_ns / 1e6,
+			hs->dropped);
+		must_close(srv.handover_sock, "handover sock close");
+	}
+
+	/**
+	 * After a handover the listeners are shared with the new process, shutting
+	 * them down would stop them there as well.
+	 */
+	for (int i = 0; i < LISTENER_COUNT; i++) {
+		if (srv.listeners[i].fd >= 0) must_close(srv.listeners[i].fd, "listener close");
+	}
 
 	io_uring_queue_exit(&ring);
+	server_deinit(&srv);
 	op_pool_deinit(&pool);
 	client_map_deinit(&clients);
 	slab_deinit(&slab64);
 	slab_deinit(&slab2k);
+	recv_ring_pool_deinit(&recv_rings);
+	groups_destroy(groups);
+	uname_index_deinit(&unames);
+	logger_deinit(&log);
+	if (cluster_env != NULL) cluster_deinit(&cluster);
+	if (capture_file != NULL) {
+		capture_deinit(&capture);
+		if (capture.ring.dropped > 0) {
+			fprintf(stderr, "warning: %lu of %lu captured records dropped\n",
+				capture.ring.dropped, capture.ring.dropped + capture.records);
+		}
+		fclose(capture_file);
+	}
 }
@@ -8,6 +8,16 @@ char *op_type_str(OpType type) {
 		return "READ";
 	case OP_WRITE:
 		return "WRITE";
+	case OP_SENDMSG:
+		return "SENDMSG";
+	case OP_WRITEV:
+		return "WRITEV";
+	case OP_PEER_CONNECT:
+		return "PEER_CONNECT";
+	case OP_PEER_RECV:
+		return "PEER_RECV";
+	case OP_PEER_SEND:
+		return "PEER_SEND";
 	default:
 		return "UNKNOWN";
 	}
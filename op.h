@@ -5,11 +5,23 @@
 #include <arpa/inet.h>
 
 #include "slab.h"
+#include "recv_ring.h"
+#include "buf_chain.h"
 
 typedef enum op_type {
 	OP_ACCEPT,
 	OP_READ,
 	OP_WRITE,
+	OP_SENDMSG,
+	/* Several queued sends of a client gathered into one sendmsg, see gathered. */
+	OP_WRITEV,
+	/**
+	 * Operations on the connections between cluster nodes, which don't belong to a
+	 * client. client_id holds the node of the link for connects and sends.
+	 */
+	OP_PEER_CONNECT,
+	OP_PEER_RECV,
+	OP_PEER_SEND,
 } OpType;
 
 typedef struct op {
@@ -17,6 +29,8 @@ typedef struct op {
 	size_t pool_id; 
 
 	OpType type;
+	/* Only set for OP_ACCEPT, the kind of listener it accepts on. */
+	uint8_t listener;
 	uint64_t client_id;
 
 	/** 
@@ -28,6 +42,26 @@ typedef struct op {
 	size_t buf_cap; /* Total capcity of buf. */
 	size_t buf_len; /* Number of bytes used for the operation. */
 	BufRef *buf_ref; /* Operation doesn't own the buf. */
+	/**
+	 * Only set for OP_READ. Unlike buf_ref, the operation owns its recv_ring and
+	 * it is returned to the pool in free_op.
+	 */
+	RecvRing *recv_ring;
+	/**
+	 * Only set for OP_SENDMSG, which sends the chain instead of buf_ref. Like
+	 * buf_ref, the chain is shared and the operation holds one reference to it.
+	 * msg points to the msghdr of the chain until a short write, after which the
+	 * operation gets a private one for the rest of the chain.
+	 */
+	BufChain *chain;
+	struct msghdr *msg;
+	/**
+	 * Only set for OP_WRITEV, the pool_ids of the OP_WRITE and OP_SENDMSG
+	 * operations it sends, in order. It owns them and frees them along with it.
+	 * msg is malloced with room for their iovecs and for gathered.
+	 */
+	size_t *gathered;
+	size_t gathered_len;
 	size_t processed; /* Used for handling short writes. */
 } Operation;
 
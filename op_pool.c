@@ -47,6 +47,35 @@ Operation *op_pool_get(OpPool *pool, size_t pool_id) {
 	return pool->ops[pool_id];
 }
 
+void op_pool_prefetch(const OpPool *pool, uint64_t pool_id) {
+	__builtin_prefetch(&pool->ops[pool_id]);
+}
+
+/* Appends a new operation to ops, which must have room for it. */
+static Operation *alloc_op(OpPool *pool) {
+	Operation *op = must_malloc(
+		sizeof(Operation), 
+		"op_pool_new_entry malloc op"
+	);
+
+	/**
+	 * OpPool contract:
+	 * assign correct value to pool_id and ensure client_fd and buf have correct
+	 * initial values.
+	 */
+	op->pool_id = pool->ops_next_idx;
+	op->client_fd = -1;
+	op->buf_ref = NULL;
+	op->recv_ring = NULL;
+	op->chain = NULL;
+	op->gathered = NULL;
+
+	pool->ops[pool->ops_next_idx] = op;
+	pool->ops_next_idx++;
+
+	return op;
+}
+
 Operation *op_pool_new_entry(OpPool *pool) {
 	if (pool->free_len != 0) {
 		/* Grab the most recent freed entry. */
@@ -74,24 +103,37 @@ Operation *op_pool_new_entry(OpPool *pool) {
 		);
 	}
 
-	Operation *op = must_malloc(
-		sizeof(Operation), 
-		"op_pool_new_entry malloc op"
-	);
+	return alloc_op(pool);
+}
 
-	/**
-	 * OpPool contract:
-	 * assign correct value to pool_id and ensure client_fd and buf have correct
-	 * initial values.
-	 */
-	op->pool_id = pool->ops_next_idx;
-	op->client_fd = -1;
-	op->buf_ref = NULL;
+void op_pool_reserve(OpPool *pool, size_t n) {
+	if (pool->ops_next_idx >= n) return;
 
-	pool->ops[pool->ops_next_idx] = op;
-	pool->ops_next_idx++;
+	if (n > pool->ops_cap) {
+		pool->ops_cap = n;
+		pool->ops = must_realloc(
+			pool->ops,
+			pool->ops_cap * sizeof(Operation *),
+			"op_pool_reserve realloc ops"
+		);
+	}
+	/* Every operation can be on the free list at once. */
+	if (n > pool->free_cap) {
+		pool->free_cap = n;
+		pool->free_ops_idx = must_realloc(
+			pool->free_ops_idx,
+			pool->free_cap * sizeof(size_t),
+			"op_pool_reserve realloc free_ops_idx"
+		);
+	}
 
-	return op;
+	/* Freed in reverse so that the lowest pool_ids are handed out first. */
+	size_t first = pool->ops_next_idx;
+	while (pool->ops_next_idx < n) alloc_op(pool);
+	for (size_t i = n; i > first; i--) {
+		pool->free_ops_idx[pool->free_len] = i - 1;
+		pool->free_len++;
+	}
 }
 
 void op_pool_return(OpPool *pool, Operation *op) {
@@ -110,6 +152,8 @@ void op_pool_return(OpPool *pool, Operation *op) {
 	 * care of these things here.
 	 */
 	assert(op->buf_ref == NULL);
+	assert(op->recv_ring == NULL);
+	assert(op->chain == NULL);
 	assert(op->client_fd == -1);
 
 	if (pool->free_len == pool->free_cap) {
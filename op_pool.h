@@ -4,10 +4,12 @@
  * it assigns a pool_id to each Operation once they are allocated and it requires
  * pool_id to not change by the users.
  *
- * it requires users to manage buf and client_fd. Before returning an entry
- * to the pool, buf must be set to NULL and client_fd to -1;
+ * it requires users to manage buf, recv_ring, chain and client_fd. Before returning
+ * an entry to the pool, buf, recv_ring and chain must be set to NULL and client_fd
+ * to -1;
  *
- * When pool returns a new entry it sets both buf to NULL and client_fd to -1;
+ * When pool returns a new entry it sets buf, recv_ring and chain to NULL and
+ * client_fd to -1;
  */
 
 #ifndef OP_POOL_H
@@ -54,6 +56,12 @@ void op_pool_deinit(OpPool *pool);
  */
 Operation *op_pool_get(OpPool *pool, uint64_t pool_id);
 
+/**
+ * Prefetches the slot of pool_id in ops, so that op_pool_get for a batch of ids
+ * doesn't miss on every one of them.
+ */
+void op_pool_prefetch(const OpPool *pool, uint64_t pool_id);
+
 /**
  * Inserts a new operation in the pool and returns a ptr to it.
  *
@@ -63,6 +71,12 @@ Operation *op_pool_get(OpPool *pool, uint64_t pool_id);
  */
 Operation *op_pool_new_entry(OpPool *pool);
 
+/**
+ * Allocates operations until the pool holds at least n, adding the new ones to
+ * the free list, so that n operations can be in use without allocating.
+ */
+void op_pool_reserve(OpPool *pool, size_t n);
+
 void op_pool_return(OpPool *pool, Operation *op);
 
 #endif
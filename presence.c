@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include "presence.h"
+#include "utils.h"
+
+void presence_queue_init(PresenceQueue *q) {
+	memset(q, 0, sizeof(*q));
+}
+
+void presence_queue_deinit(PresenceQueue *q) {
+	for (size_t i = 0; i < q->cap; i++) {
+		cid_set_deinit(&q->groups[i].changed);
+	}
+	free(q->groups);
+	q->groups = NULL;
+	q->head = 0;
+	q->len = 0;
+	q->cap = 0;
+}
+
+/* Doubles the ring, moving the entries in use to the front of the new one. */
+static void presence_grow(PresenceQueue *q) {
+	size_t cap = q->cap == 0 ? 16 : q->cap * 2;
+	struct presence_group *groups = must_malloc(
+		cap * sizeof(struct presence_group), "presence_grow malloc groups"
+	);
+	for (size_t i = 0; i < q->cap; i++) {
+		groups[i] = *presence_at(q, i);
+		if (i < q->len) groups[i].grp->presence_idx = i + 1;
+	}
+	for (size_t i = q->cap; i < cap; i++) {
+		cid_set_init(&groups[i].changed);
+	}
+	free(q->groups);
+	q->groups = groups;
+	q->head = 0;
+	q->cap = cap;
+}
+
+void presence_mark(PresenceQueue *q, struct grp *grp, uint64_t cid, uint64_t now_ns) {
+	if (grp->presence_idx == 0) {
+		if (q->len == q->cap) presence_grow(q);
+
+		struct presence_group *pg = presence_at(q, q->len);
+		pg->grp = grp;
+		pg->opened_ns = now_ns;
+		q->len++;
+		grp->presence_idx = pg - q->groups + 1;
+	}
+
+	cid_set_insert(&q->groups[grp->presence_idx - 1].changed, cid);
+}
+
+size_t presence_due(const PresenceQueue *q, uint64_t now_ns, uint64_t window_ns,
+					uint64_t *next_due_ns) {
+	*next_due_ns = 0;
+	for (size_t i = 0; i < q->len; i++) {
+		uint64_t age = now_ns - presence_at(q, i)->opened_ns;
+		if (age < window_ns) {
+			*next_due_ns = window_ns - age;
+			return i;
+		}
+	}
+	return q->len;
+}
+
+void presence_pop(PresenceQueue *q, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		struct presence_group *pg = presence_at(q, i);
+		pg->grp->presence_idx = 0;
+		cid_set_clear(&pg->changed);
+	}
+	q->head = (q->head + n) & (q->cap - 1);
+	q->len -= n;
+}
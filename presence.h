@@ -0,0 +1,64 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+/**
+ * Presence and typing changes waiting to be sent to the members of their groups.
+ *
+ * Only the ids of the members which changed are collected per group, not their
+ * states, which the server reads once the group is due. However often a member
+ * flaps within the window, it costs every member of the group one record. Groups
+ * are due window_ns after their first change and stay in that order, so the due
+ * ones are always at the front of the queue.
+ *
+ * Each grp with changes points at its entry with presence_idx, so marking a
+ * change takes one insert into the set of the entry. The entries form a ring, so
+ * popping the due groups leaves the others in place.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cid_set.h"
+#include "groups.h"
+
+struct presence_group {
+	struct grp *grp;
+	uint64_t opened_ns;
+	struct cid_set changed;
+};
+
+typedef struct {
+	/* Groups with changes, oldest first, from slot head on. */
+	size_t head;
+	size_t len;
+	/**
+	 * Power of 2. The sets of the slots not in use are empty and reused by the
+	 * next groups.
+	 */
+	size_t cap;
+	struct presence_group *groups;
+} PresenceQueue;
+
+void presence_queue_init(PresenceQueue *q);
+void presence_queue_deinit(PresenceQueue *q);
+
+/* Entry i of the queue, 0 being the oldest. */
+static inline struct presence_group *presence_at(const PresenceQueue *q, size_t i) {
+	return &q->groups[(q->head + i) & (q->cap - 1)];
+}
+
+/* Records that the presence or typing of cid changed at now_ns, to tell grp. */
+void presence_mark(PresenceQueue *q, struct grp *grp, uint64_t cid, uint64_t now_ns);
+
+/**
+ * Returns the number of groups at the front of the queue whose first change is at
+ * least window_ns old. Sets next_due_ns to the time until the next of the others
+ * is due, or 0 if none remain.
+ */
+size_t presence_due(const PresenceQueue *q, uint64_t now_ns, uint64_t window_ns,
+					uint64_t *next_due_ns);
+
+/* Removes the first n groups once their changes have been sent. */
+void presence_pop(PresenceQueue *q, size_t n);
+
+#endif
@@ -4,7 +4,9 @@
  * All messages are prefixed with a 2-byte len part.
  *
  * `len` has a maximum of 2048 bytes indicating the upper bound for length of
- * each message (including 2 bytes for len and 1 for message type).
+ * each message (including 2 bytes for len and 1 for message type). Messages
+ * longer than that are sent in chunks and delivered in a single frame with an
+ * extended header, see SEND_TO_GROUP_START and RECEIVE_FROM_GROUP_LARGE.
  *
  * All IDs are 8 bytes including group ID, client ID, message ID.
  *
@@ -43,41 +45,44 @@
  * the terminating null character, thus username may have a max length of 15 bytes.
  * Server will add the '\0' in the end. Username has a min length of 3.
  *
- * 6 <= len <= 18
+ * 14 <= len <= 26
  *
  *
  *** SET_USERNAME_RESPONSE
  * 
- * <len:2> <msgt:1> <seqid:8>
- * len = 11
+ * <len:2> <msgt:1> <seqid:8> <uid:8>
+ * len = 19
+ *
+ * uid is the ID the server assigned to the client. Other clients use it to add
+ * this client to their groups.
  *
  *
  *** GET_USERNAMES
- * 
- * <len:2> <msgt:1> <gid:8>
- * len = 11
  *
+ * <len:2> <msgt:1> <seqid:8> <gid:8>
+ * len = 19
  *
- *** GET_USERNAME_RESPONSE
- * 
- * <len:2> <msgt:1> <count:4> [<usrlen:1> <username>]*count
+ * Sender must be a member of the group.
+ *
+ *
+ *** GET_USERNAMES_RESPONSE
+ *
+ * <len:2> <msgt:1> <seqid:8> <more:1> <count:2> [<usrlen:1> <username>]*count
  *
- * 7 <= len <= 2048
+ * 14 <= len <= 2048
  *
  * `count` is the number of usernames that follows. For each username, first read
  * its length and then read `usrlen` bytes. Client should add the terminating NULL char
- * when storing it in memory.
+ * when storing it in memory. Members which haven't set a username are left out.
  *
- * In case gid is invalid, count would be 0.
- *
- * We assume that we can send all usernames in a single message for now.
- * Splitting the response into several messages will happen in the future.
+ * Usernames which don't fit in 2048 bytes are split into several responses with
+ * the seqid of the request. `more` is 1 in all of them but the last one.
  *
  *
  *** CREATE_GROUP
- * <len:2> <msgt:1> <uids_len:1> [<uid:8>]*count
- * 12 <= len <= 2044
- * 1 <= count <= 255
+ * <len:2> <msgt:1> <seqid:8> <uids_len:1> [<uid:8>]*count
+ * 20 <= len <= 1612
+ * 1 <= count <= 200
  *
  * Server creates a group with the provided user IDs and the user who issues this request.
  * Server will return the group ID as response in CREATE_GROUP_RESPONSE to the issuer.
@@ -87,52 +92,150 @@
  *
  *
  *** CREATE_GROUP_RESPONSE
- * <len:2> <msgt:1> <gid:8>
- * len = 11
+ * <len:2> <msgt:1> <seqid:8> <gid:8>
+ * len = 19
  *
  *
  *** JOINED_GROUP
- * <len:2> <msgt:1> <uid:8> <gid:8> <count:1> [<uid:8>]*count
- * 28 <= len <= 2048
+ * <len:2> <msgt:1> <seqid:8> <uid:8> <gid:8> <count:1> [<uid:8>]*count
+ * 36 <= len <= 1636
  *
  * Server will send this message to all clients who were added to a group by another client
- * that just created a group.
- * The uids can just be directly copied from the originating CREATE_GROUP message.
+ * that just created a group. uid is the creator of the group and seqid is 0.
+ * The uids are directly copied from the originating CREATE_GROUP message without
+ * being decoded.
  *
  *
  *** ADD_TO_GROUP
- * <len:2> <msgt:1> <gid:8> <count:1> [<uid:8>]*count
- * len = 11
- * msgt = 4
+ * <len:2> <msgt:1> <seqid:8> <gid:8> <uids_len:1> [<uid:8>]*uids_len
+ * 28 <= len <= 1620
+ * 1 <= uids_len <= 200
+ *
+ * Adds the connected clients among uids to a group the sender is a member of.
+ * The clients which weren't members yet receive JOINED_GROUP with the sender as
+ * uid and the uids of this message.
  *
  *
  *** ADD_TO_GROUP_RESPONSE
- * <len:2> <msgt:1> <res:1>
- * len = 4
- * msgt = 5
- * res is 0 (failure) or 1 (success).
+ * <len:2> <msgt:1> <seqid:8> <gid:8>
+ * len = 19
  *
  *
  *** SEND_TO_GROUP
- * <len:2> <msgt:1> <gid:8> <seqid:8> <msg>
- * 20 <= len <= 2048
- * msgt = 6
+ * <len:2> <msgt:1> <seqid:8> <gid:8> <msg>
+ * 20 <= len <= 2032
+ *
+ * msg may be at most MAX_GROUP_MSG_LEN bytes so that it fits in RECEIVE_FROM_GROUP.
+ * Sender must be a member of the group.
  * 
  *
  *** SEND_TO_GROUP_RESPONSE
- * <len:2> <msgt:1> <gid:8> <msgid:8> <seqid:8>
+ * <len:2> <msgt:1> <seqid:8> <gid:8> <msgid:8>
  * len = 27
- * msgt = 7
  *
  *
  *** RECEIVE_FROM_GROUP
- * <len:2> <msgt:1> <gid:8> <msgid:8> <msg>
- * 22 <= len <= 2048
- * msgt = 8
+ * <len:2> <msgt:1> <seqid:8> <gid:8> <msgid:8> <uid:8> <msg>
+ * 36 <= len <= 2048
+ *
+ * seqid is 0 and uid is the sender of the message.
+ *
+ *
+ *** SEND_TO_GROUP_START
+ * <len:2> <msgt:1> <seqid:8> <gid:8> <msg_len:4>
+ * len = 23
+ * 1 <= msg_len <= MAX_LARGE_MSG_LEN
+ *
+ * Starts a message which is too long for SEND_TO_GROUP. The message follows in
+ * SEND_TO_GROUP_CHUNKs and is finished by SEND_TO_GROUP_END. Only one such message
+ * may be in progress per connection, but other requests may be sent between its
+ * chunks. Server only answers with SERVER_ERROR if the message is rejected.
+ *
+ *
+ *** SEND_TO_GROUP_CHUNK
+ * <len:2> <msgt:1> <seqid:8> <data>
+ * 12 <= len <= 2048
+ *
+ * The data of all chunks must add up to exactly msg_len bytes.
+ *
+ *
+ *** SEND_TO_GROUP_END
+ * <len:2> <msgt:1> <seqid:8>
+ * len = 11
+ *
+ * Server answers with SEND_TO_GROUP_RESPONSE using the seqid of this message.
+ *
+ *
+ *** RECEIVE_FROM_GROUP_LARGE
+ * <len:2> <msgt:1> <seqid:8> <frame_len:4> <gid:8> <msgid:8> <uid:8> <msg>
+ * len = 0
+ * 40 <= frame_len <= 39 + MAX_LARGE_MSG_LEN
+ *
+ * Messages sent with SEND_TO_GROUP_START are delivered in a single frame with an
+ * extended header. len is 0, which no other message can have, and frame_len is
+ * the length of the whole frame. seqid is 0 and uid is the sender of the message.
+ *
+ *
+ *** SET_OPTIONS
+ * <len:2> <msgt:1> <seqid:8> <options:1>
+ * len = 12
+ *
+ * options is a bitmask of OPT_* and replaces the options of the connection. Unknown
+ * bits are ignored. OPT_BATCH asks the server to pack the frames due for the client
+ * into BATCH envelopes.
+ *
+ *
+ *** SET_OPTIONS_RESPONSE
+ * <len:2> <msgt:1> <seqid:8> <options:1>
+ * len = 12
+ *
+ * options are the ones now in effect, which may already apply to this response.
+ *
+ *
+ *** BATCH
+ * <len:2> <msgt:1> <seqid:8> [<frame>]*
+ * 12 <= len <= 2048
+ *
+ * Only sent to clients which enabled OPT_BATCH. Frames which became due for the
+ * client within one iteration of the server loop, or within the configured batch
+ * window, are sent together in one envelope in the order they were produced. Each
+ * frame is a complete message with its own header. seqid is 0. Frames which don't
+ * fit in an envelope, like RECEIVE_FROM_GROUP_LARGE, are sent on their own after
+ * the frames due before them.
+ *
+ *
+ *** SET_PRESENCE
+ * <len:2> <msgt:1> <seqid:8> <presence:1>
+ * len = 12
+ *
+ * presence is one of PRESENCE_*. Clients are PRESENCE_ONLINE once connected and
+ * PRESENCE_OFFLINE once they disconnect. The members of the groups of the client
+ * learn about it through GROUP_STATUS. Server only answers with SERVER_ERROR if
+ * presence is unknown.
+ *
+ *
+ *** SET_TYPING
+ * <len:2> <msgt:1> <seqid:8> <gid:8> <typing:1>
+ * len = 20
+ *
+ * typing is 1 while the client is typing in the group and 0 once it stops. A client
+ * types in at most one group at a time, so starting in another group stops it in
+ * the previous one, as does sending to the group. Sender must be a member of the
+ * group. Server only answers with SERVER_ERROR if the request is rejected.
+ *
+ *
+ *** GROUP_STATUS
+ * <len:2> <msgt:1> <seqid:8> <gid:8> <count:2> [<uid:8> <presence:1> <typing:1>]*count
+ * 31 <= len <= 2041
+ *
+ * Sent to every member of the group with the latest state of the members whose
+ * presence or typing changed, including the receiver itself. Changes are collected
+ * over a short window, so a member which changed several times within it is only
+ * listed once. More changes than fit in one message are split into several.
+ * seqid is 0.
  *
  */
 
-#include <liburing.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <assert.h>
@@ -141,37 +244,31 @@
 #include "protocol.h"
 #include "utils.h"
 
-/**************** WIRE PROTOCOL MESSAGES - START ****************/
-#pragma pack(push, 1)
-
-typedef struct {
-	uint16_t len;
-	uint8_t msgt;
-	uint64_t seqid;
-} Header;
+#define X(NAME, name, tail_min, tail_max) [MSGT_##NAME] = #name,
+const char *const prot_msg_names[MSGT_COUNT] = { PROT_MESSAGES(X) };
+#undef X
 
-typedef struct {
-	Header hdr;
-    uint8_t code;
-} ServerError;
+#define X(NAME, name, tail_min, tail_max) \
+	[MSGT_##NAME] = sizeof(struct msg_##name) + (tail_min),
+const uint32_t prot_min_len[MSGT_COUNT] = { PROT_MESSAGES(X) };
+#undef X
 
-typedef struct {
-	Header hdr;
-	uint8_t username[];
-} SetUsernameRequest;
+#define X(NAME, name, tail_min, tail_max) [MSGT_##NAME] = (tail_max) - (tail_min),
+const uint32_t prot_len_span[MSGT_COUNT] = { PROT_MESSAGES(X) };
+#undef X
 
-typedef struct {
-	Header hdr;
-} SetUsernameResponse;
+/* Every message fits in a frame, except the one with an extended header. */
+#define X(NAME, name, tail_min, tail_max) \
+	_Static_assert( \
+		MSGT_##NAME == MSGT_RECEIVE_FROM_GROUP_LARGE \
+			|| sizeof(struct msg_##name) + (tail_max) <= PROT_MAX_LEN, \
+		#NAME " doesn't fit in PROT_MAX_LEN" \
+	);
+PROT_MESSAGES(X)
+#undef X
 
-typedef struct {
-	Header hdr;
-	uint8_t uids_len;
-	uint64_t uids[];
-} CreateGroup;
-
-#pragma pack(pop)
-/**************** WIRE PROTOCOL MESSAGES - END ****************/
+_Static_assert(sizeof(Header) == PROT_HDR_LEN, "header size");
+_Static_assert(sizeof(struct msg_receive_from_group_large) == PROT_LARGE_HDR_LEN, "large header size");
 
 int deser_header(const char *buf, uint16_t *len, uint8_t *msgt, uint64_t *seqid) {
 	uint16_t net_len;
@@ -188,22 +285,14 @@ int deser_header(const char *buf, uint16_t *len, uint8_t *msgt, uint64_t *seqid)
 }
 
 int deser_server_error(size_t buf_len, const char *buf, uint8_t *code) {
-	if (buf_len != sizeof(ServerError)) return -1;
-	*code = *(const uint8_t *)(buf + offsetof(ServerError, code));
+	if (!prot_len_valid(MSGT_SERVER_ERROR, buf_len)) return -1;
+	*code = server_error_code(buf);
 	return 0;
 }
 
 size_t ser_server_error(size_t buf_len, char *buf, uint64_t seqid, uint8_t code) {
-	ServerError *se = (ServerError *)buf;
-	uint16_t len = sizeof(*se);
-	assert(len <= buf_len);
-
-	se->hdr.len = htons(len);
-	se->hdr.msgt = MSGT_SERVER_ERROR;
-	se->hdr.seqid = htonll(seqid);
-	se->code = code;
-
-	return len;
+	assert(sizeof(struct msg_server_error) <= buf_len);
+	return put_server_error(buf, seqid, code, 0);
 }
 
 int deser_set_username(
@@ -212,15 +301,9 @@ int deser_set_username(
 	const char **uname,
 	size_t *uname_len
 ) {
-	/**
-	 * We don't need to check buf_len for this message type using the following if because
-	 * uname_len will be set to 0 if client doesn't send any bytes for username. The caller
-	 * will check the uname_len to be within acceptable bounds.
-	 *
-	 * if (buf_len != sizeof(SetUsernameRequest)) return -1;
-	 */
-	*uname = buf + offsetof(SetUsernameRequest, username);
-	*uname_len = buf_len - sizeof(SetUsernameRequest);
+	if (!prot_len_valid(MSGT_SET_USERNAME, buf_len)) return -1;
+	*uname = set_username_tail(buf);
+	*uname_len = buf_len - sizeof(struct msg_set_username);
 	return 0;
 }
 
@@ -231,28 +314,21 @@ size_t ser_set_username(
 	size_t uname_len,
 	const char *uname
 ) {
-	SetUsernameRequest *req = (SetUsernameRequest *)buf;
-	uint16_t len = sizeof(*req) + uname_len;
-	assert(len <= buf_len);
-
-	req->hdr.len = htons(len);
-	req->hdr.msgt = MSGT_SET_USERNAME;
-	req->hdr.seqid = htonll(seqid);
-	memcpy(req->username, uname, uname_len);
-
+	assert(sizeof(struct msg_set_username) + uname_len <= buf_len);
+	size_t len = put_set_username(buf, seqid, uname_len);
+	memcpy(buf + sizeof(struct msg_set_username), uname, uname_len);
 	return len;
 }
 
-size_t ser_set_username_response(size_t buf_len, char *buf, uint64_t seqid) {
-	SetUsernameResponse *resp = (SetUsernameResponse *)buf;
-	uint64_t len = sizeof(*resp);
-	assert(len <= buf_len);
-
-	resp->hdr.len = htons(len);
-	resp->hdr.msgt = MSGT_SET_USERNAME_RESPONSE;
-	resp->hdr.seqid = htonll(seqid);
+int deser_set_username_response(size_t buf_len, const char *buf, uint64_t *uid) {
+	if (!prot_len_valid(MSGT_SET_USERNAME_RESPONSE, buf_len)) return -1;
+	*uid = set_username_response_uid(buf);
+	return 0;
+}
 
-	return len;
+size_t ser_set_username_response(size_t buf_len, char *buf, uint64_t seqid, uint64_t uid) {
+	assert(sizeof(struct msg_set_username_response) <= buf_len);
+	return put_set_username_response(buf, seqid, uid, 0);
 }
 
 int deser_create_group(
@@ -263,32 +339,18 @@ int deser_create_group(
 	const char **uids_raw,
 	size_t *uids_raw_len
 ) {
-	/**
-	 * In case client doesn't send any uids, the uids_len will be set to 0 and the
-	 * caller can validate that. Thus we only check there's enough bytes for the fixed
-	 * part here.
-	 */
-	if (buf_len < sizeof(CreateGroup)) return -1;
-
-	*uids_len = *(uint8_t *)(buf + offsetof(CreateGroup, uids_len));
-
-	/* Ensure uids has enough space. MAX_UIDS_PER_MSG is max capacity of uids array. */
-	if (*uids_len > MAX_UIDS_PER_MSG) return -1;
+	/* Also ensures uids has enough space for at most MAX_UIDS_PER_MSG uids. */
+	if (!prot_len_valid(MSGT_CREATE_GROUP, buf_len)) return -1;
 
 	/* Ensure client didn't send a wrong value for the count of uids. */
+	*uids_len = create_group_uids_len(buf);
 	size_t expected_uids_len = *uids_len * sizeof(uint64_t);
-	if (expected_uids_len != (buf_len - sizeof(CreateGroup))) return -1;
+	if (expected_uids_len != buf_len - sizeof(struct msg_create_group)) return -1;
 
-	const char *uids_base = buf + offsetof(CreateGroup, uids);
-	*uids_raw = uids_base;
+	*uids_raw = create_group_tail(buf);
 	*uids_raw_len = expected_uids_len;
 
-	for (uint8_t i = 0; i < *uids_len; ++i) {
-		uint64_t net_uid;
-		/* Relying on the compiler to optimize this pointer arithmetic. */
-		memcpy(&net_uid, uids_base + i * sizeof(uint64_t), sizeof(net_uid));
-		uids[i] = ntohll(net_uid);
-	}
+	ntohll_bulk(*uids_len, uids, *uids_raw);
 
 	return 0;
 }
@@ -302,21 +364,430 @@ size_t ser_create_group(
 ) {
 	assert(uids_len <= MAX_UIDS_PER_MSG);
 
-	CreateGroup *cg = (CreateGroup *)buf;
 	/* len is size_t to prevent overflows. */
-	size_t len = sizeof(*cg) + uids_len * sizeof(uint64_t);
-	assert(len <= buf_len);
-
-	cg->hdr.len = htons((uint16_t)len);
-	cg->hdr.msgt = MSGT_CREATE_GROUP;
-	cg->hdr.seqid = htonll(seqid);
-	cg->uids_len = uids_len;
-
-	char *uids_base = buf + sizeof(CreateGroup);
-	for (uint8_t i = 0; i < uids_len; ++i) {
-		uint64_t net_uid = htonll(uids[i]);
-		memcpy(uids_base + i * sizeof(uint64_t), &net_uid, sizeof(net_uid));
-	}
+	size_t uids_raw_len = uids_len * sizeof(uint64_t);
+	assert(sizeof(struct msg_create_group) + uids_raw_len <= buf_len);
+
+	size_t len = put_create_group(buf, seqid, uids_len, uids_raw_len);
+	htonll_bulk(uids_len, buf + sizeof(struct msg_create_group), uids);
+	return len;
+}
+
+int deser_create_group_response(size_t buf_len, const char *buf, uint64_t *gid) {
+	if (!prot_len_valid(MSGT_CREATE_GROUP_RESONSE, buf_len)) return -1;
+	*gid = create_group_response_gid(buf);
+	return 0;
+}
+
+size_t ser_create_group_response(size_t buf_len, char *buf, uint64_t seqid, uint64_t gid) {
+	assert(sizeof(struct msg_create_group_response) <= buf_len);
+	return put_create_group_response(buf, seqid, gid, 0);
+}
+
+int deser_joined_group(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *uid,
+	uint64_t *gid,
+	uint8_t *uids_len,
+	const char **uids_raw
+) {
+	if (!prot_len_valid(MSGT_JOINED_GROUP, buf_len)) return -1;
+
+	*uids_len = joined_group_uids_len(buf);
+	if (*uids_len * sizeof(uint64_t) != buf_len - sizeof(struct msg_joined_group)) return -1;
+
+	*uid = joined_group_uid(buf);
+	*gid = joined_group_gid(buf);
+	*uids_raw = joined_group_tail(buf);
+	return 0;
+}
+
+size_t ser_joined_group(
+	size_t buf_len,
+	char *buf,
+	uint64_t uid,
+	uint64_t gid,
+	uint8_t uids_len,
+	const char *uids_raw
+) {
+	assert(uids_len <= MAX_UIDS_PER_MSG);
+
+	/* len is size_t to prevent overflows. */
+	size_t uids_raw_len = uids_len * sizeof(uint64_t);
+	assert(sizeof(struct msg_joined_group) + uids_raw_len <= buf_len);
+
+	size_t len = put_joined_group(buf, 0, uid, gid, uids_len, uids_raw_len);
+	/* Already in network byte order. */
+	memcpy(buf + sizeof(struct msg_joined_group), uids_raw, uids_raw_len);
+	return len;
+}
+
+int deser_send_to_group(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	const char **msg,
+	size_t *msg_len
+) {
+	if (!prot_len_valid(MSGT_SEND_TO_GROUP, buf_len)) return -1;
+
+	*gid = send_to_group_gid(buf);
+	*msg = send_to_group_tail(buf);
+	*msg_len = buf_len - sizeof(struct msg_send_to_group);
+	return 0;
+}
+
+size_t ser_send_to_group(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint64_t gid,
+	size_t msg_len,
+	const char *msg
+) {
+	assert(msg_len <= MAX_GROUP_MSG_LEN);
+	assert(sizeof(struct msg_send_to_group) + msg_len <= buf_len);
+
+	size_t len = put_send_to_group(buf, seqid, gid, msg_len);
+	memcpy(buf + sizeof(struct msg_send_to_group), msg, msg_len);
+	return len;
+}
+
+int deser_send_to_group_response(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint64_t *msgid
+) {
+	if (!prot_len_valid(MSGT_SEND_TO_GROUP_RESPONSE, buf_len)) return -1;
+
+	*gid = send_to_group_response_gid(buf);
+	*msgid = send_to_group_response_msgid(buf);
+	return 0;
+}
+
+size_t ser_send_to_group_response(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint64_t gid,
+	uint64_t msgid
+) {
+	assert(sizeof(struct msg_send_to_group_response) <= buf_len);
+	return put_send_to_group_response(buf, seqid, gid, msgid, 0);
+}
+
+int deser_receive_from_group(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint64_t *msgid,
+	uint64_t *uid,
+	const char **msg,
+	size_t *msg_len
+) {
+	if (!prot_len_valid(MSGT_RECEIVE_FROM_GROUP, buf_len)) return -1;
+
+	*gid = receive_from_group_gid(buf);
+	*msgid = receive_from_group_msgid(buf);
+	*uid = receive_from_group_uid(buf);
+	*msg = receive_from_group_tail(buf);
+	*msg_len = buf_len - sizeof(struct msg_receive_from_group);
+	return 0;
+}
+
+size_t ser_receive_from_group(
+	size_t buf_len,
+	char *buf,
+	uint64_t gid,
+	uint64_t msgid,
+	uint64_t uid,
+	size_t msg_len,
+	const char *msg
+) {
+	assert(msg_len <= MAX_GROUP_MSG_LEN);
+	assert(sizeof(struct msg_receive_from_group) + msg_len <= buf_len);
 
+	size_t len = put_receive_from_group(buf, 0, gid, msgid, uid, msg_len);
+	memcpy(buf + sizeof(struct msg_receive_from_group), msg, msg_len);
 	return len;
 }
+
+int deser_send_to_group_start(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint32_t *msg_len
+) {
+	if (!prot_len_valid(MSGT_SEND_TO_GROUP_START, buf_len)) return -1;
+
+	*gid = send_to_group_start_gid(buf);
+	*msg_len = send_to_group_start_msg_len(buf);
+	return 0;
+}
+
+size_t ser_send_to_group_start(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint64_t gid,
+	uint32_t msg_len
+) {
+	assert(sizeof(struct msg_send_to_group_start) <= buf_len);
+	return put_send_to_group_start(buf, seqid, gid, msg_len, 0);
+}
+
+int deser_send_to_group_chunk(
+	size_t buf_len,
+	const char *buf,
+	const char **data,
+	size_t *data_len
+) {
+	if (!prot_len_valid(MSGT_SEND_TO_GROUP_CHUNK, buf_len)) return -1;
+
+	*data = send_to_group_chunk_tail(buf);
+	*data_len = buf_len - sizeof(struct msg_send_to_group_chunk);
+	return 0;
+}
+
+size_t ser_send_to_group_chunk(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	size_t data_len,
+	const char *data
+) {
+	assert(data_len <= MAX_CHUNK_LEN);
+	assert(sizeof(struct msg_send_to_group_chunk) + data_len <= buf_len);
+
+	size_t len = put_send_to_group_chunk(buf, seqid, data_len);
+	memcpy(buf + sizeof(struct msg_send_to_group_chunk), data, data_len);
+	return len;
+}
+
+int deser_send_to_group_end(size_t buf_len, const char *buf) {
+	(void)buf;
+	if (!prot_len_valid(MSGT_SEND_TO_GROUP_END, buf_len)) return -1;
+	return 0;
+}
+
+size_t ser_send_to_group_end(size_t buf_len, char *buf, uint64_t seqid) {
+	assert(sizeof(struct msg_send_to_group_end) <= buf_len);
+	return put_send_to_group_end(buf, seqid, 0);
+}
+
+int deser_receive_from_group_large(
+	const char *buf,
+	uint32_t *frame_len,
+	uint64_t *gid,
+	uint64_t *msgid,
+	uint64_t *uid
+) {
+	uint16_t net_len;
+	memcpy(&net_len, buf, sizeof(net_len));
+	if (net_len != 0) return -1;
+
+	*frame_len = receive_from_group_large_frame_len(buf);
+	if (!prot_len_valid(MSGT_RECEIVE_FROM_GROUP_LARGE, *frame_len)) return -1;
+
+	*gid = receive_from_group_large_gid(buf);
+	*msgid = receive_from_group_large_msgid(buf);
+	*uid = receive_from_group_large_uid(buf);
+	return 0;
+}
+
+size_t ser_receive_from_group_large(
+	size_t buf_len,
+	char *buf,
+	uint64_t gid,
+	uint64_t msgid,
+	uint64_t uid,
+	size_t msg_len
+) {
+	assert(msg_len <= MAX_LARGE_MSG_LEN);
+	assert(sizeof(struct msg_receive_from_group_large) <= buf_len);
+
+	/* The length goes in frame_len, len is 0 to mark the extended header. */
+	size_t frame_len = sizeof(struct msg_receive_from_group_large) + msg_len;
+	put_receive_from_group_large(buf, 0, frame_len, gid, msgid, uid, 0);
+	memset(buf, 0, sizeof(uint16_t));
+
+	return sizeof(struct msg_receive_from_group_large);
+}
+
+int deser_set_options(size_t buf_len, const char *buf, uint8_t *options) {
+	if (!prot_len_valid(MSGT_SET_OPTIONS, buf_len)) return -1;
+	*options = set_options_options(buf);
+	return 0;
+}
+
+size_t ser_set_options(size_t buf_len, char *buf, uint64_t seqid, uint8_t options) {
+	assert(sizeof(struct msg_set_options) <= buf_len);
+	return put_set_options(buf, seqid, options, 0);
+}
+
+int deser_set_options_response(size_t buf_len, const char *buf, uint8_t *options) {
+	if (!prot_len_valid(MSGT_SET_OPTIONS_RESPONSE, buf_len)) return -1;
+	*options = set_options_response_options(buf);
+	return 0;
+}
+
+size_t ser_set_options_response(size_t buf_len, char *buf, uint64_t seqid, uint8_t options) {
+	assert(sizeof(struct msg_set_options_response) <= buf_len);
+	return put_set_options_response(buf, seqid, options, 0);
+}
+
+int deser_batch(size_t buf_len, const char *buf, const char **frames, size_t *frames_len) {
+	if (!prot_len_valid(MSGT_BATCH, buf_len)) return -1;
+
+	*frames = batch_tail(buf);
+	*frames_len = buf_len - sizeof(struct msg_batch);
+	return 0;
+}
+
+size_t ser_batch(size_t buf_len, char *buf, size_t frames_len) {
+	assert(sizeof(struct msg_batch) + frames_len <= buf_len);
+	assert(sizeof(struct msg_batch) + frames_len <= PROT_MAX_LEN);
+	return put_batch(buf, 0, frames_len);
+}
+
+int deser_add_to_group(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint8_t *uids_len,
+	const char **uids_raw
+) {
+	if (!prot_len_valid(MSGT_ADD_TO_GROUP, buf_len)) return -1;
+
+	*uids_len = add_to_group_uids_len(buf);
+	if (*uids_len * sizeof(uint64_t) != buf_len - sizeof(struct msg_add_to_group)) return -1;
+
+	*gid = add_to_group_gid(buf);
+	*uids_raw = add_to_group_tail(buf);
+	return 0;
+}
+
+size_t ser_add_to_group(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint64_t gid,
+	const uint64_t *uids,
+	uint8_t uids_len
+) {
+	assert(uids_len <= MAX_UIDS_PER_MSG);
+
+	size_t uids_raw_len = uids_len * sizeof(uint64_t);
+	assert(sizeof(struct msg_add_to_group) + uids_raw_len <= buf_len);
+
+	size_t len = put_add_to_group(buf, seqid, gid, uids_len, uids_raw_len);
+	htonll_bulk(uids_len, buf + sizeof(struct msg_add_to_group), uids);
+	return len;
+}
+
+int deser_add_to_group_response(size_t buf_len, const char *buf, uint64_t *gid) {
+	if (!prot_len_valid(MSGT_ADD_TO_GROUP_RESPONSE, buf_len)) return -1;
+	*gid = add_to_group_response_gid(buf);
+	return 0;
+}
+
+size_t ser_add_to_group_response(size_t buf_len, char *buf, uint64_t seqid, uint64_t gid) {
+	assert(sizeof(struct msg_add_to_group_response) <= buf_len);
+	return put_add_to_group_response(buf, seqid, gid, 0);
+}
+
+int deser_get_usernames(size_t buf_len, const char *buf, uint64_t *gid) {
+	if (!prot_len_valid(MSGT_GET_USERNAMES, buf_len)) return -1;
+	*gid = get_usernames_gid(buf);
+	return 0;
+}
+
+size_t ser_get_usernames(size_t buf_len, char *buf, uint64_t seqid, uint64_t gid) {
+	assert(sizeof(struct msg_get_usernames) <= buf_len);
+	return put_get_usernames(buf, seqid, gid, 0);
+}
+
+int deser_get_usernames_response(
+	size_t buf_len,
+	const char *buf,
+	uint8_t *more,
+	uint16_t *count,
+	const char **records
+) {
+	if (!prot_len_valid(MSGT_GET_USERNAMES_RESPONSE, buf_len)) return -1;
+
+	*more = get_usernames_response_more(buf);
+	*count = get_usernames_response_count(buf);
+	*records = get_usernames_response_tail(buf);
+
+	const char *end = buf + buf_len;
+	const char *rec = *records;
+	for (uint16_t i = 0; i < *count; i++) {
+		if (rec == end) return -1;
+		uint8_t usrlen = (uint8_t)*rec;
+		if (usrlen < MIN_UNAME_LEN || usrlen > MAX_UNAME_LEN) return -1;
+		if (usrlen >= end - rec) return -1;
+		rec += 1 + usrlen;
+	}
+	return rec == end ? 0 : -1;
+}
+
+size_t ser_get_usernames_response(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint8_t more,
+	uint16_t count,
+	size_t records_len
+) {
+	assert(sizeof(struct msg_get_usernames_response) + records_len <= buf_len);
+	return put_get_usernames_response(buf, seqid, more, count, records_len);
+}
+
+int deser_set_presence(size_t buf_len, const char *buf, uint8_t *presence) {
+	if (!prot_len_valid(MSGT_SET_PRESENCE, buf_len)) return -1;
+	*presence = set_presence_presence(buf);
+	return 0;
+}
+
+size_t ser_set_presence(size_t buf_len, char *buf, uint64_t seqid, uint8_t presence) {
+	assert(sizeof(struct msg_set_presence) <= buf_len);
+	return put_set_presence(buf, seqid, presence, 0);
+}
+
+int deser_set_typing(size_t buf_len, const char *buf, uint64_t *gid, uint8_t *typing) {
+	if (!prot_len_valid(MSGT_SET_TYPING, buf_len)) return -1;
+	*gid = set_typing_gid(buf);
+	*typing = set_typing_typing(buf);
+	return 0;
+}
+
+size_t ser_set_typing(size_t buf_len, char *buf, uint64_t seqid, uint64_t gid, uint8_t typing) {
+	assert(sizeof(struct msg_set_typing) <= buf_len);
+	return put_set_typing(buf, seqid, gid, typing, 0);
+}
+
+int deser_group_status(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint16_t *count,
+	const char **records
+) {
+	if (!prot_len_valid(MSGT_GROUP_STATUS, buf_len)) return -1;
+
+	*gid = group_status_gid(buf);
+	*count = group_status_count(buf);
+	*records = group_status_tail(buf);
+
+	size_t records_len = buf_len - sizeof(struct msg_group_status);
+	return records_len == (size_t)*count * PROT_STATUS_REC_LEN ? 0 : -1;
+}
+
+size_t ser_group_status(size_t buf_len, char *buf, uint64_t gid, uint16_t count) {
+	size_t records_len = (size_t)count * PROT_STATUS_REC_LEN;
+	assert(sizeof(struct msg_group_status) + records_len <= buf_len);
+	return put_group_status(buf, 0, gid, count, records_len);
+}
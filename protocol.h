@@ -1,11 +1,46 @@
 #ifndef PROT_H
 #define PROT_H
 
-#include <liburing.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "utils.h"
 
 /* Length of header which consists of len (2) + message type (1) + seqid (8) */
 #define PROT_HDR_LEN 11
 
+/* Upper bound for the len of every message. */
+#define PROT_MAX_LEN 2048
+
+/* RECEIVE_FROM_GROUP adds gid (8) + msgid (8) + uid (8) to the header. */
+#define MAX_GROUP_MSG_LEN (PROT_MAX_LEN - PROT_HDR_LEN - 24)
+
+/**
+ * Upper bound for messages sent in chunks with SEND_TO_GROUP_START. Every chunk
+ * is kept in its own 2KiB buffer and sent with a single sendmsg, so the number of
+ * chunks must stay well below IOV_MAX (1024).
+ */
+#define MAX_LARGE_MSG_LEN (1 << 20)
+
+/* Data bytes carried by a single SEND_TO_GROUP_CHUNK. */
+#define MAX_CHUNK_LEN (PROT_MAX_LEN - PROT_HDR_LEN)
+
+/* RECEIVE_FROM_GROUP_LARGE adds frame_len (4) to the fields of RECEIVE_FROM_GROUP. */
+#define PROT_LARGE_HDR_LEN (PROT_HDR_LEN + 4 + 24)
+
+/* Bits of the options in SET_OPTIONS. */
+#define OPT_BATCH 0x1
+#define OPT_ALL (OPT_BATCH)
+
+/* Presence of a client in SET_PRESENCE and GROUP_STATUS. */
+#define PRESENCE_ONLINE 0
+#define PRESENCE_AWAY 1
+#define PRESENCE_BUSY 2
+#define PRESENCE_OFFLINE 3
+
 /* Maximum number of user IDs that server sends/receives. */
 #define MAX_UIDS_PER_MSG 200
 
@@ -13,31 +48,200 @@
 #define MIN_UNAME_LEN 3
 #define MAX_UNAME_LEN 15
 
+/**
+ * Message table.
+ *
+ * X(NAME, name, tail_min, tail_max) describes one message type in the order of
+ * their msgt values. PROT_FIELDS_<NAME>(F, name) lists the fixed fields which
+ * follow the header as F(name, type, field). A message may end with a tail of
+ * tail_min to tail_max bytes e.g. the text of SEND_TO_GROUP, so its valid lengths
+ * are sizeof(struct msg_<name>) plus that range.
+ *
+ * The table generates MessageType, a packed struct msg_<name> per message, zero
+ * copy accessors <name>_<field>(buf) and <name>_tail(buf), put_<name> which writes
+ * the header and fixed fields, and the length bounds checked by prot_len_valid.
+ * Adding a message only takes an entry here and its fields.
+ */
+#define PROT_FIELDS_SERVER_ERROR(F, m) F(m, u8, code)
+#define PROT_FIELDS_SET_USERNAME(F, m)
+#define PROT_FIELDS_SET_USERNAME_RESPONSE(F, m) F(m, u64, uid)
+#define PROT_FIELDS_CREATE_GROUP(F, m) F(m, u8, uids_len)
+#define PROT_FIELDS_CREATE_GROUP_RESONSE(F, m) F(m, u64, gid)
+#define PROT_FIELDS_JOINED_GROUP(F, m) F(m, u64, uid) F(m, u64, gid) F(m, u8, uids_len)
+#define PROT_FIELDS_SEND_TO_GROUP(F, m) F(m, u64, gid)
+#define PROT_FIELDS_SEND_TO_GROUP_RESPONSE(F, m) F(m, u64, gid) F(m, u64, msgid)
+#define PROT_FIELDS_RECEIVE_FROM_GROUP(F, m) F(m, u64, gid) F(m, u64, msgid) F(m, u64, uid)
+#define PROT_FIELDS_SEND_TO_GROUP_START(F, m) F(m, u64, gid) F(m, u32, msg_len)
+#define PROT_FIELDS_SEND_TO_GROUP_CHUNK(F, m)
+#define PROT_FIELDS_SEND_TO_GROUP_END(F, m)
+#define PROT_FIELDS_RECEIVE_FROM_GROUP_LARGE(F, m) \
+	F(m, u32, frame_len) F(m, u64, gid) F(m, u64, msgid) F(m, u64, uid)
+#define PROT_FIELDS_SET_OPTIONS(F, m) F(m, u8, options)
+#define PROT_FIELDS_SET_OPTIONS_RESPONSE(F, m) F(m, u8, options)
+#define PROT_FIELDS_BATCH(F, m)
+#define PROT_FIELDS_ADD_TO_GROUP(F, m) F(m, u64, gid) F(m, u8, uids_len)
+#define PROT_FIELDS_ADD_TO_GROUP_RESPONSE(F, m) F(m, u64, gid)
+#define PROT_FIELDS_GET_USERNAMES(F, m) F(m, u64, gid)
+#define PROT_FIELDS_GET_USERNAMES_RESPONSE(F, m) F(m, u8, more) F(m, u16, count)
+#define PROT_FIELDS_SET_PRESENCE(F, m) F(m, u8, presence)
+#define PROT_FIELDS_SET_TYPING(F, m) F(m, u64, gid) F(m, u8, typing)
+#define PROT_FIELDS_GROUP_STATUS(F, m) F(m, u64, gid) F(m, u16, count)
+
+#define PROT_UIDS_MIN sizeof(uint64_t)
+#define PROT_UIDS_MAX (MAX_UIDS_PER_MSG * sizeof(uint64_t))
+#define PROT_USERNAMES_MAX (PROT_MAX_LEN - PROT_HDR_LEN - 3)
+
+/* GROUP_STATUS records are <uid:8> <presence:1> <typing:1>. */
+#define PROT_STATUS_REC_LEN 10
+#define PROT_STATUS_MAX (PROT_MAX_LEN - PROT_HDR_LEN - 10)
+
+#define PROT_MESSAGES(X) \
+	X(SERVER_ERROR,               server_error,               0, 0) \
+	X(SET_USERNAME,               set_username,               MIN_UNAME_LEN, MAX_UNAME_LEN) \
+	X(SET_USERNAME_RESPONSE,      set_username_response,      0, 0) \
+	X(CREATE_GROUP,               create_group,               PROT_UIDS_MIN, PROT_UIDS_MAX) \
+	X(CREATE_GROUP_RESONSE,       create_group_response,      0, 0) \
+	X(JOINED_GROUP,               joined_group,               PROT_UIDS_MIN, PROT_UIDS_MAX) \
+	X(SEND_TO_GROUP,              send_to_group,              0, MAX_GROUP_MSG_LEN) \
+	X(SEND_TO_GROUP_RESPONSE,     send_to_group_response,     0, 0) \
+	X(RECEIVE_FROM_GROUP,         receive_from_group,         0, MAX_GROUP_MSG_LEN) \
+	X(SEND_TO_GROUP_START,        send_to_group_start,        0, 0) \
+	X(SEND_TO_GROUP_CHUNK,        send_to_group_chunk,        1, MAX_CHUNK_LEN) \
+	X(SEND_TO_GROUP_END,          send_to_group_end,          0, 0) \
+	X(RECEIVE_FROM_GROUP_LARGE,   receive_from_group_large,   1, MAX_LARGE_MSG_LEN) \
+	X(SET_OPTIONS,                set_options,                0, 0) \
+	X(SET_OPTIONS_RESPONSE,       set_options_response,       0, 0) \
+	X(BATCH,                      batch,                      1, PROT_MAX_LEN - PROT_HDR_LEN) \
+	X(ADD_TO_GROUP,               add_to_group,               PROT_UIDS_MIN, PROT_UIDS_MAX) \
+	X(ADD_TO_GROUP_RESPONSE,      add_to_group_response,      0, 0) \
+	X(GET_USERNAMES,              get_usernames,              0, 0) \
+	X(GET_USERNAMES_RESPONSE,     get_usernames_response,     0, PROT_USERNAMES_MAX) \
+	X(SET_PRESENCE,               set_presence,               0, 0) \
+	X(SET_TYPING,                 set_typing,                 0, 0) \
+	X(GROUP_STATUS,               group_status,               PROT_STATUS_REC_LEN, PROT_STATUS_MAX)
+
 typedef enum {
-	MSGT_SERVER_ERROR,
-	MSGT_SET_USERNAME,
-	MSGT_SET_USERNAME_RESPONSE,
-	MSGT_CREATE_GROUP,
-	MSGT_CREATE_GROUP_RESONSE,
+#define X(NAME, name, tail_min, tail_max) MSGT_##NAME,
+	PROT_MESSAGES(X)
+#undef X
+	MSGT_COUNT,
 } MessageType;
 
+/* Field types of the message table, in host byte order. */
+#define PROT_TYPE_u8 uint8_t
+#define PROT_TYPE_u16 uint16_t
+#define PROT_TYPE_u32 uint32_t
+#define PROT_TYPE_u64 uint64_t
+
+static inline uint8_t prot_hton_u8(uint8_t v) { return v; }
+static inline uint16_t prot_hton_u16(uint16_t v) { return htons(v); }
+static inline uint32_t prot_hton_u32(uint32_t v) { return htonl(v); }
+static inline uint64_t prot_hton_u64(uint64_t v) { return htonll(v); }
+
+#pragma pack(push, 1)
+typedef struct {
+	uint16_t len;
+	uint8_t msgt;
+	uint64_t seqid;
+} Header;
+
+#define PROT_STRUCT_FIELD(m, t, f) PROT_TYPE_##t f;
+#define X(NAME, name, tail_min, tail_max) \
+	struct msg_##name { \
+		Header hdr; \
+		PROT_FIELDS_##NAME(PROT_STRUCT_FIELD, name) \
+		uint8_t tail[]; \
+	};
+PROT_MESSAGES(X)
+#undef X
+#undef PROT_STRUCT_FIELD
+#pragma pack(pop)
+
+/**
+ * Accessors read a field straight out of a received message. buf doesn't need to
+ * be aligned and the length of the message must have been validated.
+ */
+#define PROT_GETTER(m, t, f) \
+	static inline PROT_TYPE_##t m##_##f(const char *buf) { \
+		PROT_TYPE_##t v; \
+		memcpy(&v, buf + offsetof(struct msg_##m, f), sizeof(v)); \
+		/* Byte swapping is its own inverse. */ \
+		return prot_hton_##t(v); \
+	}
+#define X(NAME, name, tail_min, tail_max) \
+	PROT_FIELDS_##NAME(PROT_GETTER, name) \
+	static inline const char *name##_tail(const char *buf) { \
+		return buf + sizeof(struct msg_##name); \
+	}
+PROT_MESSAGES(X)
+#undef X
+#undef PROT_GETTER
+
+static inline void prot_put_header(char *buf, size_t len, uint8_t msgt, uint64_t seqid) {
+	Header hdr = {
+		.len = htons((uint16_t)len),
+		.msgt = msgt,
+		.seqid = htonll(seqid),
+	};
+	memcpy(buf, &hdr, sizeof(hdr));
+}
+
+/**
+ * put_<name>(buf, seqid, fields..., tail_len) writes the header and the fixed
+ * fields and returns the length of the message. The caller writes tail_len bytes
+ * of tail right after the fixed fields.
+ */
+#define PROT_PARAM(m, t, f) , PROT_TYPE_##t f
+#define PROT_PUT(m, t, f) { \
+		PROT_TYPE_##t v = prot_hton_##t(f); \
+		memcpy(buf + offsetof(struct msg_##m, f), &v, sizeof(v)); \
+	}
+#define X(NAME, name, tail_min, tail_max) \
+	static inline size_t put_##name( \
+		char *buf, uint64_t seqid PROT_FIELDS_##NAME(PROT_PARAM, name), size_t tail_len \
+	) { \
+		size_t len = sizeof(struct msg_##name) + tail_len; \
+		prot_put_header(buf, len, MSGT_##NAME, seqid); \
+		PROT_FIELDS_##NAME(PROT_PUT, name) \
+		return len; \
+	}
+PROT_MESSAGES(X)
+#undef X
+#undef PROT_PUT
+#undef PROT_PARAM
+
+/* Name of each message in lower case, e.g. "send_to_group". */
+extern const char *const prot_msg_names[MSGT_COUNT];
+
+/* Shortest valid length of each message and the range of lengths above it. */
+extern const uint32_t prot_min_len[MSGT_COUNT];
+extern const uint32_t prot_len_span[MSGT_COUNT];
+
 /**
- * buf argument to ser_* functions MUST BE ALIGNED properly.
+ * msgt must be below MSGT_COUNT. Lengths below the minimum wrap around, so both
+ * bounds are checked with a single comparison.
+ */
+static inline bool prot_len_valid(uint8_t msgt, size_t len) {
+	return len - prot_min_len[msgt] <= prot_len_span[msgt];
+}
+
+/**
+ * The ser_* and deser_* functions below are built on the generated code.
  *
  * buf_len argument in ser_* functions determines the total capacity of the buf
  * that we can write into. In deser_* functions, however, it tells us the len which
  * was previously read from the header of the message.
  *
- * For deser_* functions, however, buf argument DOES NOT NEED TO BE ALIGNED. We use
- * separate memcpy to copy each field individually. The buf argument must include all
- * bytes from the beginning of the message which includes the header bytes because we
- * use offsetof to access first byte of each field.
+ * Neither needs buf to be aligned as every field is copied with memcpy. The buf
+ * argument of deser_* functions must include all bytes from the beginning of the
+ * message which includes the header bytes because we use offsetof to access first
+ * byte of each field.
  *
  * Also deser_* functions assume there are enough bytes in the buf to parse the message.
- * deser_* functions return -1 if an error happens or 0 in case of success. The errors
- * checked by deser_* functions are related to the protocol itself e.g. conflicting len
- * values within the message. It doesn't check the business logic such as username len
- * should be within the valid range.
+ * deser_* functions return -1 if an error happens or 0 in case of success. They
+ * check the length against the message table and the fields which depend on each
+ * other e.g. uids_len and the number of uids. Business logic, such as the
+ * characters allowed in usernames, is left to the caller.
  *
  * Header deserialization is a special case because caller of this function will
  * check we have received enough bytes to parse the header. For other messages the
@@ -64,15 +268,9 @@ size_t ser_set_username(
 	const char *uname
 );
 
-/**
- * int deser_set_username_response(const char *buf) {}
- *
- * This function has not been implemented here because its payload is equivalent to Header.
- * Thus we only need to parse the header, and look for the correct message type and that the
- * seqid matches what was sent in the SetUsernameRequest.
- */
+int deser_set_username_response(size_t buf_len, const char *buf, uint64_t *uid);
 
-size_t ser_set_username_response(size_t buf_len, char *buf, uint64_t seqid);
+size_t ser_set_username_response(size_t buf_len, char *buf, uint64_t seqid, uint64_t uid);
 
 int deser_create_group(
 	size_t buf_len,
@@ -91,4 +289,271 @@ size_t ser_create_group(
 	uint8_t uids_len
 );
 
+int deser_create_group_response(size_t buf_len, const char *buf, uint64_t *gid);
+
+size_t ser_create_group_response(size_t buf_len, char *buf, uint64_t seqid, uint64_t gid);
+
+/**
+ * uids_raw is not decoded. It points to uids_len uids in network byte order which
+ * the caller can decode with ntohll_bulk.
+ */
+int deser_joined_group(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *uid,
+	uint64_t *gid,
+	uint8_t *uids_len,
+	const char **uids_raw
+);
+
+/**
+ * uids_raw must hold uids_len uids in network byte order e.g. as returned by
+ * deser_create_group. They are copied as is without decoding.
+ */
+size_t ser_joined_group(
+	size_t buf_len,
+	char *buf,
+	uint64_t uid,
+	uint64_t gid,
+	uint8_t uids_len,
+	const char *uids_raw
+);
+
+/* msg points into buf. Returns -1 if msg is longer than MAX_GROUP_MSG_LEN. */
+int deser_send_to_group(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	const char **msg,
+	size_t *msg_len
+);
+
+size_t ser_send_to_group(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint64_t gid,
+	size_t msg_len,
+	const char *msg
+);
+
+int deser_send_to_group_response(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint64_t *msgid
+);
+
+size_t ser_send_to_group_response(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint64_t gid,
+	uint64_t msgid
+);
+
+/* msg points into buf. */
+int deser_receive_from_group(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint64_t *msgid,
+	uint64_t *uid,
+	const char **msg,
+	size_t *msg_len
+);
+
+size_t ser_receive_from_group(
+	size_t buf_len,
+	char *buf,
+	uint64_t gid,
+	uint64_t msgid,
+	uint64_t uid,
+	size_t msg_len,
+	const char *msg
+);
+
+int deser_send_to_group_start(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint32_t *msg_len
+);
+
+size_t ser_send_to_group_start(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint64_t gid,
+	uint32_t msg_len
+);
+
+/* data points into buf. Returns -1 if the chunk is empty. */
+int deser_send_to_group_chunk(
+	size_t buf_len,
+	const char *buf,
+	const char **data,
+	size_t *data_len
+);
+
+size_t ser_send_to_group_chunk(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	size_t data_len,
+	const char *data
+);
+
+int deser_send_to_group_end(size_t buf_len, const char *buf);
+
+size_t ser_send_to_group_end(size_t buf_len, char *buf, uint64_t seqid);
+
+/**
+ * Unlike other messages, buf must only hold the first PROT_LARGE_HDR_LEN bytes of
+ * the frame. frame_len is set to the length of the whole frame and the message
+ * follows the header. Returns -1 if len in the header isn't 0 or frame_len is out
+ * of range.
+ */
+int deser_receive_from_group_large(
+	const char *buf,
+	uint32_t *frame_len,
+	uint64_t *gid,
+	uint64_t *msgid,
+	uint64_t *uid
+);
+
+/**
+ * Only serializes the PROT_LARGE_HDR_LEN bytes of the header. The msg_len bytes
+ * of the message are sent right after it from separate buffers.
+ */
+size_t ser_receive_from_group_large(
+	size_t buf_len,
+	char *buf,
+	uint64_t gid,
+	uint64_t msgid,
+	uint64_t uid,
+	size_t msg_len
+);
+
+/* uids_raw is not decoded, see deser_joined_group. */
+int deser_add_to_group(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint8_t *uids_len,
+	const char **uids_raw
+);
+
+size_t ser_add_to_group(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint64_t gid,
+	const uint64_t *uids,
+	uint8_t uids_len
+);
+
+int deser_add_to_group_response(size_t buf_len, const char *buf, uint64_t *gid);
+
+size_t ser_add_to_group_response(size_t buf_len, char *buf, uint64_t seqid, uint64_t gid);
+
+int deser_get_usernames(size_t buf_len, const char *buf, uint64_t *gid);
+
+size_t ser_get_usernames(size_t buf_len, char *buf, uint64_t seqid, uint64_t gid);
+
+/**
+ * records points into buf. Returns -1 unless the tail holds exactly count
+ * <usrlen:1> <username> records with valid lengths.
+ */
+int deser_get_usernames_response(
+	size_t buf_len,
+	const char *buf,
+	uint8_t *more,
+	uint16_t *count,
+	const char **records
+);
+
+/**
+ * Writes the header and fields in front of records_len bytes of records which
+ * the caller has already written right after them.
+ */
+size_t ser_get_usernames_response(
+	size_t buf_len,
+	char *buf,
+	uint64_t seqid,
+	uint8_t more,
+	uint16_t count,
+	size_t records_len
+);
+
+int deser_set_presence(size_t buf_len, const char *buf, uint8_t *presence);
+
+size_t ser_set_presence(size_t buf_len, char *buf, uint64_t seqid, uint8_t presence);
+
+int deser_set_typing(size_t buf_len, const char *buf, uint64_t *gid, uint8_t *typing);
+
+size_t ser_set_typing(size_t buf_len, char *buf, uint64_t seqid, uint64_t gid, uint8_t typing);
+
+/**
+ * records points into buf and holds count records, which can be read with
+ * group_status_rec. Returns -1 unless the tail is exactly count records long.
+ */
+int deser_group_status(
+	size_t buf_len,
+	const char *buf,
+	uint64_t *gid,
+	uint16_t *count,
+	const char **records
+);
+
+/**
+ * Writes the header and fields in front of count records which the caller has
+ * already written right after them with put_group_status_rec.
+ */
+size_t ser_group_status(size_t buf_len, char *buf, uint64_t gid, uint16_t count);
+
+/* Writes the record of uid at rec, which must have room for PROT_STATUS_REC_LEN bytes. */
+static inline void put_group_status_rec(char *rec, uint64_t uid, uint8_t presence, uint8_t typing) {
+	uint64_t be = htonll(uid);
+	memcpy(rec, &be, sizeof(be));
+	rec[8] = presence;
+	rec[9] = typing;
+}
+
+/* Reads the i-th record of the records of a GROUP_STATUS. */
+static inline void group_status_rec(
+	const char *records,
+	uint16_t i,
+	uint64_t *uid,
+	uint8_t *presence,
+	uint8_t *typing
+) {
+	const char *rec = records + (size_t)i * PROT_STATUS_REC_LEN;
+	uint64_t be;
+	memcpy(&be, rec, sizeof(be));
+	*uid = ntohll(be);
+	*presence = rec[8];
+	*typing = rec[9];
+}
+
+int deser_set_options(size_t buf_len, const char *buf, uint8_t *options);
+
+size_t ser_set_options(size_t buf_len, char *buf, uint64_t seqid, uint8_t options);
+
+int deser_set_options_response(size_t buf_len, const char *buf, uint8_t *options);
+
+size_t ser_set_options_response(size_t buf_len, char *buf, uint64_t seqid, uint8_t options);
+
+/**
+ * frames points into buf. Each frame is a complete message which can be parsed
+ * with deser_header. Returns -1 if the envelope is empty.
+ */
+int deser_batch(size_t buf_len, const char *buf, const char **frames, size_t *frames_len);
+
+/**
+ * Only serializes the header. frames_len bytes of frames must already follow it
+ * in buf.
+ */
+size_t ser_batch(size_t buf_len, char *buf, size_t frames_len);
+
 #endif
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ratelimit.h"
+
+void rate_limits_init(RateLimits *rl) {
+	memset(rl, 0, sizeof(RateLimits));
+}
+
+void rate_limit_set(struct rate_limit *lim, uint32_t per_sec, uint32_t burst) {
+	if (per_sec == 0) {
+		lim->interval_ns = 0;
+		lim->burst_ns = 0;
+		return;
+	}
+
+	if (burst == 0) burst = 1;
+	lim->interval_ns = 1000000000ull / per_sec;
+	if (lim->interval_ns == 0) lim->interval_ns = 1;
+	lim->burst_ns = lim->interval_ns * burst;
+}
+
+void rate_limits_set(RateLimits *rl, uint8_t msgt, uint32_t per_sec, uint32_t burst) {
+	rate_limit_set(&rl->types[msgt], per_sec, burst);
+}
+
+static int find_msgt(const char *name, size_t len) {
+	for (int msgt = 0; msgt < MSGT_COUNT; msgt++) {
+		if (strlen(prot_msg_names[msgt]) == len && memcmp(prot_msg_names[msgt], name, len) == 0) {
+			return msgt;
+		}
+	}
+	return -1;
+}
+
+/* Parses <per_sec>/<burst> and sets end to the first char after it. */
+static int parse_rate(const char *str, uint32_t *per_sec, uint32_t *burst, const char **end) {
+	char *p;
+	unsigned long rate = strtoul(str, &p, 10);
+	if (p == str || *p != '/') return -1;
+
+	const char *burst_str = p + 1;
+	unsigned long b = strtoul(burst_str, &p, 10);
+	if (p == burst_str) return -1;
+	if (rate > UINT32_MAX || b > UINT32_MAX) return -1;
+
+	*per_sec = rate;
+	*burst = b;
+	*end = p;
+	return 0;
+}
+
+int rate_limit_parse(struct rate_limit *lim, const char *spec) {
+	uint32_t per_sec, burst;
+	const char *end;
+	if (parse_rate(spec, &per_sec, &burst, &end) < 0 || *end != '\0') return -1;
+
+	rate_limit_set(lim, per_sec, burst);
+	return 0;
+}
+
+int rate_limits_parse(RateLimits *rl, const char *spec) {
+	const char *p = spec;
+	while (*p != '\0') {
+		const char *eq = strchr(p, '=');
+		if (eq == NULL) return -1;
+
+		int msgt = find_msgt(p, eq - p);
+		if (msgt < 0) return -1;
+
+		uint32_t per_sec, burst;
+		const char *end;
+		if (parse_rate(eq + 1, &per_sec, &burst, &end) < 0) return -1;
+		if (*end != ',' && *end != '\0') return -1;
+
+		rate_limits_set(rl, msgt, per_sec, burst);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
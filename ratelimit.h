@@ -0,0 +1,92 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/**
+ * Per-client token buckets, one per message type.
+ *
+ * A bucket of `burst` tokens that refills at `rate` tokens per second is kept as
+ * the single time at which it will be full again, so refilling is lazy and costs
+ * nothing until the next frame of that type. Taking a token pushes that time one
+ * interval (1s / rate) further, and is only allowed if the bucket is then no more
+ * than `burst` intervals away from full. Buckets start full.
+ *
+ * The caller passes the current time, which the server reads once per batch of
+ * completions rather than once per frame.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/* interval_ns of 0 means the message type isn't limited. */
+struct rate_limit {
+	uint64_t interval_ns;
+	uint64_t burst_ns;
+};
+
+typedef struct {
+	struct rate_limit types[MSGT_COUNT];
+	/**
+	 * Whether frames over the limit wait for a token, which stops reading from the
+	 * client meanwhile, instead of failing with CODE_RATE_LIMITED.
+	 */
+	bool defer;
+} RateLimits;
+
+/* Zeroed buckets are full. Lives in ClientInfo. */
+typedef struct {
+	uint64_t full_at_ns[MSGT_COUNT];
+} TokenBuckets;
+
+/* Starts with every message type unlimited. */
+void rate_limits_init(RateLimits *rl);
+
+/* per_sec of 0 removes the limit. burst is at least 1. */
+void rate_limit_set(struct rate_limit *lim, uint32_t per_sec, uint32_t burst);
+
+/* rate_limit_set for msgt. */
+void rate_limits_set(RateLimits *rl, uint8_t msgt, uint32_t per_sec, uint32_t burst);
+
+/**
+ * Parses comma separated `<name>=<per_sec>/<burst>` limits, with names as in
+ * prot_msg_names e.g. "send_to_group=1000/100,create_group=10/5". Returns -1 if
+ * spec is malformed, in which case the limits parsed so far are kept.
+ */
+int rate_limits_parse(RateLimits *rl, const char *spec);
+
+/* Parses a single `<per_sec>/<burst>` limit. Returns -1 if spec is malformed. */
+int rate_limit_parse(struct rate_limit *lim, const char *spec);
+
+/**
+ * Takes a token from the bucket of lim whose full time is *full_at_ns. Returns 0
+ * if there was one, otherwise the time until there will be one.
+ */
+static inline uint64_t rate_take_one(
+	const struct rate_limit *lim,
+	uint64_t *full_at_ns,
+	uint64_t now_ns
+) {
+	if (lim->interval_ns == 0) return 0;
+
+	uint64_t full_at = *full_at_ns;
+	if (full_at < now_ns) full_at = now_ns;
+
+	uint64_t next = full_at + lim->interval_ns;
+	if (next - now_ns > lim->burst_ns) return next - now_ns - lim->burst_ns;
+
+	*full_at_ns = next;
+	return 0;
+}
+
+/* rate_take_one with the bucket of msgt, which must be below MSGT_COUNT. */
+static inline uint64_t rate_take(
+	const RateLimits *rl,
+	TokenBuckets *tb,
+	uint8_t msgt,
+	uint64_t now_ns
+) {
+	return rate_take_one(&rl->types[msgt], &tb->full_at_ns[msgt], now_ns);
+}
+
+#endif
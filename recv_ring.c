@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "recv_ring.h"
+#include "utils.h"
+
+#define FREE_RINGS_INIT_CAP 64
+
+bool recv_ring_init(RecvRing *r, size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (size < page) size = page;
+
+	int fd = memfd_create("recv_ring", MFD_CLOEXEC);
+	if (fd < 0) return false;
+
+	int err;
+	char *base = MAP_FAILED;
+	if (ftruncate(fd, size) < 0) goto fail;
+
+	/* Reserve both halves first so that nothing else can land in between. */
+	base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) goto fail;
+
+	for (int i = 0; i < 2; i++) {
+		void *half = mmap(
+			base + i * size, size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			fd, 0
+		);
+		if (half == MAP_FAILED) goto fail;
+	}
+
+	/* The mappings keep the memfd alive. */
+	close(fd);
+
+	r->base = base;
+	r->size = size;
+	r->head = 0;
+	r->tail = 0;
+	r->captured = 0;
+	r->shared = false;
+	return true;
+
+fail:
+	err = errno;
+	if (base != MAP_FAILED) munmap(base, 2 * size);
+	close(fd);
+	errno = err;
+	return false;
+}
+
+void recv_ring_deinit(RecvRing *r) {
+	munmap(r->base, 2 * r->size);
+	r->base = NULL;
+}
+
+void recv_ring_pool_init(RecvRingPool *pool, size_t ring_size) {
+	pool->ring_size = ring_size;
+	pool->free_len = 0;
+	pool->free_cap = FREE_RINGS_INIT_CAP;
+	pool->free = must_malloc(
+		FREE_RINGS_INIT_CAP * sizeof(RecvRing *),
+		"recv_ring_pool_init malloc free"
+	);
+}
+
+void recv_ring_pool_deinit(RecvRingPool *pool) {
+	for (size_t i = 0; i < pool->free_len; i++) {
+		recv_ring_deinit(pool->free[i]);
+		free(pool->free[i]);
+	}
+	free(pool->free);
+}
+
+RecvRing *recv_ring_pool_acquire(RecvRingPool *pool) {
+	if (pool->free_len > 0) {
+		pool->free_len--;
+		return pool->free[pool->free_len];
+	}
+
+	RecvRing *r = must_malloc(sizeof(RecvRing), "recv_ring_pool_acquire malloc");
+	if (!recv_ring_init(r, pool->ring_size)) {
+		int err = errno;
+		free(r);
+		errno = err;
+		return NULL;
+	}
+	return r;
+}
+
+size_t recv_ring_pool_reserve(RecvRingPool *pool, size_t n) {
+	if (n > pool->free_cap) {
+		pool->free_cap = n;
+		pool->free = must_realloc(
+			pool->free,
+			pool->free_cap * sizeof(RecvRing *),
+			"recv_ring_pool_reserve realloc free"
+		);
+	}
+
+	while (pool->free_len < n) {
+		RecvRing *r = must_malloc(sizeof(RecvRing), "recv_ring_pool_reserve malloc");
+		if (!recv_ring_init(r, pool->ring_size)) {
+			int err = errno;
+			free(r);
+			errno = err;
+			break;
+		}
+		/* Allocates the pages of the memfd, which both mappings share. */
+		prefault(r->base, r->size);
+		pool->free[pool->free_len] = r;
+		pool->free_len++;
+	}
+	return pool->free_len;
+}
+
+void recv_ring_pool_release(RecvRingPool *pool, RecvRing *r) {
+	if (pool->free_len == pool->free_cap) {
+		pool->free_cap *= 2;
+		pool->free = must_realloc(
+			pool->free,
+			pool->free_cap * sizeof(RecvRing *),
+			"recv_ring_pool_release realloc free"
+		);
+	}
+
+	r->head = 0;
+	r->tail = 0;
+	r->captured = 0;
+	pool->free[pool->free_len] = r;
+	pool->free_len++;
+}
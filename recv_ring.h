@@ -0,0 +1,93 @@
+#ifndef RECV_RING_H
+#define RECV_RING_H
+
+/**
+ * Per-connection receive buffer mapped twice into contiguous virtual memory.
+ *
+ * The same memfd pages back [base, base + size) and [base + size, base + 2 * size),
+ * so any size bytes starting anywhere in the first mapping are contiguous. A
+ * frame split across recvs is parsed in place once its tail arrives, and recv
+ * always writes into the free region directly, so nothing is ever memmoved.
+ *
+ * Each ring takes a memfd and two mappings, which count against vm.max_map_count.
+ * RecvRingPool recycles rings so that the syscalls are only paid when the number
+ * of concurrent connections grows.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Rounded up to the page size. Must be a power of 2. */
+#define RECV_RING_SIZE 8192
+/* Mappings each ring takes, see above. */
+#define RECV_RING_MAPS 2
+
+typedef struct {
+	char *base;
+	/* Power of 2 and a multiple of the page size. */
+	size_t size;
+	/* Bytes consumed and received so far. Only masked when used as offsets. */
+	uint64_t head;
+	uint64_t tail;
+	/* Bytes up to which the frames were captured, see capture.h. */
+	uint64_t captured;
+	/**
+	 * Set for the rings of the shm transport, which the peer fills directly and
+	 * which belong to its ShmConn rather than to a pool.
+	 */
+	bool shared;
+} RecvRing;
+
+typedef struct {
+	size_t ring_size;
+	size_t free_len;
+	size_t free_cap;
+	RecvRing **free;
+} RecvRingPool;
+
+/* Returns false and sets errno if the memfd or the mappings couldn't be created. */
+bool recv_ring_init(RecvRing *r, size_t size);
+void recv_ring_deinit(RecvRing *r);
+
+void recv_ring_pool_init(RecvRingPool *pool, size_t ring_size);
+void recv_ring_pool_deinit(RecvRingPool *pool);
+
+/* Returns an empty ring or NULL with errno set if a new one couldn't be mapped. */
+RecvRing *recv_ring_pool_acquire(RecvRingPool *pool);
+void recv_ring_pool_release(RecvRingPool *pool, RecvRing *r);
+
+/**
+ * Maps and faults in rings until at least n are free. Returns the number of free
+ * rings, fewer than n with errno set if mapping one failed e.g. past
+ * vm.max_map_count.
+ */
+size_t recv_ring_pool_reserve(RecvRingPool *pool, size_t n);
+
+/* Bytes received but not consumed yet, contiguous from recv_ring_read_ptr. */
+static inline size_t recv_ring_len(const RecvRing *r) {
+	return r->tail - r->head;
+}
+
+static inline char *recv_ring_read_ptr(const RecvRing *r) {
+	return r->base + (r->head & (r->size - 1));
+}
+
+/* Free bytes, contiguous from recv_ring_write_ptr. */
+static inline size_t recv_ring_free(const RecvRing *r) {
+	return r->size - recv_ring_len(r);
+}
+
+static inline char *recv_ring_write_ptr(const RecvRing *r) {
+	return r->base + (r->tail & (r->size - 1));
+}
+
+static inline void recv_ring_commit(RecvRing *r, size_t n) {
+	r->tail += n;
+}
+
+static inline void recv_ring_consume(RecvRing *r, size_t n) {
+	r->head += n;
+}
+
+#endif
@@ -0,0 +1,854 @@
+/**
+ * Replays a capture, see capture.h, against a server.
+ *
+ * Opens a connection for every client of the capture once its first frame is
+ * due and sends its frames in the order they were captured, either at their
+ * original pace, scaled by --speed, or as fast as the server takes them with
+ * --speed 0. A single thread drives every connection through one io_uring.
+ *
+ * The server hands out other uids and gids than the captured one did, so frames
+ * are rewritten before they are sent. uids are learned from SET_USERNAME_RESPONSE
+ * and gids from CREATE_GROUP_RESPONSE, paired with the gid the capture recorded
+ * for the CREATE_GROUP of that seqid. A frame which refers to an id whose response is still in
+ * flight holds back the frames after it until the id is known. Ids which never
+ * got one, e.g. because their frames were dropped from the capture, are sent as
+ * captured. seqids are renumbered per connection.
+ *
+ * Every frame but SEND_TO_GROUP_START, SEND_TO_GROUP_CHUNK, SET_PRESENCE and
+ * SET_TYPING gets a response, whose latency is recorded per message type.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "hist.h"
+#include "protocol.h"
+#include "uring_conn.h"
+#include "utils.h"
+
+#define QUEUE_SIZE 4096
+#define CQE_BATCH_SIZE 256
+#define RECV_BUF_SIZE (4 * PROT_MAX_LEN)
+/* Frames of a connection the kernel hasn't taken yet. Beyond, replay waits. */
+#define OUT_BUF_SIZE (4 * PROT_MAX_LEN)
+#define WAIT_TIMEOUT_NS 100000000ll
+#define DRAIN_TIMEOUT_NS 2000000000ull
+
+/* Open addressing map of ids, which are never 0. */
+typedef struct {
+	uint64_t *keys;
+	uint64_t *vals;
+	size_t cap;
+	size_t len;
+} IdMap;
+
+typedef struct {
+	/* 0 once the response arrived. */
+	uint64_t seqid;
+	uint64_t sent_at;
+	/* The seqid of the captured frame. */
+	uint64_t orig_seqid;
+	/* The captured gid of a CREATE_GROUP, 0 until its CAPTURE_GID record. */
+	uint64_t orig_gid;
+	uint8_t msgt;
+} Inflight;
+
+typedef struct {
+	int fd;
+	/* client_id of the captured client. */
+	uint64_t orig_id;
+	bool connected;
+	/* The captured client disconnected, the connection closes once it's idle. */
+	bool closing;
+	bool closed;
+
+	/* Assigned by the server. 0 until then, while uid_pending if it was asked for. */
+	uint64_t uid;
+	bool uid_pending;
+
+	uint64_t next_seqid;
+	/* Requests in the order they were sent, inflight[inflight_head..inflight_len). */
+	Inflight *inflight;
+	size_t inflight_head;
+	size_t inflight_len;
+	size_t inflight_cap;
+	/* Requests still waiting for their response. */
+	size_t pending;
+	/**
+	 * Captured seqid of a CREATE_GROUP answered before its CAPTURE_GID record to
+	 * the gid the server handed out, 0 once paired.
+	 */
+	IdMap created;
+
+	OutBuf out;
+
+	char in[RECV_BUF_SIZE];
+	size_t in_len;
+	/* Bytes of a RECEIVE_FROM_GROUP_LARGE still to be received and dropped. */
+	size_t skip;
+} Conn;
+
+typedef struct {
+	struct sockaddr_in addr;
+	double speed;
+	struct io_uring ring;
+
+	/* The records of the mapped capture, the next one at pos. */
+	const char *pos;
+	const char *end;
+	uint64_t first_ts_ns;
+	uint64_t last_ts_ns;
+	uint64_t start_ns;
+
+	/* Connections are never freed as their buffers may be in use by the kernel. */
+	Conn **conns;
+	size_t conns_len;
+	size_t conns_cap;
+	/* Captured client_id to the index of its connection. */
+	IdMap conn_ids;
+	/* Captured gid to the one the server handed out, 0 while it isn't known. */
+	IdMap gids;
+
+	/* Requests waiting for their response and bytes waiting to be sent. */
+	size_t pending;
+	size_t out_bytes;
+
+	Hist latency[MSGT_COUNT];
+	uint64_t frames;
+	uint64_t completed;
+	uint64_t received;
+	uint64_t server_errors;
+	uint64_t disconnects;
+	uint64_t skipped;
+} Replay;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t id_slot(const IdMap *m, uint64_t key) {
+	uint64_t h = key;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+
+	size_t i = h & (m->cap - 1);
+	while (m->keys[i] != 0 && m->keys[i] != key) i = (i + 1) & (m->cap - 1);
+	return i;
+}
+
+static uint64_t *id_map_get(IdMap *m, uint64_t key) {
+	if (m->len == 0 || key == 0) return NULL;
+	size_t i = id_slot(m, key);
+	return m->keys[i] == key ? &m->vals[i] : NULL;
+}
+
+static void id_map_put(IdMap *m, uint64_t key, uint64_t val) {
+	if (key == 0) return;
+	if (2 * (m->len + 1) > m->cap) {
+		IdMap old = *m;
+		m->cap = old.cap == 0 ? 64 : 2 * old.cap;
+		m->keys = must_calloc(m->cap, sizeof(uint64_t), "id_map_put calloc keys");
+		m->vals = must_malloc(m->cap * sizeof(uint64_t), "id_map_put malloc vals");
+		for (size_t i = 0; i < old.cap; i++) {
+			if (old.keys[i] == 0) continue;
+			size_t j = id_slot(m, old.keys[i]);
+			m->keys[j] = old.keys[i];
+			m->vals[j] = old.vals[i];
+		}
+		free(old.keys);
+		free(old.vals);
+	}
+
+	size_t i = id_slot(m, key);
+	if (m->keys[i] == 0) {
+		m->keys[i] = key;
+		m->len++;
+	}
+	m->vals[i] = val;
+}
+
+static void add_recv(Replay *r, size_t conn_idx) {
+	Conn *c = r->conns[conn_idx];
+	struct io_uring_sqe *sqe = conn_get_sqe(&r->ring);
+	io_uring_prep_recv(sqe, c->fd, c->in + c->in_len, RECV_BUF_SIZE - c->in_len, 0);
+	io_uring_sqe_set_data64(sqe, USER_DATA(conn_idx, EV_RECV));
+}
+
+/* Hands every queued frame to the kernel unless a send is already in flight. */
+static void flush(Replay *r, size_t conn_idx) {
+	Conn *c = r->conns[conn_idx];
+	if (c->connected && !c->closed) out_buf_flush(&r->ring, &c->out, c->fd, conn_idx);
+}
+
+/**
+ * Closes the connection of a client which disconnected in the capture once its
+ * frames are sent and answered. The recv then completes with 0.
+ */
+static void maybe_close(Replay *r, size_t conn_idx) {
+	Conn *c = r->conns[conn_idx];
+	if (!c->closing || !c->connected || c->closed || c->out.len > 0 || c->pending > 0) return;
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+static size_t open_conn(Replay *r, uint64_t orig_id) {
+	if (r->conns_len == r->conns_cap) {
+		r->conns_cap = r->conns_cap == 0 ? 64 : 2 * r->conns_cap;
+		r->conns = must_realloc(r->conns, r->conns_cap * sizeof(Conn *), "open_conn realloc conns");
+	}
+	size_t conn_idx = r->conns_len++;
+	Conn *c = must_calloc(1, sizeof(Conn), "open_conn calloc conn");
+	r->conns[conn_idx] = c;
+	c->orig_id = orig_id;
+	c->next_seqid = 1;
+	out_buf_init(&c->out, OUT_BUF_SIZE);
+	id_map_put(&r->conn_ids, orig_id, conn_idx);
+
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (c->fd < 0) fatal_error("socket()");
+	set_nonblocking(c->fd);
+
+	struct io_uring_sqe *sqe = conn_get_sqe(&r->ring);
+	io_uring_prep_connect(sqe, c->fd, (struct sockaddr *)&r->addr, sizeof(r->addr));
+	io_uring_sqe_set_data64(sqe, USER_DATA(conn_idx, EV_CONNECT));
+	return conn_idx;
+}
+
+/* Returns false if the uid is defined by a response still in flight. */
+static bool map_uid(Replay *r, uint64_t orig, uint64_t *uid) {
+	*uid = orig;
+	uint64_t *conn_idx = id_map_get(&r->conn_ids, orig);
+	if (conn_idx == NULL) return true;
+
+	Conn *c = r->conns[*conn_idx];
+	if (c->uid != 0) {
+		*uid = c->uid;
+	} else if (c->uid_pending) {
+		return false;
+	}
+	return true;
+}
+
+static bool map_gid(Replay *r, uint64_t orig, uint64_t *gid) {
+	*gid = orig;
+	uint64_t *mapped = id_map_get(&r->gids, orig);
+	if (mapped == NULL) return true;
+	if (*mapped == 0) return false;
+	*gid = *mapped;
+	return true;
+}
+
+static bool rewrite_gid(Replay *r, char *field) {
+	uint64_t net;
+	memcpy(&net, field, sizeof(net));
+	uint64_t gid;
+	if (!map_gid(r, ntohll(net), &gid)) return false;
+	net = htonll(gid);
+	memcpy(field, &net, sizeof(net));
+	return true;
+}
+
+static bool rewrite_uids(Replay *r, char *uids, size_t uids_len, size_t tail_len) {
+	if (uids_len > tail_len / sizeof(uint64_t)) uids_len = tail_len / sizeof(uint64_t);
+	for (size_t i = 0; i < uids_len; i++) {
+		uint64_t net;
+		memcpy(&net, uids + i * sizeof(net), sizeof(net));
+		uint64_t uid;
+		if (!map_uid(r, ntohll(net), &uid)) return false;
+		net = htonll(uid);
+		memcpy(uids + i * sizeof(net), &net, sizeof(net));
+	}
+	return true;
+}
+
+/**
+ * Rewrites the captured ids in frame to the ones of this run. Returns false, with
+ * frame partly rewritten, if one of them isn't known yet. Invalid frames are sent
+ * as captured.
+ */
+static bool rewrite_frame(Replay *r, char *frame, size_t len, uint8_t msgt) {
+	if (msgt >= MSGT_COUNT || !prot_len_valid(msgt, len)) return true;
+
+	switch (msgt) {
+		case MSGT_CREATE_GROUP:
+			return rewrite_uids(
+				r, frame + sizeof(struct msg_create_group), create_group_uids_len(frame),
+				len - sizeof(struct msg_create_group)
+			);
+		case MSGT_ADD_TO_GROUP:
+			return rewrite_gid(r, frame + offsetof(struct msg_add_to_group, gid))
+				&& rewrite_uids(
+					r, frame + sizeof(struct msg_add_to_group), add_to_group_uids_len(frame),
+					len - sizeof(struct msg_add_to_group)
+				);
+		case MSGT_SEND_TO_GROUP:
+			return rewrite_gid(r, frame + offsetof(struct msg_send_to_group, gid));
+		case MSGT_SEND_TO_GROUP_START:
+			return rewrite_gid(r, frame + offsetof(struct msg_send_to_group_start, gid));
+		case MSGT_GET_USERNAMES:
+			return rewrite_gid(r, frame + offsetof(struct msg_get_usernames, gid));
+		case MSGT_SET_TYPING:
+			return rewrite_gid(r, frame + offsetof(struct msg_set_typing, gid));
+		default:
+			return true;
+	}
+}
+
+static void push_inflight(Conn *c, uint64_t seqid, uint64_t orig_seqid, uint8_t msgt) {
+	if (c->inflight_len == c->inflight_cap) {
+		/* Drop the answered requests at the front before growing. */
+		if (c->inflight_head > 0) {
+			c->inflight_len -= c->inflight_head;
+			memmove(c->inflight, c->inflight + c->inflight_head, c->inflight_len * sizeof(Inflight));
+			c->inflight_head = 0;
+		} else {
+			c->inflight_cap = c->inflight_cap == 0 ? 16 : 2 * c->inflight_cap;
+			c->inflight = must_realloc(
+				c->inflight, c->inflight_cap * sizeof(Inflight), "push_inflight realloc"
+			);
+		}
+	}
+	c->inflight[c->inflight_len++] = (Inflight){
+		.seqid = seqid,
+		.sent_at = now_ns(),
+		.orig_seqid = orig_seqid,
+		.msgt = msgt,
+	};
+	c->pending++;
+}
+
+/**
+ * Queues a captured frame on the connection of its client. Returns false if it
+ * has to wait, for ids it refers to or for room in the buffer.
+ */
+static bool replay_frame(Replay *r, size_t conn_idx, const char *data, size_t len) {
+	Conn *c = r->conns[conn_idx];
+	if (c->closed) {
+		r->skipped++;
+		return true;
+	}
+	if (c->out.len + len > c->out.cap) return false;
+
+	/* Rewritten in place, the frame only counts once out.len covers it. */
+	char *frame = c->out.buf + c->out.len;
+	memcpy(frame, data, len);
+	uint16_t frame_len;
+	uint8_t msgt;
+	uint64_t orig_seqid;
+	deser_header(frame, &frame_len, &msgt, &orig_seqid);
+	if (!rewrite_frame(r, frame, len, msgt)) return false;
+
+	uint64_t seqid = c->next_seqid++;
+	prot_put_header(frame, len, msgt, seqid);
+	if (msgt != MSGT_SEND_TO_GROUP_START && msgt != MSGT_SEND_TO_GROUP_CHUNK
+		&& msgt != MSGT_SET_PRESENCE && msgt != MSGT_SET_TYPING) {
+		push_inflight(c, seqid, orig_seqid, msgt);
+		r->pending++;
+	}
+	if (msgt == MSGT_SET_USERNAME && c->uid == 0) c->uid_pending = true;
+
+	c->out.len += len;
+	r->out_bytes += len;
+	r->frames++;
+	flush(r, conn_idx);
+	return true;
+}
+
+/* Pairs the gid the capture recorded with the CREATE_GROUP it was handed out for. */
+static void replay_gid(Replay *r, size_t conn_idx, const char *data, size_t len) {
+	Conn *c = r->conns[conn_idx];
+	struct capture_gid rec;
+	if (len != sizeof(rec)) return;
+	memcpy(&rec, data, sizeof(rec));
+
+	for (size_t i = c->inflight_len; i > c->inflight_head; i--) {
+		Inflight *req = &c->inflight[i - 1];
+		if (req->seqid == 0 || req->msgt != MSGT_CREATE_GROUP) continue;
+		if (req->orig_seqid != rec.seqid) continue;
+		if (req->orig_gid != 0) return;
+		req->orig_gid = rec.gid;
+		id_map_put(&r->gids, rec.gid, 0);
+		return;
+	}
+
+	/* Frames are captured as they arrive, the response may have come first. */
+	uint64_t *gid = id_map_get(&c->created, rec.seqid);
+	if (gid != NULL && *gid != 0) {
+		id_map_put(&r->gids, rec.gid, *gid);
+		*gid = 0;
+	}
+}
+
+/* Returns when the record is due, 0 when replaying as fast as possible. */
+static uint64_t due_ns(Replay *r, const struct capture_rec *rec) {
+	if (r->speed == 0) return 0;
+	return r->start_ns + (uint64_t)((rec->ts_ns - r->first_ts_ns) / r->speed);
+}
+
+/**
+ * Replays the records which are due until one has to wait. Returns when the next
+ * one is due, or 0 if it waits for completions or none is left.
+ */
+static uint64_t advance(Replay *r, uint64_t now) {
+	while (r->pos < r->end) {
+		struct capture_rec rec;
+		ssize_t rec_len = capture_next(r->pos, r->end - r->pos, &rec);
+		if (rec_len < 0) {
+			fprintf(stderr, "capture is cut short, %zu bytes ignored\n", (size_t)(r->end - r->pos));
+			r->pos = r->end;
+			break;
+		}
+
+		uint64_t due = due_ns(r, &rec);
+		if (due > now) return due;
+
+		const char *data = r->pos + sizeof(rec);
+		uint64_t *conn_idx = id_map_get(&r->conn_ids, rec.client_id);
+		switch (rec.kind) {
+			case CAPTURE_FRAME: {
+				size_t idx = conn_idx != NULL ? *conn_idx : open_conn(r, rec.client_id);
+				if (!replay_frame(r, idx, data, rec.len)) return 0;
+				break;
+			}
+			case CAPTURE_GID:
+				if (conn_idx != NULL) replay_gid(r, *conn_idx, data, rec.len);
+				break;
+			case CAPTURE_CLOSE:
+				if (conn_idx != NULL) {
+					r->conns[*conn_idx]->closing = true;
+					maybe_close(r, *conn_idx);
+				}
+				break;
+		}
+		r->pos += rec_len;
+	}
+	return 0;
+}
+
+/**
+ * Takes the request seqid off the inflight ones of the connection and returns it,
+ * valid until the next request is sent, or NULL if it isn't one, e.g. a
+ * SEND_TO_GROUP_CHUNK which failed.
+ */
+static Inflight *complete_request(Replay *r, Conn *c, uint64_t seqid, bool ok) {
+	if (!ok) r->server_errors++;
+
+	for (size_t i = c->inflight_head; i < c->inflight_len; i++) {
+		Inflight *req = &c->inflight[i];
+		if (req->seqid != seqid) continue;
+
+		if (ok) {
+			hist_record(&r->latency[req->msgt], now_ns() - req->sent_at);
+			r->completed++;
+		}
+		if (req->msgt == MSGT_SET_USERNAME) c->uid_pending = false;
+
+		req->seqid = 0;
+		c->pending--;
+		r->pending--;
+		while (c->inflight_head < c->inflight_len && c->inflight[c->inflight_head].seqid == 0) {
+			c->inflight_head++;
+		}
+		if (c->inflight_head == c->inflight_len) {
+			c->inflight_head = 0;
+			c->inflight_len = 0;
+		}
+		return req;
+	}
+	return NULL;
+}
+
+/* Frames which referred to the gid of a failed CREATE_GROUP go out as captured. */
+static void fail_create_group(Replay *r, Inflight *req) {
+	if (req != NULL && req->msgt == MSGT_CREATE_GROUP && req->orig_gid != 0) {
+		id_map_put(&r->gids, req->orig_gid, req->orig_gid);
+	}
+}
+
+static void handle_frame(Replay *r, Conn *c, const char *frame, uint16_t len,
+						 uint8_t msgt, uint64_t seqid) {
+	switch (msgt) {
+		case MSGT_SERVER_ERROR: {
+			Inflight *req = complete_request(r, c, seqid, false);
+			fail_create_group(r, req);
+			break;
+		}
+		case MSGT_SET_USERNAME_RESPONSE: {
+			uint64_t uid;
+			if (deser_set_username_response(len, frame, &uid) < 0) goto malformed;
+			c->uid = uid;
+			complete_request(r, c, seqid, true);
+			break;
+		}
+		case MSGT_CREATE_GROUP_RESONSE: {
+			uint64_t gid;
+			if (deser_create_group_response(len, frame, &gid) < 0) goto malformed;
+			Inflight *req = complete_request(r, c, seqid, true);
+			if (req != NULL && req->orig_gid != 0) {
+				id_map_put(&r->gids, req->orig_gid, gid);
+			} else if (req != NULL) {
+				id_map_put(&c->created, req->orig_seqid, gid);
+			}
+			break;
+		}
+		case MSGT_GET_USERNAMES_RESPONSE: {
+			if (!prot_len_valid(msgt, len)) goto malformed;
+			if (!get_usernames_response_more(frame)) complete_request(r, c, seqid, true);
+			break;
+		}
+		case MSGT_SEND_TO_GROUP_RESPONSE:
+		case MSGT_ADD_TO_GROUP_RESPONSE:
+		case MSGT_SET_OPTIONS_RESPONSE: {
+			if (!prot_len_valid(msgt, len)) goto malformed;
+			complete_request(r, c, seqid, true);
+			break;
+		}
+		case MSGT_RECEIVE_FROM_GROUP:
+			r->received++;
+			break;
+		case MSGT_JOINED_GROUP:
+		case MSGT_GROUP_STATUS:
+			break;
+		case MSGT_BATCH: {
+			const char *frames;
+			size_t frames_len;
+			if (deser_batch(len, frame, &frames, &frames_len) < 0) goto malformed;
+
+			while (frames_len > 0) {
+				uint16_t inner_len;
+				uint8_t inner_msgt;
+				uint64_t inner_seqid;
+				if (frames_len < PROT_HDR_LEN) goto malformed;
+				deser_header(frames, &inner_len, &inner_msgt, &inner_seqid);
+				if (inner_len < PROT_HDR_LEN || inner_len > frames_len) goto malformed;
+				if (inner_msgt == MSGT_BATCH) goto malformed;
+
+				handle_frame(r, c, frames, inner_len, inner_msgt, inner_seqid);
+				frames += inner_len;
+				frames_len -= inner_len;
+			}
+			break;
+		}
+		default:
+			goto malformed;
+	}
+	return;
+
+malformed:
+	fprintf(stderr, "client %lx: malformed message type %u len %u\n", c->orig_id, msgt, len);
+	exit(EXIT_FAILURE);
+}
+
+/* The server dropped the connection, nothing that waits on it gets a response. */
+static void conn_lost(Replay *r, Conn *c) {
+	for (size_t i = c->inflight_head; i < c->inflight_len; i++) {
+		if (c->inflight[i].seqid != 0) fail_create_group(r, &c->inflight[i]);
+	}
+	r->pending -= c->pending;
+	c->pending = 0;
+	c->inflight_head = 0;
+	c->inflight_len = 0;
+	c->uid_pending = false;
+	r->out_bytes -= c->out.len;
+	c->out.len = 0;
+	r->disconnects++;
+}
+
+static void handle_recv(Replay *r, size_t conn_idx, int res) {
+	Conn *c = r->conns[conn_idx];
+	if (res <= 0) {
+		if (!c->closing || c->pending > 0 || c->out.len > 0) {
+			fprintf(stderr, "client %lx closed by server: %s\n",
+				c->orig_id, res == 0 ? "EOF" : strerror(-res));
+			conn_lost(r, c);
+		}
+		must_close(c->fd, "replay close");
+		c->closed = true;
+		return;
+	}
+
+	c->in_len += res;
+	const char *frame = c->in;
+	size_t avail = c->in_len;
+	while (avail > 0) {
+		if (c->skip > 0) {
+			size_t n = c->skip < avail ? c->skip : avail;
+			c->skip -= n;
+			frame += n;
+			avail -= n;
+			continue;
+		}
+		if (avail < PROT_HDR_LEN) break;
+
+		uint16_t len;
+		uint8_t msgt;
+		uint64_t seqid;
+		deser_header(frame, &len, &msgt, &seqid);
+
+		/* Large messages don't fit in the buffer, only their header is read. */
+		if (len == 0 && msgt == MSGT_RECEIVE_FROM_GROUP_LARGE) {
+			if (avail < PROT_LARGE_HDR_LEN) break;
+			uint32_t frame_len;
+			uint64_t gid, msgid, uid;
+			if (deser_receive_from_group_large(frame, &frame_len, &gid, &msgid, &uid) < 0) {
+				fprintf(stderr, "client %lx: invalid large frame\n", c->orig_id);
+				exit(EXIT_FAILURE);
+			}
+			r->received++;
+			c->skip = frame_len;
+			continue;
+		}
+
+		if (len < PROT_HDR_LEN || len > PROT_MAX_LEN) {
+			fprintf(stderr, "client %lx: invalid frame len %u\n", c->orig_id, len);
+			exit(EXIT_FAILURE);
+		}
+		if (avail < len) break;
+
+		handle_frame(r, c, frame, len, msgt, seqid);
+		frame += len;
+		avail -= len;
+	}
+
+	memmove(c->in, frame, avail);
+	c->in_len = avail;
+
+	add_recv(r, conn_idx);
+	maybe_close(r, conn_idx);
+}
+
+static void handle_send(Replay *r, size_t conn_idx, int res) {
+	Conn *c = r->conns[conn_idx];
+	c->out.sending = 0;
+	if (c->closed) return;
+	if (res < 0) {
+		fprintf(stderr, "client %lx: send: %s\n", c->orig_id, strerror(-res));
+		shutdown(c->fd, SHUT_RDWR);
+		return;
+	}
+
+	out_buf_sent(&c->out, res);
+	r->out_bytes -= res;
+	flush(r, conn_idx);
+	maybe_close(r, conn_idx);
+}
+
+static void handle_connect(Replay *r, size_t conn_idx, int res) {
+	if (res < 0) {
+		fprintf(stderr, "connect: %s\n", strerror(-res));
+		exit(EXIT_FAILURE);
+	}
+
+	Conn *c = r->conns[conn_idx];
+	c->connected = true;
+	add_recv(r, conn_idx);
+	flush(r, conn_idx);
+	maybe_close(r, conn_idx);
+}
+
+/* Maps the capture at path and checks its header. */
+static void open_capture(Replay *r, const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) fatal_error(path);
+	struct stat st;
+	if (fstat(fd, &st) < 0) fatal_error("fstat");
+
+	struct capture_hdr hdr;
+	if ((size_t)st.st_size < sizeof(hdr)) {
+		fprintf(stderr, "%s is not a capture\n", path);
+		exit(EXIT_FAILURE);
+	}
+	const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) fatal_error("mmap");
+	must_close(fd, "capture close");
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION) {
+		fprintf(stderr, "%s is not a capture of version %u\n", path, CAPTURE_VERSION);
+		exit(EXIT_FAILURE);
+	}
+	r->pos = data + sizeof(hdr);
+	r->end = data + st.st_size;
+
+	/* Timestamps are relative to the first and last records. */
+	struct capture_rec rec;
+	bool first = true;
+	for (const char *p = r->pos; p < r->end;) {
+		ssize_t rec_len = capture_next(p, r->end - p, &rec);
+		if (rec_len < 0) break;
+		if (first) r->first_ts_ns = rec.ts_ns;
+		first = false;
+		r->last_ts_ns = rec.ts_ns;
+		p += rec_len;
+	}
+}
+
+static void run(Replay *r) {
+	int ret = io_uring_queue_init(QUEUE_SIZE, &r->ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	r->start_ns = now_ns();
+	uint64_t drain_deadline = 0;
+	struct io_uring_cqe *cqes[CQE_BATCH_SIZE];
+	while (1) {
+		uint64_t now = now_ns();
+		uint64_t next_due = advance(r, now);
+		if (r->pos == r->end) {
+			if (drain_deadline == 0) drain_deadline = now + DRAIN_TIMEOUT_NS;
+			if ((r->pending == 0 && r->out_bytes == 0) || now >= drain_deadline) break;
+		}
+
+		if ((ret = io_uring_submit(&r->ring)) < 0) {
+			fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+
+		long long wait_ns = WAIT_TIMEOUT_NS;
+		if (next_due > 0 && (long long)(next_due - now) < wait_ns) wait_ns = next_due - now;
+		struct io_uring_cqe *cqe;
+		struct __kernel_timespec ts = { .tv_sec = 0, .tv_nsec = wait_ns };
+		ret = io_uring_wait_cqe_timeout(&r->ring, &cqe, &ts);
+		if (ret == -ETIME || ret == -EINTR) continue;
+		if (ret < 0) {
+			fprintf(stderr, "io_uring_wait_cqe_timeout: %s\n", strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+
+		unsigned count = io_uring_peek_batch_cqe(&r->ring, cqes, CQE_BATCH_SIZE);
+		for (unsigned i = 0; i < count; i++) {
+			uint64_t ud = io_uring_cqe_get_data64(cqes[i]);
+			int res = cqes[i]->res;
+			size_t conn_idx = USER_DATA_CONN(ud);
+
+			switch (USER_DATA_EV(ud)) {
+				case EV_CONNECT:
+					handle_connect(r, conn_idx, res);
+					break;
+				case EV_SEND:
+					handle_send(r, conn_idx, res);
+					break;
+				case EV_RECV:
+					handle_recv(r, conn_idx, res);
+					break;
+			}
+		}
+		io_uring_cq_advance(&r->ring, count);
+	}
+
+	io_uring_queue_exit(&r->ring);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"Usage: %s [options] <capture>\n"
+		"  -a, --addr IP          server address (default 127.0.0.1)\n"
+		"  -p, --port PORT        server port (default 8080)\n"
+		"  -s, --speed X          pace of the capture times X, 0 for as fast as possible (default 1)\n",
+		prog
+	);
+	exit(EXIT_FAILURE);
+}
+
+static void print_row(const char *name, const Hist *h) {
+	printf("%-22s %12lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		name, h->count,
+		hist_mean(h) / 1000.0,
+		hist_percentile(h, 50) / 1000.0,
+		hist_percentile(h, 99) / 1000.0,
+		hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0
+	);
+}
+
+/* fds for thousands of connections. */
+static void raise_nofile_limit(void) {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) fatal_error("getrlimit");
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0) fatal_error("setrlimit");
+}
+
+int main(int argc, char *argv[]) {
+	const char *ip_str = "127.0.0.1";
+	unsigned port = 8080;
+	Replay *r = must_calloc(1, sizeof(Replay), "calloc replay");
+	r->speed = 1;
+
+	static const struct option opts[] = {
+		{"addr", required_argument, NULL, 'a'},
+		{"port", required_argument, NULL, 'p'},
+		{"speed", required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "a:p:s:", opts, NULL)) != -1) {
+		switch (opt) {
+			case 'a': ip_str = optarg; break;
+			case 'p': port = strtoul(optarg, NULL, 10); break;
+			case 's': {
+				char *end_ptr;
+				r->speed = strtod(optarg, &end_ptr);
+				if (*optarg == '\0' || *end_ptr != '\0' || r->speed < 0) usage(argv[0]);
+				break;
+			}
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || port == 0 || port > 65535) usage(argv[0]);
+
+	r->addr.sin_family = AF_INET;
+	r->addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip_str, &r->addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid server ip: %s\n", ip_str);
+		exit(EXIT_FAILURE);
+	}
+
+	open_capture(r, argv[optind]);
+	raise_nofile_limit();
+	for (int t = 0; t < MSGT_COUNT; t++) hist_init(&r->latency[t]);
+
+	printf("replaying %.1fs of capture at speed %g\n",
+		(r->last_ts_ns - r->first_ts_ns) / 1e9, r->speed);
+	run(r);
+	double secs = (now_ns() - r->start_ns) / 1e9;
+
+	Hist *all = must_malloc(sizeof(Hist), "malloc all");
+	hist_init(all);
+	printf("\n%-22s %12s %10s %10s %10s %10s %10s\n",
+		"latency (us)", "count", "mean", "p50", "p99", "p999", "max");
+	for (int t = 0; t < MSGT_COUNT; t++) {
+		if (r->latency[t].count == 0) continue;
+		print_row(prot_msg_names[t], &r->latency[t]);
+		hist_merge(all, &r->latency[t]);
+	}
+	print_row("all requests", all);
+
+	printf("\n%lu frames from %zu clients in %.2fs\n", r->frames, r->conns_len, secs);
+	printf("throughput: %.0f frames/s, %.0f req/s, %.0f deliveries/s\n",
+		r->frames / secs, r->completed / secs, r->received / secs);
+	printf("server errors: %lu, disconnects: %lu, skipped frames: %lu, unanswered: %zu\n",
+		r->server_errors, r->disconnects, r->skipped, r->pending);
+
+	free(all);
+	return r->disconnects == 0 && r->pending == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,15 +1,51 @@
+#include <errno.h>
 #include <liburing.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
 
 #include "protocol.h"
 #include "server.h"
+#include "trace.h"
 
 #define CQE_BATCH_SIZE 32
+/* Batches grow up to this many completions while they keep filling up, see reap. */
+#define CQE_BATCH_MAX 256
+/* Completions handled per wakeup before submitting what they prepared. */
+#define REAP_MAX_CQES 256
+/* CQ polls between reads of the clock while spinning. */
+#define SPIN_POLLS 64
+/* How long a wait for more than one completion lasts at most by default. */
+#define REAP_WAIT_NS 50000
+/**
+ * Average CQEs per wakeup from which the loop waits for several at once, and the
+ * fixed point shift of that average. See next_target.
+ */
+#define REAP_AVG_MIN 8
+#define REAP_AVG_SHIFT 4
+
+/**
+ * Accepts kept armed on a client listener. Under load each completion waits
+ * behind the CQ backlog, so a single one would admit a client every few
+ * iterations while the listen backlog overflows.
+ */
+#define ACCEPTS_ARMED 16
+/* How long accepting pauses after running out of fds, unless a client leaves. */
+#define ACCEPT_RETRY_NS 100000000ull
+
+/* How long a handover waits for the sends in flight before leaving their clients out. */
+#define HANDOVER_DRAIN_NS 2000000000ull
+/* user_data of the cancels a handover submits, pool_ids never get this large. */
+#define HANDOVER_CANCEL_UDATA (LIBURING_UDATA_TIMEOUT - 1)
 
 static uint64_t next_client_id = 1;
+static uint64_t next_group_id = 1;
+
+volatile sig_atomic_t server_handover_requested = 0;
+volatile sig_atomic_t server_stop_requested = 0;
 
 bool username_valid(size_t len, const char username[len]) {
 	for (size_t i = 0; i < len; i++) {
@@ -19,23 +55,6 @@ bool username_valid(size_t len, const char username[len]) {
 	return true;
 }
 
-void log_with_client_info(ClientInfo *info, char *msg) {
-	char client_ip[INET_ADDRSTRLEN];
-	const char *dst = inet_ntop(
-		AF_INET, 
-		&info->client_addr.sin_addr, 
-		client_ip, 
-		INET_ADDRSTRLEN
-	);
-	if (dst == NULL) fatal_error("inet_ntop");
-	uint16_t port = ntohs(info->client_addr.sin_port);
-
-	printf("[%s:%d] client_id=%lu client_fd=%d => %s\n", 
-		client_ip, port,
-		info->client_id, info->client_fd, msg
-	);
-}
-
 void acquire_send_buf(Server *srv, size_t len, Operation *op, size_t ref) {
 	Slab *s = srv->slab64;
 	if (len > 64) {
@@ -47,40 +66,81 @@ void acquire_send_buf(Server *srv, size_t len, Operation *op, size_t ref) {
 	op->buf_len = len;
 }
 
-/**
- * Assigns to op->buf_ref and op->buf_cap. 
- * op->buf_len must be set by the caller.
- */
-void acquire_small_buf(Server *srv, Operation *op, size_t ref) {
-	op->buf_ref = slab_acquire(srv->slab64, ref);
-	assert(op->buf_ref != NULL);
-	op->buf_cap = slab_buf_cap(srv->slab64);
-}
-
-/**
- * Assigns to op->buf_ref and op->buf_cap. 
- * op->buf_len must be set by the caller.
- */
-void acquire_large_buf(Server *srv, Operation *op, size_t ref) {
-	op->buf_ref = slab_acquire(srv->slab2k, ref);
-	assert(op->buf_ref != NULL);
-	op->buf_cap = slab_buf_cap(srv->slab2k);
+/* The ring of a gateway is the first member of its shm_client, see free_op. */
+static void shm_client_free(struct shm_client *sc) {
+	shm_conn_deinit(&sc->conn);
+	free(sc->blocked);
+	free(sc);
 }
 
 void free_op(Server *srv, Operation *op) {
-	printf("FREE OP %s client_id %lu\n", op_type_str(op->type), op->client_id);
-	Slab *s = srv->slab64;
-	if (op->buf_cap > 64) {
-		s = srv->slab2k;
+	LOG(srv->log, LOG_LEVEL_DEBUG, LOG_EV_OP_FREED,
+		.client_id = op->client_id, .fd = op->client_fd, .arg = op->type);
+	DTRACE_PROBE2(chat_server, free, op->client_id, op->type);
+	TRACE(TRACE_FREE, op->type, op->pool_id, op->client_id, 0);
+
+	/* Accept and recv operations have a recv_ring instead of a buffer. */
+	if (op->buf_ref != NULL) {
+		Slab *s = srv->slab64;
+		if (op->buf_cap > 64) {
+			s = srv->slab2k;
+		}
+		slab_release(s, op->buf_ref);
+	}
+
+	/* Only returned once the recv in flight has completed, see handle_cqe_batch. */
+	if (op->recv_ring != NULL && op->recv_ring->shared) {
+		shm_client_free((struct shm_client *)op->recv_ring);
+	} else if (op->recv_ring != NULL) {
+		recv_ring_pool_release(srv->recv_rings, op->recv_ring);
+	}
+
+	/* Sendmsg operations have a chain instead of a buffer. */
+	if (op->chain != NULL) {
+		if (op->msg != &op->chain->msg) free(op->msg);
+		buf_chain_release(op->chain);
+	}
+
+	/* Gathered sends own the sends they cover, see gather_sends. */
+	if (op->gathered != NULL) {
+		for (size_t i = 0; i < op->gathered_len; i++) {
+			free_op(srv, op_pool_get(srv->pool, op->gathered[i]));
+		}
+		free(op->msg);
 	}
-	slab_release(s, op->buf_ref);
 
 	/* POOL CONTRACT */
 	op->client_fd = -1;
 	op->buf_ref = NULL;
+	op->recv_ring = NULL;
+	op->chain = NULL;
+	op->gathered = NULL;
 	op_pool_return(srv->pool, op);
 }
 
+/**
+ * Frees the sends of a gateway still waiting for room. The rings themselves go
+ * with its recv operation.
+ */
+static void shm_client_drop(Server *srv, struct shm_client *sc) {
+	for (size_t i = sc->blocked_head; i < sc->blocked_len; i++) {
+		free_op(srv, op_pool_get(srv->pool, sc->blocked[i]));
+	}
+	srv->shm_blocked -= sc->blocked_len - sc->blocked_head;
+	sc->blocked_head = 0;
+	sc->blocked_len = 0;
+	srv->shm_clients--;
+}
+
+/* Marks a change of the presence of cid, to tell every group it is a member of. */
+static void mark_presence(Server *srv, uint64_t cid) {
+	size_t len;
+	struct grp **grps = groups_of_client(srv->groups, cid, &len);
+	for (size_t i = 0; i < len; i++) {
+		presence_mark(&srv->presence, grps[i], cid, srv->now_ns);
+	}
+}
+
 void disconnect_and_free_op(Server *srv, ClientInfo *info, Operation *op) {
 	/**
 	 * DISCONNECT
@@ -90,69 +150,446 @@ void disconnect_and_free_op(Server *srv, ClientInfo *info, Operation *op) {
 	 * and client information has already been removed and the corresponding client_fd closed.
 	 */
 	if (info != NULL) {
-		log_with_client_info(info, "disconnected");
+		LOG_CLIENT(srv->log, LOG_LEVEL_INFO, LOG_EV_DISCONNECTED, info);
+		if (srv->capture != NULL) {
+			capture_push(srv->capture, CAPTURE_CLOSE, op->client_id, srv->now_ns, NULL, 0);
+		}
 		must_close(op->client_fd, "handle_recv close client_fd");
+
+		/* Only touches the groups this client has joined. */
+		mark_presence(srv, op->client_id);
+		groups_remove_client(srv->groups, op->client_id);
+		uname_index_remove(srv->unames, op->client_id);
+		if (info->upload != NULL) buf_chain_release(info->upload);
+		if (info->batch != NULL) slab_release(srv->slab2k, info->batch);
+		if (info->shm != NULL) shm_client_drop(srv, info->shm);
+
+		/* The send in flight, if any, is freed once it completes. */
+		for (size_t i = info->sendq_head; i < info->sendq_len; i++) {
+			free_op(srv, op_pool_get(srv->pool, info->sendq[i]));
+		}
+		free(info->sendq);
 		client_map_delete(srv->clients, op->client_id);
+
+		/* Its fd is free again, accepting resumes before the next submit. */
+		srv->accept_retry_ns = 0;
 	}
 
 	/* FREE OPERATION */
 	free_op(srv, op);
-
-	/* TODO: RATE LIMITING Accept more connections.
-	 * rh_add_accept(rh, next_client_id);
-	 * next_client_id++;
-	 */
 }
 
 Server server_init(struct io_uring *ring, ClientMap *clients, Slab *slab64, Slab *slab2k,
-			   OpPool *pool, int server_fd)
+			   OpPool *pool, RecvRingPool *recv_rings, struct groups *groups,
+			   UnameIndex *unames, Logger *log, int server_fd)
 {
-	return (Server){
+	Server srv = {
 		.ring = ring,
 		.clients = clients,
 		.slab64 = slab64,
 		.slab2k = slab2k,
 		.pool = pool,
-		.server_fd = server_fd,
+		.recv_rings = recv_rings,
+		.groups = groups,
+		.unames = unames,
+		.log = log,
+		.listeners = {
+			[LISTENER_TCP] = { .fd = server_fd },
+			[LISTENER_UNIX] = { .fd = -1 },
+			[LISTENER_SHM] = { .fd = -1 },
+			[LISTENER_PEER] = { .fd = -1 },
+		},
+		.reap_batch = CQE_BATCH_SIZE,
+		.reap_wait_ns = REAP_WAIT_NS,
+		.cqe_batch = CQE_BATCH_SIZE,
+		.fanout_inline_max = FANOUT_INLINE_MAX,
+		.handover_sock = -1,
 	};
+	presence_queue_init(&srv.presence);
+	fanout_sched_init(&srv.fanout, FANOUT_QUANTUM);
+	return srv;
+}
+
+void server_deinit(Server *srv) {
+	presence_queue_deinit(&srv->presence);
+	fanout_sched_deinit(&srv->fanout);
+	free(srv->sq_overflow);
+	free(srv->send_pending);
+	free(srv->deferred);
+	free(srv->batch_pending);
+	srv->sq_overflow = NULL;
+	srv->send_pending = NULL;
+	srv->deferred = NULL;
+	srv->batch_pending = NULL;
+}
+
+void server_reserve(Server *srv, size_t conns) {
+	if (conns > srv->sq_overflow_cap) {
+		srv->sq_overflow_cap = conns;
+		srv->sq_overflow = must_realloc(
+			srv->sq_overflow, srv->sq_overflow_cap * sizeof(size_t),
+			"server_reserve realloc sq_overflow"
+		);
+		prefault(srv->sq_overflow, srv->sq_overflow_cap * sizeof(size_t));
+	}
+	if (conns > srv->send_pending_cap) {
+		srv->send_pending_cap = conns;
+		srv->send_pending = must_realloc(
+			srv->send_pending, srv->send_pending_cap * sizeof(uint64_t),
+			"server_reserve realloc send_pending"
+		);
+		prefault(srv->send_pending, srv->send_pending_cap * sizeof(uint64_t));
+	}
+	if (conns > srv->deferred_cap) {
+		srv->deferred_cap = conns;
+		srv->deferred = must_realloc(
+			srv->deferred, srv->deferred_cap * sizeof(struct deferred_recv),
+			"server_reserve realloc deferred"
+		);
+		prefault(srv->deferred, srv->deferred_cap * sizeof(struct deferred_recv));
+	}
+	if (conns > srv->batch_pending_cap) {
+		srv->batch_pending_cap = conns;
+		srv->batch_pending = must_realloc(
+			srv->batch_pending, srv->batch_pending_cap * sizeof(uint64_t),
+			"server_reserve realloc batch_pending"
+		);
+		prefault(srv->batch_pending, srv->batch_pending_cap * sizeof(uint64_t));
+	}
+}
+
+/* Fills sqe with the operation described by the current state of op. */
+static void prep_op(Server *srv, struct io_uring_sqe *sqe, Operation *op) {
+	switch (op->type) {
+		case OP_ACCEPT: {
+			ClientInfo *info = client_map_get(srv->clients, op->client_id);
+			TRACE(TRACE_SUBMIT, OP_ACCEPT, op->pool_id, op->client_id, 0);
+			/* Only TCP clients have an address, which fits in client_addr. */
+			struct sockaddr *addr = NULL;
+			socklen_t *addr_len = NULL;
+			if (op->listener == LISTENER_TCP) {
+				addr = (struct sockaddr *)&info->client_addr;
+				addr_len = &info->client_addr_len;
+			}
+			/* Setting SOCK_NONBLOCK saves us extra calls to fcntl. */
+			io_uring_prep_accept(
+				sqe, srv->listeners[op->listener].fd, addr, addr_len, SOCK_NONBLOCK
+			);
+			break;
+		}
+		case OP_READ: {
+			/* Gateways publish their frames in shared memory and only ring. */
+			if (op->recv_ring->shared) {
+				TRACE(TRACE_SUBMIT, OP_READ, op->pool_id, op->client_id, 0);
+				io_uring_prep_recv(sqe, op->client_fd, srv->doorbell, sizeof(srv->doorbell), 0);
+				break;
+			}
+			/* Receives into the free region of the recv_ring, which is always contiguous. */
+			char *buf = recv_ring_write_ptr(op->recv_ring);
+			size_t len = recv_ring_free(op->recv_ring);
+			TRACE(TRACE_SUBMIT, OP_READ, op->pool_id, op->client_id, len);
+			io_uring_prep_recv(sqe, op->client_fd, buf, len, 0);
+			break;
+		}
+		case OP_WRITE: {
+			char *buf = op->buf_ref->buf + op->processed;
+			size_t len = op->buf_len - op->processed;
+			TRACE(TRACE_SUBMIT, OP_WRITE, op->pool_id, op->client_id, len);
+			io_uring_prep_send(sqe, op->client_fd, buf, len, 0);
+			break;
+		}
+		case OP_SENDMSG: {
+			TRACE(TRACE_SUBMIT, OP_SENDMSG, op->pool_id, op->client_id,
+				  op->buf_len - op->processed);
+			io_uring_prep_sendmsg(sqe, op->client_fd, op->msg, 0);
+			break;
+		}
+		case OP_WRITEV: {
+			TRACE(TRACE_SUBMIT, OP_WRITEV, op->pool_id, op->client_id,
+				  op->buf_len - op->processed);
+			io_uring_prep_sendmsg(sqe, op->client_fd, op->msg, 0);
+			break;
+		}
+		case OP_PEER_CONNECT: {
+			const struct sockaddr_in *addr = &srv->cluster->addrs[op->client_id];
+			io_uring_prep_connect(sqe, op->client_fd, (const struct sockaddr *)addr, sizeof(*addr));
+			break;
+		}
+		case OP_PEER_RECV: {
+			char *buf = recv_ring_write_ptr(op->recv_ring);
+			size_t len = recv_ring_free(op->recv_ring);
+			io_uring_prep_recv(sqe, op->client_fd, buf, len, 0);
+			break;
+		}
+		case OP_PEER_SEND: {
+			struct peer_link *l = &srv->cluster->links[op->client_id];
+			io_uring_prep_send(
+				sqe, op->client_fd, l->inflight.data + l->sent, l->inflight.len - l->sent,
+				MSG_NOSIGNAL
+			);
+			break;
+		}
+	}
+	io_uring_sqe_set_data(sqe, (void *)op->pool_id);
 }
 
-void add_accept(Server *srv, uint64_t client_id) {
+/**
+ * Returns an SQE, submitting what is in the SQ to make room if it is full. Returns
+ * NULL if the kernel can't take more submissions yet, e.g. with IORING_FEAT_NODROP
+ * it returns EBUSY while completions wait in the CQ overflow list.
+ */
+static struct io_uring_sqe *get_sqe(Server *srv) {
 	struct io_uring_sqe *sqe = io_uring_get_sqe(srv->ring);
-	if (sqe == NULL) {
-		fprintf(stderr, "SQ is full\n");
+	if (sqe != NULL) return sqe;
+
+	srv->sq_stats.sq_full++;
+	srv->loop_stats.submits++;
+	int ret = io_uring_submit(srv->ring);
+	if (ret < 0 && ret != -EBUSY && ret != -EAGAIN && ret != -EINTR) {
+		fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
 		exit(EXIT_FAILURE);
 	}
+	return io_uring_get_sqe(srv->ring);
+}
+
+/**
+ * Marks a gateway which published an invalid position. Shutting its socket down
+ * completes the recv it may wait in, so that handle_frames drops it.
+ */
+static void shm_client_break(Server *srv, struct shm_client *sc, uint64_t client_id, int fd) {
+	LOG(srv->log, LOG_LEVEL_WARN, LOG_EV_RECV_RING_FAILED,
+		.client_id = client_id, .fd = fd, .code = EPROTO);
+	sc->broken = true;
+	shutdown(fd, SHUT_RDWR);
+}
+
+/**
+ * Copies as many of the unsent bytes of op as fit into the ring towards the
+ * gateway and rings it if it waits for them. Returns whether all were copied.
+ */
+static bool shm_copy(Server *srv, struct shm_client *sc, Operation *op) {
+	if (sc->broken) return false;
+	ShmRing *out = &sc->conn.out;
+	size_t left = op->buf_len - op->processed;
+	ssize_t room = shm_ring_space(out);
+	if (room < 0) {
+		shm_client_break(srv, sc, op->client_id, op->client_fd);
+		return false;
+	}
+	size_t n = left < (size_t)room ? left : (size_t)room;
+	if (n == 0) return left == 0;
+
+	/* The free region is contiguous, like in a RecvRing. */
+	char *dst = recv_ring_write_ptr(&out->ring);
+	if (op->type == OP_SENDMSG) {
+		BufChain *chain = op->chain;
+		size_t skip = op->processed;
+		size_t copied = 0;
+		for (size_t i = 0; i < chain->bufs_len && copied < n; i++) {
+			const struct iovec *iov = &chain->iov[i];
+			if (skip >= iov->iov_len) {
+				skip -= iov->iov_len;
+				continue;
+			}
+			size_t len = iov->iov_len - skip;
+			if (len > n - copied) len = n - copied;
+			memcpy(dst + copied, (const char *)iov->iov_base + skip, len);
+			copied += len;
+			skip = 0;
+		}
+	} else {
+		memcpy(dst, op->buf_ref->buf + op->processed, n);
+	}
+
+	recv_ring_commit(&out->ring, n);
+	op->processed += n;
+	if (shm_ring_publish(out)) shm_doorbell(op->client_fd);
+	return op->processed == op->buf_len;
+}
+
+/**
+ * Copies the blocked sends of a gateway in order, until one doesn't fit and the
+ * gateway is asked for a doorbell once it has made room.
+ */
+static void shm_flush_blocked(Server *srv, struct shm_client *sc) {
+	while (sc->blocked_head < sc->blocked_len) {
+		Operation *op = op_pool_get(srv->pool, sc->blocked[sc->blocked_head]);
+		if (!shm_copy(srv, sc, op)) {
+			if (sc->broken || shm_ring_sleep_producer(&sc->conn.out, 1)) return;
+			continue;
+		}
+		free_op(srv, op);
+		sc->blocked_head++;
+		srv->shm_blocked--;
+	}
+	sc->blocked_head = 0;
+	sc->blocked_len = 0;
+}
+
+/**
+ * Sends op to a gateway through its ring instead of its socket. The op is freed
+ * once copied. Sends queue behind the blocked ones so that frames keep their
+ * order.
+ */
+static void shm_send(Server *srv, struct shm_client *sc, Operation *op) {
+	if (sc->blocked_head == sc->blocked_len && shm_copy(srv, sc, op)) {
+		free_op(srv, op);
+		return;
+	}
+
+	if (sc->blocked_len == sc->blocked_cap) {
+		sc->blocked_cap = sc->blocked_cap == 0 ? 64 : sc->blocked_cap * 2;
+		sc->blocked = must_realloc(
+			sc->blocked, sc->blocked_cap * sizeof(size_t), "shm_send realloc blocked"
+		);
+	}
+	sc->blocked[sc->blocked_len] = op->pool_id;
+	sc->blocked_len++;
+	srv->shm_blocked++;
+	shm_flush_blocked(srv, sc);
+}
+
+/**
+ * Prepares an SQE for op, or queues op in the SQ overflow queue if there's none.
+ * Once an op is queued, later ones queue behind it so that the sends of a client
+ * keep their order. The queue is flushed before every submit. Sends to gateways
+ * don't need an SQE, see shm_send.
+ */
+void submit_op(Server *srv, Operation *op) {
+	if (srv->shm_clients > 0 && (op->type == OP_WRITE || op->type == OP_SENDMSG)) {
+		ClientInfo *info = client_map_get(srv->clients, op->client_id);
+		if (info != NULL && info->shm != NULL) {
+			shm_send(srv, info->shm, op);
+			return;
+		}
+	}
+
+	struct io_uring_sqe *sqe = NULL;
+	if (srv->sq_overflow_head == srv->sq_overflow_len) sqe = get_sqe(srv);
+	if (sqe != NULL) {
+		prep_op(srv, sqe, op);
+		return;
+	}
+
+	/* Reuses the room of the flushed ops before growing. */
+	if (srv->sq_overflow_len == srv->sq_overflow_cap && srv->sq_overflow_head > 0) {
+		srv->sq_overflow_len -= srv->sq_overflow_head;
+		memmove(srv->sq_overflow, srv->sq_overflow + srv->sq_overflow_head,
+			srv->sq_overflow_len * sizeof(size_t));
+		srv->sq_overflow_head = 0;
+	}
+	if (srv->sq_overflow_len == srv->sq_overflow_cap) {
+		srv->sq_overflow_cap = srv->sq_overflow_cap == 0 ? 1024 : srv->sq_overflow_cap * 2;
+		srv->sq_overflow = must_realloc(
+			srv->sq_overflow, srv->sq_overflow_cap * sizeof(size_t),
+			"submit_op realloc sq_overflow"
+		);
+	}
+	srv->sq_overflow[srv->sq_overflow_len] = op->pool_id;
+	srv->sq_overflow_len++;
+
+	srv->sq_stats.queued++;
+	size_t queued = srv->sq_overflow_len - srv->sq_overflow_head;
+	if (queued > srv->sq_stats.queue_max) srv->sq_stats.queue_max = queued;
+}
+
+/* Parks the recv operation of a client until wake_ns. */
+void defer_recv(Server *srv, Operation *op, uint64_t wake_ns) {
+	if (srv->deferred_len == srv->deferred_cap) {
+		srv->deferred_cap = srv->deferred_cap == 0 ? 64 : srv->deferred_cap * 2;
+		srv->deferred = must_realloc(
+			srv->deferred, srv->deferred_cap * sizeof(struct deferred_recv),
+			"defer_recv realloc deferred"
+		);
+	}
+	srv->deferred[srv->deferred_len] = (struct deferred_recv){
+		.wake_ns = wake_ns,
+		.pool_id = op->pool_id,
+	};
+	srv->deferred_len++;
+}
+
+/**
+ * Moves the queued ops into the SQ in order, until the queue is empty or the
+ * kernel can't take more submissions.
+ */
+static void flush_sq_overflow(Server *srv) {
+	while (srv->sq_overflow_head < srv->sq_overflow_len) {
+		Operation *op = op_pool_get(srv->pool, srv->sq_overflow[srv->sq_overflow_head]);
+		assert(op != NULL);
+
+		/* The client was dropped while op was queued and its fd may be reused. */
+		if (op->type < OP_PEER_CONNECT && client_map_get(srv->clients, op->client_id) == NULL) {
+			free_op(srv, op);
+			srv->sq_overflow_head++;
+			continue;
+		}
+
+		if (op->type == OP_READ && srv->handover_sock >= 0) {
+			defer_recv(srv, op, 0);
+			srv->sq_overflow_head++;
+			continue;
+		}
+
+		struct io_uring_sqe *sqe = get_sqe(srv);
+		if (sqe == NULL) break;
+
+		prep_op(srv, sqe, op);
+		srv->sq_overflow_head++;
+	}
+
+	if (srv->sq_overflow_head == srv->sq_overflow_len) {
+		srv->sq_overflow_head = 0;
+		srv->sq_overflow_len = 0;
+	}
+}
+
+/* Resets the per-connection state of a new entry of the client map. */
+static void init_client_info(ClientInfo *info) {
+	info->client_fd = -1;
+	info->username[0] = '\0';
+	info->upload = NULL;
+	info->options = 0;
+	info->presence = PRESENCE_ONLINE;
+	info->typing_gid = 0;
+	info->batch = NULL;
+	info->batch_queued = false;
+	info->sendq = NULL;
+	info->sendq_head = 0;
+	info->sendq_len = 0;
+	info->sendq_cap = 0;
+	info->send_busy = false;
+	info->send_queued = false;
+	info->shm = NULL;
+	memset(&info->buckets, 0, sizeof(info->buckets));
+	memset(&info->client_addr, 0, sizeof(info->client_addr));
+	info->client_addr_len = sizeof(info->client_addr);
+}
 
+void add_accept(Server *srv, uint64_t client_id, enum listener_kind listener) {
 	Operation *op = op_pool_new_entry(srv->pool);
 	assert(op != NULL);
 
 	/**
 	 * op->pool_id should not be modified.
 	 *
-	 * Directly getting a buffer from slab2k instead of calling acquire_op_buf because
-	 * the buffer will be used for recv operations and we want it to be as large as possible.
+	 * The operation is reused for recv once accept completes. It gets its recv_ring
+	 * then, so that pending accepts don't hold any.
 	 */
-	acquire_large_buf(srv, op, 1);
 	op->buf_len = 0;
 	op->client_id = client_id;
 	op->processed = 0;
 	op->client_fd = -1;
 	op->type = OP_ACCEPT;
+	op->listener = listener;
 
 	ClientInfo *info;
 	client_map_new_entry(srv->clients, client_id, &info);
-	memset(&info->client_addr, 0, sizeof(info->client_addr));
-	info->client_addr_len = sizeof(info->client_addr);
+	/* client_fd is only known once accept completes. */
+	init_client_info(info);
 
-	io_uring_sqe_set_data(sqe, (void *)op->pool_id);
-	/* Setting SOCK_NONBLOCK saves us extra calls to fcntl. */
-	io_uring_prep_accept(
-		sqe, 
-		srv->server_fd, 
-		(struct sockaddr *)&info->client_addr,
-		&info->client_addr_len, SOCK_NONBLOCK
-	);
+	srv->listeners[listener].armed++;
+	submit_op(srv, op);
 }
 
 /*
@@ -200,83 +637,112 @@ int add_read_with_timeout(
 }
 */
 
+/* Receives into the free region of the recv_ring, which is always contiguous. */
+void resume_recv(Server *srv, Operation *op) {
+	/**
+	 * pool_id:           must not be modified.
+	 * client_id:         set in add_accept.
+	 * recv_ring:         set in handle_accept.
+	 * type:              set in add_recv.
+	 * client_fd:         set in add_recv.
+	 * processed:         not needed.
+	 */
+
+	/* Nothing may be read from a socket being handed over. */
+	if (srv->handover_sock >= 0) {
+		defer_recv(srv, op, 0);
+		return;
+	}
+
+	/**
+	 * A gateway is only waited for once its ring is empty. Frames which arrived
+	 * meanwhile are handled on the next flush, without a doorbell.
+	 */
+	if (op->recv_ring->shared) {
+		ShmRing *in = (ShmRing *)op->recv_ring;
+		if (shm_ring_release(in)) shm_doorbell(op->client_fd);
+		if (!shm_ring_sleep_consumer(in)) {
+			defer_recv(srv, op, 0);
+			return;
+		}
+	}
+
+	submit_op(srv, op);
+}
+
 /**
  * Essentially client_fd is only needed when this function is called for the first time,
  * because we only get the client_fd after a successful accept. But in order to keep the
  * code style consistent, we avoid assigning the client_fd outside of this functions.
  */
 void add_recv(Server *srv, Operation *op, int client_fd) {
-	struct io_uring_sqe *sqe = io_uring_get_sqe(srv->ring);
-	if (sqe == NULL) {
-		fprintf(stderr, "SQ is full\n");
-		exit(EXIT_FAILURE);
-	}
-
 	/**
 	 * pool_id:           must not be modified.
 	 * client_id:         set in add_accept.
-	 * buf_cap:           set in add_accept.
-	 * buf_len:           set in add_accept.
-	 * buf:               set in add_accept.
+	 * recv_ring:         set in handle_accept.
 	 * processed:         not needed.
 	 */
 	op->client_fd = client_fd;
 	op->type = OP_READ;
 
-	io_uring_sqe_set_data(sqe, (void *)op->pool_id);
-	char *buf = op->buf_ref->buf;
-	io_uring_prep_recv(sqe, op->client_fd, buf, op->buf_cap, 0);
+	resume_recv(srv, op);
 }
 
-void resume_recv(Server *srv, Operation *op, size_t bytes_read) {
-	struct io_uring_sqe *sqe = io_uring_get_sqe(srv->ring);
-	if (sqe == NULL) {
-		fprintf(stderr, "SQ is full\n");
-		exit(EXIT_FAILURE);
-	}
-
-	/**
-	 * pool_id:           must not be modified.
-	 * client_id:         set in add_accept.
-	 * buf_cap:           set in add_accept.
-	 * buf_len:           set in add_accept.
-	 * buf:               set in add_accept.
-	 * type:              set in add_read.
-	 * client_fd:         set in add_read.
-	 * processed:         not needed.
-	 */
+/* Adds the client to the pending sends of the server, unless it is already. */
+static void mark_send_pending(Server *srv, ClientInfo *info) {
+	if (info->send_queued) return;
 
-	io_uring_sqe_set_data(sqe, (void *)op->pool_id);
-	char *buf = op->buf_ref->buf + bytes_read;
-	size_t len = op->buf_cap - bytes_read;
-	io_uring_prep_recv(sqe, op->client_fd, buf, len, 0);
+	if (srv->send_pending_len == srv->send_pending_cap) {
+		srv->send_pending_cap = srv->send_pending_cap == 0 ? 64 : srv->send_pending_cap * 2;
+		srv->send_pending = must_realloc(
+			srv->send_pending, srv->send_pending_cap * sizeof(uint64_t),
+			"mark_send_pending realloc send_pending"
+		);
+	}
+	srv->send_pending[srv->send_pending_len] = info->client_id;
+	srv->send_pending_len++;
+	info->send_queued = true;
 }
 
-void add_send(Server *srv, Operation *op, int client_fd, uint64_t client_id) {
-	struct io_uring_sqe *sqe = io_uring_get_sqe(srv->ring);
-	if (sqe == NULL) {
-		fprintf(stderr, "SQ is full\n");
-		exit(EXIT_FAILURE);
+/**
+ * Queues op behind the other sends of the client. Sends to gateways are copied
+ * into their ring right away instead, which keeps them in order, see shm_send.
+ */
+static void queue_send(Server *srv, ClientInfo *info, Operation *op) {
+	if (info->shm != NULL) {
+		submit_op(srv, op);
+		return;
+	}
+
+	/* Reuses the room of the sent ops before growing. */
+	if (info->sendq_len == info->sendq_cap && info->sendq_head > 0) {
+		info->sendq_len -= info->sendq_head;
+		memmove(info->sendq, info->sendq + info->sendq_head, info->sendq_len * sizeof(size_t));
+		info->sendq_head = 0;
 	}
+	if (info->sendq_len == info->sendq_cap) {
+		info->sendq_cap = info->sendq_cap == 0 ? 8 : info->sendq_cap * 2;
+		info->sendq = must_realloc(
+			info->sendq, info->sendq_cap * sizeof(size_t), "queue_send realloc sendq"
+		);
+	}
+	info->sendq[info->sendq_len] = op->pool_id;
+	info->sendq_len++;
+
+	if (!info->send_busy) mark_send_pending(srv, info);
+}
 
+void add_send(Server *srv, ClientInfo *info, Operation *op) {
 	/* op->pool_id should not be modified. */
-	op->client_id = client_id;
+	op->client_id = info->client_id;
 	op->processed = 0;
-	op->client_fd = client_fd;
+	op->client_fd = info->client_fd;
 	op->type = OP_WRITE;
 
-	io_uring_sqe_set_data(sqe, (void *)op->pool_id);
-	char *buf = op->buf_ref->buf;
-	io_uring_prep_send(sqe, op->client_fd, buf, op->buf_len, 0);
+	queue_send(srv, info, op);
 }
 
 void resume_send(Server *srv, Operation *op, size_t processed) {
-	struct io_uring_sqe *sqe = io_uring_get_sqe(srv->ring);
-	if (sqe == NULL) {
-		fprintf(stderr, "SQ is full\n");
-		exit(EXIT_FAILURE);
-	}
-
 	/**
 	 * pool_id:           should not be modified.
 	 * client_id:         set in add_send.
@@ -288,154 +754,1629 @@ void resume_send(Server *srv, Operation *op, size_t processed) {
 	 */
 	op->processed += processed;
 
-	io_uring_sqe_set_data(sqe, (void *)op->pool_id);
-	char *buf = op->buf_ref->buf + op->processed;
-	size_t len = op->buf_len - op->processed;
-	io_uring_prep_send(sqe, op->client_fd, buf, len, 0);
-}
-
-void send_server_error(
-	Server *srv, 
-	int client_fd, 
-	uint64_t client_id,
-	uint64_t seqid, 
-	uint8_t code
-) {
-	Operation *op = op_pool_new_entry(srv->pool); 
-	assert(op != NULL);
-	acquire_small_buf(srv, op, 1);
-
-	char *buf = op->buf_ref->buf;
-	op->buf_len = ser_server_error(op->buf_cap, buf, seqid, code);
-	add_send(srv, op, client_fd, client_id);
+	submit_op(srv, op);
 }
 
-void send_set_username_response(
-	Server *srv, 
-	int client_fd, 
-	uint64_t seqid,
-	uint64_t client_id
-) {
-	Operation *op = op_pool_new_entry(srv->pool); 
-	assert(op != NULL);
-	acquire_small_buf(srv, op, 1);
+/**
+ * Sends the whole chain with a single sendmsg. op->chain must be set by the caller.
+ * The msghdr of the chain is shared by all its sends, so it isn't modified here.
+ */
+void add_sendmsg(Server *srv, ClientInfo *info, Operation *op) {
+	/* op->pool_id should not be modified. */
+	op->client_id = info->client_id;
+	op->processed = 0;
+	op->client_fd = info->client_fd;
+	op->type = OP_SENDMSG;
+	op->buf_len = op->chain->len;
+	op->msg = &op->chain->msg;
 
-	char *buf = op->buf_ref->buf;
-	op->buf_len = ser_set_username_response(op->buf_cap, buf, seqid);
-	add_send(srv, op, client_fd, client_id);
+	queue_send(srv, info, op);
 }
 
 /**
- * rh_handle will add sqes but will not submit. We assume ring will have
- * enough room for the resulting sqes. However, for massive groups the job has
- * to be handles in several stages in order to avoid overflowing the sqe buffer.
- *
- * req_len is essentially the prefix of the each message already parsed by the
- * caller of this function. We assume req_len >= 3 and req should contain all bytes 
- * necessary for parsing a request.
+ * Other sends of the chain may still be using its msghdr, so on the first short
+ * write the operation gets a private msghdr followed by room for an iovec per
+ * buffer of the chain. It is reused for any later short writes.
  */
-int handle(
-	Server *srv,
-	ClientInfo *info,
-	Operation *req_op,
-	char *req_buf,
-	size_t req_len,
-	uint8_t msgt,
-	uint64_t seqid
-) {
-	int client_fd = req_op->client_fd;
-	uint64_t client_id = req_op->client_id;
-
-	switch (msgt) {
-		case MSGT_SET_USERNAME: {
-			/* Network byte order to host byte order. */
-			const char *uname;
-			size_t uname_len;
-			deser_set_username(req_len, req_buf, &uname, &uname_len);
-
-			/* Ensure username len is in range [3, 15]. */
-			if (uname_len < MIN_UNAME_LEN || uname_len > MAX_UNAME_LEN) {
-				uint8_t code = CODE_INVALID_MSG_LEN;
-				send_server_error(srv, client_fd, client_id, seqid, code);
-				return 0;
-			}
+void resume_sendmsg(Server *srv, Operation *op, size_t processed) {
+	/* Every other field is set in add_sendmsg. */
+	op->processed += processed;
 
-			/* Ensure username chars are valid. */
-			if (!username_valid(uname_len, uname)) {
-				uint8_t code = CODE_INVALID_USERNAME;
-				send_server_error(srv, client_fd, client_id, seqid, code);
-				return 0;
-			}
-			
-			memcpy(info->username, uname, uname_len);
-			info->username[uname_len] = '\0';
-			printf("client username is %s\n", info->username);
+	BufChain *chain = op->chain;
+	if (op->msg == &chain->msg) {
+		size_t size = sizeof(struct msghdr) + chain->bufs_len * sizeof(struct iovec);
+		op->msg = must_malloc(size, "resume_sendmsg");
+	}
 
-			send_set_username_response(srv, client_fd, seqid, client_id);
-			return 0;
-		}
-		case MSGT_CREATE_GROUP: {
+	struct iovec *iov = (struct iovec *)(op->msg + 1);
+	memset(op->msg, 0, sizeof(struct msghdr));
+	op->msg->msg_iov = iov;
+	op->msg->msg_iovlen = buf_chain_iov_from(chain, op->processed, iov);
+
+	submit_op(srv, op);
+}
 
+/* Points the msghdr of a gathered send to the bytes of its sends after processed. */
+static void gather_iov(Server *srv, Operation *op) {
+	struct iovec *iov = (struct iovec *)(op->msg + 1);
+	size_t iov_len = 0;
+	size_t skip = op->processed;
+	for (size_t i = 0; i < op->gathered_len; i++) {
+		Operation *send = op_pool_get(srv->pool, op->gathered[i]);
+		if (skip >= send->buf_len) {
+			skip -= send->buf_len;
+			continue;
 		}
-		default: {
-			return -1;
+		if (send->type == OP_SENDMSG) {
+			iov_len += buf_chain_iov_from(send->chain, skip, iov + iov_len);
+		} else {
+			iov[iov_len] = (struct iovec){
+				.iov_base = send->buf_ref->buf + skip,
+				.iov_len = send->buf_len - skip,
+			};
+			iov_len++;
 		}
-	};
+		skip = 0;
+	}
+
+	memset(op->msg, 0, sizeof(struct msghdr));
+	op->msg->msg_iov = iov;
+	op->msg->msg_iovlen = iov_len;
 }
 
-void handle_accept(Server *srv, int client_fd, ClientInfo *info, Operation *op) {
-	info->client_fd = client_fd;
+/**
+ * Returns an OP_WRITEV which sends the first n queued sends of the client with
+ * one sendmsg, and owns them until it completes.
+ */
+static Operation *gather_sends(Server *srv, ClientInfo *info, size_t n, size_t iov_len) {
+	Operation *op = op_pool_new_entry(srv->pool);
+	assert(op != NULL);
 
-	/* Log connection info. */
-	log_with_client_info(info, "connected");
+	size_t size = sizeof(struct msghdr) + iov_len * sizeof(struct iovec) + n * sizeof(size_t);
+	op->msg = must_malloc(size, "gather_sends malloc msg");
+	op->gathered = (size_t *)((struct iovec *)(op->msg + 1) + iov_len);
+	op->gathered_len = n;
+	memcpy(op->gathered, info->sendq + info->sendq_head, n * sizeof(size_t));
 
-	/* Recv from connected socket. */
-	add_recv(srv, op, client_fd);
+	op->client_id = info->client_id;
+	op->client_fd = info->client_fd;
+	op->type = OP_WRITEV;
+	op->processed = 0;
+	op->buf_len = 0;
+	for (size_t i = 0; i < n; i++) {
+		op->buf_len += op_pool_get(srv->pool, op->gathered[i])->buf_len;
+	}
+	gather_iov(srv, op);
+	return op;
+}
 
-	/* Accept more connections. */
-	add_accept(srv, next_client_id);
-	next_client_id++;
+void resume_writev(Server *srv, Operation *op, size_t processed) {
+	/* Every other field is set in gather_sends. */
+	op->processed += processed;
+	gather_iov(srv, op);
+
+	submit_op(srv, op);
 }
 
-void handle_recv(Server *srv, ClientInfo *info, Operation *op, size_t bytes_read) {
-	if (bytes_read == 0) {
+/**
+ * Starts the queued sends of the client, up to SEND_GATHER_MAX of them and
+ * SEND_GATHER_IOV_MAX buffers, as one send.
+ */
+static void start_sends(Server *srv, ClientInfo *info) {
+	size_t n = 0;
+	size_t iov_len = 0;
+	while (info->sendq_head + n < info->sendq_len && n < SEND_GATHER_MAX) {
+		Operation *send = op_pool_get(srv->pool, info->sendq[info->sendq_head + n]);
+		size_t send_iov_len = send->type == OP_SENDMSG ? send->chain->bufs_len : 1;
+		if (n > 0 && iov_len + send_iov_len > SEND_GATHER_IOV_MAX) break;
+		iov_len += send_iov_len;
+		n++;
+	}
+
+	Operation *op;
+	if (n == 1) {
+		op = op_pool_get(srv->pool, info->sendq[info->sendq_head]);
+	} else {
+		op = gather_sends(srv, info, n, iov_len);
+	}
+	info->sendq_head += n;
+	if (info->sendq_head == info->sendq_len) {
+		info->sendq_head = 0;
+		info->sendq_len = 0;
+	}
+
+	info->send_busy = true;
+	submit_op(srv, op);
+}
+
+/**
+ * Starts the sends of the clients queued during this loop iteration which have
+ * none in flight, the frames of each client in one send.
+ */
+static void flush_sends(Server *srv) {
+	for (size_t i = 0; i < srv->send_pending_len; i++) {
+		/* Clients that disconnected have already freed their sends. */
+		ClientInfo *info = client_map_get(srv->clients, srv->send_pending[i]);
+		if (info == NULL) continue;
+
+		info->send_queued = false;
+		if (!info->send_busy && info->sendq_head < info->sendq_len) start_sends(srv, info);
+	}
+	srv->send_pending_len = 0;
+}
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Sends the BATCH envelope of the client right away. */
+void send_batch(Server *srv, ClientInfo *info) {
+	Operation *op = op_pool_new_entry(srv->pool);
+	assert(op != NULL);
+
+	op->buf_ref = info->batch;
+	op->buf_cap = slab_buf_cap(srv->slab2k);
+	op->buf_len = ser_batch(op->buf_cap, op->buf_ref->buf, info->batch_len - PROT_HDR_LEN);
+	info->batch = NULL;
+	add_send(srv, info, op);
+}
+
+/**
+ * Appends the frame to the BATCH envelope of the client, opening one if needed.
+ * Returns false if the frame can't fit in an envelope, in which case the open
+ * envelope is sent first so that the frame still follows the ones due before it.
+ */
+bool batch_frame(Server *srv, ClientInfo *info, const char *frame, size_t len) {
+	if (len > PROT_MAX_LEN - PROT_HDR_LEN) {
+		if (info->batch != NULL) send_batch(srv, info);
+		return false;
+	}
+
+	if (info->batch != NULL && info->batch_len + len > PROT_MAX_LEN) {
+		send_batch(srv, info);
+	}
+
+	if (info->batch == NULL) {
+		info->batch = slab_acquire(srv->slab2k, 1);
+		info->batch_len = PROT_HDR_LEN;
+		info->batch_opened_ns = srv->now_ns;
+
+		if (!info->batch_queued) {
+			if (srv->batch_pending_len == srv->batch_pending_cap) {
+				srv->batch_pending_cap = srv->batch_pending_cap == 0 ? 64 : srv->batch_pending_cap * 2;
+				srv->batch_pending = must_realloc(
+					srv->batch_pending, srv->batch_pending_cap * sizeof(uint64_t),
+					"batch_frame realloc batch_pending"
+				);
+			}
+			srv->batch_pending[srv->batch_pending_len] = info->client_id;
+			srv->batch_pending_len++;
+			info->batch_queued = true;
+		}
+	}
+
+	memcpy(info->batch->buf + info->batch_len, frame, len);
+	info->batch_len += len;
+	return true;
+}
+
+/**
+ * Sends the envelopes which have been open for at least batch_window_ns. Returns
+ * the time until the next remaining envelope is due, or 0 if none remain.
+ */
+uint64_t flush_batches(Server *srv) {
+	if (srv->batch_pending_len == 0) return 0;
+
+	uint64_t window = srv->batch_window_ns;
+	uint64_t now = window > 0 ? monotonic_ns() : 0;
+	uint64_t next_due = 0;
+
+	size_t kept = 0;
+	for (size_t i = 0; i < srv->batch_pending_len; i++) {
+		/* Clients that disconnected have already released their envelope. */
+		ClientInfo *info = client_map_get(srv->clients, srv->batch_pending[i]);
+		if (info == NULL) continue;
+
+		if (info->batch != NULL) {
+			uint64_t age = now - info->batch_opened_ns;
+			if (age < window) {
+				if (next_due == 0 || window - age < next_due) next_due = window - age;
+				srv->batch_pending[kept] = srv->batch_pending[i];
+				kept++;
+				continue;
+			}
+			send_batch(srv, info);
+		}
+		info->batch_queued = false;
+	}
+	srv->batch_pending_len = kept;
+
+	return next_due;
+}
+
+/**
+ * Sends len bytes of bref to the client and takes over one reference to bref,
+ * which must come from s. For clients that enabled OPT_BATCH, the frame is
+ * copied into their envelope instead and bref is released right away.
+ */
+void send_frame(Server *srv, ClientInfo *info, Slab *s, BufRef *bref, size_t len) {
+	if ((info->options & OPT_BATCH) && batch_frame(srv, info, bref->buf, len)) {
+		slab_release(s, bref);
+		return;
+	}
+
+	Operation *op = op_pool_new_entry(srv->pool);
+	assert(op != NULL);
+	op->buf_ref = bref;
+	op->buf_cap = slab_buf_cap(s);
+	op->buf_len = len;
+	add_send(srv, info, op);
+}
+
+void send_server_error(Server *srv, ClientInfo *info, uint64_t seqid, uint8_t code) {
+	BufRef *bref = slab_acquire(srv->slab64, 1);
+	size_t len = ser_server_error(slab_buf_cap(srv->slab64), bref->buf, seqid, code);
+	send_frame(srv, info, srv->slab64, bref, len);
+}
+
+void send_set_username_response(Server *srv, ClientInfo *info, uint64_t seqid) {
+	BufRef *bref = slab_acquire(srv->slab64, 1);
+	size_t len = ser_set_username_response(
+		slab_buf_cap(srv->slab64), bref->buf, seqid, info->client_id
+	);
+	send_frame(srv, info, srv->slab64, bref, len);
+}
+
+void send_create_group_response(Server *srv, ClientInfo *info, uint64_t seqid, uint64_t gid) {
+	BufRef *bref = slab_acquire(srv->slab64, 1);
+	size_t len = ser_create_group_response(slab_buf_cap(srv->slab64), bref->buf, seqid, gid);
+	send_frame(srv, info, srv->slab64, bref, len);
+}
+
+void send_set_options_response(Server *srv, ClientInfo *info, uint64_t seqid, uint8_t options) {
+	BufRef *bref = slab_acquire(srv->slab64, 1);
+	size_t len = ser_set_options_response(slab_buf_cap(srv->slab64), bref->buf, seqid, options);
+	send_frame(srv, info, srv->slab64, bref, len);
+}
+
+/**
+ * Sends JOINED_GROUP to the clients which were just added to the group. The message
+ * is the same for all of them, so it is serialized once into a single BufRef which
+ * is shared by all the send operations. uids_raw is forwarded without decoding.
+ */
+void send_joined_group(
+	Server *srv,
+	uint64_t uid,
+	uint64_t gid,
+	uint8_t uids_len,
+	const char *uids_raw,
+	size_t members_len,
+	const uint64_t *members
+) {
+	if (members_len == 0) return;
+
+	/* Every new member holds a reference to the buffer. */
+	BufRef *bref = slab_acquire(srv->slab2k, members_len);
+	size_t frame_len = ser_joined_group(
+		slab_buf_cap(srv->slab2k), bref->buf,
+		uid, gid, uids_len, uids_raw
+	);
+
+	for (size_t i = 0; i < members_len; i++) {
+		ClientInfo *info = client_map_get(srv->clients, members[i]);
+		assert(info != NULL);
+		send_frame(srv, info, srv->slab2k, bref, frame_len);
+	}
+}
+
+void send_add_to_group_response(Server *srv, ClientInfo *info, uint64_t seqid, uint64_t gid) {
+	BufRef *bref = slab_acquire(srv->slab64, 1);
+	size_t len = ser_add_to_group_response(slab_buf_cap(srv->slab64), bref->buf, seqid, gid);
+	send_frame(srv, info, srv->slab64, bref, len);
+}
+
+void send_send_to_group_response(
+	Server *srv,
+	ClientInfo *info,
+	uint64_t seqid,
+	uint64_t gid,
+	uint64_t msgid
+) {
+	BufRef *bref = slab_acquire(srv->slab64, 1);
+	size_t len = ser_send_to_group_response(
+		slab_buf_cap(srv->slab64), bref->buf, seqid, gid, msgid
+	);
+	send_frame(srv, info, srv->slab64, bref, len);
+}
+
+#define FANOUT_BATCH_SIZE 64
+
+/**
+ * Sends the member its share of a fan-out, the frame in bref or, if it is set,
+ * chain, taking over one reference. Members which have disconnected since the
+ * fan-out was scheduled release it instead.
+ */
+static void fanout_member(Server *srv, uint64_t cid, BufRef *bref, size_t len, BufChain *chain) {
+	ClientInfo *info = client_map_get(srv->clients, cid);
+	if (info == NULL) {
+		if (chain != NULL) {
+			buf_chain_release(chain);
+		} else {
+			slab_release(srv->slab2k, bref);
+		}
+		return;
+	}
+
+	if (chain == NULL) {
+		send_frame(srv, info, srv->slab2k, bref, len);
+		return;
+	}
+
+	/* The chain can't be batched, so it follows the frames due before it. */
+	if (info->batch != NULL) send_batch(srv, info);
+
+	Operation *op = op_pool_new_entry(srv->pool);
+	assert(op != NULL);
+	op->chain = chain;
+	add_sendmsg(srv, info, op);
+}
+
+static void fanout_send(void *ctx, struct fanout_job *job, const uint64_t *ids, size_t n) {
+	Server *srv = ctx;
+	TRACE(TRACE_FANOUT_BEGIN, 0, n, 0, 0);
+	for (size_t i = 0; i < n; i++) {
+		if (ids[i] == job->skip) continue;
+		fanout_member(srv, ids[i], job->bref, job->len, job->chain);
+	}
+	TRACE(TRACE_FANOUT_END, 0, n, 0, 0);
+}
+
+/**
+ * Sends bref, or chain, to the recipients, the members of grp other than
+ * sender_id, each of which holds a reference to it. Small groups are sent to
+ * right away. Groups with more than fanout_inline_max recipients, or with
+ * fan-outs still scheduled, get a job in the scheduler instead, see fanout.h.
+ */
+static void fanout_members(
+	Server *srv,
+	struct grp *grp,
+	uint64_t sender_id,
+	size_t recipients,
+	BufRef *bref,
+	size_t len,
+	BufChain *chain
+) {
+	if (recipients > srv->fanout_inline_max || grp->fanout_idx != 0) {
+		/* The job sends to a snapshot, so members may come and go while it runs. */
+		size_t cost = chain != NULL ? 1 + buf_chain_data_len(chain) / PROT_MAX_LEN : 1;
+		struct fanout_job *job = fanout_sched_push(&srv->fanout, grp, grp_snapshot(grp), cost);
+		job->skip = sender_id;
+		job->bref = bref;
+		job->len = len;
+		job->chain = chain;
+		return;
+	}
+
+	struct cid_iter iter;
+	cid_set_iter(&grp->client_ids, &iter);
+	uint64_t batch[FANOUT_BATCH_SIZE];
+	size_t n;
+	while ((n = cid_iter_next_batch(&iter, FANOUT_BATCH_SIZE, batch)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			if (batch[i] == sender_id) continue;
+			fanout_member(srv, batch[i], bref, len, chain);
+		}
+	}
+}
+
+/**
+ * Sends RECEIVE_FROM_GROUP to every member of grp except the sender. Like
+ * JOINED_GROUP, the message is serialized once into a BufRef shared by all sends.
+ */
+void fanout_to_group(
+	Server *srv,
+	struct grp *grp,
+	uint64_t sender_id,
+	uint64_t msgid,
+	size_t msg_len,
+	const char *msg
+) {
+	/**
+	 * Every member but the sender holds a reference to the buffer. In cluster mode
+	 * the sender may be a client of another node.
+	 */
+	size_t recipients = grp->client_ids.len;
+	if (cid_set_exists(&grp->client_ids, sender_id)) recipients--;
+	if (recipients == 0) return;
+	TRACE(TRACE_FANOUT_BEGIN, 0, recipients, sender_id, grp->gid);
+
+	BufRef *bref = slab_acquire(srv->slab2k, recipients);
+	size_t len = ser_receive_from_group(
+		slab_buf_cap(srv->slab2k), bref->buf,
+		grp->gid, msgid, sender_id, msg_len, msg
+	);
+
+	fanout_members(srv, grp, sender_id, recipients, bref, len, NULL);
+	TRACE(TRACE_FANOUT_END, 0, recipients, sender_id, grp->gid);
+}
+
+/**
+ * Sends the RECEIVE_FROM_GROUP_LARGE in chain to every member of grp except the
+ * sender. The caller's reference to chain is handed over to the sends, which all
+ * share the chain and its buffers.
+ */
+void fanout_chain(Server *srv, struct grp *grp, uint64_t sender_id, BufChain *chain) {
+	size_t recipients = grp->client_ids.len;
+	if (cid_set_exists(&grp->client_ids, sender_id)) recipients--;
+	if (recipients == 0) {
+		buf_chain_release(chain);
+		return;
+	}
+	TRACE(TRACE_FANOUT_BEGIN, 0, recipients, sender_id, grp->gid);
+
+	buf_chain_seal(chain, recipients);
+	fanout_members(srv, grp, sender_id, recipients, NULL, 0, chain);
+	TRACE(TRACE_FANOUT_END, 0, recipients, sender_id, grp->gid);
+}
+
+/**
+ * Sends the usernames of the members of grp in GET_USERNAMES_RESPONSEs. Members
+ * are resolved in batches and their records written straight into a 2KiB buffer,
+ * which is sent whenever the next record doesn't fit.
+ */
+void send_usernames(Server *srv, ClientInfo *info, uint64_t seqid, struct grp *grp) {
+	size_t cap = slab_buf_cap(srv->slab2k);
+	size_t hdr_len = sizeof(struct msg_get_usernames_response);
+
+	BufRef *bref = slab_acquire(srv->slab2k, 1);
+	size_t len = hdr_len;
+	uint16_t count = 0;
+
+	uint64_t batch[FANOUT_BATCH_SIZE];
+	const struct uname_entry *entries[FANOUT_BATCH_SIZE];
+	struct cid_iter iter;
+	cid_set_iter(&grp->client_ids, &iter);
+
+	size_t n;
+	while ((n = cid_iter_next_batch(&iter, FANOUT_BATCH_SIZE, batch)) > 0) {
+		uname_index_get_batch(srv->unames, n, batch, entries);
+
+		for (size_t i = 0; i < n; i++) {
+			const struct uname_entry *e = entries[i];
+			if (e == NULL) continue;
+
+			if (len + 1 + e->len > cap) {
+				ser_get_usernames_response(cap, bref->buf, seqid, 1, count, len - hdr_len);
+				send_frame(srv, info, srv->slab2k, bref, len);
+
+				bref = slab_acquire(srv->slab2k, 1);
+				len = hdr_len;
+				count = 0;
+			}
+
+			bref->buf[len] = e->len;
+			memcpy(bref->buf + len + 1, e->name, e->len);
+			len += 1 + e->len;
+			count++;
+		}
+	}
+
+	ser_get_usernames_response(cap, bref->buf, seqid, 0, count, len - hdr_len);
+	send_frame(srv, info, srv->slab2k, bref, len);
+}
+
+/* Sends the GROUP_STATUS in bref, holding count records, to every member of grp. */
+static void send_status_frame(Server *srv, struct grp *grp, BufRef *bref, uint16_t count) {
+	size_t len = ser_group_status(slab_buf_cap(srv->slab2k), bref->buf, grp->gid, count);
+	/* No client has id 0, so nobody is left out. */
+	fanout_members(srv, grp, 0, grp->client_ids.len, bref, len, NULL);
+}
+
+/**
+ * Sends the latest presence and typing state of the changed members to every
+ * member of grp. Members which have disconnected are offline. Like RECEIVE_FROM_GROUP,
+ * each GROUP_STATUS is serialized once into a BufRef shared by all sends.
+ */
+void send_group_status(Server *srv, struct grp *grp, struct cid_set *changed) {
+	size_t members = grp->client_ids.len;
+	if (members == 0) return;
+	TRACE(TRACE_FANOUT_BEGIN, 0, members, 0, grp->gid);
+
+	size_t hdr_len = sizeof(struct msg_group_status);
+	size_t max_count = (slab_buf_cap(srv->slab2k) - hdr_len) / PROT_STATUS_REC_LEN;
+	BufRef *bref = NULL;
+	uint16_t count = 0;
+
+	uint64_t batch[FANOUT_BATCH_SIZE];
+	struct cid_iter iter;
+	cid_set_iter(changed, &iter);
+
+	size_t n;
+	while ((n = cid_iter_next_batch(&iter, FANOUT_BATCH_SIZE, batch)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			/* Every member holds a reference to the buffer. */
+			if (bref == NULL) {
+				bref = slab_acquire(srv->slab2k, members);
+				count = 0;
+			}
+
+			uint8_t presence = PRESENCE_OFFLINE;
+			uint8_t typing = 0;
+			ClientInfo *info = client_map_get(srv->clients, batch[i]);
+			if (info != NULL) {
+				presence = info->presence;
+				typing = info->typing_gid == grp->gid;
+			}
+			put_group_status_rec(
+				bref->buf + hdr_len + (size_t)count * PROT_STATUS_REC_LEN,
+				batch[i], presence, typing
+			);
+			count++;
+
+			if (count == max_count) {
+				send_status_frame(srv, grp, bref, count);
+				bref = NULL;
+			}
+		}
+	}
+
+	if (bref != NULL) send_status_frame(srv, grp, bref, count);
+	TRACE(TRACE_FANOUT_END, 0, members, 0, grp->gid);
+}
+
+/* Stops the typing of info, if any, and marks the change in its group. */
+static void stop_typing(Server *srv, ClientInfo *info) {
+	if (info->typing_gid == 0) return;
+
+	struct grp *grp = groups_find(srv->groups, info->typing_gid);
+	info->typing_gid = 0;
+	if (grp != NULL) presence_mark(&srv->presence, grp, info->client_id, srv->now_ns);
+}
+
+/* Drops the message being received in chunks, if any. */
+void drop_upload(ClientInfo *info) {
+	if (info->upload == NULL) return;
+	buf_chain_release(info->upload);
+	info->upload = NULL;
+}
+
+/**
+ * Adds the connected clients among uids to group gid and sends JOINED_GROUP from
+ * uid to the ones which weren't members yet. client_ids are assigned per
+ * connection and are never reused, so only connected clients become members. The
+ * others are still listed in the forwarded uids_raw. In cluster mode the group may
+ * not exist on this node yet, and its first member creates it.
+ */
+void add_members(
+	Server *srv,
+	uint64_t gid,
+	uint64_t uid,
+	uint8_t uids_len,
+	const uint64_t *uids,
+	const char *uids_raw
+) {
+	uint64_t added[MAX_UIDS_PER_MSG];
+	size_t added_len = 0;
+	struct grp *grp = groups_find(srv->groups, gid);
+
+	for (uint8_t i = 0; i < uids_len; i++) {
+		ClientInfo *member = client_map_get(srv->clients, uids[i]);
+		/* client_fd is -1 while the accept for this client_id is pending. */
+		if (member == NULL || member->client_fd < 0) continue;
+		if (grp != NULL && cid_set_exists(&grp->client_ids, uids[i])) continue;
+
+		if (!groups_insert(srv->groups, gid, uids[i])) {
+			fatal_error("add_members groups_insert");
+		}
+		/* grps live in a slab, so the pointer stays valid across inserts. */
+		if (grp == NULL) grp = groups_find(srv->groups, gid);
+		added[added_len] = uids[i];
+		added_len++;
+	}
+
+	send_joined_group(srv, uid, gid, uids_len, uids_raw, added_len, added);
+}
+
+/**
+ * Returns the buffer collecting the frames for node, or NULL if its link is down,
+ * in which case the frame is dropped.
+ */
+static PeerBuf *peer_out(Server *srv, uint32_t node) {
+	struct peer_link *l = &srv->cluster->links[node];
+	if (l->fd < 0) {
+		srv->cluster->stats.dropped++;
+		return NULL;
+	}
+	srv->cluster->stats.frames_out++;
+	return &l->out;
+}
+
+/**
+ * Owner: records that uid added uids to gid and has the nodes of the new members
+ * add them, except the node of uid which has already done so.
+ */
+static void cluster_owner_add(
+	Server *srv,
+	uint64_t gid,
+	uint64_t uid,
+	uint8_t uids_len,
+	const char *uids_raw
+) {
+	Cluster *c = srv->cluster;
+	struct owned_group *og = cluster_owned(c, gid);
+	uint32_t from = cluster_node_of(uid);
+	if (from < c->nodes_len) og->nodes |= 1ull << from;
+
+	uint64_t uids[MAX_UIDS_PER_MSG];
+	ntohll_bulk(uids_len, uids, uids_raw);
+
+	uint64_t joined = 0;
+	for (uint8_t i = 0; i < uids_len; i++) {
+		uint32_t node = cluster_node_of(uids[i]);
+		if (node < c->nodes_len && node != from) joined |= 1ull << node;
+	}
+	og->nodes |= joined;
+
+	for (uint32_t node = 0; joined != 0; node++, joined >>= 1) {
+		if (!(joined & 1)) continue;
+		if (node == c->self) {
+			add_members(srv, gid, uid, uids_len, uids, uids_raw);
+			continue;
+		}
+		PeerBuf *out = peer_out(srv, node);
+		if (out != NULL) peer_put_add(out, PEER_JOIN, gid, uid, uids_len, uids_raw);
+	}
+}
+
+/* Tells the owner of gid that uid, a client of this node, added uids to it. */
+static void cluster_add(
+	Server *srv,
+	uint64_t gid,
+	uint64_t uid,
+	uint8_t uids_len,
+	const char *uids_raw
+) {
+	/* Members only ever send to the group, which registers their node. */
+	if (uids_len == 0) return;
+
+	uint32_t owner = cluster_owner(srv->cluster, gid);
+	if (owner == srv->cluster->self) {
+		cluster_owner_add(srv, gid, uid, uids_len, uids_raw);
+		return;
+	}
+	PeerBuf *out = peer_out(srv, owner);
+	if (out != NULL) peer_put_add(out, PEER_ADD, gid, uid, uids_len, uids_raw);
+}
+
+/**
+ * Owner: numbers the message uid sent to gid and delivers it to the other nodes
+ * with members. The members on this node are left to the caller. Returns the
+ * msgid.
+ */
+static uint64_t cluster_owner_send(
+	Server *srv,
+	uint64_t gid,
+	uint64_t uid,
+	uint64_t seqid,
+	uint8_t flags,
+	const struct iovec *iov,
+	size_t iovcnt
+) {
+	Cluster *c = srv->cluster;
+	struct owned_group *og = cluster_owned(c, gid);
+	uint32_t from = cluster_node_of(uid);
+	if (from < c->nodes_len) og->nodes |= 1ull << from;
+	uint64_t msgid = og->next_msgid;
+	og->next_msgid++;
+
+	uint64_t nodes = og->nodes & ~(1ull << c->self);
+	for (uint32_t node = 0; nodes != 0; node++, nodes >>= 1) {
+		if (!(nodes & 1)) continue;
+		PeerBuf *out = peer_out(srv, node);
+		if (out != NULL) peer_put_msg(out, PEER_DELIVER, flags, gid, msgid, uid, seqid, iov, iovcnt);
+	}
+	return msgid;
+}
+
+/**
+ * Passes the message info sent to gid on to its owner on another node. Fails the
+ * request right away if the link to the owner is down, and otherwise once the
+ * owner hasn't delivered the message within CLUSTER_FORWARD_TIMEOUT_NS.
+ */
+static void cluster_forward(
+	Server *srv,
+	ClientInfo *info,
+	uint64_t seqid,
+	uint64_t gid,
+	uint8_t flags,
+	const struct iovec *iov,
+	size_t iovcnt
+) {
+	uint32_t owner = cluster_owner(srv->cluster, gid);
+	PeerBuf *out = peer_out(srv, owner);
+	if (out == NULL) {
+		uint8_t code = CODE_FAILURE;
+		send_server_error(srv, info, seqid, code);
+		return;
+	}
+	peer_put_msg(out, PEER_SEND, flags, gid, 0, info->client_id, seqid, iov, iovcnt);
+
+	srv->now_ns = monotonic_ns();
+	forward_queue_push(
+		&srv->cluster->links[owner].forwards,
+		info->client_id, seqid, srv->now_ns + CLUSTER_FORWARD_TIMEOUT_NS
+	);
+}
+
+/* Fails a forwarded request whose message the owner never delivered. */
+static void forward_failed(Server *srv, const struct forward *fw) {
+	srv->cluster->stats.forwards_failed++;
+	ClientInfo *info = client_map_get(srv->clients, fw->uid);
+	if (info != NULL && info->client_fd >= 0) {
+		uint8_t code = CODE_FAILURE;
+		send_server_error(srv, info, fw->seqid, code);
+	}
+}
+
+/**
+ * Settles the forward of a message the owner delivered. The owner handles the
+ * PEER_SENDs of a node in order, so the older forwards were dropped with a link
+ * on the way there or back and are failed. Returns false if the forward has
+ * already been failed, in which case the request is answered already.
+ */
+static bool forward_delivered(Server *srv, const PeerFrame *f) {
+	Cluster *c = srv->cluster;
+	ForwardQueue *q = &c->links[cluster_owner(c, f->gid)].forwards;
+	size_t i = forward_queue_find(q, f->uid, f->seqid);
+	if (i == q->len) return false;
+
+	for (size_t j = q->head; j < i; j++) forward_failed(srv, &q->fwd[j]);
+	forward_queue_pop(q, i + 1 - q->head);
+	return true;
+}
+
+/**
+ * Fans a message numbered by the owner out to the members on this node, and
+ * answers the request if the sender is a client of this node which is still
+ * waiting for it.
+ */
+static void cluster_deliver(Server *srv, const PeerFrame *f) {
+	struct grp *grp = groups_find(srv->groups, f->gid);
+	if (grp != NULL && (f->flags & PEER_LARGE)) {
+		BufChain *chain = buf_chain_create(srv->slab64, srv->slab2k, f->tail_len);
+		buf_chain_append(chain, f->tail, f->tail_len);
+		size_t hdr_len = ser_receive_from_group_large(
+			slab_buf_cap(srv->slab64), buf_chain_hdr(chain),
+			f->gid, f->msgid, f->uid, f->tail_len
+		);
+		buf_chain_set_hdr_len(chain, hdr_len);
+		fanout_chain(srv, grp, f->uid, chain);
+	} else if (grp != NULL) {
+		fanout_to_group(srv, grp, f->uid, f->msgid, f->tail_len, f->tail);
+	}
+
+	if (cluster_node_of(f->uid) != srv->cluster->self) return;
+	if (!forward_delivered(srv, f)) return;
+	ClientInfo *info = client_map_get(srv->clients, f->uid);
+	if (info != NULL && info->client_fd >= 0) {
+		send_send_to_group_response(srv, info, f->seqid, f->gid, f->msgid);
+	}
+}
+
+static void handle_peer_frame(Server *srv, PeerFrame *f) {
+	switch (f->type) {
+		case PEER_ADD:
+			cluster_owner_add(srv, f->gid, f->uid, f->uids_len, f->tail);
+			break;
+		case PEER_JOIN: {
+			uint64_t uids[MAX_UIDS_PER_MSG];
+			ntohll_bulk(f->uids_len, uids, f->tail);
+			add_members(srv, f->gid, f->uid, f->uids_len, uids, f->tail);
+			break;
+		}
+		case PEER_SEND: {
+			struct iovec iov = { .iov_base = (void *)f->tail, .iov_len = f->tail_len };
+			f->msgid = cluster_owner_send(srv, f->gid, f->uid, f->seqid, f->flags, &iov, 1);
+			cluster_deliver(srv, f);
+			break;
+		}
+		case PEER_DELIVER:
+			cluster_deliver(srv, f);
+			break;
+	}
+}
+
+/**
+ * Request handlers, dispatched by msgt from handle. The length of the request has
+ * already been validated against the message table, so fixed fields are read with
+ * the accessors. Returning -1 disconnects the client.
+ *
+ * Handlers add sqes but don't submit. Ops that find the SQ full wait in
+ * sq_overflow until the next flush, see submit_op. Groups with more than
+ * fanout_inline_max recipients are queued in the FanoutSched instead and sent to
+ * in deficit round robin rounds, a quantum per group every loop iteration.
+ */
+typedef int (*Handler)(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+);
+
+int handle_set_username(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	/* The message table keeps the length in [MIN_UNAME_LEN, MAX_UNAME_LEN]. */
+	const char *uname = set_username_tail(req);
+	size_t uname_len = req_len - sizeof(struct msg_set_username);
+
+	/* Ensure username chars are valid. */
+	if (!username_valid(uname_len, uname)) {
+		uint8_t code = CODE_INVALID_USERNAME;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	/* Names are unique, setting the current one again succeeds. */
+	if (!uname_index_set(srv->unames, info->client_id, uname, uname_len)) {
+		uint8_t code = CODE_USERNAME_TAKEN;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	memcpy(info->username, uname, uname_len);
+	info->username[uname_len] = '\0';
+	LOG_STR(srv->log, LOG_LEVEL_DEBUG, LOG_EV_USERNAME_SET,
+		uname, uname_len, .client_id = info->client_id);
+
+	send_set_username_response(srv, info, seqid);
+	return 0;
+}
+
+int handle_create_group(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	uint8_t uids_len;
+	uint64_t uids[MAX_UIDS_PER_MSG];
+	const char *uids_raw;
+	size_t uids_raw_len;
+	if (deser_create_group(req_len, req, &uids_len, uids, &uids_raw, &uids_raw_len) < 0) {
+		uint8_t code = CODE_INVALID_MSG_LEN;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	uint64_t gid = next_group_id;
+	if (!groups_insert(srv->groups, gid, info->client_id)) {
+		uint8_t code = CODE_FAILURE;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+	next_group_id++;
+	if (srv->capture != NULL) {
+		struct capture_gid rec = { .gid = gid, .seqid = seqid };
+		capture_push(srv->capture, CAPTURE_GID, info->client_id, srv->now_ns, &rec, sizeof(rec));
+	}
+
+	send_create_group_response(srv, info, seqid, gid);
+	add_members(srv, gid, info->client_id, uids_len, uids, uids_raw);
+	if (srv->cluster != NULL) cluster_add(srv, gid, info->client_id, uids_len, uids_raw);
+	return 0;
+}
+
+int handle_add_to_group(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	uint64_t gid;
+	uint8_t uids_len;
+	const char *uids_raw;
+	if (deser_add_to_group(req_len, req, &gid, &uids_len, &uids_raw) < 0) {
+		uint8_t code = CODE_INVALID_MSG_LEN;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	/* Only members can add to a group. */
+	struct grp *grp = groups_find(srv->groups, gid);
+	if (grp == NULL || !cid_set_exists(&grp->client_ids, info->client_id)) {
+		uint8_t code = CODE_INVALID_GROUP;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	uint64_t uids[MAX_UIDS_PER_MSG];
+	ntohll_bulk(uids_len, uids, uids_raw);
+
+	send_add_to_group_response(srv, info, seqid, gid);
+	add_members(srv, gid, info->client_id, uids_len, uids, uids_raw);
+	if (srv->cluster != NULL) cluster_add(srv, gid, info->client_id, uids_len, uids_raw);
+	return 0;
+}
+
+int handle_get_usernames(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	(void)req_len;
+	uint64_t gid = get_usernames_gid(req);
+
+	/* Only members can list a group. */
+	struct grp *grp = groups_find(srv->groups, gid);
+	if (grp == NULL || !cid_set_exists(&grp->client_ids, info->client_id)) {
+		uint8_t code = CODE_INVALID_GROUP;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	send_usernames(srv, info, seqid, grp);
+	return 0;
+}
+
+int handle_send_to_group(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	uint64_t gid = send_to_group_gid(req);
+	const char *msg = send_to_group_tail(req);
+	size_t msg_len = req_len - sizeof(struct msg_send_to_group);
+
+	/* Only members can send to a group. */
+	struct grp *grp = groups_find(srv->groups, gid);
+	if (grp == NULL || !cid_set_exists(&grp->client_ids, info->client_id)) {
+		uint8_t code = CODE_INVALID_GROUP;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	/* Sending ends typing. */
+	if (info->typing_gid == gid) stop_typing(srv, info);
+
+	/* In cluster mode the owner of the group numbers its messages. */
+	uint64_t msgid;
+	if (srv->cluster == NULL) {
+		msgid = grp->next_msgid;
+		grp->next_msgid++;
+	} else {
+		struct iovec iov = { .iov_base = (void *)msg, .iov_len = msg_len };
+		if (cluster_owner(srv->cluster, gid) != srv->cluster->self) {
+			cluster_forward(srv, info, seqid, gid, 0, &iov, 1);
+			return 0;
+		}
+		msgid = cluster_owner_send(srv, gid, info->client_id, seqid, 0, &iov, 1);
+	}
+
+	fanout_to_group(srv, grp, info->client_id, msgid, msg_len, msg);
+	send_send_to_group_response(srv, info, seqid, gid, msgid);
+	return 0;
+}
+
+int handle_send_to_group_start(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	(void)req_len;
+	uint64_t gid = send_to_group_start_gid(req);
+	uint32_t msg_len = send_to_group_start_msg_len(req);
+	if (msg_len == 0 || msg_len > MAX_LARGE_MSG_LEN) {
+		uint8_t code = CODE_INVALID_MSG_LEN;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	/* Only one message can be received in chunks at a time. */
+	if (info->upload != NULL) {
+		uint8_t code = CODE_INVALID_CHUNK;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	struct grp *grp = groups_find(srv->groups, gid);
+	if (grp == NULL || !cid_set_exists(&grp->client_ids, info->client_id)) {
+		uint8_t code = CODE_INVALID_GROUP;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	/* msg_len is known up front, so the chain never has to grow. */
+	info->upload = buf_chain_create(srv->slab64, srv->slab2k, msg_len);
+	info->upload_gid = gid;
+	info->upload_len = msg_len;
+	return 0;
+}
+
+int handle_send_to_group_chunk(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	const char *data = send_to_group_chunk_tail(req);
+	size_t data_len = req_len - sizeof(struct msg_send_to_group_chunk);
+
+	BufChain *upload = info->upload;
+	if (upload == NULL || data_len > info->upload_len - buf_chain_data_len(upload)) {
+		drop_upload(info);
+		uint8_t code = CODE_INVALID_CHUNK;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	/* Copied straight out of the recv_ring into the buffers of the chain. */
+	buf_chain_append(upload, data, data_len);
+	return 0;
+}
+
+int handle_send_to_group_end(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	(void)req;
+	(void)req_len;
+	BufChain *upload = info->upload;
+	if (upload == NULL || buf_chain_data_len(upload) != info->upload_len) {
+		drop_upload(info);
+		uint8_t code = CODE_INVALID_CHUNK;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	/* Members are only removed on disconnect, so the sender is still one. */
+	uint64_t gid = info->upload_gid;
+	struct grp *grp = groups_find(srv->groups, gid);
+	assert(grp != NULL);
+	info->upload = NULL;
+	if (info->typing_gid == gid) stop_typing(srv, info);
+
+	/* The data buffers follow the header buffer of the chain. */
+	uint64_t msgid;
+	if (srv->cluster == NULL) {
+		msgid = grp->next_msgid;
+		grp->next_msgid++;
+	} else if (cluster_owner(srv->cluster, gid) != srv->cluster->self) {
+		cluster_forward(srv, info, seqid, gid, PEER_LARGE, &upload->iov[1], upload->bufs_len - 1);
+		buf_chain_release(upload);
+		return 0;
+	} else {
+		msgid = cluster_owner_send(
+			srv, gid, info->client_id, seqid, PEER_LARGE, &upload->iov[1], upload->bufs_len - 1
+		);
+	}
+
+	size_t hdr_len = ser_receive_from_group_large(
+		slab_buf_cap(srv->slab64), buf_chain_hdr(upload),
+		gid, msgid, info->client_id, buf_chain_data_len(upload)
+	);
+	buf_chain_set_hdr_len(upload, hdr_len);
+
+	fanout_chain(srv, grp, info->client_id, upload);
+	send_send_to_group_response(srv, info, seqid, gid, msgid);
+	return 0;
+}
+
+int handle_set_options(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	(void)req_len;
+
+	/* Frames already in the envelope go out before the ones sent without it. */
+	info->options = set_options_options(req) & OPT_ALL;
+	if (!(info->options & OPT_BATCH) && info->batch != NULL) {
+		send_batch(srv, info);
+	}
+
+	send_set_options_response(srv, info, seqid, info->options);
+	return 0;
+}
+
+int handle_set_presence(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	(void)req_len;
+	uint8_t presence = set_presence_presence(req);
+	if (presence > PRESENCE_OFFLINE) {
+		uint8_t code = CODE_FAILURE;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	if (presence == info->presence) return 0;
+	info->presence = presence;
+	mark_presence(srv, info->client_id);
+	return 0;
+}
+
+int handle_set_typing(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint64_t seqid
+) {
+	(void)req_len;
+	uint64_t gid = set_typing_gid(req);
+	bool typing = set_typing_typing(req) != 0;
+
+	/* Only members can type in a group. */
+	struct grp *grp = groups_find(srv->groups, gid);
+	if (grp == NULL || !cid_set_exists(&grp->client_ids, info->client_id)) {
+		uint8_t code = CODE_INVALID_GROUP;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	if (!typing) {
+		if (info->typing_gid == gid) stop_typing(srv, info);
+		return 0;
+	}
+
+	/* Clients type in one group at a time. */
+	if (info->typing_gid == gid) return 0;
+	stop_typing(srv, info);
+	info->typing_gid = gid;
+	presence_mark(&srv->presence, grp, info->client_id, srv->now_ns);
+	return 0;
+}
+
+/* Clients can't send the message types without a handler. */
+static const Handler handlers[MSGT_COUNT] = {
+	[MSGT_SET_USERNAME] = handle_set_username,
+	[MSGT_CREATE_GROUP] = handle_create_group,
+	[MSGT_ADD_TO_GROUP] = handle_add_to_group,
+	[MSGT_SEND_TO_GROUP] = handle_send_to_group,
+	[MSGT_SEND_TO_GROUP_START] = handle_send_to_group_start,
+	[MSGT_SEND_TO_GROUP_CHUNK] = handle_send_to_group_chunk,
+	[MSGT_SEND_TO_GROUP_END] = handle_send_to_group_end,
+	[MSGT_SET_OPTIONS] = handle_set_options,
+	[MSGT_GET_USERNAMES] = handle_get_usernames,
+	[MSGT_SET_PRESENCE] = handle_set_presence,
+	[MSGT_SET_TYPING] = handle_set_typing,
+};
+
+/**
+ * req_len is the len already parsed from the header by the caller and req holds
+ * all of its bytes. Unknown message types return -1 so that the client is
+ * disconnected, while invalid lengths only fail the request.
+ */
+int handle(
+	Server *srv,
+	ClientInfo *info,
+	const char *req,
+	size_t req_len,
+	uint8_t msgt,
+	uint64_t seqid
+) {
+	if (msgt >= MSGT_COUNT || handlers[msgt] == NULL) return -1;
+
+	if (!prot_len_valid(msgt, req_len)) {
+		uint8_t code = CODE_INVALID_MSG_LEN;
+		send_server_error(srv, info, seqid, code);
+		return 0;
+	}
+
+	return handlers[msgt](srv, info, req, req_len, seqid);
+}
+
+/* Returns the number of connections waiting in the listen backlog, or -1. */
+static int listen_queue_len(Server *srv) {
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	if (getsockopt(srv->listeners[LISTENER_TCP].fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) return -1;
+
+	/* For listening sockets these hold the accept queue length and its limit. */
+	srv->accept_stats.listen_queue_len = ti.tcpi_unacked;
+	srv->accept_stats.listen_queue_max = ti.tcpi_sacked;
+	return ti.tcpi_unacked;
+}
+
+/**
+ * Whether admission control lets another client in. Otherwise sets wait_ns to the
+ * time until it may, if a timer holds it back, or to 0.
+ */
+static bool admit(Server *srv, uint64_t *wait_ns_out) {
+	const char *reason = NULL;
+	uint64_t wait_ns = 0;
+	if (srv->accept_retry_ns > srv->now_ns) {
+		reason = "out of fds";
+		wait_ns = srv->accept_retry_ns - srv->now_ns;
+	} else if (srv->max_conns > 0 && srv->clients->len >= srv->max_conns) {
+		reason = "max_conns";
+	} else {
+		wait_ns = rate_take_one(&srv->accept_limit, &srv->accept_full_at_ns, srv->now_ns);
+		if (wait_ns > 0) reason = "accept rate";
+	}
+
+	if (reason != NULL) {
+		if (srv->accept_paused_ns == 0) {
+			srv->accept_paused_ns = srv->now_ns;
+			srv->accept_stats.pauses++;
+			LOG_STR(srv->log, LOG_LEVEL_WARN, LOG_EV_ACCEPT_PAUSED,
+				reason, strlen(reason), .code = listen_queue_len(srv));
+		}
+		*wait_ns_out = wait_ns;
+		return false;
+	}
+
+	if (srv->accept_paused_ns != 0) {
+		uint64_t paused_ns = srv->now_ns - srv->accept_paused_ns;
+		srv->accept_stats.paused_ns += paused_ns;
+		srv->accept_paused_ns = 0;
+		LOG(srv->log, LOG_LEVEL_INFO, LOG_EV_ACCEPT_RESUMED,
+			.arg = paused_ns, .code = listen_queue_len(srv));
+	}
+	return true;
+}
+
+/* Whether an open listener has fewer accepts armed than it keeps. */
+static bool accept_idle(Server *srv) {
+	for (int i = 0; i < LISTENER_COUNT; i++) {
+		unsigned keep = i == LISTENER_PEER ? 1 : ACCEPTS_ARMED;
+		if (srv->listeners[i].fd >= 0 && srv->listeners[i].armed < keep) return true;
+	}
+	return false;
+}
+
+/**
+ * Arms accepts on every listener up to ACCEPTS_ARMED, or one for other nodes,
+ * unless admission control holds them back. Connections keep queueing in the
+ * listen backlogs meanwhile. Returns the time until accepting may resume if it
+ * is paused by a timer, or 0.
+ */
+uint64_t maybe_accept(Server *srv) {
+	/* The listeners go to the new process along with the clients. */
+	if (srv->handover_sock >= 0) return 0;
+
+	/* Other nodes aren't clients, so admission control doesn't hold them back. */
+	struct listener *peer = &srv->listeners[LISTENER_PEER];
+	if (peer->fd >= 0 && peer->armed == 0) {
+		add_accept(srv, next_client_id, LISTENER_PEER);
+		next_client_id++;
+	}
+
+	for (int i = 0; i < LISTENER_COUNT; i++) {
+		if (i == LISTENER_PEER || srv->listeners[i].fd < 0) continue;
+
+		while (srv->listeners[i].armed < ACCEPTS_ARMED) {
+			uint64_t wait_ns = 0;
+			if (!admit(srv, &wait_ns)) return wait_ns;
+			add_accept(srv, next_client_id, i);
+			next_client_id++;
+		}
+	}
+	return 0;
+}
+
+/**
+ * The client reserved for the failed accept is dropped. Running out of fds or
+ * memory pauses accepting, other errors e.g. ECONNABORTED just accept again.
+ * Accepts canceled by a handover aren't failures.
+ */
+void handle_accept_failed(Server *srv, Operation *op, int err) {
+	if (err != ECANCELED || srv->handover_sock < 0) {
+		LOG(srv->log, LOG_LEVEL_WARN, LOG_EV_OP_FAILED,
+			.client_id = op->client_id, .fd = op->client_fd, .arg = op->type, .code = err);
+	}
+
+	srv->listeners[op->listener].armed--;
+	client_map_delete(srv->clients, op->client_id);
+	free_op(srv, op);
+
+	if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+		srv->accept_retry_ns = srv->now_ns + ACCEPT_RETRY_NS;
+	}
+}
+
+/* Closes a link from another node, which reconnects on its own. */
+static void peer_recv_close(Server *srv, Operation *op) {
+	must_close(op->client_fd, "peer_recv_close close");
+	if (op->recv_ring->base != NULL) recv_ring_deinit(op->recv_ring);
+	free(op->recv_ring);
+	op->recv_ring = NULL;
+	free_op(srv, op);
+	srv->peer_ops--;
+}
+
+/**
+ * Creates the rings of a gateway which connected to the shm listener and passes
+ * them over its socket. Returns the ring it sends to, or NULL with errno set.
+ */
+static RecvRing *shm_client_new(Server *srv, ClientInfo *info, int client_fd) {
+	struct shm_client *sc = must_calloc(1, sizeof(*sc), "shm_client_new");
+	int memfd = shm_conn_create(&sc->conn, SHM_RING_SIZE);
+	if (memfd < 0) {
+		free(sc);
+		return NULL;
+	}
+
+	/* The mappings keep the memfd alive on both ends. */
+	int ret = shm_send_fd(client_fd, memfd);
+	int err = errno;
+	must_close(memfd, "shm_client_new close memfd");
+	if (ret < 0) {
+		shm_client_free(sc);
+		errno = err;
+		return NULL;
+	}
+
+	info->shm = sc;
+	srv->shm_clients++;
+	return &sc->conn.in.ring;
+}
+
+/**
+ * Turns the accept of a link from another node into its recv. The client reserved
+ * for the accept is dropped, links aren't clients. Their rings are large enough
+ * for any peer frame and don't come from the pool.
+ */
+static void peer_accept(Server *srv, int fd, Operation *op) {
+	client_map_delete(srv->clients, op->client_id);
+	op->client_fd = fd;
+	op->type = OP_PEER_RECV;
+	srv->peer_ops++;
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	/* base stays NULL if the ring can't be mapped. */
+	op->recv_ring = must_calloc(1, sizeof(RecvRing), "peer_accept");
+	if (!recv_ring_init(op->recv_ring, CLUSTER_RING_SIZE)) {
+		LOG(srv->log, LOG_LEVEL_WARN, LOG_EV_RECV_RING_FAILED, .fd = fd, .code = errno);
+		peer_recv_close(srv, op);
+		return;
+	}
+	submit_op(srv, op);
+}
+
+void handle_accept(Server *srv, int client_fd, ClientInfo *info, Operation *op) {
+	info->client_fd = client_fd;
+	DTRACE_PROBE2(chat_server, accept, op->client_id, client_fd);
+	srv->listeners[op->listener].armed--;
+	srv->accept_stats.accepted++;
+
+	/* Accept more connections if admission control allows it. */
+	maybe_accept(srv);
+
+	if (op->listener == LISTENER_PEER) {
+		peer_accept(srv, client_fd, op);
+		return;
+	}
+
+	/**
+	 * The frames a client gets in one loop iteration already go out in one send,
+	 * see queue_send. Nagle would still hold the next iteration's back until the
+	 * client's delayed ACK.
+	 */
+	if (op->listener == LISTENER_TCP) {
+		int one = 1;
+		setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	/* Each ring takes two mappings, so this fails once vm.max_map_count is hit. */
+	if (op->listener == LISTENER_SHM) {
+		op->recv_ring = shm_client_new(srv, info, client_fd);
+	} else {
+		op->recv_ring = recv_ring_pool_acquire(srv->recv_rings);
+	}
+	if (op->recv_ring == NULL) {
+		LOG(srv->log, LOG_LEVEL_WARN, LOG_EV_RECV_RING_FAILED,
+			.client_id = op->client_id, .fd = client_fd, .code = errno);
+		op->client_fd = client_fd;
+		disconnect_and_free_op(srv, info, op);
+		return;
+	}
+
+	/* Log connection info. */
+	LOG_CLIENT(srv->log, LOG_LEVEL_INFO, LOG_EV_CONNECTED, info);
+
+	/* Recv from connected socket. */
+	add_recv(srv, op, client_fd);
+}
+
+/**
+ * Captures the complete frames in the recv ring of op which weren't yet, stamped
+ * with the time they arrived. Frames deferred by rate limiting or fan-out
+ * backpressure stay in the ring and keep their first timestamp.
+ */
+static void capture_frames(Server *srv, Operation *op) {
+	RecvRing *ring = op->recv_ring;
+	uint64_t pos = ring->captured > ring->head ? ring->captured : ring->head;
+	while (ring->tail - pos >= PROT_HDR_LEN) {
+		const char *buf = ring->base + (pos & (ring->size - 1));
+		uint16_t len;
+		uint8_t msgt;
+		uint64_t seqid;
+		deser_header(buf, &len, &msgt, &seqid);
+
+		/* Invalid lengths are left to handle_frames, which drops the client. */
+		if (len < PROT_HDR_LEN || len > PROT_MAX_LEN || ring->tail - pos < len) break;
+		capture_push(srv->capture, CAPTURE_FRAME, op->client_id, srv->now_ns, buf, len);
+		pos += len;
+	}
+	ring->captured = pos;
+}
+
+/**
+ * Handles the complete frames in the recv ring of op. Returns false if the client
+ * was disconnected or its recv was deferred, in which case recv must not be
+ * re-armed.
+ */
+bool handle_frames(Server *srv, ClientInfo *info, Operation *op) {
+	RecvRing *ring = op->recv_ring;
+
+	/**
+	 * A doorbell of a gateway may mean bytes to handle or room for its sends. A
+	 * gateway which published an invalid position is dropped.
+	 */
+	if (ring->shared) {
+		if (!info->shm->broken && shm_ring_pull((ShmRing *)ring) < 0) {
+			shm_client_break(srv, info->shm, info->client_id, op->client_fd);
+		}
+		if (info->shm->broken) {
+			disconnect_and_free_op(srv, info, op);
+			return false;
+		}
+		if (info->shm->blocked_len > 0) shm_flush_blocked(srv, info->shm);
+	}
+
+	if (srv->capture != NULL) capture_frames(srv, op);
+
+	/* Frames are contiguous in the ring even when they wrap around its end. */
+	while (recv_ring_len(ring) >= PROT_HDR_LEN) {
+		char *req_buf = recv_ring_read_ptr(ring);
+		uint16_t req_len;
+		uint8_t req_msgt;
+		uint64_t req_seqid;
+		deser_header(req_buf, &req_len, &req_msgt, &req_seqid);
+
+		if (req_len < PROT_HDR_LEN || req_len > PROT_MAX_LEN) {
+			disconnect_and_free_op(srv, info, op);
+			return false;
+		}
+
+		/* Received request is incomplete. The rest is received right after it. */
+		if (recv_ring_len(ring) < req_len) break;
+
+		/* The frame stays in the ring and is handled once the scheduler has caught up. */
+		if ((req_msgt == MSGT_SEND_TO_GROUP || req_msgt == MSGT_SEND_TO_GROUP_END)
+			&& srv->fanout.pending >= FANOUT_MAX_PENDING) {
+			defer_recv(srv, op, 0);
+			return false;
+		}
+
+		/* Unknown types are left to handle, which drops the client. */
+		if (req_msgt < MSGT_COUNT) {
+			uint64_t wait_ns = rate_take(&srv->limits, &info->buckets, req_msgt, srv->now_ns);
+			if (wait_ns > 0) {
+				LOG(srv->log, LOG_LEVEL_DEBUG, LOG_EV_RATE_LIMITED,
+					.client_id = op->client_id, .arg = req_msgt, .code = srv->limits.defer);
+				if (srv->limits.defer) {
+					/* The frame stays in the ring and is handled first on wake up. */
+					defer_recv(srv, op, srv->now_ns + wait_ns);
+					return false;
+				}
+
+				uint8_t code = CODE_RATE_LIMITED;
+				send_server_error(srv, info, req_seqid, code);
+				recv_ring_consume(ring, req_len);
+				continue;
+			}
+		}
+
+		/* There's enough bytes to parse a request. */
+		DTRACE_PROBE3(chat_server, handle, op->client_id, req_msgt, req_seqid);
+		TRACE(TRACE_HANDLE_BEGIN, req_msgt, 0, op->client_id, req_seqid);
+		int ret = handle(srv, info, req_buf, req_len, req_msgt, req_seqid);
+		TRACE(TRACE_HANDLE_END, req_msgt, 0, op->client_id, req_seqid);
+		if (ret == -1) {
+			disconnect_and_free_op(srv, info, op);
+			return false;
+		}
+
+		recv_ring_consume(ring, req_len);
+	}
+
+	return true;
+}
+
+void handle_recv(Server *srv, ClientInfo *info, Operation *op, size_t bytes_read) {
+	DTRACE_PROBE2(chat_server, recv, op->client_id, bytes_read);
+	if (bytes_read == 0) {
 		disconnect_and_free_op(srv, info, op);
 		return;
 	}
 
-	char *req_buf = op->buf_ref->buf;
-	while (bytes_read >= PROT_HDR_LEN) {
-		uint16_t req_len;
-		uint8_t req_msgt;
-		uint64_t req_seqid;
-		deser_header(req_buf, &req_len, &req_msgt, &req_seqid);
+	/* The bytes of a gateway are already in its ring, bytes_read are doorbells. */
+	if (!op->recv_ring->shared) recv_ring_commit(op->recv_ring, bytes_read);
 
-		if (req_len > BUFFER_SIZE_2KB) {
-			disconnect_and_free_op(srv, info, op);
-			return;
-		}
+	/* The frames are handed over along with the socket. */
+	if (srv->handover_sock >= 0) {
+		defer_recv(srv, op, 0);
+		return;
+	}
 
-		/* Received request is incomplete. */
-		if (bytes_read < req_len) {
-			/* No need for memmove if we haven't handled anything. */
-			if (op->buf_ref->buf != req_buf) {
-				memmove(op->buf_ref->buf, req_buf, op->buf_cap - bytes_read);
-			}
-			break;
+	if (handle_frames(srv, info, op)) resume_recv(srv, op);
+}
+
+/**
+ * Handles the frames of the deferred clients whose tokens have refilled and
+ * re-arms their recv. Returns the time until the next remaining one is due, or
+ * 0 if none remain.
+ */
+uint64_t resume_deferred(Server *srv) {
+	if (srv->deferred_len == 0) return 0;
+	srv->now_ns = monotonic_ns();
+
+	size_t len = srv->deferred_len;
+	size_t kept = 0;
+	for (size_t i = 0; i < len; i++) {
+		struct deferred_recv d = srv->deferred[i];
+		if (d.wake_ns > srv->now_ns) {
+			srv->deferred[kept] = d;
+			kept++;
+			continue;
 		}
 
-		/* There's enough bytes to parse a request. */
-		int ret = handle(srv, info, op, req_buf, req_len, req_msgt, req_seqid);
-		if (ret == -1) {
-			disconnect_and_free_op(srv, info, op);
-			return;
+		Operation *op = op_pool_get(srv->pool, d.pool_id);
+		assert(op != NULL);
+
+		/* A failed send may have dropped the client while its recv was parked. */
+		ClientInfo *info = client_map_get(srv->clients, op->client_id);
+		if (info == NULL) {
+			free_op(srv, op);
+			continue;
 		}
 
-		bytes_read -= req_len;
-		req_buf += req_len;
+		if (handle_frames(srv, info, op)) resume_recv(srv, op);
 	}
 
-	resume_recv(srv, op, bytes_read);
+	/* Clients deferred again above were appended after len. */
+	size_t appended = srv->deferred_len - len;
+	memmove(&srv->deferred[kept], &srv->deferred[len], appended * sizeof(struct deferred_recv));
+	srv->deferred_len = kept + appended;
+
+	uint64_t next_due = 0;
+	for (size_t i = 0; i < srv->deferred_len; i++) {
+		/* Gateways with frames left are deferred to 0, i.e. due right away. */
+		uint64_t wake_ns = srv->deferred[i].wake_ns;
+		uint64_t due = wake_ns > srv->now_ns ? wake_ns - srv->now_ns : 1;
+		if (next_due == 0 || due < next_due) next_due = due;
+	}
+	return next_due;
 }
 
 /**
@@ -444,39 +2385,205 @@ void handle_recv(Server *srv, ClientInfo *info, Operation *op, size_t bytes_read
  * its value hits 0.
  */
 void handle_send(Server *srv, ClientInfo *info, Operation *op, size_t bytes_written) {
+	DTRACE_PROBE2(chat_server, send, op->client_id, bytes_written);
 	if (bytes_written == 0) {
-		log_with_client_info(info, "SHORT_WRITE_0");
+		LOG_CLIENT(srv->log, LOG_LEVEL_WARN, LOG_EV_SHORT_WRITE_0, info);
 	}
 
+	/* The rest goes out before any other send of the client. */
 	if (op_is_incomplete(op, bytes_written)) {
-		resume_send(srv, op, bytes_written);
+		if (op->type == OP_SENDMSG) {
+			resume_sendmsg(srv, op, bytes_written);
+		} else if (op->type == OP_WRITEV) {
+			resume_writev(srv, op, bytes_written);
+		} else {
+			resume_send(srv, op, bytes_written);
+		}
 		return;
 	}
 	
 	free_op(srv, op);
+	info->send_busy = false;
+	if (info->sendq_head < info->sendq_len) mark_send_pending(srv, info);
+}
+
+/**
+ * Closes the link to node after its connect or send failed and drops the frames
+ * waiting for it. Connecting is retried after CLUSTER_RETRY_NS.
+ */
+static void peer_link_down(Server *srv, uint32_t node, int err) {
+	Cluster *c = srv->cluster;
+	struct peer_link *l = &c->links[node];
+	if (!l->connecting) {
+		c->stats.links_down++;
+		LOG(srv->log, LOG_LEVEL_WARN, LOG_EV_PEER_DOWN, .arg = node, .code = err);
+	}
+
+	must_close(l->fd, "peer_link_down close");
+	l->fd = -1;
+	l->connecting = false;
+	l->sending = false;
+	l->retry_ns = srv->now_ns + CLUSTER_RETRY_NS;
+
+	c->stats.dropped += l->out.len + l->inflight.len - l->sent;
+	l->out.len = 0;
+	l->inflight.len = 0;
+	l->sent = 0;
+}
+
+/* Handles the completion of an op on a link between nodes. */
+static void handle_peer_op(Server *srv, Operation *op, int res) {
+	Cluster *c = srv->cluster;
+
+	if (op->type == OP_PEER_RECV) {
+		if (res <= 0) {
+			peer_recv_close(srv, op);
+			return;
+		}
+		RecvRing *ring = op->recv_ring;
+		recv_ring_commit(ring, res);
+		c->stats.bytes_in += res;
+
+		while (1) {
+			PeerFrame f;
+			ssize_t len = peer_frame_parse(recv_ring_read_ptr(ring), recv_ring_len(ring), &f);
+			if (len == 0) break;
+			if (len < 0) {
+				peer_recv_close(srv, op);
+				return;
+			}
+			c->stats.frames_in++;
+			handle_peer_frame(srv, &f);
+			recv_ring_consume(ring, len);
+		}
+		submit_op(srv, op);
+		return;
+	}
+
+	uint32_t node = op->client_id;
+	struct peer_link *l = &c->links[node];
+	if (res < 0 || (op->type == OP_PEER_SEND && res == 0)) {
+		peer_link_down(srv, node, res < 0 ? -res : EPIPE);
+	} else if (op->type == OP_PEER_CONNECT) {
+		l->connecting = false;
+		c->stats.links_up++;
+		LOG(srv->log, LOG_LEVEL_INFO, LOG_EV_PEER_UP, .arg = node);
+	} else {
+		c->stats.bytes_out += res;
+		l->sent += res;
+		if (l->sent < l->inflight.len) {
+			submit_op(srv, op);
+			return;
+		}
+		l->sending = false;
+		l->inflight.len = 0;
+		l->sent = 0;
+	}
+	free_op(srv, op);
+	srv->peer_ops--;
+}
+
+/* A completion copied out of the CQ, which is released before handling the batch. */
+struct reaped_cqe {
+	uint64_t user_data;
+	int res;
+};
+
+/* Completions which don't belong to an op. */
+static bool internal_udata(uint64_t user_data) {
+	/* Timeouts liburing adds itself on kernels without IORING_FEAT_EXT_ARG. */
+	return user_data == LIBURING_UDATA_TIMEOUT || user_data == HANDOVER_CANCEL_UDATA;
+}
+
+/**
+ * Prefetches what handling the completions is going to touch, in passes over the
+ * batch so that the cache misses overlap instead of stalling one after another:
+ * the slots of the ops, the ops, the buckets of their clients and their recv
+ * rings, and last the ClientInfos and the received bytes. Each pass only reads
+ * what the one before prefetched. ops[i] is set to the op of reaped[i], or NULL.
+ */
+static void prefetch_batch(Server *srv, const struct reaped_cqe *reaped, int count,
+						   Operation *ops[]) {
+	for (int i = 0; i < count; i++) {
+		if (!internal_udata(reaped[i].user_data)) op_pool_prefetch(srv->pool, reaped[i].user_data);
+	}
+
+	for (int i = 0; i < count; i++) {
+		ops[i] = internal_udata(reaped[i].user_data)
+			? NULL : op_pool_get(srv->pool, reaped[i].user_data);
+		if (ops[i] != NULL) __builtin_prefetch(ops[i]);
+	}
+
+	/* Links between nodes have no ClientInfo. */
+	for (int i = 0; i < count; i++) {
+		Operation *op = ops[i];
+		if (op == NULL || op->type >= OP_PEER_CONNECT) continue;
+		client_map_prefetch_bucket(srv->clients, op->client_id);
+		if (op->type == OP_READ && op->recv_ring != NULL) __builtin_prefetch(op->recv_ring);
+	}
+
+	for (int i = 0; i < count; i++) {
+		Operation *op = ops[i];
+		if (op == NULL || op->type >= OP_PEER_CONNECT) continue;
+		client_map_prefetch_info(srv->clients, op->client_id);
+		if (op->type == OP_READ && op->recv_ring != NULL && !op->recv_ring->shared) {
+			__builtin_prefetch(recv_ring_read_ptr(op->recv_ring));
+		}
+	}
 }
 
 void handle_cqe_batch(Server *srv, struct io_uring_cqe *cqes[], int count) {
+	/* Rate limits and envelopes use the same time for the whole batch. */
+	srv->now_ns = monotonic_ns();
+	assert(count <= CQE_BATCH_MAX);
+
+	struct reaped_cqe reaped[CQE_BATCH_MAX];
 	for (int i = 0; i < count; i++) {
-		struct io_uring_cqe *cqe = cqes[i];
+		reaped[i].user_data = cqes[i]->user_data;
+		reaped[i].res = cqes[i]->res;
+	}
+	/* DO NOT TOUCH CQES AFTER THIS POINT. */
+	io_uring_cq_advance(srv->ring, count);
 
-		uint64_t pool_id = cqe->user_data;
-		int cqe_res = cqe->res;
-		/* DO NOT TOUCH CQE AFTER THIS POINT. */
-		io_uring_cqe_seen(srv->ring, cqe);
+	Operation *ops[CQE_BATCH_MAX];
+	prefetch_batch(srv, reaped, count, ops);
 
-		Operation *op = op_pool_get(srv->pool, pool_id);
-		assert(op != NULL);
+	for (int i = 0; i < count; i++) {
+		if (reaped[i].user_data == HANDOVER_CANCEL_UDATA) srv->handover_cancels--;
+		if (ops[i] == NULL) continue;
+
+		Operation *op = ops[i];
+		int cqe_res = reaped[i].res;
+		TRACE(TRACE_COMPLETE, op->type, op->pool_id, op->client_id, (int64_t)cqe_res);
+
+		/* Links between nodes have no ClientInfo. */
+		if (op->type >= OP_PEER_CONNECT) {
+			handle_peer_op(srv, op, cqe_res);
+			continue;
+		}
 
 		ClientInfo *info = client_map_get(srv->clients, op->client_id);
 
+		/* A failed accept has no connection to drop. */
+		if (cqe_res < 0 && op->type == OP_ACCEPT) {
+			handle_accept_failed(srv, op, -cqe_res);
+			continue;
+		}
+
+		/**
+		 * Only handovers cancel recvs. resume_recv parks it to be handed over, or
+		 * re-arms it if the handover was given up meanwhile.
+		 */
+		if (cqe_res == -ECANCELED && op->type == OP_READ && info != NULL) {
+			resume_recv(srv, op);
+			continue;
+		}
+
 		/* If an operation fails, server disconnects the client and frees the op. */
 		if (cqe_res < 0) {
-			fprintf(stderr,
-				"[fd=%d client_id=%lu] op %s failed: %s\n",
-				op->client_fd, op->client_id,
-				op_type_str(op->type), strerror(-cqe_res)
-			);
+			LOG(srv->log, LOG_LEVEL_WARN, LOG_EV_OP_FAILED,
+				.client_id = op->client_id, .fd = op->client_fd,
+				.arg = op->type, .code = -cqe_res);
 			disconnect_and_free_op(srv, info, op);
 			continue;
 		}
@@ -487,11 +2594,8 @@ void handle_cqe_batch(Server *srv, struct io_uring_cqe *cqes[], int count) {
 		 * a malformed message from this client_id and already dropped its connection.
 		 */
 		if (info == NULL) {
-			printf(
-				"[fd=%d client_id=%lu] successful op %s but client already disconnected.\n",
-				op->client_fd, op->client_id,
-				op_type_str(op->type)
-			);
+			LOG(srv->log, LOG_LEVEL_DEBUG, LOG_EV_OP_AFTER_DISCONNECT,
+				.client_id = op->client_id, .fd = op->client_fd, .arg = op->type);
 			free_op(srv, op);
 			continue;
 		}
@@ -508,58 +2612,650 @@ void handle_cqe_batch(Server *srv, struct io_uring_cqe *cqes[], int count) {
 				handle_recv(srv, info, op, bytes_read);
 				break;
 			}
-			case OP_WRITE: {
+			case OP_WRITE:
+			case OP_SENDMSG:
+			case OP_WRITEV: {
 				/* cqe_res isn't negative so it's safe to assign to size_t. */
 				size_t bytes_written = cqe_res;
 				handle_send(srv, info, op, bytes_written);
 				break;
 			}
 			default: {
-				printf("invalid operation type: %s\n", op_type_str(op->type));
+				LOG(srv->log, LOG_LEVEL_ERROR, LOG_EV_INVALID_OP_TYPE,
+					.client_id = op->client_id, .arg = op->type);
 			}
 		}
 	}
 }
 
-int server_start(Server *srv) {
-	int ret;
-	struct io_uring_cqe *cqes[CQE_BATCH_SIZE];
-	
-	add_accept(srv, next_client_id);
-	next_client_id++;
+/* Returns the earliest of two due times, where 0 means nothing is due. */
+static uint64_t min_due(uint64_t a, uint64_t b) {
+	if (a == 0) return b;
+	if (b == 0 || a < b) return a;
+	return b;
+}
 
-	if ((ret = io_uring_submit(srv->ring)) < 0) {
-		fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
-		exit(EXIT_FAILURE);
-	} 
+/**
+ * Cancels the accepts and the recvs in flight so that nothing more is read from
+ * the sockets being handed over. Carries on with the next flush once the SQ is
+ * full.
+ */
+static void handover_cancel(Server *srv) {
+	/* The accepts are canceled first, again if the SQ filled up before the recvs. */
+	for (int i = 0; i < LISTENER_COUNT && srv->handover_cancel_next == 0; i++) {
+		struct listener *l = &srv->listeners[i];
+		if (l->armed == 0) continue;
+
+		struct io_uring_sqe *sqe = get_sqe(srv);
+		if (sqe == NULL) return;
+		io_uring_prep_cancel_fd(sqe, l->fd, IORING_ASYNC_CANCEL_ALL);
+		io_uring_sqe_set_data64(sqe, HANDOVER_CANCEL_UDATA);
+		srv->handover_cancels++;
+	}
+
+	/* Parked recvs are canceled as well, which fails harmlessly with ENOENT. */
+	while (srv->handover_cancel_next < srv->pool->ops_next_idx) {
+		Operation *op = op_pool_get(srv->pool, srv->handover_cancel_next);
+		if (op->type == OP_READ && op->recv_ring != NULL) {
+			struct io_uring_sqe *sqe = get_sqe(srv);
+			if (sqe == NULL) return;
+			io_uring_prep_cancel64(sqe, op->pool_id, 0);
+			io_uring_sqe_set_data64(sqe, HANDOVER_CANCEL_UDATA);
+			srv->handover_cancels++;
+		}
+		srv->handover_cancel_next++;
+	}
+}
+
+/**
+ * Starts handing the clients over to the process listening at handover_path.
+ * Open envelopes are sent right away, the accept and the recvs are canceled and
+ * the server waits for its sends to complete. Nothing happens if the new process
+ * can't be reached.
+ */
+static void handover_begin(Server *srv) {
+	server_handover_requested = 0;
+	if (srv->handover_path == NULL || srv->handover_sock >= 0) return;
+
+	int sock = handover_connect(srv->handover_path);
+	if (sock < 0) {
+		LOG_STR(srv->log, LOG_LEVEL_ERROR, LOG_EV_HANDOVER_FAILED,
+			"connect", strlen("connect"), .code = errno);
+		return;
+	}
+	LOG(srv->log, LOG_LEVEL_INFO, LOG_EV_HANDOVER_STARTED, .arg = srv->clients->len);
+
+	srv->handover_sock = sock;
+	srv->handover_started_ns = monotonic_ns();
+	srv->handover_deadline_ns = srv->handover_started_ns + HANDOVER_DRAIN_NS;
+	srv->handover_cancel_next = 0;
+	memset(&srv->handover_stats, 0, sizeof(srv->handover_stats));
+
+	srv->handover_window_ns = srv->batch_window_ns;
+	srv->batch_window_ns = 0;
+}
+
+/* Gives up on the handover and goes back to serving the clients. */
+static void handover_abort(Server *srv, const char *step) {
+	LOG_STR(srv->log, LOG_LEVEL_ERROR, LOG_EV_HANDOVER_FAILED,
+		step, strlen(step), .code = errno);
+	must_close(srv->handover_sock, "handover_abort close");
+	srv->handover_sock = -1;
+	srv->batch_window_ns = srv->handover_window_ns;
+	/* The parked recvs are resumed and accepting is re-armed by the next flush. */
+}
+
+/* Whether the parked recvs are the only operations left, or time has run out. */
+static bool handover_ready(Server *srv) {
+	if (srv->now_ns >= srv->handover_deadline_ns) return true;
+
+	/* Gateways and links to other nodes aren't handed over, so their ops needn't drain. */
+	size_t in_use = srv->pool->ops_next_idx - srv->pool->free_len - srv->shm_blocked
+		- srv->peer_ops;
+	return srv->handover_cancel_next == srv->pool->ops_next_idx
+		&& srv->handover_cancels == 0
+		&& srv->batch_pending_len == 0
+		&& srv->fanout.len == 0
+		&& in_use == srv->deferred_len;
+}
+
+static bool write_client(Server *srv, HandoverWriter *w, ClientInfo *info, Operation *op) {
+	size_t groups_len;
+	struct grp **grps = groups_of_client(srv->groups, op->client_id, &groups_len);
+	if (grps == NULL) groups_len = 0;
+	size_t recv_len = recv_ring_len(op->recv_ring);
+
+	size_t len = sizeof(struct handover_client) + groups_len * sizeof(uint64_t) + recv_len;
+	struct handover_client *c = handover_reserve(w, HANDOVER_REC_CLIENT, len, op->client_fd);
+	if (c == NULL) return false;
+
+	c->client_id = op->client_id;
+	c->addr = info->client_addr;
+	c->groups_len = groups_len;
+	c->recv_len = recv_len;
+	c->options = info->options;
+
+	const struct uname_entry *e = uname_index_get(srv->unames, op->client_id);
+	if (e != NULL) {
+		c->username_len = e->len;
+		memcpy(c->username, e->name, e->len);
+	}
+
+	uint64_t *gids = (uint64_t *)(c + 1);
+	for (size_t i = 0; i < groups_len; i++) gids[i] = grps[i]->gid;
+	/* The unconsumed bytes are contiguous even when they wrap around the ring. */
+	memcpy(gids + groups_len, recv_ring_read_ptr(op->recv_ring), recv_len);
+	return true;
+}
+
+/**
+ * Writes the listeners, the clients with a parked recv and the groups to the new
+ * process. A client with a send still in flight or an envelope not sent yet,
+ * which would interleave with the sends of the new process, or with an upload in
+ * progress is left out and disconnected when this process exits. So are gateways,
+ * whose rings belong to this process, and which reconnect to the new one through
+ * the shm listener. Returns false if the new process couldn't take them.
+ */
+static bool handover_send(Server *srv) {
+	HandoverStats *hs = &srv->handover_stats;
+	uint64_t start_ns = monotonic_ns();
+	hs->drain_ns = start_ns - srv->handover_started_ns;
+
+	/* Past the deadline, the members a fan-out hasn't reached yet are left out too. */
+	fanout_sched_flush(&srv->fanout, fanout_send, srv);
+
+	struct cid_set busy;
+	cid_set_init(&busy);
+	for (size_t i = 0; i < srv->pool->ops_next_idx; i++) {
+		Operation *op = op_pool_get(srv->pool, i);
+		if (op->buf_ref != NULL || op->chain != NULL) cid_set_insert(&busy, op->client_id);
+	}
+
+	HandoverWriter w;
+	handover_writer_init(&w, srv->handover_sock);
+	bool ok = false;
+
+	for (int i = 0; i < LISTENER_COUNT; i++) {
+		if (srv->listeners[i].fd < 0) continue;
+		struct handover_listener *l = handover_reserve(
+			&w, HANDOVER_REC_LISTENER, sizeof(struct handover_listener), srv->listeners[i].fd);
+		if (l == NULL) goto done;
+		l->next_client_id = next_client_id;
+		l->next_group_id = next_group_id;
+		l->kind = i;
+	}
+
+	for (size_t i = 0; i < srv->deferred_len; i++) {
+		Operation *op = op_pool_get(srv->pool, srv->deferred[i].pool_id);
+		ClientInfo *info = client_map_get(srv->clients, op->client_id);
+		if (info == NULL || info->upload != NULL || info->batch != NULL) continue;
+		if (info->shm != NULL) continue;
+		if (cid_set_exists(&busy, op->client_id)) continue;
+
+		if (!write_client(srv, &w, info, op)) goto done;
+		hs->clients++;
+	}
+
+	for (size_t i = 0; i < groups_len(srv->groups); i++) {
+		struct grp *grp = groups_at(srv->groups, i);
+		/* Without members nobody can reach the group anymore. */
+		if (grp->client_ids.len == 0) continue;
+
+		struct handover_group *g = handover_reserve(
+			&w, HANDOVER_REC_GROUP, sizeof(struct handover_group), -1);
+		if (g == NULL) goto done;
+		g->gid = grp->gid;
+		g->next_msgid = grp->next_msgid;
+		hs->groups++;
+	}
+
+	struct handover_end *end = handover_reserve(
+		&w, HANDOVER_REC_END, sizeof(struct handover_end), -1);
+	if (end == NULL) goto done;
+	end->clients = hs->clients;
+	end->groups = hs->groups;
+	ok = handover_flush(&w) == 0;
+
+done:
+	handover_writer_deinit(&w);
+	cid_set_deinit(&busy);
+	hs->dropped = srv->clients->len - hs->clients;
+	hs->transfer_ns = monotonic_ns() - start_ns;
+	return ok;
+}
+
+/**
+ * Adds a client handed over by the old process and arms its recv. Frames it had
+ * received but not handled are handled before the next recv.
+ */
+static bool adopt_client(Server *srv, const struct handover_client *c, int fd) {
+	ClientInfo *info;
+	if (fd < 0 || c->recv_len > RECV_RING_SIZE
+		|| !client_map_new_entry(srv->clients, c->client_id, &info)) {
+		if (fd >= 0) must_close(fd, "adopt_client close");
+		return false;
+	}
+	init_client_info(info);
+	info->client_fd = fd;
+	info->client_addr = c->addr;
+	info->options = c->options;
+
+	size_t uname_len = c->username_len < UNAME_INDEX_MAX_LEN ? c->username_len : UNAME_INDEX_MAX_LEN;
+	if (uname_len > 0 && uname_index_set(srv->unames, c->client_id, c->username, uname_len)) {
+		memcpy(info->username, c->username, uname_len);
+		info->username[uname_len] = '\0';
+	}
+
+	Operation *op = op_pool_new_entry(srv->pool);
+	assert(op != NULL);
+	op->client_id = c->client_id;
+	op->buf_len = 0;
+	op->processed = 0;
+	op->client_fd = fd;
+	op->type = OP_READ;
+
+	op->recv_ring = recv_ring_pool_acquire(srv->recv_rings);
+	if (op->recv_ring == NULL) {
+		LOG(srv->log, LOG_LEVEL_WARN, LOG_EV_RECV_RING_FAILED,
+			.client_id = op->client_id, .fd = fd, .code = errno);
+		disconnect_and_free_op(srv, info, op);
+		return false;
+	}
+
+	const uint64_t *gids = (const uint64_t *)(c + 1);
+	for (uint32_t i = 0; i < c->groups_len; i++) groups_insert(srv->groups, gids[i], c->client_id);
+
+	memcpy(recv_ring_write_ptr(op->recv_ring), gids + c->groups_len, c->recv_len);
+	recv_ring_commit(op->recv_ring, c->recv_len);
+
+	if (c->recv_len > 0) {
+		defer_recv(srv, op, 0);
+	} else {
+		add_recv(srv, op, fd);
+	}
+	return true;
+}
+
+int server_takeover(Server *srv, int sock) {
+	HandoverStats *hs = &srv->handover_stats;
+	uint64_t start_ns = monotonic_ns();
+	srv->now_ns = start_ns;
+
+	HandoverReader r;
+	handover_reader_init(&r, sock);
+	int ret = -1;
 
 	while (1) {
-		if ((ret = io_uring_wait_cqe(srv->ring, &cqes[0])) < 0) {
-			fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-ret));
-			exit(EXIT_FAILURE);
-		}
-		
-		handle_cqe_batch(srv, cqes, 1);
-
-		int count = io_uring_peek_batch_cqe(srv->ring, cqes, CQE_BATCH_SIZE);
-		if (count == -EAGAIN) {
-			/* Submit the result of handling cqe from io_uring_wait_cqe. */
-			if ((ret = io_uring_submit(srv->ring)) < 0) {
-				fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
-				exit(EXIT_FAILURE);
+		int fd;
+		const struct handover_rec *rec = handover_read(&r, &fd);
+		if (rec == NULL) {
+			/* The old process gave up before the end. */
+			if (errno == 0) errno = EPIPE;
+			break;
+		}
+
+		if (rec->type == HANDOVER_REC_LISTENER) {
+			const struct handover_listener *l = (const struct handover_listener *)rec;
+			if (l->kind >= LISTENER_COUNT) {
+				if (fd >= 0) must_close(fd, "server_takeover close");
+				errno = EBADMSG;
+				break;
+			}
+			/* Without cluster mode there are no links to accept. */
+			if (l->kind == LISTENER_PEER && srv->cluster == NULL) {
+				if (fd >= 0) must_close(fd, "server_takeover close");
+				continue;
+			}
+			struct listener *lst = &srv->listeners[l->kind];
+			if (lst->fd >= 0) must_close(lst->fd, "server_takeover close");
+			lst->fd = fd;
+			next_client_id = l->next_client_id;
+			next_group_id = l->next_group_id;
+			continue;
+		}
+		if (fd >= 0 && rec->type != HANDOVER_REC_CLIENT) must_close(fd, "server_takeover close");
+
+		if (rec->type == HANDOVER_REC_CLIENT) {
+			if (adopt_client(srv, (const struct handover_client *)rec, fd)) {
+				hs->clients++;
+			} else {
+				hs->dropped++;
+			}
+		} else if (rec->type == HANDOVER_REC_GROUP) {
+			const struct handover_group *g = (const struct handover_group *)rec;
+			struct grp *grp = groups_find(srv->groups, g->gid);
+			if (grp != NULL) grp->next_msgid = g->next_msgid;
+			hs->groups++;
+		} else if (rec->type == HANDOVER_REC_END) {
+			const struct handover_end *end = (const struct handover_end *)rec;
+			if (srv->listeners[LISTENER_TCP].fd < 0 || end->clients != hs->clients + hs->dropped
+				|| end->groups != hs->groups) {
+				errno = EBADMSG;
+				break;
+			}
+			ret = 0;
+			break;
+		}
+	}
+
+	handover_reader_deinit(&r);
+	hs->transfer_ns = monotonic_ns() - start_ns;
+	return ret;
+}
+
+void server_join_cluster(Server *srv, Cluster *c) {
+	srv->cluster = c;
+	next_client_id = cluster_first_id(c->self);
+	next_group_id = cluster_first_id(c->self);
+}
+
+/* Starts connecting the link to node. */
+static void peer_connect(Server *srv, uint32_t node) {
+	struct peer_link *l = &srv->cluster->links[node];
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		l->retry_ns = srv->now_ns + CLUSTER_RETRY_NS;
+		return;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	l->fd = fd;
+	l->connecting = true;
+
+	Operation *op = op_pool_new_entry(srv->pool);
+	assert(op != NULL);
+	op->client_id = node;
+	op->client_fd = fd;
+	op->buf_len = 0;
+	op->processed = 0;
+	op->type = OP_PEER_CONNECT;
+	srv->peer_ops++;
+	submit_op(srv, op);
+}
+
+/**
+ * Fails the requests forwarded to node whose delivery is overdue. Returns the time
+ * until the next one is, or 0 if none remain.
+ */
+static uint64_t expire_forwards(Server *srv, uint32_t node) {
+	ForwardQueue *q = &srv->cluster->links[node].forwards;
+	size_t due = 0;
+	while (q->head + due < q->len && q->fwd[q->head + due].due_ns <= srv->now_ns) {
+		forward_failed(srv, &q->fwd[q->head + due]);
+		due++;
+	}
+	forward_queue_pop(q, due);
+	return q->head < q->len ? q->fwd[q->head].due_ns - srv->now_ns : 0;
+}
+
+/**
+ * Sends the frames collected for each peer since the last flush with a single
+ * send, once the previous one has completed, connects the links which are due
+ * and fails the overdue forwards. Returns the time until the next link is due to
+ * connect or forward to expire, or 0.
+ */
+static uint64_t cluster_flush(Server *srv) {
+	Cluster *c = srv->cluster;
+	if (c == NULL) return 0;
+	srv->now_ns = monotonic_ns();
+
+	uint64_t next_due_ns = 0;
+	for (uint32_t node = 0; node < c->nodes_len; node++) {
+		if (node == c->self) continue;
+		struct peer_link *l = &c->links[node];
+		next_due_ns = min_due(next_due_ns, expire_forwards(srv, node));
+		if (l->fd < 0) {
+			if (l->retry_ns <= srv->now_ns) {
+				peer_connect(srv, node);
+			} else {
+				next_due_ns = min_due(next_due_ns, l->retry_ns - srv->now_ns);
 			}
 			continue;
 		}
-		if (count < 0) {
-			fprintf(stderr, "io_uring_peek_batch_cqe: %s\n", strerror(-ret));
-			exit(EXIT_FAILURE);
+		if (l->connecting || l->sending || l->out.len == 0) continue;
+
+		/* The buffers swap roles, so neither is reallocated once it is large enough. */
+		PeerBuf sent = l->inflight;
+		l->inflight = l->out;
+		l->out = sent;
+		l->sent = 0;
+		l->sending = true;
+
+		Operation *op = op_pool_new_entry(srv->pool);
+		assert(op != NULL);
+		op->client_id = node;
+		op->client_fd = l->fd;
+		op->buf_len = 0;
+		op->processed = 0;
+		op->type = OP_PEER_SEND;
+		srv->peer_ops++;
+		submit_op(srv, op);
+	}
+	return next_due_ns;
+}
+
+/**
+ * Sends GROUP_STATUS to the members of the groups whose changes are due. Returns
+ * the time until the next group is due, or 0 if none remain.
+ */
+static uint64_t flush_presence(Server *srv) {
+	PresenceQueue *q = &srv->presence;
+	if (q->len == 0) return 0;
+
+	uint64_t window = srv->presence_window_ns;
+	if (window > 0) srv->now_ns = monotonic_ns();
+	uint64_t next_due_ns;
+	size_t due = presence_due(q, srv->now_ns, window, &next_due_ns);
+	if (due == 0) return next_due_ns;
+
+	for (size_t i = 0; i < due; i++) {
+		struct presence_group *pg = presence_at(q, i);
+		send_group_status(srv, pg->grp, &pg->changed);
+	}
+	presence_pop(q, due);
+	return next_due_ns;
+}
+
+/**
+ * Resumes the deferred clients, sends the status updates, a round of the
+ * scheduled fan-outs and the envelopes and peer frames that are due, starts the
+ * sends queued for clients, resumes accepting if it was paused and moves queued
+ * ops into the SQ. While handing over, recvs stay parked and are canceled
+ * instead. Returns the time until the next of them is due, or 0 if none remain.
+ */
+static uint64_t flush_pending(Server *srv) {
+	uint64_t next_due_ns = 0;
+	if (srv->handover_sock < 0) next_due_ns = resume_deferred(srv);
+	next_due_ns = min_due(next_due_ns, flush_presence(srv));
+	if (srv->fanout.len > 0) fanout_sched_round(&srv->fanout, fanout_send, srv);
+	next_due_ns = min_due(next_due_ns, flush_batches(srv));
+	next_due_ns = min_due(next_due_ns, cluster_flush(srv));
+	flush_sends(srv);
+
+	if (srv->handover_sock >= 0) {
+		handover_cancel(srv);
+		srv->now_ns = monotonic_ns();
+		uint64_t left_ns = srv->handover_deadline_ns > srv->now_ns
+			? srv->handover_deadline_ns - srv->now_ns : 1;
+		next_due_ns = min_due(next_due_ns, left_ns);
+	} else if (accept_idle(srv)) {
+		srv->now_ns = monotonic_ns();
+		next_due_ns = min_due(next_due_ns, maybe_accept(srv));
+	}
+
+	flush_sq_overflow(srv);
+	return next_due_ns;
+}
+
+/* EBUSY leaves the SQEs in the SQ until completions have been reaped. */
+static void check_submit(int ret, const char *what) {
+	if (ret < 0 && ret != -EBUSY && ret != -EAGAIN && ret != -EINTR && ret != -ETIME) {
+		fprintf(stderr, "%s: %s\n", what, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Polls the CQ for up to spin_ns. Returns whether a completion arrived. */
+static bool spin_for_cqe(Server *srv) {
+	srv->loop_stats.spins++;
+	uint64_t deadline_ns = monotonic_ns() + srv->spin_ns;
+	do {
+		/* Reads the clock every few polls, a poll is a single load. */
+		for (int i = 0; i < SPIN_POLLS; i++) {
+			if (io_uring_cq_ready(srv->ring) > 0) {
+				srv->loop_stats.spin_hits++;
+				return true;
+			}
+		}
+	} while (monotonic_ns() < deadline_ns);
+	return false;
+}
+
+/**
+ * Submits the SQ and waits until target completions are ready. A target above 1
+ * waits at most reap_wait_ns, and every wait ends when next_due_ns is due.
+ * Nothing is waited for if completions are already ready, and with spin_ns a
+ * single completion is polled for before going to sleep. Returns whether the wait
+ * timed out before its target.
+ */
+static bool submit_and_wait(Server *srv, unsigned target, uint64_t next_due_ns) {
+	/* Scheduled fan-outs go on with the next round right away. */
+	if (io_uring_cq_ready(srv->ring) > 0 || srv->fanout.len > 0) {
+		target = 0;
+	} else if (target == 1 && srv->spin_ns > 0) {
+		srv->loop_stats.submits++;
+		check_submit(io_uring_submit(srv->ring), "io_uring_submit");
+		if (spin_for_cqe(srv)) return false;
+	}
+
+	uint64_t wait_ns = next_due_ns;
+	if (target > 1) wait_ns = min_due(wait_ns, srv->reap_wait_ns);
+
+	struct __kernel_timespec ts = {
+		.tv_sec = wait_ns / 1000000000,
+		.tv_nsec = wait_ns % 1000000000,
+	};
+	struct io_uring_cqe *cqe;
+	srv->loop_stats.submits++;
+	int ret = io_uring_submit_and_wait_timeout(
+		srv->ring, &cqe, target, target > 0 && wait_ns > 0 ? &ts : NULL, srv->wait_sigmask);
+	check_submit(ret, "io_uring_submit_and_wait_timeout");
+	if (ret != -ETIME) return false;
+
+	srv->loop_stats.timeouts++;
+	return true;
+}
+
+/**
+ * Handles the ready completions, up to REAP_MAX_CQES so that what they prepared
+ * gets submitted in time. Returns how many there were.
+ */
+static unsigned reap(Server *srv, struct io_uring_cqe *cqes[CQE_BATCH_MAX]) {
+	unsigned total = 0;
+	while (total < REAP_MAX_CQES) {
+		/**
+		 * With IORING_FEAT_NODROP, completions that didn't fit in the CQ wait in the
+		 * kernel. Moves them into the CQ now that handling a batch made room.
+		 */
+		if (io_uring_cq_has_overflow(srv->ring)) {
+			srv->sq_stats.cq_overflows++;
+			io_uring_get_events(srv->ring);
 		}
 
+		unsigned count = io_uring_peek_batch_cqe(srv->ring, cqes, srv->cqe_batch);
+		if (count == 0) break;
+
 		handle_cqe_batch(srv, cqes, count);
+		total += count;
+
+		/**
+		 * A full batch means more completions are waiting, so the next one is bigger
+		 * and its prefetching overlaps more misses. It shrinks back once batches
+		 * stay mostly empty.
+		 */
+		if (count == srv->cqe_batch && srv->cqe_batch < CQE_BATCH_MAX) {
+			srv->cqe_batch *= 2;
+		} else if (count < srv->cqe_batch / 4 && srv->cqe_batch > CQE_BATCH_SIZE) {
+			srv->cqe_batch /= 2;
+		}
+	}
+
+	if (total > 0) {
+		LoopStats *ls = &srv->loop_stats;
+		ls->wakeups++;
+		ls->cqes += total;
+		if (total > ls->cqes_max) ls->cqes_max = total;
+
+		unsigned bucket = 0;
+		while (bucket + 1 < LOOP_HIST_LEN && (2u << bucket) <= total) bucket++;
+		ls->cqes_hist[bucket]++;
+	}
+	return total;
+}
 
-		if ((ret = io_uring_submit(srv->ring)) < 0) {
-			fprintf(stderr, "io_uring_submit %s\n", strerror(-ret));
-			exit(EXIT_FAILURE);
+/**
+ * Completions the next wait aims for, from reap_avg, the CQEs per wakeup averaged
+ * over the last few wakeups. While the average stays under REAP_AVG_MIN it is 1,
+ * so a completion is handled as soon as it arrives. Above it, it is half of the
+ * average up to reap_batch, which usually arrives well before reap_wait_ns runs
+ * out. A wait that timed out halves the average, so a load that drops off goes
+ * back to waking up for the first completion within a few wakeups. A
+ * reap_wait_ns of 0 never waits for more than one.
+ */
+static unsigned next_target(Server *srv, unsigned reaped, bool timed_out) {
+	srv->reap_avg += ((uint64_t)reaped << REAP_AVG_SHIFT) / 8 - srv->reap_avg / 8;
+	if (timed_out) srv->reap_avg /= 2;
+
+	unsigned avg = srv->reap_avg >> REAP_AVG_SHIFT;
+	if (srv->reap_wait_ns == 0 || avg < REAP_AVG_MIN) return 1;
+
+	unsigned target = avg / 2;
+	return target < srv->reap_batch ? target : srv->reap_batch;
+}
+
+int server_start(Server *srv) {
+	struct io_uring_cqe *cqes[CQE_BATCH_MAX];
+	unsigned target = 1;
+
+	/* Arms the first accept. */
+	srv->now_ns = monotonic_ns();
+	uint64_t next_due_ns = flush_pending(srv);
+
+	while (!server_stop_requested) {
+		srv->loop_stats.iterations++;
+		bool timed_out = submit_and_wait(srv, target, next_due_ns);
+
+		/* Also after a timeout or EINTR e.g. SIGUSR1 toggling tracing. */
+		unsigned reaped = reap(srv, cqes);
+		target = next_target(srv, reaped, timed_out);
+
+		if (server_handover_requested) handover_begin(srv);
+		next_due_ns = flush_pending(srv);
+
+		if (srv->handover_sock >= 0 && handover_ready(srv)) {
+			if (handover_send(srv)) return 0;
+
+			handover_abort(srv, "send");
+			next_due_ns = flush_pending(srv);
 		}
 	}
+	return 1;
+}
+
+void server_print_stats(const Server *srv, FILE *out) {
+	const LoopStats *ls = &srv->loop_stats;
+	const SqStats *sq = &srv->sq_stats;
+	uint64_t iterations = ls->iterations > 0 ? ls->iterations : 1;
+	uint64_t wakeups = ls->wakeups > 0 ? ls->wakeups : 1;
+
+	fprintf(out, "Loop: %lu iterations, %lu wakeups, %.2f submits per iteration, "
+		"%.1f CQEs per wakeup (max %lu), %lu timeouts, %lu of %lu spins hit\n",
+		ls->iterations, ls->wakeups, (double)ls->submits / iterations,
+		(double)ls->cqes / wakeups, ls->cqes_max, ls->timeouts, ls->spin_hits, ls->spins);
+	fprintf(out, "CQEs per wakeup:");
+	for (unsigned i = 0; i < LOOP_HIST_LEN; i++) {
+		fprintf(out, " %u%s:%lu", 1u << i, i + 1 == LOOP_HIST_LEN ? "+" : "", ls->cqes_hist[i]);
+	}
+	fprintf(out, "\nSQ: full %lu times, %lu ops queued (max %lu), %lu CQ overflows\n",
+		sq->sq_full, sq->queued, sq->queue_max, sq->cq_overflows);
 }
@@ -2,36 +2,339 @@
 #define SERVER_H
 
 #include <liburing.h>
+#include <signal.h>
+#include <stdio.h>
 
 #include "utils.h"
 #include "op.h"
 #include "client_map.h"
 #include "op_pool.h"
+#include "recv_ring.h"
 #include "slab.h"
+#include "groups.h"
+#include "ratelimit.h"
+#include "uname_index.h"
+#include "log.h"
+#include "handover.h"
+#include "shm_ring.h"
+#include "cluster.h"
+#include "capture.h"
+#include "presence.h"
+#include "fanout.h"
 
 #define BUFFER_SIZE_64B 64
 #define BUFFER_SIZE_2KB 2048
 
+/* Defaults of fanout_inline_max and of the quantum of the fan-out scheduler. */
+#define FANOUT_INLINE_MAX 256
+#define FANOUT_QUANTUM 1024
+/**
+ * Fan-out jobs beyond which messages to groups wait in the recv rings of their
+ * senders until the scheduler catches up.
+ */
+#define FANOUT_MAX_PENDING 256
+/* Queued sends of a client gathered into one OP_WRITEV at most. */
+#define SEND_GATHER_MAX 64
+/* Buffers of an OP_WRITEV at most, the kernel's UIO_MAXIOV. */
+#define SEND_GATHER_IOV_MAX 1024
+
 typedef enum {
 	CODE_SUCCESS,
 	CODE_INVALID_MSG_TYPE,
 	CODE_INVALID_MSG_LEN,
 	CODE_INVALID_USERNAME,
 	CODE_FAILURE,
+	CODE_INVALID_GROUP,
+	CODE_INVALID_CHUNK,
+	CODE_USERNAME_TAKEN,
+	CODE_RATE_LIMITED,
 } ResponseCode;
 
+/**
+ * Admission control counters. listen_queue_len is the number of connections
+ * waiting in the listen backlog, sampled whenever accepting pauses or resumes.
+ */
+typedef struct {
+	uint64_t accepted;
+	uint64_t pauses;
+	uint64_t paused_ns;
+	uint32_t listen_queue_len;
+	uint32_t listen_queue_max;
+} AcceptStats;
+
+/**
+ * Submission counters. sq_full counts the times the SQ was found full and queued
+ * the ops that had to wait in the overflow queue, of which there were at most
+ * queue_max at once. cq_overflows counts the times completions had to be moved
+ * from the kernel's overflow list.
+ */
+typedef struct {
+	uint64_t sq_full;
+	uint64_t queued;
+	uint64_t queue_max;
+	uint64_t cq_overflows;
+} SqStats;
+
+#define LOOP_HIST_LEN 10
+
+/**
+ * Event loop counters. Every iteration submits and waits once, plus the submits
+ * made for spinning and to make room in a full SQ. A wakeup is an iteration that
+ * reaped completions, cqes_hist[i] counts those which reaped [2^i, 2^(i+1)) of
+ * them with the last bucket open ended. timeouts counts the waits which ended
+ * before their target, spin_hits the spins that found a completion.
+ */
+typedef struct {
+	uint64_t iterations;
+	uint64_t submits;
+	uint64_t wakeups;
+	uint64_t cqes;
+	uint64_t cqes_max;
+	uint64_t cqes_hist[LOOP_HIST_LEN];
+	uint64_t timeouts;
+	uint64_t spins;
+	uint64_t spin_hits;
+} LoopStats;
+
+/**
+ * Handover counters, of the old process or of the new one. dropped counts the
+ * clients which couldn't be handed over and are disconnected instead. drain_ns is
+ * how long the old process waited for its operations to finish, transfer_ns how
+ * long writing or reading and rebuilding the state took.
+ */
+typedef struct {
+	uint64_t clients;
+	uint64_t dropped;
+	uint64_t groups;
+	uint64_t drain_ns;
+	uint64_t transfer_ns;
+} HandoverStats;
+
+/* Set by the SIGUSR2 handler to hand over to the process at handover_path. */
+extern volatile sig_atomic_t server_handover_requested;
+
+/* Set by the SIGINT and SIGTERM handlers to leave the event loop. */
+extern volatile sig_atomic_t server_stop_requested;
+
+/**
+ * Kinds of listeners. Clients of the Unix listeners have no address. Clients of
+ * the shm listener are gateways which exchange frames over an ShmConn. The peer
+ * listener accepts the links of the other nodes of a cluster.
+ */
+enum listener_kind {
+	LISTENER_TCP,
+	LISTENER_UNIX,
+	LISTENER_SHM,
+	LISTENER_PEER,
+	LISTENER_COUNT,
+};
+
+/* Listening socket and the number of accepts armed on it. fd is -1 if unused. */
+struct listener {
+	int fd;
+	unsigned armed;
+};
+
+/**
+ * Gateway attached over shared memory. Its recv operation holds conn.in as its
+ * recv_ring and owns the shm_client, which is freed along with it. The recv
+ * waits for doorbells instead of bytes. Sends that don't fit in conn.out wait in
+ * blocked, oldest at blocked_head, until the gateway makes room. broken is set
+ * once it publishes an invalid position, see shm_ring.h.
+ */
+struct shm_client {
+	ShmConn conn;
+	bool broken;
+	size_t blocked_head;
+	size_t blocked_len;
+	size_t blocked_cap;
+	size_t *blocked;
+};
+
+/* recv operation of a client parked until it has tokens again. */
+struct deferred_recv {
+	uint64_t wake_ns;
+	uint64_t pool_id;
+};
+
 typedef struct {
 	struct io_uring *ring; 
 	ClientMap *clients;
 	Slab *slab64;
 	Slab *slab2k;
 	OpPool *pool;
-	int server_fd;
+	RecvRingPool *recv_rings;
+	struct groups *groups;
+	UnameIndex *unames;
+	Logger *log;
+	/* listeners[LISTENER_TCP] is always open, except before a takeover. */
+	struct listener listeners[LISTENER_COUNT];
+	/**
+	 * Connected gateways, sends are only checked for them while there are any, and
+	 * the sends of theirs waiting for room in their rings.
+	 */
+	size_t shm_clients;
+	size_t shm_blocked;
+	/* The recvs of the gateways all receive their doorbells here. */
+	char doorbell[64];
+
+	/**
+	 * The other nodes in cluster mode, NULL otherwise. peer_ops counts the ops of
+	 * the links, which are always in flight and aren't handed over.
+	 */
+	Cluster *cluster;
+	size_t peer_ops;
+
+	/* Records the frames clients send when set, see capture.h. */
+	Capture *capture;
+
+	/**
+	 * pool_ids of the ops waiting for room in the SQ, oldest at sq_overflow_head.
+	 * See submit_op.
+	 */
+	size_t sq_overflow_head;
+	size_t sq_overflow_len;
+	size_t sq_overflow_cap;
+	size_t *sq_overflow;
+	SqStats sq_stats;
+
+	/**
+	 * client_ids with sends queued and none in flight. Their sends are started at
+	 * the end of every loop iteration, so that the frames a client gets in one
+	 * iteration go out together. See queue_send.
+	 */
+	size_t send_pending_len;
+	size_t send_pending_cap;
+	uint64_t *send_pending;
+
+	/**
+	 * Reaping. Once wakeups reap many completions on average, reap_avg in
+	 * 1/16ths, the loop waits for up to reap_batch of them at once, at most
+	 * reap_wait_ns, and otherwise it wakes up for the first one. reap_wait_ns of 0
+	 * always wakes up for the first. With spin_ns, the loop polls the CQ that long
+	 * before going to sleep. See next_target.
+	 */
+	unsigned reap_batch;
+	uint64_t reap_wait_ns;
+	uint64_t reap_avg;
+	/**
+	 * Completions peeked and prefetched at once, which doubles while batches fill
+	 * up and halves while they stay mostly empty. See reap.
+	 */
+	unsigned cqe_batch;
+	uint64_t spin_ns;
+	LoopStats loop_stats;
+	/* Signals blocked everywhere but while waiting for completions, or NULL. */
+	sigset_t *wait_sigmask;
+
+	/**
+	 * Open BATCH envelopes are sent once they are batch_window_ns old, or at the
+	 * end of every loop iteration if it is 0. batch_pending holds the client_ids
+	 * which may have an open envelope.
+	 */
+	uint64_t batch_window_ns;
+	size_t batch_pending_len;
+	size_t batch_pending_cap;
+	uint64_t *batch_pending;
+
+	/**
+	 * Presence and typing changes are sent to the members of a group once its first
+	 * change is presence_window_ns old, or at the end of every loop iteration if it
+	 * is 0. See presence.h.
+	 */
+	uint64_t presence_window_ns;
+	PresenceQueue presence;
+
+	/**
+	 * Messages to groups with up to fanout_inline_max recipients, and responses, are
+	 * sent while handling the request. Larger groups are sent to by the scheduler,
+	 * a quantum of sends per group every loop iteration, and the loop doesn't wait
+	 * for completions while it has jobs. See fanout.h.
+	 */
+	size_t fanout_inline_max;
+	FanoutSched fanout;
+
+	/**
+	 * Limits of each message type, checked per client before handling a frame.
+	 * now_ns is read once per batch of completions. With limits.defer, the recv
+	 * of a client over the limit isn't re-armed and its operation waits in
+	 * deferred until the tokens refill.
+	 */
+	RateLimits limits;
+	uint64_t now_ns;
+	size_t deferred_len;
+	size_t deferred_cap;
+	struct deferred_recv *deferred;
+
+	/**
+	 * Admission control. An accept is only armed on a listener while there are
+	 * fewer than max_conns clients, counting those being accepted, and accept_limit
+	 * has a token. Accepting resumes once a client leaves or the token is due. After the
+	 * process runs out of fds it is retried at accept_retry_ns, or sooner if a
+	 * client leaves. max_conns of 0 means no cap.
+	 */
+	size_t max_conns;
+	struct rate_limit accept_limit;
+	uint64_t accept_full_at_ns;
+	uint64_t accept_retry_ns;
+	/* When accepting paused, 0 while it isn't paused. */
+	uint64_t accept_paused_ns;
+	AcceptStats accept_stats;
+
+	/**
+	 * Handover to a new process listening at handover_path, NULL if disabled.
+	 * handover_sock is connected to it while draining and -1 otherwise. Meanwhile
+	 * the recvs which complete or are canceled aren't re-armed but parked in
+	 * deferred, and the state is handed over once they are the only operations
+	 * left or the deadline passes. See server_handover_begin.
+	 */
+	const char *handover_path;
+	int handover_sock;
+	uint64_t handover_started_ns;
+	uint64_t handover_deadline_ns;
+	/* pool_id up to which recvs have been canceled, and cancels in flight. */
+	size_t handover_cancel_next;
+	size_t handover_cancels;
+	uint64_t handover_window_ns;
+	HandoverStats handover_stats;
 } Server;
 
 Server server_init(struct io_uring *ring, ClientMap *clients, Slab *slab64,
-				   Slab *slab2k, OpPool *pool, int server_fd);
+				   Slab *slab2k, OpPool *pool, RecvRingPool *recv_rings,
+				   struct groups *groups, UnameIndex *unames, Logger *log,
+				   int server_fd);
+
+/* Frees the queues of the server. The structures passed to server_init stay. */
+void server_deinit(Server *srv);
 
+/**
+ * Sizes the queues of the server which grow with the number of clients, the SQ
+ * overflow, deferred recvs, pending sends and pending envelopes, for conns
+ * clients.
+ */
+void server_reserve(Server *srv, size_t conns);
+
+/**
+ * Turns on cluster mode, in which clients and groups get ids of the node of c and
+ * groups owned by other nodes are reached through them. See cluster.h.
+ */
+void server_join_cluster(Server *srv, Cluster *c);
+
+/**
+ * Runs the event loop. Returns 0 once the server has handed its clients over to
+ * a new process, or 1 once it was asked to stop.
+ */
 int server_start(Server *srv);
 
+/* Prints the loop and SQ counters, per wakeup and per iteration. */
+void server_print_stats(const Server *srv, FILE *out);
+
+/**
+ * Rebuilds the listeners, clients and groups handed over by the old process on
+ * sock and arms their operations, before server_start. Returns -1 with errno set
+ * if the stream is cut short or malformed, in which case the old process keeps
+ * serving and this one should exit.
+ */
+int server_takeover(Server *srv, int sock);
+
 #endif
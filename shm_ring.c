@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+/**
+ * Maps the control page followed by both rings, each twice, and points to_server
+ * and to_gateway at them. The memfd holds the control page and then the bytes of
+ * to_server and of to_gateway.
+ */
+static int map_rings(ShmConn *c, int memfd, size_t page, size_t ring_size, bool server) {
+	size_t map_len = page + 4 * ring_size;
+	/* Reserve everything first so that nothing else can land in between. */
+	char *map = mmap(NULL, map_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) return -1;
+
+	void *hdr = mmap(map, page, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0);
+	if (hdr == MAP_FAILED) goto fail;
+	for (int i = 0; i < 4; i++) {
+		/* Both halves of a ring map the same bytes of the memfd. */
+		off_t off = page + (i / 2) * ring_size;
+		void *half = mmap(
+			map + page + i * ring_size, ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			memfd, off
+		);
+		if (half == MAP_FAILED) goto fail;
+	}
+
+	struct shm_hdr *h = hdr;
+	ShmRing to_server = {
+		.ring = { .base = map + page, .size = ring_size, .shared = true },
+		.ctl = &h->to_server,
+	};
+	ShmRing to_gateway = {
+		.ring = { .base = map + page + 2 * ring_size, .size = ring_size, .shared = true },
+		.ctl = &h->to_gateway,
+	};
+	c->in = server ? to_server : to_gateway;
+	c->out = server ? to_gateway : to_server;
+	c->map = map;
+	c->map_len = map_len;
+	return 0;
+
+fail:;
+	int err = errno;
+	munmap(map, map_len);
+	errno = err;
+	return -1;
+}
+
+int shm_conn_create(ShmConn *c, size_t ring_size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (ring_size < page) ring_size = page;
+
+	int memfd = memfd_create("shm_ring", MFD_CLOEXEC);
+	if (memfd < 0) return -1;
+	if (ftruncate(memfd, page + 2 * ring_size) < 0
+		|| map_rings(c, memfd, page, ring_size, true) < 0) {
+		int err = errno;
+		close(memfd);
+		errno = err;
+		return -1;
+	}
+
+	/* The rest of the page is zero, so both rings start empty. */
+	struct shm_hdr *h = (struct shm_hdr *)c->map;
+	h->ring_size = ring_size;
+	h->magic = SHM_MAGIC;
+	return memfd;
+}
+
+int shm_conn_attach(ShmConn *c, int memfd) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	if (fstat(memfd, &st) < 0) return -1;
+
+	struct shm_hdr h;
+	if ((size_t)st.st_size < page || pread(memfd, &h, sizeof(h), 0) != sizeof(h)) {
+		errno = EPROTO;
+		return -1;
+	}
+	size_t ring_size = h.ring_size;
+	if (h.magic != SHM_MAGIC || ring_size < page || (ring_size & (ring_size - 1)) != 0
+		|| (size_t)st.st_size != page + 2 * ring_size) {
+		errno = EPROTO;
+		return -1;
+	}
+	return map_rings(c, memfd, page, ring_size, false);
+}
+
+void shm_conn_deinit(ShmConn *c) {
+	munmap(c->map, c->map_len);
+	c->map = NULL;
+}
+
+/**
+ * The flag is stored before the position is loaded, and the other side stores
+ * the position before it loads the flag. Both are sequentially consistent, so at
+ * least one of them sees the other.
+ */
+bool shm_ring_sleep_consumer(ShmRing *r) {
+	atomic_store(&r->ctl->consumer_sleeping, 1);
+	uint64_t tail = atomic_load(&r->ctl->tail);
+	if (shm_ring_tail_valid(r, tail)) {
+		r->ring.tail = tail;
+		if (recv_ring_len(&r->ring) == 0) return true;
+	}
+
+	/* A doorbell may still come, which only costs a spurious wake up. */
+	atomic_store(&r->ctl->consumer_sleeping, 0);
+	return false;
+}
+
+bool shm_ring_sleep_producer(ShmRing *r, size_t len) {
+	atomic_store(&r->ctl->producer_sleeping, 1);
+	uint64_t head = atomic_load(&r->ctl->head);
+	if (shm_ring_head_valid(r, head)) {
+		r->ring.head = head;
+		if (recv_ring_free(&r->ring) < len) return true;
+	}
+
+	atomic_store(&r->ctl->producer_sleeping, 0);
+	return false;
+}
+
+void shm_doorbell(int sock) {
+	/* EAGAIN means earlier doorbells are still unread, which wake the peer as well. */
+	char b = 0;
+	(void)send(sock, &b, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+int shm_send_fd(int sock, int memfd) {
+	char b = 0;
+	struct iovec iov = { .iov_base = &b, .iov_len = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+	/* Goes first on a new connection, so the socket buffer has room for it. */
+	if (sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) return -1;
+	return 0;
+}
+
+/* Receives the memfd sent with shm_send_fd. Returns -1 with errno set. */
+static int recv_fd(int sock) {
+	char b;
+	struct iovec iov = { .iov_base = &b, .iov_len = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf),
+	};
+
+	ssize_t n;
+	do {
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) return -1;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (n == 0 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+		|| cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		errno = EPROTO;
+		return -1;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+int shm_gateway_connect(const char *path, ShmConn *c) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) return -1;
+
+	int memfd = -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) goto fail;
+	memfd = recv_fd(sock);
+	if (memfd < 0 || shm_conn_attach(c, memfd) < 0) goto fail;
+
+	/* The mappings keep the memfd alive. */
+	close(memfd);
+	return sock;
+
+fail:;
+	int err = errno;
+	if (memfd >= 0) close(memfd);
+	close(sock);
+	errno = err;
+	return -1;
+}
+
+/* Waits for a doorbell. Returns 0 if the server went away. */
+static ssize_t wait_doorbell(int sock) {
+	char buf[64];
+	ssize_t n;
+	do {
+		n = recv(sock, buf, sizeof(buf), 0);
+	} while (n < 0 && errno == EINTR);
+	return n;
+}
+
+int shm_gateway_write(ShmConn *c, int sock, const void *buf, size_t len) {
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t room = shm_ring_space(&c->out);
+		if (room < 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (room == 0) {
+			if (!shm_ring_sleep_producer(&c->out, 1)) continue;
+
+			ssize_t n = wait_doorbell(sock);
+			if (n <= 0) {
+				if (n == 0) errno = EPIPE;
+				return -1;
+			}
+			continue;
+		}
+
+		size_t n = len < (size_t)room ? len : (size_t)room;
+		memcpy(recv_ring_write_ptr(&c->out.ring), p, n);
+		recv_ring_commit(&c->out.ring, n);
+		if (shm_ring_publish(&c->out)) shm_doorbell(sock);
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+ssize_t shm_gateway_wait(ShmConn *c, int sock) {
+	while (1) {
+		ssize_t len = shm_ring_pull(&c->in);
+		if (len < 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (len > 0) return len;
+		if (!shm_ring_sleep_consumer(&c->in)) continue;
+
+		ssize_t n = wait_doorbell(sock);
+		if (n <= 0) return n;
+	}
+}
+
+void shm_gateway_consume(ShmConn *c, int sock, size_t n) {
+	recv_ring_consume(&c->in.ring, n);
+	if (shm_ring_release(&c->in)) shm_doorbell(sock);
+}
@@ -0,0 +1,181 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+/**
+ * Shared-memory transport between the server and a gateway on the same host.
+ *
+ * A gateway connects to the shm listener of the server over AF_UNIX and gets a
+ * memfd along with the first byte. The memfd holds a control page and two byte
+ * rings of protocol frames, one towards the server and one towards the gateway,
+ * each with a single producer and a single consumer. Like RecvRing, each ring is
+ * mapped twice back to back, so that frames are contiguous even where they wrap
+ * and the server parses them in place.
+ *
+ * Producers publish tail and consumers publish head. A side about to wait sets
+ * its sleeping flag and checks the ring once more, and the other side clears the
+ * flag and writes a byte to the Unix socket, which completes the recv the sleeper
+ * waits in. The socket only carries a byte when a side was idle, and it still
+ * reports when the peer goes away.
+ *
+ * Neither side trusts the positions the other one publishes. A tail behind the
+ * last one or more than the ring size ahead of head, or a head outside
+ * [tail - size, tail], is left alone and reported instead, and the side which
+ * published it is dropped.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "recv_ring.h"
+
+#define SHM_MAGIC 0x63686d31
+/* Of each ring. Rounded up to the page size. Must be a power of 2. */
+#define SHM_RING_SIZE (1 << 20)
+
+/* Positions are in bytes since the ring was created, like in RecvRing. */
+struct shm_ring_ctl {
+	_Alignas(64) _Atomic uint64_t tail;
+	/* Set by the producer while it waits for room. */
+	_Atomic uint32_t producer_sleeping;
+	_Alignas(64) _Atomic uint64_t head;
+	/* Set by the consumer while it waits for bytes. */
+	_Atomic uint32_t consumer_sleeping;
+};
+
+/* Starts the control page. */
+struct shm_hdr {
+	uint32_t magic;
+	uint32_t ring_size;
+	struct shm_ring_ctl to_server;
+	struct shm_ring_ctl to_gateway;
+};
+
+/**
+ * One side of a ring. ring holds the positions as this side last saw them and
+ * maps the bytes, which both sides share.
+ */
+typedef struct {
+	RecvRing ring;
+	struct shm_ring_ctl *ctl;
+} ShmRing;
+
+typedef struct {
+	/* First, so that the RecvRing of in is at the address of the ShmConn. */
+	ShmRing in;
+	ShmRing out;
+	char *map;
+	size_t map_len;
+} ShmConn;
+
+/**
+ * Creates the rings of a new gateway for the server, which reads in and writes
+ * out. Returns the memfd to pass to the gateway, or -1 with errno set.
+ */
+int shm_conn_create(ShmConn *c, size_t ring_size);
+
+/**
+ * Maps the rings of memfd for a gateway, which reads in and writes out. Returns
+ * -1 with errno set, EPROTO if memfd doesn't hold rings.
+ */
+int shm_conn_attach(ShmConn *c, int memfd);
+
+void shm_conn_deinit(ShmConn *c);
+
+/* Whether tail, published by the producer, is one the consumer may pick up. */
+static inline bool shm_ring_tail_valid(const ShmRing *r, uint64_t tail) {
+	return tail >= r->ring.tail && tail - r->ring.head <= r->ring.size;
+}
+
+/* Whether head, published by the consumer, is one the producer may pick up. */
+static inline bool shm_ring_head_valid(const ShmRing *r, uint64_t head) {
+	return head <= r->ring.tail && r->ring.tail - head <= r->ring.size;
+}
+
+/**
+ * Consumer: picks up the bytes published since and returns how many there are,
+ * or -1 if the producer published an invalid tail.
+ */
+static inline ssize_t shm_ring_pull(ShmRing *r) {
+	uint64_t tail = atomic_load_explicit(&r->ctl->tail, memory_order_acquire);
+	if (!shm_ring_tail_valid(r, tail)) return -1;
+	r->ring.tail = tail;
+	return recv_ring_len(&r->ring);
+}
+
+/**
+ * Consumer: publishes the bytes consumed with recv_ring_consume. Returns true if
+ * the producer waits for room and has to be woken.
+ */
+static inline bool shm_ring_release(ShmRing *r) {
+	atomic_store(&r->ctl->head, r->ring.head);
+	return atomic_load(&r->ctl->producer_sleeping)
+		&& atomic_exchange(&r->ctl->producer_sleeping, 0);
+}
+
+/**
+ * Producer: picks up the room made since and returns how much there is, or -1 if
+ * the consumer published an invalid head.
+ */
+static inline ssize_t shm_ring_space(ShmRing *r) {
+	uint64_t head = atomic_load_explicit(&r->ctl->head, memory_order_acquire);
+	if (!shm_ring_head_valid(r, head)) return -1;
+	r->ring.head = head;
+	return recv_ring_free(&r->ring);
+}
+
+/**
+ * Producer: publishes the bytes added with recv_ring_commit. Returns true if the
+ * consumer waits for bytes and has to be woken.
+ */
+static inline bool shm_ring_publish(ShmRing *r) {
+	atomic_store(&r->ctl->tail, r->ring.tail);
+	return atomic_load(&r->ctl->consumer_sleeping)
+		&& atomic_exchange(&r->ctl->consumer_sleeping, 0);
+}
+
+/**
+ * Consumer: announces that it is about to wait for the doorbell. Returns false
+ * if bytes arrived meanwhile, in which case it must not wait, or if the tail is
+ * invalid, which the next shm_ring_pull reports.
+ */
+bool shm_ring_sleep_consumer(ShmRing *r);
+
+/**
+ * Producer: same as shm_ring_sleep_consumer, waiting for room for len bytes. An
+ * invalid head is left to the next shm_ring_space.
+ */
+bool shm_ring_sleep_producer(ShmRing *r, size_t len);
+
+/* Wakes the peer at the other end of sock. Never blocks. */
+void shm_doorbell(int sock);
+
+/* Passes memfd along with a single byte on sock. Returns -1 with errno set. */
+int shm_send_fd(int sock, int memfd);
+
+/**
+ * Connects a gateway to the shm listener of the server at path and maps the
+ * rings it hands out. Returns the socket, or -1 with errno set.
+ */
+int shm_gateway_connect(const char *path, ShmConn *c);
+
+/**
+ * Copies len bytes into the ring towards the server, waiting for room. Returns
+ * -1 with errno set, EPIPE if the server went away and EPROTO if it published an
+ * invalid head.
+ */
+int shm_gateway_write(ShmConn *c, int sock, const void *buf, size_t len);
+
+/**
+ * Waits for bytes from the server, readable at recv_ring_read_ptr(&c->in.ring),
+ * and returns how many there are. Returns 0 if the server went away, or -1 with
+ * errno set, EPROTO if it published an invalid tail.
+ */
+ssize_t shm_gateway_wait(ShmConn *c, int sock);
+
+/* Consumes n of the bytes returned by shm_gateway_wait. */
+void shm_gateway_consume(ShmConn *c, int sock, size_t n);
+
+#endif
@@ -36,6 +36,24 @@ void slab_deinit(Slab *s) {
 	free(s->buf_refs);
 }
 
+void slab_reserve(Slab *s, size_t n) {
+	if (n > s->cap) {
+		s->cap = n;
+		s->buf_refs = must_realloc(
+			s->buf_refs,
+			s->cap * sizeof(BufRef *),
+			"slab_reserve realloc buffers"
+		);
+	}
+
+	while (s->len < n) {
+		BufRef *bref = malloc_buf_ref(s);
+		prefault(bref, sizeof(BufRef) + s->buf_cap);
+		s->buf_refs[s->len] = bref;
+		s->len++;
+	}
+}
+
 BufRef *slab_acquire(Slab *s, size_t ref) {
 	BufRef *bref;
 
@@ -28,6 +28,12 @@ void slab_init_cap(Slab *s, size_t buf_cap, size_t cap);
 void slab_init(Slab *s, size_t buf_cap);
 void slab_deinit(Slab *s);
 
+/**
+ * Allocates and faults in buffers until at least n are free, so that acquiring n
+ * buffers doesn't allocate.
+ */
+void slab_reserve(Slab *s, size_t n);
+
 /* Returns a buffer or exits the program if memory allocation fails. */
 BufRef *slab_acquire(Slab *s, size_t ref);
 
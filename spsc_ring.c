@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "spsc_ring.h"
+#include "utils.h"
+
+void spsc_ring_init(SpscRing *r, size_t cap, spsc_drain_fn drain, void *arg) {
+	memset(r, 0, sizeof(*r));
+	r->cap = cap;
+	r->buf = must_malloc(cap, "spsc_ring_init malloc buf");
+	r->drain = drain;
+	r->arg = arg;
+}
+
+/* Copies len bytes to the ring at pos, wrapping around its end. */
+static void ring_copy(SpscRing *r, uint64_t pos, const void *data, size_t len) {
+	size_t off = pos & (r->cap - 1);
+	size_t first = r->cap - off < len ? r->cap - off : len;
+	memcpy(r->buf + off, data, first);
+	memcpy(r->buf, (const char *)data + first, len - first);
+}
+
+bool spsc_ring_push(SpscRing *r, const void *a, size_t a_len, const void *b, size_t b_len) {
+	size_t total = a_len + b_len;
+	uint64_t head = r->head;
+	if (r->cap - (head - r->tail_cache) < total) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (r->cap - (head - r->tail_cache) < total) {
+			__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+			return false;
+		}
+	}
+
+	ring_copy(r, head, a, a_len);
+	if (b_len > 0) ring_copy(r, head + a_len, b, b_len);
+	__atomic_store_n(&r->head, head + total, __ATOMIC_RELEASE);
+	return true;
+}
+
+const char *spsc_ring_peek(const SpscRing *r, size_t len, size_t *span_len) {
+	size_t off = r->tail & (r->cap - 1);
+	*span_len = r->cap - off < len ? r->cap - off : len;
+	return r->buf + off;
+}
+
+void spsc_ring_read(SpscRing *r, void *dst, size_t len) {
+	size_t first;
+	const char *p = spsc_ring_peek(r, len, &first);
+	memcpy(dst, p, first);
+	memcpy((char *)dst + first, r->buf, len - first);
+	spsc_ring_consume(r, len);
+}
+
+static void *writer_run(void *arg) {
+	SpscRing *r = arg;
+	struct timespec interval = {
+		.tv_sec = r->interval_ms / 1000,
+		.tv_nsec = (r->interval_ms % 1000) * 1000000l,
+	};
+
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		if (r->drain(r->arg) == 0) nanosleep(&interval, NULL);
+	}
+	r->drain(r->arg);
+	return NULL;
+}
+
+void spsc_ring_start(SpscRing *r, long interval_ms) {
+	r->interval_ms = interval_ms;
+	if (pthread_create(&r->writer, NULL, writer_run, r) != 0) {
+		fatal_error("spsc_ring_start pthread_create");
+	}
+	r->running = true;
+}
+
+void spsc_ring_deinit(SpscRing *r) {
+	if (r->running) {
+		__atomic_store_n(&r->stop, true, __ATOMIC_RELEASE);
+		pthread_join(r->writer, NULL);
+		r->running = false;
+	} else {
+		r->drain(r->arg);
+	}
+	free(r->buf);
+	r->buf = NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+/**
+ * Lock-free single producer, single consumer byte ring with a writer thread,
+ * which the Logger and the Capture write through.
+ *
+ * The event loop pushes records and moves on. When the ring is full they are
+ * dropped and counted rather than blocking the loop. The writer calls drain,
+ * which consumes what is pending, and sleeps for the interval when there was
+ * nothing. Records may wrap around the end of the ring, drain copies them out
+ * with spsc_ring_read or writes the contiguous spans of spsc_ring_peek.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Consumes the bytes pending in the ring of arg and returns how many there were. */
+typedef size_t (*spsc_drain_fn)(void *arg);
+
+typedef struct {
+	size_t cap;
+	char *buf;
+
+	/* Written by the producer only. */
+	_Alignas(64) uint64_t head;
+	uint64_t tail_cache;
+	uint64_t dropped;
+
+	/* Written by the consumer only. */
+	_Alignas(64) uint64_t tail;
+
+	spsc_drain_fn drain;
+	void *arg;
+	long interval_ms;
+	bool running;
+	bool stop;
+	pthread_t writer;
+} SpscRing;
+
+/* cap must be a power of 2. drain is called with arg. */
+void spsc_ring_init(SpscRing *r, size_t cap, spsc_drain_fn drain, void *arg);
+
+/* Starts the writer thread, which sleeps for interval_ms when the ring is empty. */
+void spsc_ring_start(SpscRing *r, long interval_ms);
+
+/**
+ * Stops the writer, if running, after it has drained every pending record, or
+ * drains them here.
+ */
+void spsc_ring_deinit(SpscRing *r);
+
+/**
+ * Copies a record made of the a_len bytes at a followed by the b_len bytes at b
+ * into the ring. Returns false and counts it as dropped if there is no room.
+ * Never blocks.
+ */
+bool spsc_ring_push(SpscRing *r, const void *a, size_t a_len, const void *b, size_t b_len);
+
+/* Bytes pushed but not consumed yet. Only called by the consumer. */
+static inline size_t spsc_ring_len(const SpscRing *r) {
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+}
+
+/**
+ * Returns the pending bytes contiguous from the tail, at most len of them, in
+ * *span_len. They stay in the ring until consumed.
+ */
+const char *spsc_ring_peek(const SpscRing *r, size_t len, size_t *span_len);
+
+/* Hands len bytes back to the producer. */
+static inline void spsc_ring_consume(SpscRing *r, size_t len) {
+	__atomic_store_n(&r->tail, r->tail + len, __ATOMIC_RELEASE);
+}
+
+/* Copies len pending bytes to dst and consumes them. */
+void spsc_ring_read(SpscRing *r, void *dst, size_t len);
+
+#endif
@@ -0,0 +1,104 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "stress_client.h"
+#include "utils.h"
+
+/* Connections per loopback source address, below the ephemeral port range. */
+#define CONNS_PER_SRC 20000
+
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int connect_client(const struct sockaddr_in *addr, size_t idx, int recv_timeout_s) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) fatal_error("socket");
+
+	struct timeval tv = { .tv_sec = recv_timeout_s };
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		fatal_error("setsockopt(SO_RCVTIMEO)");
+	}
+
+	if ((ntohl(addr->sin_addr.s_addr) >> 24) == 127) {
+		struct sockaddr_in src = {
+			.sin_family = AF_INET,
+			.sin_addr.s_addr = htonl(0x7f000002 + idx / CONNS_PER_SRC),
+		};
+		if (bind(fd, (struct sockaddr *)&src, sizeof(src)) < 0) fatal_error("bind");
+	}
+	if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) fatal_error("connect");
+	return fd;
+}
+
+void write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fatal_error("write");
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+void read_all(int fd, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) fatal_error("read, server stalled or message lost");
+		if (n == 0) {
+			fprintf(stderr, "server closed the connection\n");
+			exit(EXIT_FAILURE);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+void expect_frame(int fd, char *buf, uint8_t msgt, uint16_t *len) {
+	while (1) {
+		read_all(fd, buf, PROT_HDR_LEN);
+		uint8_t got;
+		uint64_t seqid;
+		deser_header(buf, len, &got, &seqid);
+		if (*len < PROT_HDR_LEN || *len > PROT_MAX_LEN) {
+			fprintf(stderr, "invalid frame len %u\n", *len);
+			exit(EXIT_FAILURE);
+		}
+		read_all(fd, buf + PROT_HDR_LEN, *len - PROT_HDR_LEN);
+
+		if (got == msgt) return;
+		if (got == MSGT_SERVER_ERROR) {
+			uint8_t code;
+			deser_server_error(*len, buf, &code);
+			fprintf(stderr, "SERVER_ERROR %u while waiting for msgt %u\n", code, msgt);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+uint64_t set_username(int fd, size_t idx, const char *prefix) {
+	char buf[PROT_MAX_LEN];
+	char uname[MAX_UNAME_LEN + 1];
+	int uname_len = snprintf(uname, sizeof(uname), "%s%x%zu", prefix, getpid() & 0xfff, idx);
+
+	size_t len = ser_set_username(sizeof(buf), buf, idx, uname_len, uname);
+	write_all(fd, buf, len);
+
+	uint16_t frame_len;
+	expect_frame(fd, buf, MSGT_SET_USERNAME_RESPONSE, &frame_len);
+	uint64_t uid;
+	deser_set_username_response(frame_len, buf, &uid);
+	return uid;
+}
@@ -0,0 +1,33 @@
+#ifndef STRESS_CLIENT_H
+#define STRESS_CLIENT_H
+
+/**
+ * Blocking clients for the stress tools. Every helper exits the process once
+ * something goes wrong, which fails the run.
+ */
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t monotonic_ns(void);
+
+/**
+ * Connects client idx to addr. Its reads time out after recv_timeout_s. Loopback
+ * connections are spread over source addresses so that ports don't run out.
+ */
+int connect_client(const struct sockaddr_in *addr, size_t idx, int recv_timeout_s);
+
+void write_all(int fd, const char *buf, size_t len);
+void read_all(int fd, char *buf, size_t len);
+
+/**
+ * Reads frames into buf, which holds PROT_MAX_LEN bytes, until one of type msgt.
+ * Fails on SERVER_ERROR.
+ */
+void expect_frame(int fd, char *buf, uint8_t msgt, uint16_t *len);
+
+/* Sets the username <prefix><pid><idx> with seqid idx. Returns the uid. */
+uint64_t set_username(int fd, size_t idx, const char *prefix);
+
+#endif
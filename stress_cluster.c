@@ -0,0 +1,163 @@
+/**
+ * Checks delivery across the nodes of a cluster and measures its rate.
+ *
+ * Connects the clients round robin to nodes listening on consecutive ports and
+ * creates the groups, each with every client as a member, so that they are owned
+ * by different nodes. Then each group in turn gets messages from senders on every
+ * node. Every member must receive every message exactly once, with msgids of a
+ * group increasing, and every sender must get its response. It reports how long
+ * the messages took to reach all members.
+ *
+ * e.g. with three nodes on one host
+ * ```
+ * set -x CHAT_CLUSTER 127.0.0.1:9000,127.0.0.1:9001,127.0.0.1:9002
+ * for n in 0 1 2; CHAT_NODE=$n CHAT_PORT=(math 8080 + $n) ./server &; end
+ * ./stress_cluster 127.0.0.1 8080 3 100 16 1000
+ * ```
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "stress_client.h"
+#include "utils.h"
+
+#define MSG_LEN 64
+/* How long a client waits for a frame before the run fails. */
+#define RECV_TIMEOUT_S 30
+/* Of the top bits of client_ids and gids, see cluster.h. */
+#define NODE_SHIFT 56
+
+/* Client creator creates a group with every other client. Returns its gid. */
+static uint64_t create_group(int *fds, uint64_t *uids, size_t clients, size_t creator) {
+	uint64_t others[clients];
+	size_t others_len = 0;
+	for (size_t i = 0; i < clients; i++) {
+		if (i != creator) others[others_len++] = uids[i];
+	}
+
+	char buf[PROT_MAX_LEN];
+	uint16_t frame_len;
+	size_t first = others_len < MAX_UIDS_PER_MSG ? others_len : MAX_UIDS_PER_MSG;
+	size_t len = ser_create_group(buf, sizeof(buf), 1, others, first);
+	write_all(fds[creator], buf, len);
+	expect_frame(fds[creator], buf, MSGT_CREATE_GROUP_RESONSE, &frame_len);
+	uint64_t gid;
+	deser_create_group_response(frame_len, buf, &gid);
+
+	for (size_t i = first; i < others_len; i += MAX_UIDS_PER_MSG) {
+		size_t n = others_len - i < MAX_UIDS_PER_MSG ? others_len - i : MAX_UIDS_PER_MSG;
+		len = ser_add_to_group(sizeof(buf), buf, 2, gid, others + i, n);
+		write_all(fds[creator], buf, len);
+		expect_frame(fds[creator], buf, MSGT_ADD_TO_GROUP_RESPONSE, &frame_len);
+	}
+
+	/* Members on other nodes are added through the owner of the group. */
+	for (size_t i = 0; i < clients; i++) {
+		if (i != creator) expect_frame(fds[i], buf, MSGT_JOINED_GROUP, &frame_len);
+	}
+	return gid;
+}
+
+int main(int argc, char *argv[]) {
+	size_t nodes = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+	size_t per_node = argc > 4 ? strtoul(argv[4], NULL, 10) : 0;
+	size_t groups = argc > 5 ? strtoul(argv[5], NULL, 10) : 0;
+	size_t messages = argc > 6 ? strtoul(argv[6], NULL, 10) : 0;
+	if (argc < 7 || nodes < 2 || per_node < 1 || groups < 1) {
+		fprintf(stderr, "Usage: %s <ip> <first port> <nodes >= 2> <clients per node> <groups> "
+			"<messages>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *ip_str = argv[1];
+	int port = atoi(argv[2]);
+	size_t clients = nodes * per_node;
+
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	if (inet_pton(AF_INET, ip_str, &addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid server ip: %s\n", ip_str);
+		return EXIT_FAILURE;
+	}
+
+	/* One fd per client. */
+	struct rlimit nofile;
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < clients + 64) {
+		nofile.rlim_cur = nofile.rlim_max < clients + 64 ? nofile.rlim_max : clients + 64;
+		setrlimit(RLIMIT_NOFILE, &nofile);
+	}
+
+	int *fds = must_malloc(clients * sizeof(int), "fds");
+	uint64_t *uids = must_malloc(clients * sizeof(uint64_t), "uids");
+	for (size_t i = 0; i < clients; i++) {
+		addr.sin_port = htons(port + i % nodes);
+		fds[i] = connect_client(&addr, i, RECV_TIMEOUT_S);
+		uids[i] = set_username(fds[i], i, "cl");
+		if (uids[i] >> NODE_SHIFT != i % nodes) {
+			fprintf(stderr, "client_id %lx doesn't come from node %zu\n", uids[i], i % nodes);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("connected %zu clients to %zu nodes\n", clients, nodes);
+
+	uint64_t *gids = must_malloc(groups * sizeof(uint64_t), "gids");
+	for (size_t g = 0; g < groups; g++) gids[g] = create_group(fds, uids, clients, g % clients);
+	printf("created %zu groups of %zu members\n", groups, clients);
+
+	/* Last msgid each client got from each group. */
+	uint64_t *last = must_calloc(clients * groups, sizeof(uint64_t), "last");
+	char buf[PROT_MAX_LEN];
+	char msg[MSG_LEN];
+	uint16_t frame_len;
+
+	uint64_t start_ns = monotonic_ns();
+	for (size_t m = 0; m < messages; m++) {
+		size_t g = m % groups;
+		size_t sender = m % clients;
+		memset(msg, 0, sizeof(msg));
+		snprintf(msg, sizeof(msg), "%zu", m);
+		size_t len = ser_send_to_group(sizeof(buf), buf, 3, gids[g], MSG_LEN, msg);
+		write_all(fds[sender], buf, len);
+
+		expect_frame(fds[sender], buf, MSGT_SEND_TO_GROUP_RESPONSE, &frame_len);
+		uint64_t gid, msgid;
+		deser_send_to_group_response(frame_len, buf, &gid, &msgid);
+
+		for (size_t i = 0; i < clients; i++) {
+			if (i == sender) {
+				last[i * groups + g] = msgid;
+				continue;
+			}
+			expect_frame(fds[i], buf, MSGT_RECEIVE_FROM_GROUP, &frame_len);
+			uint64_t got_gid, got_msgid, uid;
+			const char *got;
+			size_t got_len;
+			deser_receive_from_group(frame_len, buf, &got_gid, &got_msgid, &uid, &got, &got_len);
+			if (got_gid != gids[g] || got_msgid != msgid || uid != uids[sender]
+				|| got_len != MSG_LEN || memcmp(got, msg, MSG_LEN) != 0
+				|| got_msgid <= last[i * groups + g]) {
+				fprintf(stderr, "client %zu got msgid %lu of group %lx, expected %lu of %lx\n",
+					i, got_msgid, got_gid, msgid, gids[g]);
+				return EXIT_FAILURE;
+			}
+			last[i * groups + g] = got_msgid;
+		}
+	}
+	uint64_t elapsed_ns = monotonic_ns() - start_ns;
+	printf("%zu messages reached every member in %.1f ms, %.0f deliveries/s\n",
+		messages, elapsed_ns / 1e6, messages * (clients - 1) / (elapsed_ns / 1e9));
+
+	for (size_t i = 0; i < clients; i++) close(fds[i]);
+	free(last);
+	free(gids);
+	free(uids);
+	free(fds);
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+/**
+ * Measures a handover from a running server to a new one under load.
+ *
+ * Connects the clients to the old server and puts all of them in one group. Once
+ * the new server is waiting at the handover path, it signals the old one and then
+ * has every client send a request. It reports how long after the signal the last
+ * client got its response. Afterwards no connection may have been dropped, the
+ * group must still reach every member and new clients must still be served.
+ *
+ * Both servers need an fd limit above the number of clients e.g.
+ * ```
+ * ulimit -n 250000
+ * CHAT_HANDOVER=/tmp/chat.sock ./server &
+ * ./stress_handover 127.0.0.1 8080 100000 (pidof server) /tmp/chat.sock
+ * CHAT_HANDOVER=/tmp/chat.sock CHAT_TAKEOVER=1 ./server   # once connected
+ * ```
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "stress_client.h"
+#include "utils.h"
+
+#define MSG_LEN 64
+/* How long a client waits for a frame before the run fails. */
+#define RECV_TIMEOUT_S 30
+
+int main(int argc, char *argv[]) {
+	size_t clients = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+	if (argc < 6 || clients < 2) {
+		fprintf(stderr, "Usage: %s <ip> <port> <clients >= 2> <old pid> <handover path>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *ip_str = argv[1];
+	int port = atoi(argv[2]);
+	pid_t old_pid = atoi(argv[4]);
+	const char *path = argv[5];
+
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	if (inet_pton(AF_INET, ip_str, &addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid server ip: %s\n", ip_str);
+		return EXIT_FAILURE;
+	}
+
+	/* One fd per client. */
+	struct rlimit nofile;
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < clients + 64) {
+		nofile.rlim_cur = nofile.rlim_max < clients + 64 ? nofile.rlim_max : clients + 64;
+		setrlimit(RLIMIT_NOFILE, &nofile);
+	}
+
+	int *fds = must_malloc(clients * sizeof(int), "fds");
+	uint64_t *uids = must_malloc(clients * sizeof(uint64_t), "uids");
+	for (size_t i = 0; i < clients; i++) {
+		fds[i] = connect_client(&addr, i, RECV_TIMEOUT_S);
+		uids[i] = set_username(fds[i], i, "ho");
+	}
+	printf("connected %zu clients\n", clients);
+
+	/* Client 0 creates the group and adds everyone else, MAX_UIDS_PER_MSG at a time. */
+	char buf[PROT_MAX_LEN];
+	uint16_t frame_len;
+	size_t first = clients - 1 < MAX_UIDS_PER_MSG ? clients - 1 : MAX_UIDS_PER_MSG;
+	size_t len = ser_create_group(buf, sizeof(buf), 1, uids + 1, first);
+	write_all(fds[0], buf, len);
+	expect_frame(fds[0], buf, MSGT_CREATE_GROUP_RESONSE, &frame_len);
+	uint64_t gid;
+	deser_create_group_response(frame_len, buf, &gid);
+
+	for (size_t i = 1 + first; i < clients; i += MAX_UIDS_PER_MSG) {
+		size_t n = clients - i < MAX_UIDS_PER_MSG ? clients - i : MAX_UIDS_PER_MSG;
+		len = ser_add_to_group(sizeof(buf), buf, 2, gid, uids + i, n);
+		write_all(fds[0], buf, len);
+		expect_frame(fds[0], buf, MSGT_ADD_TO_GROUP_RESPONSE, &frame_len);
+	}
+	for (size_t i = 1; i < clients; i++) {
+		expect_frame(fds[i], buf, MSGT_JOINED_GROUP, &frame_len);
+	}
+	printf("group %lu has %zu members\n", gid, clients);
+
+	printf("waiting for the new server at %s\n", path);
+	struct stat st;
+	while (stat(path, &st) < 0) usleep(10000);
+
+	/* Every client has a request in flight while the clients are handed over. */
+	uint64_t start_ns = monotonic_ns();
+	if (kill(old_pid, SIGUSR2) < 0) fatal_error("kill(SIGUSR2)");
+	len = ser_set_options(sizeof(buf), buf, 3, 0);
+	for (size_t i = 0; i < clients; i++) write_all(fds[i], buf, len);
+	for (size_t i = 0; i < clients; i++) {
+		expect_frame(fds[i], buf, MSGT_SET_OPTIONS_RESPONSE, &frame_len);
+	}
+	printf("handover: every client answered %.1f ms after the signal\n",
+		(monotonic_ns() - start_ns) / 1e6);
+
+	/* The group survived the handover. */
+	char msg[MSG_LEN];
+	memset(msg, 'x', sizeof(msg));
+	len = ser_send_to_group(sizeof(buf), buf, 4, gid, MSG_LEN, msg);
+	write_all(fds[0], buf, len);
+	expect_frame(fds[0], buf, MSGT_SEND_TO_GROUP_RESPONSE, &frame_len);
+	for (size_t i = 1; i < clients; i++) {
+		expect_frame(fds[i], buf, MSGT_RECEIVE_FROM_GROUP, &frame_len);
+	}
+	printf("every member received the group message\n");
+
+	/* The new server accepts new clients and doesn't reuse client_ids. */
+	int fd = connect_client(&addr, clients, RECV_TIMEOUT_S);
+	uint64_t uid = set_username(fd, clients, "ho");
+	for (size_t i = 0; i < clients; i++) {
+		if (uids[i] == uid) {
+			fprintf(stderr, "client_id %lu handed out twice\n", uid);
+			return EXIT_FAILURE;
+		}
+	}
+	close(fd);
+
+	for (size_t i = 0; i < clients; i++) close(fds[i]);
+	free(uids);
+	free(fds);
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+/**
+ * Drives the submission queue of a running server past its capacity.
+ *
+ * Connects more clients than the SQ has entries, puts all of them in one group,
+ * and then pipelines a burst of SEND_TO_GROUPs from one of them. The server
+ * handles the burst in a single pass over the recv ring, which prepares a send per
+ * member per message, i.e. many times QUEUE_SIZE SQEs at once. Every LEAVE_EVERY-th
+ * member resets its connection as soon as the burst is sent, while sends to it are
+ * still being prepared or queued. Every other member must receive every message
+ * and the server must still accept new clients afterwards.
+ *
+ * The server needs an fd limit above the number of clients e.g.
+ * `ulimit -n 65536; ./server` and then `./stress_sq 127.0.0.1 8080 6000 8`.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "stress_client.h"
+#include "utils.h"
+
+#define DEFAULT_CLIENTS 6000
+#define DEFAULT_BURST 8
+#define MSG_LEN 64
+/* How long a client waits for a frame before the run fails. */
+#define RECV_TIMEOUT_S 10
+/* Members which leave during the burst. */
+#define LEAVE_EVERY 4
+
+int main(int argc, char *argv[]) {
+	const char *ip_str = argc > 1 ? argv[1] : "127.0.0.1";
+	int port = argc > 2 ? atoi(argv[2]) : 8080;
+	size_t clients = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_CLIENTS;
+	size_t burst = argc > 4 ? strtoul(argv[4], NULL, 10) : DEFAULT_BURST;
+	if (clients < 2 || burst == 0) {
+		fprintf(stderr, "Usage: %s [ip] [port] [clients >= 2] [burst >= 1]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	if (inet_pton(AF_INET, ip_str, &addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid server ip: %s\n", ip_str);
+		return EXIT_FAILURE;
+	}
+
+	/* One fd per client. */
+	struct rlimit nofile;
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < clients + 64) {
+		nofile.rlim_cur = nofile.rlim_max < clients + 64 ? nofile.rlim_max : clients + 64;
+		setrlimit(RLIMIT_NOFILE, &nofile);
+	}
+
+	int *fds = must_malloc(clients * sizeof(int), "fds");
+	uint64_t *uids = must_malloc(clients * sizeof(uint64_t), "uids");
+	for (size_t i = 0; i < clients; i++) {
+		fds[i] = connect_client(&addr, i, RECV_TIMEOUT_S);
+		uids[i] = set_username(fds[i], i, "sq");
+	}
+	printf("connected %zu clients\n", clients);
+
+	/* Client 0 creates the group and adds everyone else, MAX_UIDS_PER_MSG at a time. */
+	char buf[PROT_MAX_LEN];
+	uint16_t frame_len;
+	size_t first = clients - 1 < MAX_UIDS_PER_MSG ? clients - 1 : MAX_UIDS_PER_MSG;
+	size_t len = ser_create_group(buf, sizeof(buf), 1, uids + 1, first);
+	write_all(fds[0], buf, len);
+	expect_frame(fds[0], buf, MSGT_CREATE_GROUP_RESONSE, &frame_len);
+	uint64_t gid;
+	deser_create_group_response(frame_len, buf, &gid);
+
+	for (size_t i = 1 + first; i < clients; i += MAX_UIDS_PER_MSG) {
+		size_t n = clients - i < MAX_UIDS_PER_MSG ? clients - i : MAX_UIDS_PER_MSG;
+		len = ser_add_to_group(sizeof(buf), buf, 2, gid, uids + i, n);
+		write_all(fds[0], buf, len);
+		expect_frame(fds[0], buf, MSGT_ADD_TO_GROUP_RESPONSE, &frame_len);
+	}
+	for (size_t i = 1; i < clients; i++) {
+		expect_frame(fds[i], buf, MSGT_JOINED_GROUP, &frame_len);
+	}
+	printf("group %lu has %zu members\n", gid, clients);
+
+	/* The whole burst goes out in one write so the server handles it in one pass. */
+	char msg[MSG_LEN];
+	memset(msg, 'x', sizeof(msg));
+	size_t frame = sizeof(struct msg_send_to_group) + MSG_LEN;
+	char *out = must_malloc(burst * frame, "burst");
+	for (size_t i = 0; i < burst; i++) {
+		ser_send_to_group(frame, out + i * frame, 100 + i, gid, MSG_LEN, msg);
+	}
+	write_all(fds[0], out, burst * frame);
+	printf("sent %zu messages, %zu sends for an SQ of 4096 entries\n",
+		burst, burst * (clients - 1));
+
+	/* A zero linger timeout resets the connection instead of closing it gracefully. */
+	size_t left = 0;
+	struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+	for (size_t c = LEAVE_EVERY; c < clients; c += LEAVE_EVERY) {
+		setsockopt(fds[c], SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+		close(fds[c]);
+		fds[c] = -1;
+		left++;
+	}
+
+	for (size_t i = 0; i < burst; i++) {
+		expect_frame(fds[0], buf, MSGT_SEND_TO_GROUP_RESPONSE, &frame_len);
+	}
+	for (size_t c = 1; c < clients; c++) {
+		if (fds[c] < 0) continue;
+		for (size_t i = 0; i < burst; i++) {
+			expect_frame(fds[c], buf, MSGT_RECEIVE_FROM_GROUP, &frame_len);
+		}
+	}
+	printf("%zu members left during the burst, the other %zu received %zu messages each\n",
+		left, clients - 1 - left, burst);
+
+	/* The server is still serving new clients. */
+	int fd = connect_client(&addr, clients, RECV_TIMEOUT_S);
+	set_username(fd, clients, "sq");
+	close(fd);
+
+	for (size_t i = 0; i < clients; i++) {
+		if (fds[i] >= 0) close(fds[i]);
+	}
+	free(out);
+	free(uids);
+	free(fds);
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
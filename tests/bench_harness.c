@@ -0,0 +1,279 @@
+/**
+ * Runs every suite, prints a table of the results and optionally writes them
+ * as JSON and compares them with a baseline written by a previous run:
+ *
+ *   ./bench_runner [--cpu N] [--filter SUBSTR] [--json FILE]
+ *                  [--compare BASELINE] [--threshold PCT]
+ *
+ * With --compare, exits with 1 if any benchmark got slower than the baseline by
+ * more than the threshold (10% by default).
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "bench_harness.h"
+
+#define MAX_RESULTS 256
+#define SAMPLE_NS 1000000ull
+#define CALIBRATE_NS 50000000ull
+
+typedef struct {
+	char name[64];
+	double cycles_median;
+	double cycles_min;
+	double ns_median;
+} BenchResult;
+
+volatile uint64_t bench_sink;
+
+static BenchResult results[MAX_RESULTS];
+static size_t results_len;
+
+static const char *filter;
+
+/* TSC ticks per ns, measured once at startup. */
+static double cycles_per_ns;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * lfence keeps rdtsc from being reordered with the code being measured. Falls
+ * back to the monotonic clock, i.e. 1 cycle per ns, elsewhere.
+ */
+static inline uint64_t cycles_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_lfence();
+	uint64_t tsc = __rdtsc();
+	_mm_lfence();
+	return tsc;
+#else
+	return now_ns();
+#endif
+}
+
+static void calibrate_cycles(void) {
+	uint64_t start_ns = now_ns();
+	uint64_t start = cycles_now();
+	while (now_ns() - start_ns < CALIBRATE_NS);
+	cycles_per_ns = (double)(cycles_now() - start) / (now_ns() - start_ns);
+}
+
+/**
+ * Pins to cpu, or to the first CPU we are allowed on if cpu is negative.
+ * Returns the CPU pinned to.
+ */
+static int pin_cpu(int cpu) {
+	cpu_set_t set;
+	if (cpu < 0) {
+		if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+			perror("sched_getaffinity");
+			exit(EXIT_FAILURE);
+		}
+		for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &set); cpu++);
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_setaffinity");
+		exit(EXIT_FAILURE);
+	}
+	return cpu;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void bench_run(const char *name, bench_fn fn, void *ctx, size_t ops_per_iter) {
+	if (filter != NULL && strstr(name, filter) == NULL) return;
+	if (results_len == MAX_RESULTS) {
+		fprintf(stderr, "too many benchmarks, raise MAX_RESULTS\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Warms up caches and finds how many iterations fill a sample. */
+	size_t iters = 1;
+	uint64_t target = SAMPLE_NS * cycles_per_ns;
+	while (1) {
+		uint64_t start = cycles_now();
+		fn(ctx, iters);
+		if (cycles_now() - start >= target) break;
+		iters *= 2;
+	}
+
+	double samples[BENCH_SAMPLES];
+	for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint64_t start = cycles_now();
+		fn(ctx, iters);
+		uint64_t elapsed = cycles_now() - start;
+		samples[i] = (double)elapsed / ((double)iters * ops_per_iter);
+	}
+	qsort(samples, BENCH_SAMPLES, sizeof(double), cmp_double);
+
+	BenchResult *r = &results[results_len++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->cycles_median = samples[BENCH_SAMPLES / 2];
+	r->cycles_min = samples[0];
+	r->ns_median = r->cycles_median / cycles_per_ns;
+
+	printf("%-44s %12.2f %12.2f %12.2f\n", r->name, r->cycles_median, r->cycles_min, r->ns_median);
+	fflush(stdout);
+}
+
+static void write_json(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(f, "{\n  \"cycles_per_ns\": %.6f,\n  \"benchmarks\": [\n", cycles_per_ns);
+	for (size_t i = 0; i < results_len; i++) {
+		BenchResult *r = &results[i];
+		fprintf(f,
+			"    {\"name\": \"%s\", \"cycles_per_op\": %.4f, \"cycles_min\": %.4f, \"ns_per_op\": %.4f}%s\n",
+			r->name, r->cycles_median, r->cycles_min, r->ns_median,
+			i + 1 < results_len ? "," : ""
+		);
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+}
+
+/**
+ * Looks up cycles_per_op of name in a file written by write_json. Only has to
+ * understand the one object per line layout write_json produces.
+ */
+static bool baseline_cycles(const char *json, const char *name, double *cycles) {
+	char key[96];
+	snprintf(key, sizeof(key), "\"name\": \"%.63s\",", name);
+
+	const char *entry = strstr(json, key);
+	if (entry == NULL) return false;
+
+	const char *field = strstr(entry, "\"cycles_per_op\": ");
+	if (field == NULL) return false;
+
+	*cycles = strtod(field + strlen("\"cycles_per_op\": "), NULL);
+	return true;
+}
+
+static char *read_file(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char *buf = malloc(len + 1);
+	if (buf == NULL || fread(buf, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "failed to read %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	buf[len] = '\0';
+	fclose(f);
+	return buf;
+}
+
+/* Returns the number of regressions. */
+static size_t compare(const char *path, double threshold) {
+	char *json = read_file(path);
+	size_t regressions = 0;
+
+	printf("\n%-44s %12s %12s %9s\n", "compared to baseline", "base cyc/op", "cyc/op", "delta");
+	for (size_t i = 0; i < results_len; i++) {
+		BenchResult *r = &results[i];
+		double base;
+		if (!baseline_cycles(json, r->name, &base)) {
+			printf("%-44s %12s %12.2f %9s\n", r->name, "-", r->cycles_median, "new");
+			continue;
+		}
+
+		double delta = (r->cycles_median - base) / base * 100.0;
+		const char *verdict = "";
+		if (delta > threshold) {
+			verdict = "  REGRESSION";
+			regressions++;
+		} else if (delta < -threshold) {
+			verdict = "  improved";
+		}
+		printf("%-44s %12.2f %12.2f %+8.1f%%%s\n", r->name, base, r->cycles_median, delta, verdict);
+	}
+
+	free(json);
+	return regressions;
+}
+
+int main(int argc, char *argv[]) {
+	int cpu = -1;
+	const char *json_path = NULL;
+	const char *baseline_path = NULL;
+	double threshold = 10.0;
+
+	static const struct option opts[] = {
+		{"cpu", required_argument, NULL, 'c'},
+		{"filter", required_argument, NULL, 'f'},
+		{"json", required_argument, NULL, 'j'},
+		{"compare", required_argument, NULL, 'b'},
+		{"threshold", required_argument, NULL, 't'},
+		{NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:f:j:b:t:", opts, NULL)) != -1) {
+		switch (opt) {
+			case 'c': cpu = atoi(optarg); break;
+			case 'f': filter = optarg; break;
+			case 'j': json_path = optarg; break;
+			case 'b': baseline_path = optarg; break;
+			case 't': threshold = atof(optarg); break;
+			default:
+				fprintf(stderr,
+					"Usage: %s [--cpu N] [--filter SUBSTR] [--json FILE] "
+					"[--compare BASELINE] [--threshold PCT]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	cpu = pin_cpu(cpu);
+	calibrate_cycles();
+	printf("pinned to cpu %d, %.3f cycles/ns\n\n", cpu, cycles_per_ns);
+
+	printf("%-44s %12s %12s %12s\n", "benchmark", "cycles/op", "min", "ns/op");
+	bench_suite_structs();
+	bench_suite_protocol();
+	bench_suite_trace();
+
+	if (json_path != NULL) write_json(json_path);
+
+	if (baseline_path != NULL) {
+		size_t regressions = compare(baseline_path, threshold);
+		if (regressions > 0) {
+			printf("\n%zu regression(s) above %.1f%%\n", regressions, threshold);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+/**
+ * Microbenchmark harness behind `make bench`.
+ *
+ * A benchmark is a function which performs the operation under test `iters`
+ * times. bench_run calibrates iters so that a sample lasts about a millisecond,
+ * collects BENCH_SAMPLES samples on a pinned CPU and reports the median and the
+ * minimum number of TSC cycles per operation.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_SAMPLES 21
+
+typedef void (*bench_fn)(void *ctx, size_t iters);
+
+/**
+ * ops_per_iter is the number of operations a single iteration performs, e.g.
+ * the members of a group drained in one iteration. Results are reported per
+ * operation.
+ */
+void bench_run(const char *name, bench_fn fn, void *ctx, size_t ops_per_iter);
+
+/* Keeps the compiler from optimizing away the results of the operations. */
+extern volatile uint64_t bench_sink;
+
+/* Suites, one per bench_*.c file. */
+void bench_suite_structs(void);
+void bench_suite_protocol(void);
+void bench_suite_trace(void);
+
+#endif
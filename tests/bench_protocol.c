@@ -0,0 +1,278 @@
+/**
+ * Benchmarks for every ser_* and deser_* function of the protocol, and for the
+ * bulk uid codec they use.
+ */
+
+#include <string.h>
+
+#include "bench_harness.h"
+#include "../protocol.h"
+#include "../utils.h"
+
+#define GROUP_MSG_LEN 64
+
+/**
+ * Holds one serialized message of each type which the deser_* benchmarks parse
+ * and the ser_* benchmarks overwrite in place.
+ */
+typedef struct {
+	uint64_t uids[MAX_UIDS_PER_MSG];
+	char group_msg[GROUP_MSG_LEN];
+
+	/* ser_* requires an aligned buf. */
+	uint64_t buf[PROT_MAX_LEN / sizeof(uint64_t)];
+	size_t len;
+} ProtCtx;
+
+static void bench_deser_header(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		uint16_t len;
+		uint8_t msgt;
+		uint64_t seqid;
+		deser_header((char *)c->buf, &len, &msgt, &seqid);
+		bench_sink += seqid;
+	}
+}
+
+static void bench_ser_server_error(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_server_error(sizeof(c->buf), (char *)c->buf, i, 1);
+	}
+}
+
+static void bench_deser_server_error(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		uint8_t code;
+		deser_server_error(c->len, (char *)c->buf, &code);
+		bench_sink += code;
+	}
+}
+
+static void bench_ser_set_username(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_set_username(sizeof(c->buf), (char *)c->buf, i, 9, "benchuser");
+	}
+}
+
+static void bench_deser_set_username(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		const char *uname;
+		size_t uname_len;
+		deser_set_username(c->len, (char *)c->buf, &uname, &uname_len);
+		bench_sink += uname_len;
+	}
+}
+
+static void bench_ser_set_username_response(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_set_username_response(sizeof(c->buf), (char *)c->buf, i, i);
+	}
+}
+
+static void bench_deser_set_username_response(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t uid;
+		deser_set_username_response(c->len, (char *)c->buf, &uid);
+		bench_sink += uid;
+	}
+}
+
+static void bench_ser_create_group(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_create_group((char *)c->buf, sizeof(c->buf), i, c->uids, MAX_UIDS_PER_MSG);
+	}
+}
+
+static void bench_deser_create_group(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	uint64_t uids[MAX_UIDS_PER_MSG];
+	for (size_t i = 0; i < iters; i++) {
+		uint8_t uids_len;
+		const char *uids_raw;
+		size_t uids_raw_len;
+		deser_create_group(c->len, (char *)c->buf, &uids_len, uids, &uids_raw, &uids_raw_len);
+		bench_sink += uids[uids_len - 1];
+	}
+}
+
+static void bench_ser_create_group_response(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_create_group_response(sizeof(c->buf), (char *)c->buf, i, i);
+	}
+}
+
+static void bench_deser_create_group_response(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t gid;
+		deser_create_group_response(c->len, (char *)c->buf, &gid);
+		bench_sink += gid;
+	}
+}
+
+/* uids are forwarded raw from a CREATE_GROUP, so the source is another buffer. */
+typedef struct {
+	ProtCtx *prot;
+	char raw[MAX_UIDS_PER_MSG * sizeof(uint64_t)];
+} JoinedCtx;
+
+static void bench_ser_joined_group(void *ctx, size_t iters) {
+	JoinedCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_joined_group(
+			sizeof(c->prot->buf), (char *)c->prot->buf,
+			i, i, MAX_UIDS_PER_MSG, c->raw
+		);
+	}
+}
+
+static void bench_deser_joined_group(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t uid, gid;
+		uint8_t uids_len;
+		const char *uids_raw;
+		deser_joined_group(c->len, (char *)c->buf, &uid, &gid, &uids_len, &uids_raw);
+		bench_sink += gid;
+	}
+}
+
+static void bench_ser_send_to_group(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_send_to_group(
+			sizeof(c->buf), (char *)c->buf,
+			i, i, GROUP_MSG_LEN, c->group_msg
+		);
+	}
+}
+
+static void bench_deser_send_to_group(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t gid;
+		const char *msg;
+		size_t msg_len;
+		deser_send_to_group(c->len, (char *)c->buf, &gid, &msg, &msg_len);
+		bench_sink += msg_len;
+	}
+}
+
+static void bench_ser_send_to_group_response(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_send_to_group_response(sizeof(c->buf), (char *)c->buf, i, i, i);
+	}
+}
+
+static void bench_deser_send_to_group_response(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t gid, msgid;
+		deser_send_to_group_response(c->len, (char *)c->buf, &gid, &msgid);
+		bench_sink += msgid;
+	}
+}
+
+static void bench_ser_receive_from_group(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		bench_sink += ser_receive_from_group(
+			sizeof(c->buf), (char *)c->buf,
+			i, i, i, GROUP_MSG_LEN, c->group_msg
+		);
+	}
+}
+
+static void bench_deser_receive_from_group(void *ctx, size_t iters) {
+	ProtCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t gid, msgid, uid;
+		const char *msg;
+		size_t msg_len;
+		deser_receive_from_group(c->len, (char *)c->buf, &gid, &msgid, &uid, &msg, &msg_len);
+		bench_sink += msg_len;
+	}
+}
+
+typedef void (*decode_fn)(size_t, uint64_t *, const char *);
+
+typedef struct {
+	decode_fn decode;
+	char raw[MAX_UIDS_PER_MSG * sizeof(uint64_t) + 1];
+} DecodeCtx;
+
+/* One iteration decodes the uids of a full CREATE_GROUP. */
+static void bench_decode_uids(void *ctx, size_t iters) {
+	DecodeCtx *c = ctx;
+	uint64_t uids[MAX_UIDS_PER_MSG];
+	for (size_t i = 0; i < iters; i++) {
+		/* Odd offset like on the wire. */
+		c->decode(MAX_UIDS_PER_MSG, uids, c->raw + 1);
+		bench_sink += uids[i % MAX_UIDS_PER_MSG];
+	}
+}
+
+void bench_suite_protocol(void) {
+	ProtCtx c;
+	for (size_t i = 0; i < MAX_UIDS_PER_MSG; i++) {
+		c.uids[i] = 0x0102030405060708ull * (i + 1);
+	}
+	memset(c.group_msg, 'x', GROUP_MSG_LEN);
+	char *buf = (char *)c.buf;
+
+	c.len = ser_server_error(sizeof(c.buf), buf, 1, 1);
+	bench_run("protocol/deser_header", bench_deser_header, &c, 1);
+	bench_run("protocol/ser_server_error", bench_ser_server_error, &c, 1);
+	bench_run("protocol/deser_server_error", bench_deser_server_error, &c, 1);
+
+	c.len = ser_set_username(sizeof(c.buf), buf, 1, 9, "benchuser");
+	bench_run("protocol/ser_set_username", bench_ser_set_username, &c, 1);
+	bench_run("protocol/deser_set_username", bench_deser_set_username, &c, 1);
+
+	c.len = ser_set_username_response(sizeof(c.buf), buf, 1, 1);
+	bench_run("protocol/ser_set_username_response", bench_ser_set_username_response, &c, 1);
+	bench_run("protocol/deser_set_username_response", bench_deser_set_username_response, &c, 1);
+
+	c.len = ser_create_group(buf, sizeof(c.buf), 1, c.uids, MAX_UIDS_PER_MSG);
+	bench_run("protocol/ser_create_group/200", bench_ser_create_group, &c, 1);
+	bench_run("protocol/deser_create_group/200", bench_deser_create_group, &c, 1);
+
+	c.len = ser_create_group_response(sizeof(c.buf), buf, 1, 1);
+	bench_run("protocol/ser_create_group_response", bench_ser_create_group_response, &c, 1);
+	bench_run("protocol/deser_create_group_response", bench_deser_create_group_response, &c, 1);
+
+	JoinedCtx joined = { .prot = &c };
+	htonll_bulk(MAX_UIDS_PER_MSG, joined.raw, c.uids);
+	c.len = ser_joined_group(sizeof(c.buf), buf, 1, 1, MAX_UIDS_PER_MSG, joined.raw);
+	bench_run("protocol/ser_joined_group/200", bench_ser_joined_group, &joined, 1);
+	bench_run("protocol/deser_joined_group/200", bench_deser_joined_group, &c, 1);
+
+	c.len = ser_send_to_group(sizeof(c.buf), buf, 1, 1, GROUP_MSG_LEN, c.group_msg);
+	bench_run("protocol/ser_send_to_group/64", bench_ser_send_to_group, &c, 1);
+	bench_run("protocol/deser_send_to_group/64", bench_deser_send_to_group, &c, 1);
+
+	c.len = ser_send_to_group_response(sizeof(c.buf), buf, 1, 1, 1);
+	bench_run("protocol/ser_send_to_group_response", bench_ser_send_to_group_response, &c, 1);
+	bench_run("protocol/deser_send_to_group_response", bench_deser_send_to_group_response, &c, 1);
+
+	c.len = ser_receive_from_group(sizeof(c.buf), buf, 1, 1, 1, GROUP_MSG_LEN, c.group_msg);
+	bench_run("protocol/ser_receive_from_group/64", bench_ser_receive_from_group, &c, 1);
+	bench_run("protocol/deser_receive_from_group/64", bench_deser_receive_from_group, &c, 1);
+
+	DecodeCtx decode;
+	htonll_bulk(MAX_UIDS_PER_MSG, decode.raw + 1, c.uids);
+	decode.decode = ntohll_bulk_scalar;
+	bench_run("codec/ntohll_bulk_scalar", bench_decode_uids, &decode, MAX_UIDS_PER_MSG);
+	decode.decode = ntohll_bulk;
+	bench_run("codec/ntohll_bulk", bench_decode_uids, &decode, MAX_UIDS_PER_MSG);
+}
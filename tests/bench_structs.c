@@ -0,0 +1,375 @@
+/**
+ * Benchmarks for the data structures on the hot path of the event loop: slab,
+ * op_pool, client_map, cid_set, groups and uname_index.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench_harness.h"
+#include "../cid_set.h"
+#include "../client_map.h"
+#include "../groups.h"
+#include "../op_pool.h"
+#include "../slab.h"
+#include "../uname_index.h"
+
+/* Number of keys the lookup benchmarks cycle through. Must be a power of 2. */
+#define LOOKUP_KEYS 4096
+#define BURST_LEN 64
+/**
+ * Clients and keys of the cold lookups, enough that the ClientInfos they touch
+ * don't stay in the cache between passes over the keys. Powers of 2.
+ */
+#define COLD_CLIENTS (1 << 18)
+#define COLD_KEYS (1 << 20)
+
+/* xorshift64, deterministic across runs so that baselines stay comparable. */
+static uint64_t next_rand(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void bench_slab_acquire_release(void *ctx, size_t iters) {
+	Slab *s = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		BufRef *bref = slab_acquire(s, 1);
+		bench_sink += (uintptr_t)bref;
+		slab_release(s, bref);
+	}
+}
+
+/* Acquires a burst of buffers before releasing them, like a fan-out does. */
+static void bench_slab_burst(void *ctx, size_t iters) {
+	Slab *s = ctx;
+	BufRef *brefs[BURST_LEN];
+	for (size_t i = 0; i < iters; i++) {
+		for (size_t j = 0; j < BURST_LEN; j++) brefs[j] = slab_acquire(s, 1);
+		for (size_t j = 0; j < BURST_LEN; j++) slab_release(s, brefs[j]);
+	}
+	bench_sink += (uintptr_t)brefs[0];
+}
+
+static void bench_op_pool_new_return(void *ctx, size_t iters) {
+	OpPool *pool = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		Operation *op = op_pool_new_entry(pool);
+		bench_sink += op->pool_id;
+		op_pool_return(pool, op);
+	}
+}
+
+static void bench_op_pool_burst(void *ctx, size_t iters) {
+	OpPool *pool = ctx;
+	Operation *ops[BURST_LEN];
+	for (size_t i = 0; i < iters; i++) {
+		for (size_t j = 0; j < BURST_LEN; j++) ops[j] = op_pool_new_entry(pool);
+		for (size_t j = 0; j < BURST_LEN; j++) op_pool_return(pool, ops[j]);
+	}
+	bench_sink += ops[0]->pool_id;
+}
+
+typedef struct {
+	ClientMap cm;
+	uint64_t keys[LOOKUP_KEYS];
+} ClientMapCtx;
+
+static void bench_client_map_get(void *ctx, size_t iters) {
+	ClientMapCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		ClientInfo *info = client_map_get(&c->cm, c->keys[i & (LOOKUP_KEYS - 1)]);
+		bench_sink += info->client_fd;
+	}
+}
+
+typedef struct {
+	ClientMap cm;
+	uint64_t *keys;
+} ColdMapCtx;
+
+/* Looks up a burst of keys one after another. */
+static void bench_client_map_get_cold(void *ctx, size_t iters) {
+	ColdMapCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		const uint64_t *keys = &c->keys[(i * BURST_LEN) & (COLD_KEYS - 1)];
+		for (size_t j = 0; j < BURST_LEN; j++) {
+			bench_sink += client_map_get(&c->cm, keys[j])->client_fd;
+		}
+	}
+}
+
+/* Looks up a burst of keys in passes, like handle_cqe_batch does. */
+static void bench_client_map_get_cold_prefetched(void *ctx, size_t iters) {
+	ColdMapCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		const uint64_t *keys = &c->keys[(i * BURST_LEN) & (COLD_KEYS - 1)];
+		for (size_t j = 0; j < BURST_LEN; j++) client_map_prefetch_bucket(&c->cm, keys[j]);
+		for (size_t j = 0; j < BURST_LEN; j++) client_map_prefetch_info(&c->cm, keys[j]);
+		for (size_t j = 0; j < BURST_LEN; j++) {
+			bench_sink += client_map_get(&c->cm, keys[j])->client_fd;
+		}
+	}
+}
+
+typedef struct {
+	size_t len;
+	uint64_t *ids;
+} CidInsertCtx;
+
+/* One iteration builds a whole set, growth included. */
+static void bench_cid_set_insert(void *ctx, size_t iters) {
+	CidInsertCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		struct cid_set set;
+		cid_set_init(&set);
+		for (size_t j = 0; j < c->len; j++) cid_set_insert(&set, c->ids[j]);
+		bench_sink += set.len;
+		cid_set_deinit(&set);
+	}
+}
+
+typedef size_t (*next_batch_fn)(struct cid_iter *, size_t, uint64_t *);
+
+typedef struct {
+	struct cid_set set;
+	next_batch_fn next_batch;
+} CidDrainCtx;
+
+/* One iteration drains the whole set in batches of 64, like fan-out does. */
+static void bench_cid_drain(void *ctx, size_t iters) {
+	CidDrainCtx *c = ctx;
+	uint64_t batch[BURST_LEN];
+	for (size_t i = 0; i < iters; i++) {
+		struct cid_iter iter;
+		cid_set_iter(&c->set, &iter);
+		size_t n;
+		while ((n = c->next_batch(&iter, BURST_LEN, batch)) > 0) {
+			bench_sink += batch[n - 1];
+		}
+	}
+}
+
+#define GROUPS_INSERT_GROUPS 1024
+#define GROUPS_INSERT_MEMBERS 8
+
+/**
+ * One iteration creates GROUPS_INSERT_GROUPS groups of GROUPS_INSERT_MEMBERS
+ * members each into an index which starts small, so incremental rehashes and
+ * membership growth are included.
+ */
+static void bench_groups_insert(void *ctx, size_t iters) {
+	(void)ctx;
+	for (size_t i = 0; i < iters; i++) {
+		struct groups *g = groups_create(64);
+		for (uint64_t gid = 1; gid <= GROUPS_INSERT_GROUPS; gid++) {
+			for (uint64_t cid = 0; cid < GROUPS_INSERT_MEMBERS; cid++) {
+				groups_insert(g, gid, gid * 31 + cid);
+			}
+		}
+		bench_sink += groups_len(g);
+		groups_destroy(g);
+	}
+}
+
+typedef struct {
+	struct groups *g;
+	uint64_t gids[LOOKUP_KEYS];
+} GroupsGetCtx;
+
+static void bench_groups_get(void *ctx, size_t iters) {
+	GroupsGetCtx *c = ctx;
+	for (size_t i = 0; i < iters; i++) {
+		struct cid_iter iter;
+		groups_get(c->g, c->gids[i & (LOOKUP_KEYS - 1)], &iter);
+		bench_sink += iter.len;
+	}
+}
+
+/* Size of the group whose usernames are listed, as in GET_USERNAMES. */
+#define UNAMES_GROUP_LEN 10000
+
+typedef struct {
+	UnameIndex ix;
+	struct cid_set members;
+} UnamesCtx;
+
+/* Resolves every member of a group in batches like send_usernames does. */
+static void bench_uname_index_group(void *ctx, size_t iters) {
+	UnamesCtx *c = ctx;
+	uint64_t batch[64];
+	const struct uname_entry *entries[64];
+
+	for (size_t i = 0; i < iters; i++) {
+		struct cid_iter iter;
+		cid_set_iter(&c->members, &iter);
+
+		size_t n;
+		while ((n = cid_iter_next_batch(&iter, 64, batch)) > 0) {
+			uname_index_get_batch(&c->ix, n, batch, entries);
+			for (size_t j = 0; j < n; j++) bench_sink += entries[j]->len;
+		}
+	}
+}
+
+static void suite_slab(void) {
+	Slab s;
+	slab_init(&s, 2048);
+	bench_run("slab/acquire_release", bench_slab_acquire_release, &s, 1);
+	bench_run("slab/acquire_release_burst64", bench_slab_burst, &s, BURST_LEN);
+	slab_deinit(&s);
+}
+
+static void suite_op_pool(void) {
+	OpPool pool;
+	op_pool_init(&pool);
+	bench_run("op_pool/new_entry_return", bench_op_pool_new_return, &pool, 1);
+	bench_run("op_pool/new_entry_return_burst64", bench_op_pool_burst, &pool, BURST_LEN);
+	op_pool_deinit(&pool);
+}
+
+/**
+ * client_ids are sequential like the ones the server hands out. Fill is the
+ * number of clients per bucket, i.e. the average chain length.
+ */
+static void suite_client_map(void) {
+	size_t buckets = 4096;
+	double fills[] = {0.25, 1, 4, 16};
+
+	for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+		ClientMapCtx *c = malloc(sizeof(ClientMapCtx));
+		client_map_init(&c->cm, buckets);
+
+		size_t clients = buckets * fills[f];
+		for (uint64_t id = 0; id < clients; id++) {
+			ClientInfo *info;
+			client_map_new_entry(&c->cm, id, &info);
+			info->client_fd = id;
+		}
+
+		uint64_t rng = 42;
+		for (size_t i = 0; i < LOOKUP_KEYS; i++) {
+			c->keys[i] = next_rand(&rng) % clients;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "client_map/get/fill=%.2f", fills[f]);
+		bench_run(name, bench_client_map_get, c, 1);
+
+		client_map_deinit(&c->cm);
+		free(c);
+	}
+
+	ColdMapCtx cold;
+	client_map_init(&cold.cm, COLD_CLIENTS);
+	for (uint64_t id = 0; id < COLD_CLIENTS; id++) {
+		ClientInfo *info;
+		client_map_new_entry(&cold.cm, id, &info);
+		info->client_fd = id;
+	}
+	cold.keys = malloc(COLD_KEYS * sizeof(uint64_t));
+	uint64_t rng = 42;
+	for (size_t i = 0; i < COLD_KEYS; i++) cold.keys[i] = next_rand(&rng) % COLD_CLIENTS;
+
+	bench_run("client_map/get_cold_burst64", bench_client_map_get_cold, &cold, BURST_LEN);
+	bench_run("client_map/get_cold_prefetched_burst64", bench_client_map_get_cold_prefetched,
+		&cold, BURST_LEN);
+	client_map_deinit(&cold.cm);
+	free(cold.keys);
+}
+
+static void suite_cid_set(void) {
+	size_t sizes[] = {1000, 10000, 100000, 1000000};
+	uint64_t rng = 42;
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		CidInsertCtx ins = {
+			.len = sizes[s],
+			.ids = malloc(sizes[s] * sizeof(uint64_t)),
+		};
+		for (size_t i = 0; i < sizes[s]; i++) {
+			/* Never UINT64_MAX, which marks empty slots. */
+			ins.ids[i] = next_rand(&rng) >> 1;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "cid_set/insert/%zu", sizes[s]);
+		bench_run(name, bench_cid_set_insert, &ins, sizes[s]);
+
+		CidDrainCtx drain;
+		cid_set_init(&drain.set);
+		for (size_t i = 0; i < sizes[s]; i++) cid_set_insert(&drain.set, ins.ids[i]);
+
+		drain.next_batch = cid_iter_next_batch_scalar;
+		snprintf(name, sizeof(name), "cid_set/next_batch_scalar/%zu", sizes[s]);
+		bench_run(name, bench_cid_drain, &drain, drain.set.len);
+
+		drain.next_batch = cid_iter_next_batch;
+		snprintf(name, sizeof(name), "cid_set/next_batch/%zu", sizes[s]);
+		bench_run(name, bench_cid_drain, &drain, drain.set.len);
+
+		cid_set_deinit(&drain.set);
+		free(ins.ids);
+	}
+}
+
+static void suite_groups(void) {
+	bench_run("groups/insert", bench_groups_insert, NULL,
+		GROUPS_INSERT_GROUPS * GROUPS_INSERT_MEMBERS);
+
+	size_t sizes[] = {1024, 1048576};
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		GroupsGetCtx *c = malloc(sizeof(GroupsGetCtx));
+		c->g = groups_create(1024);
+		for (uint64_t gid = 0; gid < sizes[s]; gid++) {
+			groups_insert(c->g, gid, gid);
+		}
+
+		uint64_t rng = 42;
+		for (size_t i = 0; i < LOOKUP_KEYS; i++) {
+			c->gids[i] = next_rand(&rng) % sizes[s];
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "groups/get/%zu", sizes[s]);
+		bench_run(name, bench_groups_get, c, 1);
+
+		groups_destroy(c->g);
+		free(c);
+	}
+}
+
+/* Members are spread over an index of a million usernames. */
+static void suite_uname_index(void) {
+	UnamesCtx *c = malloc(sizeof(UnamesCtx));
+	uname_index_init(&c->ix, 1024);
+	cid_set_init(&c->members);
+
+	size_t clients = 1000000;
+	char name[16];
+	for (uint64_t cid = 1; cid <= clients; cid++) {
+		int len = snprintf(name, sizeof(name), "u%lu", cid);
+		uname_index_set(&c->ix, cid, name, len);
+	}
+
+	uint64_t rng = 42;
+	while (c->members.len < UNAMES_GROUP_LEN) {
+		cid_set_insert(&c->members, next_rand(&rng) % clients + 1);
+	}
+
+	bench_run("uname_index/get_batch_group/10000", bench_uname_index_group, c, UNAMES_GROUP_LEN);
+
+	cid_set_deinit(&c->members);
+	uname_index_deinit(&c->ix);
+	free(c);
+}
+
+void bench_suite_structs(void) {
+	suite_slab();
+	suite_op_pool();
+	suite_client_map();
+	suite_cid_set();
+	suite_groups();
+	suite_uname_index();
+}
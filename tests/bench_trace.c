@@ -0,0 +1,30 @@
+/**
+ * Cost of the TRACE macro on the hot path, with tracing disabled and enabled.
+ */
+
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bench_harness.h"
+#include "../trace.h"
+
+static void bench_trace(void *ctx, size_t iters) {
+	(void)ctx;
+	for (size_t i = 0; i < iters; i++) {
+		TRACE(TRACE_SUBMIT, 1, i, i, i);
+	}
+}
+
+void bench_suite_trace(void) {
+	trace_init(false);
+	bench_run("trace/disabled", bench_trace, NULL, 1);
+
+	trace_enabled = true;
+	bench_run("trace/enabled", bench_trace, NULL, 1);
+	trace_enabled = false;
+
+	char path[128];
+	snprintf(path, sizeof(path), "%s/chat-trace-%d-%ld", TRACE_DIR, getpid(), (long)syscall(SYS_gettid));
+	unlink(path);
+}
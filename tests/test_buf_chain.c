@@ -0,0 +1,84 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <string.h>
+
+#include "../buf_chain.h"
+
+Test(buf_chain, append_and_iov) {
+	Slab hdr_slab, data_slab;
+	slab_init_cap(&hdr_slab, 64, 8);
+	slab_init_cap(&data_slab, 2048, 8);
+
+	/* Chunks don't line up with the buffers. */
+	static char msg[5000];
+	for (size_t i = 0; i < sizeof(msg); i++) msg[i] = i % 251;
+
+	BufChain *c = buf_chain_create(&hdr_slab, &data_slab, sizeof(msg));
+	for (size_t off = 0; off < sizeof(msg); off += 1500) {
+		size_t n = sizeof(msg) - off < 1500 ? sizeof(msg) - off : 1500;
+		buf_chain_append(c, msg + off, n);
+	}
+	memset(buf_chain_hdr(c), 'h', 10);
+	buf_chain_set_hdr_len(c, 10);
+
+	cr_assert(eq(sz, c->bufs_len, 4));
+	cr_assert(eq(sz, c->cap, 4));
+	cr_assert(eq(sz, c->len, 10 + sizeof(msg)));
+	cr_assert(eq(sz, buf_chain_data_len(c), sizeof(msg)));
+	cr_assert(eq(sz, c->iov[1].iov_len, 2048));
+	cr_assert(eq(sz, c->iov[3].iov_len, sizeof(msg) - 2 * 2048));
+
+	/* Gathering the iovecs gives back the frame. */
+	buf_chain_seal(c, 2);
+	static char out[10 + sizeof(msg)];
+	size_t pos = 0;
+	for (size_t i = 0; i < c->msg.msg_iovlen; i++) {
+		memcpy(out + pos, c->msg.msg_iov[i].iov_base, c->msg.msg_iov[i].iov_len);
+		pos += c->msg.msg_iov[i].iov_len;
+	}
+	cr_assert(eq(sz, pos, c->len));
+	cr_assert(eq(int, memcmp(out + 10, msg, sizeof(msg)), 0));
+
+	/* Resuming in the middle of the second buffer. */
+	struct iovec iov[4];
+	size_t n = buf_chain_iov_from(c, 10 + 100, iov);
+	cr_assert(eq(sz, n, 3));
+	cr_assert(eq(ptr, iov[0].iov_base, (char *)c->iov[1].iov_base + 100));
+	cr_assert(eq(sz, iov[0].iov_len, 2048 - 100));
+
+	/* Resuming at a buffer boundary skips it entirely. */
+	n = buf_chain_iov_from(c, 10, iov);
+	cr_assert(eq(sz, n, 3));
+	cr_assert(eq(ptr, iov[0].iov_base, c->iov[1].iov_base));
+
+	/* Buffers are only returned once every reference is released. */
+	buf_chain_release(c);
+	cr_assert(eq(sz, data_slab.len, 8 - 3));
+	buf_chain_release(c);
+	cr_assert(eq(sz, hdr_slab.len, 8));
+	cr_assert(eq(sz, data_slab.len, 8));
+
+	slab_deinit(&hdr_slab);
+	slab_deinit(&data_slab);
+}
+
+Test(buf_chain, grows_past_hint) {
+	Slab hdr_slab, data_slab;
+	slab_init_cap(&hdr_slab, 64, 8);
+	slab_init_cap(&data_slab, 2048, 8);
+
+	BufChain *c = buf_chain_create(&hdr_slab, &data_slab, 0);
+	cr_assert(eq(sz, c->cap, 1));
+
+	static char msg[3 * 2048 + 1];
+	memset(msg, 'm', sizeof(msg));
+	buf_chain_append(c, msg, sizeof(msg));
+	cr_assert(eq(sz, c->bufs_len, 5));
+	cr_assert(eq(sz, buf_chain_data_len(c), sizeof(msg)));
+
+	buf_chain_release(c);
+	cr_assert(eq(sz, data_slab.len, 8));
+
+	slab_deinit(&hdr_slab);
+	slab_deinit(&data_slab);
+}
@@ -0,0 +1,45 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+
+#include "../capacity.h"
+
+Test(capacity, parse) {
+	CapacityProfile p = { .groups = 7 };
+	cr_assert(eq(int, capacity_parse(&p, "conns=100000,msg_rate=20000"), 0));
+	cr_assert(eq(sz, p.conns, 100000));
+	cr_assert(eq(sz, p.groups, 7));
+	cr_assert(eq(sz, p.msg_rate, 20000));
+
+	cr_assert(eq(int, capacity_parse(&p, "conn=1"), -1));
+	cr_assert(eq(int, capacity_parse(&p, "conns="), -1));
+	cr_assert(eq(int, capacity_parse(&p, "conns=1;groups=2"), -1));
+	cr_assert(eq(int, capacity_parse(&p, "groups"), -1));
+	cr_assert(eq(int, capacity_parse(&p, ""), 0));
+}
+
+Test(capacity, sizes) {
+	CapacityProfile p = { .conns = 100000, .groups = 5000, .msg_rate = 20000 };
+	CapacitySizes s;
+	capacity_sizes(&p, false, &s);
+
+	cr_assert(eq(u32, s.sq_entries, CAPACITY_MAX_SQ_ENTRIES));
+	cr_assert(eq(sz, s.clients, 100001));
+	cr_assert(eq(sz, s.client_buckets, 131072));
+	cr_assert(eq(sz, s.ops, 200001));
+	cr_assert(eq(sz, s.recv_rings, 100000));
+	cr_assert(eq(sz, s.slab2k, 2000));
+	cr_assert(eq(sz, s.groups, 5000));
+
+	/* Open envelopes take a large buffer per client. */
+	capacity_sizes(&p, true, &s);
+	cr_assert(eq(sz, s.slab2k, 102000));
+
+	p.conns = 1000;
+	capacity_sizes(&p, false, &s);
+	cr_assert(eq(u32, s.sq_entries, 1024));
+
+	/* Without a profile nothing is reserved. */
+	capacity_sizes(&(CapacityProfile){0}, false, &s);
+	cr_assert(eq(u32, s.sq_entries, 0));
+	cr_assert(eq(sz, s.ops, 1));
+}
@@ -0,0 +1,140 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../capture.h"
+
+/* Reads what was written to f back into a malloced buffer. */
+static char *read_back(FILE *f, size_t *len) {
+	fflush(f);
+	*len = ftell(f);
+	char *buf = malloc(*len);
+	rewind(f);
+	cr_assert(eq(sz, fread(buf, 1, *len, f), *len));
+	return buf;
+}
+
+Test(capture, records_round_trip) {
+	FILE *f = tmpfile();
+	Capture c;
+	cr_assert(eq(int, capture_init(&c, f, 1024, 1000), 0));
+
+	capture_push(&c, CAPTURE_FRAME, 7, 1500, "hello", 5);
+	struct capture_gid gid = { .gid = 42, .seqid = 3 };
+	capture_push(&c, CAPTURE_GID, 7, 1600, &gid, sizeof(gid));
+	/* Before the start of the capture. */
+	capture_push(&c, CAPTURE_CLOSE, 8, 900, NULL, 0);
+	cr_assert(eq(sz, capture_drain(&c), 3 * sizeof(struct capture_rec) + 5 + sizeof(gid)));
+	cr_assert(eq(sz, capture_drain(&c), 0));
+	capture_deinit(&c);
+
+	size_t len;
+	char *buf = read_back(f, &len);
+	struct capture_hdr hdr;
+	memcpy(&hdr, buf, sizeof(hdr));
+	cr_assert(eq(u32, hdr.magic, CAPTURE_MAGIC));
+	cr_assert(eq(u32, hdr.version, CAPTURE_VERSION));
+
+	const char *p = buf + sizeof(hdr);
+	size_t left = len - sizeof(hdr);
+	struct capture_rec rec;
+	ssize_t rec_len = capture_next(p, left, &rec);
+	cr_assert(eq(sz, (size_t)rec_len, sizeof(rec) + 5));
+	cr_assert(eq(u64, rec.ts_ns, 500));
+	cr_assert(eq(u64, rec.client_id, 7));
+	cr_assert(eq(u8, rec.kind, CAPTURE_FRAME));
+	cr_assert(eq(int, memcmp(p + sizeof(rec), "hello", 5), 0));
+	p += rec_len;
+	left -= rec_len;
+
+	rec_len = capture_next(p, left, &rec);
+	cr_assert(eq(u8, rec.kind, CAPTURE_GID));
+	cr_assert(eq(u16, rec.len, sizeof(gid)));
+	cr_assert(eq(int, memcmp(p + sizeof(rec), &gid, sizeof(gid)), 0));
+	p += rec_len;
+	left -= rec_len;
+
+	/* Cut short, then complete. */
+	cr_assert(eq(int, (int)capture_next(p, left - 1, &rec), -1));
+	cr_assert(eq(sz, (size_t)capture_next(p, left, &rec), left));
+	cr_assert(eq(u8, rec.kind, CAPTURE_CLOSE));
+	cr_assert(eq(u64, rec.ts_ns, 0));
+	cr_assert(eq(int, (int)capture_next(p + left, 0, &rec), 0));
+
+	free(buf);
+	fclose(f);
+}
+
+Test(capture, wraps_around_and_drops_when_full) {
+	FILE *f = tmpfile();
+	Capture c;
+	cr_assert(eq(int, capture_init(&c, f, 256, 0), 0));
+
+	/* 19 + 81 bytes per record, the ring holds two of them. */
+	char data[81];
+	size_t written = 0;
+	for (int i = 0; i < 10; i++) {
+		memset(data, 'a' + i, sizeof(data));
+		capture_push(&c, CAPTURE_FRAME, i, i, data, sizeof(data));
+		capture_push(&c, CAPTURE_FRAME, i, i, data, sizeof(data));
+		capture_push(&c, CAPTURE_FRAME, i, i, data, sizeof(data));
+		written += capture_drain(&c);
+	}
+	capture_deinit(&c);
+	cr_assert(eq(u64, c.records, 20));
+	cr_assert(eq(u64, c.ring.dropped, 10));
+
+	size_t len;
+	char *buf = read_back(f, &len);
+	cr_assert(eq(sz, len, sizeof(struct capture_hdr) + written));
+
+	const char *p = buf + sizeof(struct capture_hdr);
+	struct capture_rec rec;
+	for (int i = 0; i < 20; i++) {
+		ssize_t rec_len = capture_next(p, buf + len - p, &rec);
+		cr_assert(eq(sz, (size_t)rec_len, sizeof(rec) + sizeof(data)));
+		cr_assert(eq(u64, rec.client_id, (uint64_t)i / 2));
+		memset(data, 'a' + i / 2, sizeof(data));
+		cr_assert(eq(int, memcmp(p + sizeof(rec), data, sizeof(data)), 0));
+		p += rec_len;
+	}
+	cr_assert(eq(ptr, (void *)p, (void *)(buf + len)));
+
+	free(buf);
+	fclose(f);
+}
+
+Test(capture, writer_thread) {
+	FILE *f = tmpfile();
+	Capture c;
+	cr_assert(eq(int, capture_init(&c, f, 1 << 16, 0), 0));
+	capture_start(&c);
+
+	/* Records pushed right before deinit are still written. */
+	uint64_t pushed = 0;
+	for (uint64_t i = 0; i < 100000; i++) {
+		capture_push(&c, CAPTURE_FRAME, i, i, &i, sizeof(i));
+	}
+	pushed = c.records;
+	capture_deinit(&c);
+	cr_assert(eq(u64, pushed + c.ring.dropped, 100000));
+
+	size_t len;
+	char *buf = read_back(f, &len);
+	cr_assert(eq(sz, len, sizeof(struct capture_hdr) + pushed * (sizeof(struct capture_rec) + 8)));
+
+	/* Dropped records leave gaps, the rest stay in order. */
+	const char *p = buf + sizeof(struct capture_hdr);
+	struct capture_rec rec;
+	int64_t last = -1;
+	for (uint64_t i = 0; i < pushed; i++) {
+		p += capture_next(p, buf + len - p, &rec);
+		cr_assert(gt(i64, (int64_t)rec.client_id, last));
+		last = rec.client_id;
+	}
+
+	free(buf);
+	fclose(f);
+}
@@ -49,3 +49,84 @@ Test(cid_set, operations) {
 		cr_assert(eq(u64, big_batch[i], i));
 	}
 }
+
+/**
+ * Drains the set with the given batch size and returns the sorted ids. Uses
+ * cid_iter_next_batch_scalar if scalar is true.
+ */
+static size_t drain(struct cid_set *set, bool scalar, size_t batch_size, uint64_t *out) {
+	struct cid_iter iter;
+	cid_set_iter(set, &iter);
+
+	uint64_t batch[64];
+	size_t total = 0;
+	size_t n;
+	do {
+		n = scalar
+			? cid_iter_next_batch_scalar(&iter, batch_size, batch)
+			: cid_iter_next_batch(&iter, batch_size, batch);
+		for (size_t i = 0; i < n; i++) {
+			out[total + i] = batch[i];
+		}
+		total += n;
+	} while (n == batch_size);
+
+	qsort(out, total, sizeof(uint64_t), compare_cids);
+	return total;
+}
+
+Test(cid_set, simd_matches_scalar) {
+	struct cid_set set;
+	cid_set_init(&set);
+
+	/* Sparse ids so that runs of empty and non-empty slots are mixed. */
+	size_t len = 1000;
+	for (size_t i = 0; i < len; i++) {
+		cid_set_insert(&set, i * 7919);
+	}
+
+	uint64_t *expected = malloc(len * sizeof(uint64_t));
+	uint64_t *actual = malloc(len * sizeof(uint64_t));
+	cr_assert(eq(sz, drain(&set, true, 64, expected), len));
+
+	size_t batch_sizes[] = {1, 2, 3, 4, 5, 7, 8, 64};
+	for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+		size_t n = drain(&set, false, batch_sizes[b], actual);
+		cr_assert(eq(sz, n, len));
+		for (size_t i = 0; i < len; i++) {
+			cr_assert(eq(u64, actual[i], expected[i]));
+		}
+	}
+
+	free(expected);
+	free(actual);
+}
+
+Test(cid_set, remove) {
+	struct cid_set set;
+	cid_set_init(&set);
+
+	size_t len = 200;
+	for (size_t i = 0; i < len; i++) {
+		cid_set_insert(&set, i);
+	}
+
+	/* Remove every other id, the rest must still be reachable by probing. */
+	for (size_t i = 0; i < len; i += 2) {
+		cr_assert(cid_set_remove(&set, i));
+	}
+	cr_assert(not(cid_set_remove(&set, 0)));
+	cr_assert(not(cid_set_remove(&set, len)));
+	cr_assert(eq(sz, set.len, len / 2));
+
+	for (size_t i = 0; i < len; i++) {
+		cr_assert(eq(int, cid_set_exists(&set, i), i % 2 == 1));
+	}
+
+	uint64_t batch[200];
+	struct cid_iter iter;
+	cid_set_iter(&set, &iter);
+	cr_assert(eq(sz, cid_iter_next_batch(&iter, 200, batch), len / 2));
+
+	cid_set_deinit(&set);
+}
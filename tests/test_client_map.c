@@ -23,6 +23,7 @@ Test(client_map, operations) {
 	info->client_addr_len = 31;
 
 	cr_assert(not(client_map_new_entry(&cm, 1, &info)));
+	cr_assert(eq(sz, cm.len, 3));
 
 	cr_assert(client_map_delete(&cm, 31));
 	cr_assert(client_map_get(&cm, 1) != NULL);
@@ -39,6 +40,7 @@ Test(client_map, operations) {
 	cr_assert(client_map_get(&cm, 17) == NULL);
 	cr_assert(client_map_get(&cm, 31) == NULL);
 
+	cr_assert(eq(sz, cm.len, 0));
 	cr_assert(eq(sz, cm.free_cap, FREE_INIT_LEN));
 	cr_assert(eq(sz, cm.free_len, 3));
 
@@ -79,3 +81,21 @@ Test(client_map, cap_adjust) {
 	cr_assert(eq(sz, cm.free_cap, FREE_INIT_LEN * 4));
 	cr_assert(eq(sz, cm.free_len, insertions));
 }
+
+Test(client_map, reserve) {
+	ClientMap cm;
+	client_map_init(&cm, 16);
+	size_t n = FREE_INIT_LEN * 2 + 10;
+	client_map_reserve(&cm, n);
+	cr_assert(eq(sz, cm.free_len, n));
+
+	/* Adding takes the reserved entries and deleting gives them back. */
+	ClientInfo *info;
+	for (size_t i = 0; i < n; i++) client_map_new_entry(&cm, i, &info);
+	cr_assert(eq(sz, cm.free_len, 0));
+	size_t free_cap = cm.free_cap;
+	for (size_t i = 0; i < n; i++) client_map_delete(&cm, i);
+	cr_assert(eq(sz, cm.free_len, n));
+	cr_assert(eq(sz, cm.free_cap, free_cap));
+	client_map_deinit(&cm);
+}
@@ -0,0 +1,188 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "../cluster.h"
+#include "../protocol.h"
+#include "../utils.h"
+
+#define GROUPS 30000
+
+Test(cluster, init) {
+	Cluster c;
+	cr_assert(eq(int, cluster_init(&c, "127.0.0.1:9000,10.0.0.2:9001", 1), 0));
+	cr_assert(eq(u32, c.nodes_len, 2));
+	cr_assert(eq(u32, c.self, 1));
+	cr_assert(eq(u16, ntohs(c.addrs[1].sin_port), 9001));
+	cr_assert(eq(u32, ntohl(c.addrs[1].sin_addr.s_addr), 0x0a000002));
+	cr_assert(eq(int, c.links[0].fd, -1));
+	cluster_deinit(&c);
+
+	cr_assert(eq(int, cluster_init(&c, "127.0.0.1:9000", 1), -1));
+	cr_assert(eq(int, cluster_init(&c, "127.0.0.1", 0), -1));
+	cr_assert(eq(int, cluster_init(&c, "127.0.0.1:0", 0), -1));
+	cr_assert(eq(int, cluster_init(&c, "127.0.0.1:9000,", 1), -1));
+	cr_assert(eq(int, cluster_init(&c, "localhost:9000", 0), -1));
+}
+
+Test(cluster, ids_carry_their_node) {
+	uint64_t id = cluster_first_id(5);
+	cr_assert(eq(u32, cluster_node_of(id), 5));
+	cr_assert(eq(u32, cluster_node_of(id + 1000000), 5));
+	cr_assert(eq(u64, cluster_first_id(0), 1));
+}
+
+Test(cluster, owners_are_balanced) {
+	Cluster c;
+	cr_assert(eq(int, cluster_init(&c, "127.0.0.1:9000,127.0.0.1:9001,127.0.0.1:9002", 0), 0));
+
+	size_t owned[3] = {0};
+	for (uint32_t node = 0; node < 3; node++) {
+		for (uint64_t gid = cluster_first_id(node); gid < cluster_first_id(node) + GROUPS; gid++) {
+			owned[cluster_owner(&c, gid)]++;
+		}
+	}
+	/* Within a fifth of an even share. */
+	for (int i = 0; i < 3; i++) {
+		cr_assert(gt(sz, owned[i], GROUPS * 4 / 5));
+		cr_assert(lt(sz, owned[i], GROUPS * 6 / 5));
+	}
+	cluster_deinit(&c);
+}
+
+Test(cluster, adding_a_node_only_moves_groups_to_it) {
+	Cluster three, four;
+	cr_assert(eq(int, cluster_init(&three, "127.0.0.1:9000,127.0.0.1:9001,127.0.0.1:9002", 0), 0));
+	cr_assert(eq(int, cluster_init(
+		&four, "127.0.0.1:9000,127.0.0.1:9001,127.0.0.1:9002,127.0.0.1:9003", 0), 0));
+
+	size_t moved = 0;
+	for (uint64_t gid = 1; gid <= GROUPS; gid++) {
+		uint32_t before = cluster_owner(&three, gid);
+		uint32_t after = cluster_owner(&four, gid);
+		if (before == after) continue;
+		cr_assert(eq(u32, after, 3));
+		moved++;
+	}
+	/* About a quarter of them. */
+	cr_assert(gt(sz, moved, GROUPS / 5));
+	cr_assert(lt(sz, moved, GROUPS * 3 / 10));
+
+	cluster_deinit(&three);
+	cluster_deinit(&four);
+}
+
+Test(cluster, owned_grows) {
+	Cluster c;
+	cr_assert(eq(int, cluster_init(&c, "127.0.0.1:9000", 0), 0));
+
+	for (uint64_t gid = 1; gid <= 5000; gid++) {
+		struct owned_group *g = cluster_owned(&c, gid);
+		cr_assert(eq(u64, g->next_msgid, 1));
+		g->next_msgid = gid + 1;
+		g->nodes = gid;
+	}
+	cr_assert(eq(sz, c.owned_len, 5000));
+	cr_assert(ge(sz, c.owned_cap, 10000));
+
+	for (uint64_t gid = 1; gid <= 5000; gid++) {
+		struct owned_group *g = cluster_owned(&c, gid);
+		cr_assert(eq(u64, g->next_msgid, gid + 1));
+		cr_assert(eq(u64, g->nodes, gid));
+	}
+	cr_assert(eq(sz, c.owned_len, 5000));
+	cluster_deinit(&c);
+}
+
+Test(cluster, frames_round_trip) {
+	PeerBuf b = {0};
+	uint64_t uids[2] = { htonll(cluster_first_id(1)), htonll(cluster_first_id(2)) };
+	peer_put_add(&b, PEER_ADD, 7, 3, 2, (const char *)uids);
+
+	char part1[] = "hello ";
+	char part2[] = "world";
+	struct iovec iov[2] = {
+		{ .iov_base = part1, .iov_len = strlen(part1) },
+		{ .iov_base = part2, .iov_len = strlen(part2) },
+	};
+	peer_put_msg(&b, PEER_DELIVER, PEER_LARGE, 7, 42, 3, 9, iov, 2);
+
+	PeerFrame f;
+	ssize_t len = peer_frame_parse(b.data, b.len, &f);
+	cr_assert(eq(sz, (size_t)len, sizeof(struct peer_add) + sizeof(uids)));
+	cr_assert(eq(u8, f.type, PEER_ADD));
+	cr_assert(eq(u64, f.gid, 7));
+	cr_assert(eq(u64, f.uid, 3));
+	cr_assert(eq(u8, f.uids_len, 2));
+	cr_assert(eq(int, memcmp(f.tail, uids, sizeof(uids)), 0));
+
+	const char *next = b.data + len;
+	size_t left = b.len - len;
+	cr_assert(eq(sz, (size_t)peer_frame_parse(next, left, &f), left));
+	cr_assert(eq(u8, f.type, PEER_DELIVER));
+	cr_assert(eq(u8, f.flags, PEER_LARGE));
+	cr_assert(eq(u64, f.msgid, 42));
+	cr_assert(eq(u64, f.seqid, 9));
+	cr_assert(eq(sz, f.tail_len, 11));
+	cr_assert(eq(int, memcmp(f.tail, "hello world", 11), 0));
+
+	/* Incomplete until the last byte is there. */
+	cr_assert(eq(sz, (size_t)peer_frame_parse(next, left - 1, &f), 0));
+	cr_assert(eq(sz, (size_t)peer_frame_parse(next, 3, &f), 0));
+	peer_buf_deinit(&b);
+}
+
+Test(cluster, malformed_frames) {
+	PeerBuf b = {0};
+	PeerFrame f;
+
+	/* The count of uids doesn't match the tail. */
+	uint64_t uid = htonll(1);
+	peer_put_add(&b, PEER_JOIN, 7, 3, 1, (const char *)&uid);
+	((struct peer_add *)b.data)->uids_len = 2;
+	cr_assert(eq(int, (int)peer_frame_parse(b.data, b.len, &f), -1));
+	b.len = 0;
+
+	/* A group message which is too long. */
+	char msg[MAX_GROUP_MSG_LEN + 1] = {0};
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(msg) };
+	peer_put_msg(&b, PEER_SEND, 0, 7, 0, 3, 9, &iov, 1);
+	cr_assert(eq(int, (int)peer_frame_parse(b.data, b.len, &f), -1));
+	((struct peer_hdr *)b.data)->flags = PEER_LARGE;
+	cr_assert(gt(int, (int)peer_frame_parse(b.data, b.len, &f), 0));
+	b.len = 0;
+
+	/* Unknown types and lengths shorter than the header. */
+	peer_put_msg(&b, PEER_SEND, 0, 7, 0, 3, 9, &iov, 0);
+	((struct peer_hdr *)b.data)->type = 9;
+	cr_assert(eq(int, (int)peer_frame_parse(b.data, b.len, &f), -1));
+	((struct peer_hdr *)b.data)->len = htonl(2);
+	cr_assert(eq(int, (int)peer_frame_parse(b.data, b.len, &f), -1));
+	peer_buf_deinit(&b);
+}
+
+Test(cluster, forward_queue) {
+	ForwardQueue q = {0};
+	for (uint64_t i = 0; i < 100; i++) forward_queue_push(&q, 7, i, i * 10);
+	cr_assert(eq(sz, forward_queue_find(&q, 7, 42), 42));
+	cr_assert(eq(sz, forward_queue_find(&q, 8, 42), q.len));
+
+	forward_queue_pop(&q, 43);
+	cr_assert(eq(sz, forward_queue_find(&q, 7, 42), q.len));
+	cr_assert(eq(u64, q.fwd[q.head].seqid, 43));
+
+	/* Room freed at the front is reused before growing. */
+	size_t cap = q.cap;
+	while (q.len < q.cap) forward_queue_push(&q, 7, 100 + q.len, 0);
+	forward_queue_push(&q, 9, 1, 0);
+	cr_assert(eq(sz, q.cap, cap));
+	cr_assert(eq(sz, q.head, 0));
+	cr_assert(eq(u64, q.fwd[0].seqid, 43));
+	cr_assert(eq(u64, q.fwd[q.len - 1].uid, 9));
+
+	forward_queue_pop(&q, q.len);
+	cr_assert(eq(sz, q.head, 0));
+	cr_assert(eq(sz, q.len, 0));
+	forward_queue_deinit(&q);
+}
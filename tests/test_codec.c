@@ -0,0 +1,320 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <arpa/inet.h>
+
+#include "../protocol.h"
+#include "../utils.h"
+
+Test(codec, bulk_bswap) {
+	uint64_t host[37];
+	for (size_t i = 0; i < 37; i++) {
+		host[i] = 0x0102030405060708ull * (i + 1);
+	}
+
+	/* Odd offset and lengths that don't fill whole vectors. */
+	char net[37 * sizeof(uint64_t) + 1];
+	for (size_t n = 0; n <= 37; n++) {
+		htonll_bulk(n, net + 1, host);
+
+		uint64_t decoded[37];
+		uint64_t decoded_scalar[37];
+		ntohll_bulk(n, decoded, net + 1);
+		ntohll_bulk_scalar(n, decoded_scalar, net + 1);
+
+		for (size_t i = 0; i < n; i++) {
+			uint64_t net_uid;
+			memcpy(&net_uid, net + 1 + i * sizeof(uint64_t), sizeof(net_uid));
+			cr_assert(eq(u64, net_uid, htonll(host[i])));
+			cr_assert(eq(u64, decoded[i], host[i]));
+			cr_assert(eq(u64, decoded_scalar[i], host[i]));
+		}
+	}
+}
+
+Test(codec, joined_group_forwards_raw_uids) {
+	uint64_t uids[MAX_UIDS_PER_MSG];
+	for (size_t i = 0; i < MAX_UIDS_PER_MSG; i++) {
+		uids[i] = i * 1000 + 7;
+	}
+
+	uint64_t req_storage[2048 / sizeof(uint64_t)];
+	char *req = (char *)req_storage;
+	size_t req_len = ser_create_group(req, sizeof(req_storage), 42, uids, MAX_UIDS_PER_MSG);
+
+	uint16_t len;
+	uint8_t msgt;
+	uint64_t seqid;
+	deser_header(req, &len, &msgt, &seqid);
+	cr_assert(eq(sz, len, req_len));
+	cr_assert(eq(u8, msgt, MSGT_CREATE_GROUP));
+	cr_assert(eq(u64, seqid, 42));
+
+	uint8_t uids_len;
+	uint64_t decoded[MAX_UIDS_PER_MSG];
+	const char *uids_raw;
+	size_t uids_raw_len;
+	cr_assert(eq(int, deser_create_group(len, req, &uids_len, decoded, &uids_raw, &uids_raw_len), 0));
+	cr_assert(eq(u8, uids_len, MAX_UIDS_PER_MSG));
+	cr_assert(eq(int, memcmp(decoded, uids, sizeof(uids)), 0));
+
+	/* A wrong uids count is rejected. */
+	req[PROT_HDR_LEN] = MAX_UIDS_PER_MSG - 1;
+	cr_assert(eq(int, deser_create_group(len, req, &uids_len, decoded, &uids_raw, &uids_raw_len), -1));
+
+	uint64_t resp_storage[2048 / sizeof(uint64_t)];
+	char *resp = (char *)resp_storage;
+	size_t resp_len = ser_joined_group(
+		sizeof(resp_storage), resp, 5, 9, MAX_UIDS_PER_MSG, uids_raw
+	);
+
+	uint64_t uid, gid;
+	const char *fwd_raw;
+	cr_assert(eq(int, deser_joined_group(resp_len, resp, &uid, &gid, &uids_len, &fwd_raw), 0));
+	cr_assert(eq(u64, uid, 5));
+	cr_assert(eq(u64, gid, 9));
+	cr_assert(eq(u8, uids_len, MAX_UIDS_PER_MSG));
+	cr_assert(eq(int, memcmp(fwd_raw, uids_raw, uids_raw_len), 0));
+}
+
+Test(codec, chunked_send_to_group) {
+	uint64_t storage[PROT_MAX_LEN / sizeof(uint64_t)];
+	char *buf = (char *)storage;
+	uint16_t len;
+	uint8_t msgt;
+	uint64_t seqid;
+
+	size_t start_len = ser_send_to_group_start(sizeof(storage), buf, 1, 9, MAX_LARGE_MSG_LEN);
+	deser_header(buf, &len, &msgt, &seqid);
+	cr_assert(eq(sz, len, start_len));
+	cr_assert(eq(u8, msgt, MSGT_SEND_TO_GROUP_START));
+
+	uint64_t gid;
+	uint32_t msg_len;
+	cr_assert(eq(int, deser_send_to_group_start(len, buf, &gid, &msg_len), 0));
+	cr_assert(eq(u64, gid, 9));
+	cr_assert(eq(u32, msg_len, MAX_LARGE_MSG_LEN));
+
+	/* A full chunk fills the whole frame. */
+	char data[MAX_CHUNK_LEN];
+	memset(data, 'x', sizeof(data));
+	size_t chunk_len = ser_send_to_group_chunk(sizeof(storage), buf, 2, sizeof(data), data);
+	cr_assert(eq(sz, chunk_len, PROT_MAX_LEN));
+
+	const char *chunk;
+	size_t chunk_data_len;
+	cr_assert(eq(int, deser_send_to_group_chunk(chunk_len, buf, &chunk, &chunk_data_len), 0));
+	cr_assert(eq(sz, chunk_data_len, sizeof(data)));
+	cr_assert(eq(int, memcmp(chunk, data, sizeof(data)), 0));
+
+	/* Empty chunks are rejected. */
+	cr_assert(eq(int, deser_send_to_group_chunk(PROT_HDR_LEN, buf, &chunk, &chunk_data_len), -1));
+
+	size_t end_len = ser_send_to_group_end(sizeof(storage), buf, 3);
+	cr_assert(eq(sz, end_len, PROT_HDR_LEN));
+	cr_assert(eq(int, deser_send_to_group_end(end_len, buf), 0));
+}
+
+Test(codec, receive_from_group_large) {
+	uint64_t storage[64 / sizeof(uint64_t)];
+	char *buf = (char *)storage;
+
+	size_t hdr_len = ser_receive_from_group_large(sizeof(storage), buf, 9, 4, 7, MAX_LARGE_MSG_LEN);
+	cr_assert(eq(sz, hdr_len, PROT_LARGE_HDR_LEN));
+
+	/* len is 0 so that the frame can't be mistaken for any other message. */
+	uint16_t len;
+	uint8_t msgt;
+	uint64_t seqid;
+	deser_header(buf, &len, &msgt, &seqid);
+	cr_assert(eq(u16, len, 0));
+	cr_assert(eq(u8, msgt, MSGT_RECEIVE_FROM_GROUP_LARGE));
+	cr_assert(eq(u64, seqid, 0));
+
+	uint32_t frame_len;
+	uint64_t gid, msgid, uid;
+	cr_assert(eq(int, deser_receive_from_group_large(buf, &frame_len, &gid, &msgid, &uid), 0));
+	cr_assert(eq(u32, frame_len, PROT_LARGE_HDR_LEN + MAX_LARGE_MSG_LEN));
+	cr_assert(eq(u64, gid, 9));
+	cr_assert(eq(u64, msgid, 4));
+	cr_assert(eq(u64, uid, 7));
+
+	/* Longer than the limit. */
+	ser_receive_from_group_large(sizeof(storage), buf, 9, 4, 7, MAX_LARGE_MSG_LEN);
+	uint32_t too_long = htonl(PROT_LARGE_HDR_LEN + MAX_LARGE_MSG_LEN + 1);
+	memcpy(buf + PROT_HDR_LEN, &too_long, sizeof(too_long));
+	cr_assert(eq(int, deser_receive_from_group_large(buf, &frame_len, &gid, &msgid, &uid), -1));
+}
+
+Test(codec, batch_envelope) {
+	uint64_t storage[PROT_MAX_LEN / sizeof(uint64_t)];
+	char *buf = (char *)storage;
+
+	/* Frames are placed after the header before it is serialized. */
+	size_t frames_len = 0;
+	frames_len += ser_set_options_response(
+		sizeof(storage) - PROT_HDR_LEN, buf + PROT_HDR_LEN, 4, OPT_BATCH
+	);
+	frames_len += ser_send_to_group_response(
+		sizeof(storage) - PROT_HDR_LEN - frames_len, buf + PROT_HDR_LEN + frames_len, 5, 9, 2
+	);
+	size_t len = ser_batch(sizeof(storage), buf, frames_len);
+	cr_assert(eq(sz, len, PROT_HDR_LEN + 12 + 27));
+
+	uint16_t hdr_len;
+	uint8_t msgt;
+	uint64_t seqid;
+	deser_header(buf, &hdr_len, &msgt, &seqid);
+	cr_assert(eq(u16, hdr_len, len));
+	cr_assert(eq(u8, msgt, MSGT_BATCH));
+
+	const char *frames;
+	size_t got_len;
+	cr_assert(eq(int, deser_batch(hdr_len, buf, &frames, &got_len), 0));
+	cr_assert(eq(sz, got_len, frames_len));
+
+	uint8_t options;
+	deser_header(frames, &hdr_len, &msgt, &seqid);
+	cr_assert(eq(u8, msgt, MSGT_SET_OPTIONS_RESPONSE));
+	cr_assert(eq(u64, seqid, 4));
+	cr_assert(eq(int, deser_set_options_response(hdr_len, frames, &options), 0));
+	cr_assert(eq(u8, options, OPT_BATCH));
+
+	uint64_t gid, msgid;
+	deser_header(frames + hdr_len, &hdr_len, &msgt, &seqid);
+	cr_assert(eq(u8, msgt, MSGT_SEND_TO_GROUP_RESPONSE));
+	cr_assert(eq(int, deser_send_to_group_response(hdr_len, frames + 12, &gid, &msgid), 0));
+	cr_assert(eq(u64, msgid, 2));
+
+	/* Empty envelopes are never sent. */
+	cr_assert(eq(int, deser_batch(PROT_HDR_LEN, buf, &frames, &got_len), -1));
+}
+
+Test(codec, message_table_lengths) {
+	/* Fixed length messages only accept their exact length. */
+	cr_assert(prot_len_valid(MSGT_SEND_TO_GROUP_RESPONSE, 27));
+	cr_assert(not(prot_len_valid(MSGT_SEND_TO_GROUP_RESPONSE, 26)));
+	cr_assert(not(prot_len_valid(MSGT_SEND_TO_GROUP_RESPONSE, 28)));
+
+	/* Lengths below the minimum don't wrap into the valid range. */
+	cr_assert(not(prot_len_valid(MSGT_SET_USERNAME, 0)));
+	cr_assert(not(prot_len_valid(MSGT_SET_USERNAME, PROT_HDR_LEN + MIN_UNAME_LEN - 1)));
+	cr_assert(prot_len_valid(MSGT_SET_USERNAME, PROT_HDR_LEN + MIN_UNAME_LEN));
+	cr_assert(prot_len_valid(MSGT_SET_USERNAME, PROT_HDR_LEN + MAX_UNAME_LEN));
+	cr_assert(not(prot_len_valid(MSGT_SET_USERNAME, PROT_HDR_LEN + MAX_UNAME_LEN + 1)));
+
+	cr_assert(prot_len_valid(MSGT_SEND_TO_GROUP, PROT_HDR_LEN + 8));
+	cr_assert(prot_len_valid(MSGT_SEND_TO_GROUP, 2032));
+	cr_assert(not(prot_len_valid(MSGT_SEND_TO_GROUP, 2033)));
+
+	cr_assert(eq(u32, prot_min_len[MSGT_CREATE_GROUP], 20));
+	cr_assert(eq(u32, prot_min_len[MSGT_CREATE_GROUP] + prot_len_span[MSGT_CREATE_GROUP], 1612));
+}
+
+Test(codec, add_to_group) {
+	uint64_t uids[3] = {4, 5, 6};
+	uint64_t storage[PROT_MAX_LEN / sizeof(uint64_t)];
+	char *buf = (char *)storage;
+
+	size_t len = ser_add_to_group(sizeof(storage), buf, 8, 9, uids, 3);
+	cr_assert(eq(sz, len, PROT_HDR_LEN + 9 + sizeof(uids)));
+
+	/* The accessors read the fields in place. */
+	cr_assert(eq(u64, add_to_group_gid(buf), 9));
+	cr_assert(eq(u8, add_to_group_uids_len(buf), 3));
+
+	uint64_t gid;
+	uint8_t uids_len;
+	const char *uids_raw;
+	cr_assert(eq(int, deser_add_to_group(len, buf, &gid, &uids_len, &uids_raw), 0));
+	cr_assert(eq(ptr, (void *)uids_raw, (void *)add_to_group_tail(buf)));
+
+	uint64_t decoded[3];
+	ntohll_bulk(uids_len, decoded, uids_raw);
+	cr_assert(eq(int, memcmp(decoded, uids, sizeof(uids)), 0));
+
+	/* uids_len has to match the number of uids. */
+	buf[offsetof(struct msg_add_to_group, uids_len)] = 2;
+	cr_assert(eq(int, deser_add_to_group(len, buf, &gid, &uids_len, &uids_raw), -1));
+
+	len = ser_add_to_group_response(sizeof(storage), buf, 8, 9);
+	cr_assert(eq(int, deser_add_to_group_response(len, buf, &gid), 0));
+	cr_assert(eq(u64, gid, 9));
+}
+
+Test(codec, get_usernames_response) {
+	uint64_t storage[PROT_MAX_LEN / sizeof(uint64_t)];
+	char *buf = (char *)storage;
+
+	size_t len = ser_get_usernames(sizeof(storage), buf, 3, 9);
+	uint64_t gid;
+	cr_assert(eq(int, deser_get_usernames(len, buf, &gid), 0));
+	cr_assert(eq(u64, gid, 9));
+
+	/* Records are written in place after the fixed fields, like the server does. */
+	char *rec = buf + sizeof(struct msg_get_usernames_response);
+	memcpy(rec, "\3bob\5alice", 10);
+	len = ser_get_usernames_response(sizeof(storage), buf, 3, 1, 2, 10);
+	cr_assert(eq(sz, len, PROT_HDR_LEN + 3 + 10));
+
+	uint8_t more;
+	uint16_t count;
+	const char *records;
+	cr_assert(eq(int, deser_get_usernames_response(len, buf, &more, &count, &records), 0));
+	cr_assert(eq(u8, more, 1));
+	cr_assert(eq(u16, count, 2));
+	cr_assert(eq(ptr, (void *)records, (void *)rec));
+
+	/* count has to match the records exactly. */
+	ser_get_usernames_response(sizeof(storage), buf, 3, 1, 3, 10);
+	cr_assert(eq(int, deser_get_usernames_response(len, buf, &more, &count, &records), -1));
+	ser_get_usernames_response(sizeof(storage), buf, 3, 1, 1, 10);
+	cr_assert(eq(int, deser_get_usernames_response(len, buf, &more, &count, &records), -1));
+
+	/* A record can't run past the end of the message. */
+	rec[4] = 6;
+	ser_get_usernames_response(sizeof(storage), buf, 3, 1, 2, 10);
+	cr_assert(eq(int, deser_get_usernames_response(len, buf, &more, &count, &records), -1));
+}
+
+Test(codec, presence_and_typing) {
+	uint64_t storage[PROT_MAX_LEN / sizeof(uint64_t)];
+	char *buf = (char *)storage;
+
+	size_t len = ser_set_presence(sizeof(storage), buf, 3, PRESENCE_AWAY);
+	cr_assert(eq(sz, len, PROT_HDR_LEN + 1));
+	uint8_t presence;
+	cr_assert(eq(int, deser_set_presence(len, buf, &presence), 0));
+	cr_assert(eq(u8, presence, PRESENCE_AWAY));
+
+	len = ser_set_typing(sizeof(storage), buf, 4, 9, 1);
+	cr_assert(eq(sz, len, PROT_HDR_LEN + 9));
+	uint64_t gid;
+	uint8_t typing;
+	cr_assert(eq(int, deser_set_typing(len, buf, &gid, &typing), 0));
+	cr_assert(eq(u64, gid, 9));
+	cr_assert(eq(u8, typing, 1));
+
+	/* Records are written in place after the fixed fields, like the server does. */
+	char *rec = buf + sizeof(struct msg_group_status);
+	put_group_status_rec(rec, 7, PRESENCE_ONLINE, 1);
+	put_group_status_rec(rec + PROT_STATUS_REC_LEN, 8, PRESENCE_OFFLINE, 0);
+	len = ser_group_status(sizeof(storage), buf, 9, 2);
+	cr_assert(eq(sz, len, PROT_HDR_LEN + 10 + 2 * PROT_STATUS_REC_LEN));
+
+	uint16_t count;
+	const char *records;
+	cr_assert(eq(int, deser_group_status(len, buf, &gid, &count, &records), 0));
+	cr_assert(eq(u64, gid, 9));
+	cr_assert(eq(u16, count, 2));
+
+	uint64_t uid;
+	group_status_rec(records, 1, &uid, &presence, &typing);
+	cr_assert(eq(u64, uid, 8));
+	cr_assert(eq(u8, presence, PRESENCE_OFFLINE));
+	cr_assert(eq(u8, typing, 0));
+
+	/* count has to match the records exactly. */
+	ser_group_status(sizeof(storage), buf, 9, 1);
+	cr_assert(eq(int, deser_group_status(len, buf, &gid, &count, &records), -1));
+	cr_assert(eq(int, deser_group_status(len - 1, buf, &gid, &count, &records), -1));
+}
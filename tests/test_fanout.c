@@ -0,0 +1,180 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <stdlib.h>
+
+#include "../fanout.h"
+#include "../groups.h"
+
+/* Records the sends of a round per group, in the order they were made. */
+struct sent {
+	size_t len;
+	uint64_t ids[4096];
+	size_t per_job[8];
+};
+
+static void record(void *ctx, struct fanout_job *job, const uint64_t *ids, size_t n) {
+	struct sent *s = ctx;
+	for (size_t i = 0; i < n; i++) {
+		if (ids[i] != job->skip) s->ids[s->len++] = ids[i];
+	}
+	/* Tests keep the job number in len. */
+	s->per_job[job->len] += n;
+}
+
+static struct fanout_job *push(FanoutSched *s, struct grp *grp, size_t job_no, uint64_t first,
+							   size_t n, size_t cost) {
+	struct member_snapshot *members = malloc(sizeof(*members) + n * sizeof(uint64_t));
+	members->refs = 1;
+	members->len = n;
+	for (size_t i = 0; i < n; i++) members->ids[i] = first + i;
+	struct fanout_job *job = fanout_sched_push(s, grp, members, cost);
+	job->len = job_no;
+	return job;
+}
+
+Test(fanout, round_robin_quantum) {
+	struct groups *g = groups_create(8);
+	groups_insert(g, 1, 100);
+	groups_insert(g, 2, 100);
+	struct grp *big = groups_find(g, 1);
+	struct grp *small = groups_find(g, 2);
+
+	FanoutSched s;
+	fanout_sched_init(&s, 10);
+
+	/* Two messages to the big group and one to the small one. */
+	push(&s, big, 0, 1000, 25, 1);
+	push(&s, big, 1, 2000, 25, 1);
+	push(&s, small, 2, 3000, 4, 1);
+	cr_assert(eq(sz, s.len, 2));
+	cr_assert(eq(sz, s.pending, 3));
+	cr_assert(eq(sz, big->fanout_idx, 1));
+	cr_assert(eq(sz, small->fanout_idx, 2));
+
+	/* The small group is done in the first round, the big one gets 10 sends a round. */
+	struct sent sent = {0};
+	cr_assert(eq(sz, fanout_sched_round(&s, record, &sent), 14));
+	cr_assert(eq(sz, sent.per_job[0], 10));
+	cr_assert(eq(sz, sent.per_job[2], 4));
+	cr_assert(eq(sz, s.len, 1));
+	cr_assert(eq(sz, small->fanout_idx, 0));
+
+	cr_assert(eq(sz, fanout_sched_round(&s, record, &sent), 10));
+	cr_assert(eq(sz, fanout_sched_round(&s, record, &sent), 10));
+	cr_assert(eq(sz, sent.per_job[0], 25));
+	cr_assert(eq(sz, sent.per_job[1], 5));
+
+	/* The second message only starts once the first one is done. */
+	for (size_t i = 0; i < 25; i++) cr_assert(eq(u64, sent.ids[i < 10 ? i : i + 4], 1000 + i));
+
+	while (fanout_sched_round(&s, record, &sent) > 0) {}
+	cr_assert(eq(sz, sent.per_job[1], 25));
+	cr_assert(eq(sz, s.len, 0));
+	cr_assert(eq(sz, big->fanout_idx, 0));
+	cr_assert(eq(sz, s.pending, 0));
+	cr_assert(eq(u64, s.sends, 54));
+
+	fanout_sched_deinit(&s);
+	groups_destroy(g);
+}
+
+Test(fanout, deficit_carries_over) {
+	struct groups *g = groups_create(8);
+	groups_insert(g, 1, 100);
+	struct grp *grp = groups_find(g, 1);
+
+	FanoutSched s;
+	fanout_sched_init(&s, 10);
+
+	/* Sends costing 4 fit twice in the first round, the 2 left carry over. */
+	push(&s, grp, 0, 1, 10, 4);
+	struct sent sent = {0};
+	cr_assert(eq(sz, fanout_sched_round(&s, record, &sent), 2));
+	cr_assert(eq(sz, s.groups[0].deficit, 2));
+	cr_assert(eq(sz, fanout_sched_round(&s, record, &sent), 3));
+	cr_assert(eq(sz, s.groups[0].deficit, 0));
+
+	/* A cost above the quantum is paid over several rounds. */
+	push(&s, grp, 1, 100, 1, 25);
+	while (sent.per_job[0] < 10) fanout_sched_round(&s, record, &sent);
+	cr_assert(eq(sz, sent.per_job[1], 0));
+	size_t rounds = 0;
+	while (s.len > 0) {
+		fanout_sched_round(&s, record, &sent);
+		rounds++;
+	}
+	cr_assert(eq(sz, sent.per_job[1], 1));
+	cr_assert(eq(sz, rounds, 3));
+
+	fanout_sched_deinit(&s);
+	groups_destroy(g);
+}
+
+Test(fanout, flush_and_reuse) {
+	size_t n = 40;
+	struct groups *g = groups_create(8);
+	for (size_t i = 1; i <= n; i++) groups_insert(g, i, 7);
+
+	FanoutSched s;
+	fanout_sched_init(&s, 1);
+	for (size_t i = 1; i <= n; i++) push(&s, groups_find(g, i), 0, i * 100, i, 1);
+	cr_assert(eq(sz, s.len, n));
+
+	/* Groups which are done leave, the others keep pointing at their queues. */
+	struct sent sent = {0};
+	cr_assert(eq(sz, fanout_sched_round(&s, record, &sent), n));
+	cr_assert(eq(sz, s.len, n - 1));
+	for (size_t i = 2; i <= n; i++) {
+		struct grp *grp = groups_find(g, i);
+		cr_assert(eq(ptr, s.groups[grp->fanout_idx - 1].grp, grp));
+	}
+
+	fanout_sched_flush(&s, record, &sent);
+	cr_assert(eq(sz, s.len, 0));
+	cr_assert(eq(sz, sent.len, n * (n + 1) / 2));
+
+	/* A job without recipients finishes without sends. */
+	push(&s, groups_find(g, 1), 0, 0, 0, 1);
+	cr_assert(eq(sz, fanout_sched_round(&s, record, &sent), 0));
+	cr_assert(eq(sz, s.len, 0));
+
+	fanout_sched_deinit(&s);
+	groups_destroy(g);
+}
+
+Test(fanout, jobs_share_the_snapshot) {
+	struct groups *g = groups_create(8);
+	for (uint64_t cid = 1; cid <= 5; cid++) groups_insert(g, 1, cid);
+	struct grp *grp = groups_find(g, 1);
+
+	FanoutSched s;
+	fanout_sched_init(&s, 100);
+
+	/* Two messages in a row share one copy of the members, and skip their sender. */
+	struct fanout_job *job = fanout_sched_push(&s, grp, grp_snapshot(grp), 1);
+	job->skip = 2;
+	job = fanout_sched_push(&s, grp, grp_snapshot(grp), 1);
+	job->skip = 4;
+	cr_assert(eq(ptr, s.groups[0].jobs[0].members, s.groups[0].jobs[1].members));
+	cr_assert(eq(sz, grp->snapshot->refs, 3));
+
+	/* A new member gets a new copy, which the queued jobs don't see. */
+	groups_insert(g, 1, 6);
+	cr_assert(eq(ptr, grp->snapshot, NULL));
+	job = fanout_sched_push(&s, grp, grp_snapshot(grp), 1);
+	cr_assert(eq(sz, job->members->len, 6));
+	cr_assert(eq(sz, s.groups[0].jobs[0].members->len, 5));
+
+	struct sent sent = {0};
+	fanout_sched_round(&s, record, &sent);
+	cr_assert(eq(sz, sent.len, 4 + 4 + 6));
+	cr_assert(eq(sz, s.pending, 0));
+	cr_assert(eq(sz, grp->snapshot->refs, 1));
+
+	/* So does a member leaving. */
+	groups_remove_client(g, 6);
+	cr_assert(eq(ptr, grp->snapshot, NULL));
+
+	fanout_sched_deinit(&s);
+	groups_destroy(g);
+}
@@ -42,4 +42,115 @@ Test(groups, operations) {
 	cr_assert(groups_get(g, g2, &iter));
 	n = cid_iter_next_batch(&iter, 20, batch);
 	cr_assert(eq(u64, n, 10));
+
+	groups_destroy(g);
+}
+
+Test(groups, incremental_rehash) {
+	struct groups *g = groups_create(8);
+	cr_assert(eq(u64, groups_size(g), 8));
+
+	/* Enough groups to grow several times and span multiple slab chunks. */
+	size_t num_groups = 5000;
+	for (uint64_t gid = 0; gid < num_groups; gid++) {
+		cr_assert(groups_insert(g, gid, gid));
+		cr_assert(groups_insert(g, gid, gid + 1));
+
+		/* Every group must be reachable while the old table is being migrated. */
+		if (g->old.slots != NULL) {
+			struct cid_iter iter;
+			cr_assert(groups_get(g, gid / 2, &iter));
+		}
+	}
+	cr_assert(eq(u64, groups_len(g), num_groups));
+	cr_assert(groups_size(g) * 3 >= num_groups * 4);
+
+	uint64_t batch[4];
+	struct cid_iter iter;
+	for (uint64_t gid = 0; gid < num_groups; gid++) {
+		cr_assert(groups_get(g, gid, &iter));
+		size_t n = cid_iter_next_batch(&iter, 4, batch);
+		cr_assert(eq(u64, n, 2));
+	}
+	cr_assert(not(groups_get(g, num_groups, &iter)));
+
+	/* groups_at walks the groups in creation order across slab chunks. */
+	for (size_t i = 0; i < groups_len(g); i++) {
+		cr_assert(eq(u64, groups_at(g, i)->gid, i));
+	}
+
+	groups_destroy(g);
+}
+
+Test(groups, client_memberships) {
+	struct groups *g = groups_create(16);
+
+	/* Client 1 is in every group, client 2 in every other one. */
+	size_t num_groups = 10;
+	for (uint64_t gid = 0; gid < num_groups; gid++) {
+		cr_assert(groups_insert(g, gid, 1));
+		cr_assert(groups_insert(g, gid, 1));
+		if (gid % 2 == 0) {
+			cr_assert(groups_insert(g, gid, 2));
+		}
+	}
+
+	/* Enough clients to grow the memberships table. */
+	for (uint64_t cid = 100; cid < 300; cid++) {
+		cr_assert(groups_insert(g, 0, cid));
+	}
+
+	size_t len;
+	struct grp **grps = groups_of_client(g, 1, &len);
+	cr_assert(eq(sz, len, num_groups));
+	for (size_t i = 0; i < len; i++) {
+		cr_assert(eq(u64, grps[i]->gid, i));
+	}
+
+	grps = groups_of_client(g, 2, &len);
+	cr_assert(eq(sz, len, num_groups / 2));
+	cr_assert(zero(ptr, groups_of_client(g, 3, &len)));
+	cr_assert(eq(sz, len, 0));
+
+	cr_assert(eq(sz, groups_remove_client(g, 1), num_groups));
+	cr_assert(eq(sz, groups_remove_client(g, 1), 0));
+	cr_assert(zero(ptr, groups_of_client(g, 1, &len)));
+
+	uint64_t batch[4];
+	struct cid_iter iter;
+	cr_assert(groups_get(g, 2, &iter));
+	cr_assert(eq(sz, cid_iter_next_batch(&iter, 4, batch), 1));
+	cr_assert(eq(u64, batch[0], 2));
+	cr_assert(groups_get(g, 3, &iter));
+	cr_assert(eq(sz, cid_iter_next_batch(&iter, 4, batch), 0));
+
+	for (uint64_t cid = 100; cid < 300; cid++) {
+		cr_assert(eq(sz, groups_remove_client(g, cid), 1));
+		cr_assert(groups_of_client(g, 2, &len) != NULL);
+	}
+	cr_assert(eq(sz, g->members.len, 1));
+
+	groups_destroy(g);
+}
+
+Test(groups, reserve) {
+	struct groups *g = groups_create(4);
+	cr_assert(groups_insert(g, 1, 100));
+
+	size_t n = 5000;
+	cr_assert(groups_reserve(g, n, n));
+	size_t cap = groups_size(g);
+	cr_assert(cap * 0.75 >= n);
+	cr_assert(eq(sz, g->slab.chunks_len, (n + 1023) / 1024));
+
+	/* Groups created before are kept, and filling it up doesn't grow it. */
+	struct grp *first = groups_find(g, 1);
+	cr_assert(first != NULL);
+	for (uint64_t gid = 2; gid <= n; gid++) cr_assert(groups_insert(g, gid, gid));
+	cr_assert(eq(sz, groups_size(g), cap));
+	cr_assert(eq(ptr, groups_find(g, 1), first));
+	cr_assert(eq(ptr, groups_at(g, 0), first));
+	cr_assert(eq(u64, groups_find(g, n)->gid, n));
+
+	groups_destroy(g);
 }
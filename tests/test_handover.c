@@ -0,0 +1,182 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../handover.h"
+
+/* More than fit in a message, so that fds are passed over several of them. */
+#define CLIENTS 600
+/* The record of the last client doesn't fit in a message. */
+#define BIG_GROUPS 10000
+#define BIG_RECV 8192
+
+typedef struct {
+	int sock;
+	int fd;
+} WriterCtx;
+
+static void put_client(HandoverWriter *w, uint64_t cid, uint32_t groups_len, uint16_t recv_len, int fd) {
+	size_t len = sizeof(struct handover_client) + groups_len * sizeof(uint64_t) + recv_len;
+	struct handover_client *c = handover_reserve(w, HANDOVER_REC_CLIENT, len, fd);
+	cr_assert(ne(ptr, c, NULL));
+
+	c->client_id = cid;
+	c->groups_len = groups_len;
+	c->recv_len = recv_len;
+	c->options = cid & 1;
+	c->username_len = snprintf(c->username, sizeof(c->username), "u%lu", cid);
+
+	uint64_t *gids = (uint64_t *)(c + 1);
+	for (uint32_t i = 0; i < groups_len; i++) gids[i] = cid + i;
+	memset(gids + groups_len, (int)(cid & 0xff), recv_len);
+}
+
+static void *write_state(void *arg) {
+	WriterCtx *ctx = arg;
+	HandoverWriter w;
+	handover_writer_init(&w, ctx->sock);
+
+	struct handover_listener *l = handover_reserve(
+		&w, HANDOVER_REC_LISTENER, sizeof(struct handover_listener), ctx->fd);
+	l->next_client_id = 1000;
+	l->next_group_id = 2000;
+
+	for (uint64_t cid = 1; cid <= CLIENTS; cid++) put_client(&w, cid, cid % 4, cid % 100, ctx->fd);
+	put_client(&w, CLIENTS + 1, BIG_GROUPS, BIG_RECV, ctx->fd);
+
+	struct handover_group *g = handover_reserve(
+		&w, HANDOVER_REC_GROUP, sizeof(struct handover_group), -1);
+	g->gid = 7;
+	g->next_msgid = 42;
+
+	struct handover_end *end = handover_reserve(
+		&w, HANDOVER_REC_END, sizeof(struct handover_end), -1);
+	end->clients = CLIENTS + 1;
+	end->groups = 1;
+
+	cr_assert(eq(int, handover_flush(&w), 0));
+	handover_writer_deinit(&w);
+	close(ctx->sock);
+	return NULL;
+}
+
+static void check_client(const struct handover_client *c, uint64_t cid, uint32_t groups_len, uint16_t recv_len) {
+	cr_assert(eq(u64, c->client_id, cid));
+	cr_assert(eq(u32, c->groups_len, groups_len));
+	cr_assert(eq(u16, c->recv_len, recv_len));
+	cr_assert(eq(u8, c->options, cid & 1));
+
+	char name[16];
+	int name_len = snprintf(name, sizeof(name), "u%lu", cid);
+	cr_assert(eq(u8, c->username_len, name_len));
+	cr_assert(eq(int, memcmp(c->username, name, name_len), 0));
+
+	const uint64_t *gids = (const uint64_t *)(c + 1);
+	for (uint32_t i = 0; i < groups_len; i++) cr_assert(eq(u64, gids[i], cid + i));
+	const uint8_t *recv = (const uint8_t *)(gids + groups_len);
+	for (uint16_t i = 0; i < recv_len; i++) cr_assert(eq(u8, recv[i], cid & 0xff));
+}
+
+Test(handover, round_trip) {
+	int sv[2];
+	cr_assert(eq(int, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), 0));
+	int pipe_fds[2];
+	cr_assert(eq(int, pipe(pipe_fds), 0));
+
+	WriterCtx ctx = { .sock = sv[0], .fd = pipe_fds[1] };
+	pthread_t writer;
+	pthread_create(&writer, NULL, write_state, &ctx);
+
+	HandoverReader r;
+	handover_reader_init(&r, sv[1]);
+
+	int fd;
+	const struct handover_rec *rec = handover_read(&r, &fd);
+	cr_assert(ne(ptr, (void *)rec, NULL));
+	cr_assert(eq(u16, rec->type, HANDOVER_REC_LISTENER));
+	const struct handover_listener *l = (const struct handover_listener *)rec;
+	cr_assert(eq(u64, l->next_client_id, 1000));
+	cr_assert(eq(u64, l->next_group_id, 2000));
+	cr_assert(ge(int, fd, 0));
+	close(fd);
+
+	/* Every passed fd refers to the write end of the pipe. */
+	struct stat want;
+	fstat(pipe_fds[1], &want);
+	for (uint64_t cid = 1; cid <= CLIENTS + 1; cid++) {
+		rec = handover_read(&r, &fd);
+		cr_assert(ne(ptr, (void *)rec, NULL));
+		cr_assert(eq(u16, rec->type, HANDOVER_REC_CLIENT));
+
+		struct stat got;
+		cr_assert(eq(int, fstat(fd, &got), 0));
+		cr_assert(eq(u64, got.st_ino, want.st_ino));
+		close(fd);
+
+		if (cid <= CLIENTS) {
+			check_client((const struct handover_client *)rec, cid, cid % 4, cid % 100);
+		} else {
+			check_client((const struct handover_client *)rec, cid, BIG_GROUPS, BIG_RECV);
+		}
+	}
+
+	rec = handover_read(&r, &fd);
+	cr_assert(eq(u16, rec->type, HANDOVER_REC_GROUP));
+	cr_assert(eq(int, fd, -1));
+	cr_assert(eq(u64, ((const struct handover_group *)rec)->next_msgid, 42));
+
+	rec = handover_read(&r, &fd);
+	cr_assert(eq(u16, rec->type, HANDOVER_REC_END));
+	cr_assert(eq(u64, ((const struct handover_end *)rec)->clients, CLIENTS + 1));
+
+	/* The old process closed the connection. */
+	cr_assert(eq(ptr, (void *)handover_read(&r, &fd), NULL));
+	cr_assert(eq(int, errno, 0));
+
+	pthread_join(writer, NULL);
+	handover_reader_deinit(&r);
+	close(sv[1]);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+/* Sends rec as a message of its own and checks that reading it fails. */
+static void expect_bad(const void *rec, size_t len) {
+	int sv[2];
+	cr_assert(eq(int, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), 0));
+	cr_assert(eq(sz, (size_t)send(sv[0], rec, len, 0), len));
+
+	HandoverReader r;
+	handover_reader_init(&r, sv[1]);
+	int fd;
+	cr_assert(eq(ptr, (void *)handover_read(&r, &fd), NULL));
+	cr_assert(eq(int, errno, EBADMSG));
+
+	handover_reader_deinit(&r);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+Test(handover, malformed) {
+	/* A client record too short for the lengths it declares. */
+	struct handover_client c = {
+		.hdr = { .type = HANDOVER_REC_CLIENT, .len = sizeof(c) },
+		.groups_len = 1,
+	};
+	expect_bad(&c, sizeof(c));
+
+	/* A record claiming an fd which wasn't passed. */
+	struct handover_group g = {
+		.hdr = { .type = HANDOVER_REC_GROUP, .has_fd = 1, .len = sizeof(g) },
+	};
+	expect_bad(&g, sizeof(g));
+
+	/* A record running past the end of its message. */
+	g.hdr.has_fd = 0;
+	g.hdr.len = sizeof(g) + 8;
+	expect_bad(&g, sizeof(g));
+}
@@ -0,0 +1,45 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+
+#include "../hist.h"
+
+Test(hist, percentiles) {
+	Hist h;
+	hist_init(&h);
+	cr_assert(eq(u64, hist_percentile(&h, 50), 0));
+
+	/* Values below HIST_SUB_BUCKETS are recorded exactly. */
+	for (uint64_t v = 1; v <= 100; v++) {
+		hist_record(&h, v);
+	}
+	cr_assert(eq(u64, h.count, 100));
+	cr_assert(eq(u64, h.min, 1));
+	cr_assert(eq(u64, h.max, 100));
+	cr_assert(eq(u64, hist_percentile(&h, 50), 50));
+	cr_assert(eq(u64, hist_percentile(&h, 99), 99));
+	cr_assert(eq(u64, hist_percentile(&h, 100), 100));
+
+	/* Larger values are reported within the relative error of a bucket. */
+	Hist big;
+	hist_init(&big);
+	for (uint64_t v = 1; v <= 100000; v++) {
+		hist_record(&big, v * 1000);
+	}
+
+	double ps[] = {50, 99, 99.9};
+	for (size_t i = 0; i < 3; i++) {
+		double expected = ps[i] / 100.0 * 100000 * 1000;
+		double actual = hist_percentile(&big, ps[i]);
+		double err = (actual - expected) / expected;
+		cr_assert(lt(dbl, err < 0 ? -err : err, 1.0 / HIST_SUB_BUCKETS));
+	}
+	cr_assert(eq(u64, hist_percentile(&big, 100), 100000 * 1000));
+
+	hist_merge(&h, &big);
+	cr_assert(eq(u64, h.count, 100100));
+	cr_assert(eq(u64, h.min, 1));
+	cr_assert(eq(u64, h.max, 100000 * 1000));
+
+	hist_record(&h, UINT64_MAX);
+	cr_assert(eq(u64, hist_percentile(&h, 100), UINT64_MAX));
+}
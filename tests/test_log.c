@@ -0,0 +1,82 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../log.h"
+
+static size_t count_lines(const char *s) {
+	size_t n = 0;
+	for (; *s != '\0'; s++) {
+		if (*s == '\n') n++;
+	}
+	return n;
+}
+
+Test(log, formats_and_drops_when_full) {
+	char *out;
+	size_t out_len;
+	FILE *f = open_memstream(&out, &out_len);
+
+	Logger lg;
+	/* Room for 4 records. */
+	logger_init(&lg, f, 256);
+
+	ClientInfo info = { .client_id = 7, .client_fd = 5 };
+	info.client_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	info.client_addr.sin_port = htons(4242);
+
+	LOG_CLIENT(&lg, LOG_LEVEL_INFO, LOG_EV_CONNECTED, &info);
+	LOG_STR(&lg, LOG_LEVEL_WARN, LOG_EV_USERNAME_SET, "averyveryverylongname", 21, .client_id = 7);
+	LOG(&lg, LOG_LEVEL_WARN, LOG_EV_OP_FAILED, .client_id = 7, .fd = 5, .arg = 1, .code = 104);
+
+	/* Below LOG_MIN_LEVEL, compiled out. */
+	LOG(&lg, LOG_LEVEL_DEBUG, LOG_EV_OP_FREED, .client_id = 7);
+	cr_assert(eq(u64, lg.ring.head, 3 * sizeof(LogRecord)));
+
+	/* The ring holds 4 records, the rest are dropped. */
+	for (int i = 0; i < 3; i++) {
+		LOG_CLIENT(&lg, LOG_LEVEL_INFO, LOG_EV_DISCONNECTED, &info);
+	}
+	cr_assert(eq(u64, lg.ring.dropped, 2));
+
+	cr_assert(eq(sz, logger_drain(&lg), 4));
+	fflush(f);
+	cr_assert(strstr(out, "[127.0.0.1:4242] client_id=7 client_fd=5 => connected\n") != NULL);
+	cr_assert(strstr(out, "client_id=7 username is averyveryverylo\n") != NULL);
+	cr_assert(strstr(out, "[fd=5 client_id=7] op READ failed: ") != NULL);
+	cr_assert(strstr(out, "logger dropped 2 records") != NULL);
+	cr_assert(eq(sz, count_lines(out), 5));
+
+	/* Room again once drained. */
+	LOG_CLIENT(&lg, LOG_LEVEL_INFO, LOG_EV_DISCONNECTED, &info);
+	cr_assert(eq(u64, lg.ring.dropped, 2));
+
+	logger_deinit(&lg);
+	fclose(f);
+	cr_assert(eq(sz, count_lines(out), 6));
+	free(out);
+}
+
+Test(log, flusher_writes_everything_on_deinit) {
+	char *out;
+	size_t out_len;
+	FILE *f = open_memstream(&out, &out_len);
+
+	Logger lg;
+	logger_init(&lg, f, 4096);
+	logger_start(&lg);
+
+	for (uint64_t i = 0; i < 1000; i++) {
+		while (lg.ring.cap - (lg.ring.head - __atomic_load_n(&lg.ring.tail, __ATOMIC_ACQUIRE))
+			   < sizeof(LogRecord));
+		LOG(&lg, LOG_LEVEL_ERROR, LOG_EV_INVALID_OP_TYPE, .client_id = i, .arg = 2);
+	}
+
+	logger_deinit(&lg);
+	fclose(f);
+	cr_assert(eq(u64, lg.ring.dropped, 0));
+	cr_assert(eq(sz, count_lines(out), 1000));
+	free(out);
+}
@@ -17,6 +17,8 @@ Test(op_pool, operations) {
 	cr_assert(eq(sz, op->pool_id, 0));
 	cr_assert(eq(i32, op->client_fd, -1));
 	cr_assert(zero(ptr, op->buf_ref));
+	cr_assert(zero(ptr, op->recv_ring));
+	cr_assert(zero(ptr, op->chain));
 	/* ops_next_idx advances by 1 and free_ops remains unchanged. */
 	cr_assert(eq(sz, pool.ops_next_idx, 1));
 	cr_assert(eq(sz, pool.free_len, 0));
@@ -34,6 +36,8 @@ Test(op_pool, operations) {
 	cr_assert(eq(sz, op->pool_id, 0));
 	cr_assert(eq(i32, op->client_fd, -1));
 	cr_assert(zero(ptr, op->buf_ref));
+	cr_assert(zero(ptr, op->recv_ring));
+	cr_assert(zero(ptr, op->chain));
 	/* ops_next_idx advances by 1 and free_ops remains unchanged. */
 	cr_assert(eq(sz, pool.ops_next_idx, 1));
 	cr_assert(eq(sz, pool.free_len, 0));
@@ -77,3 +81,28 @@ Test(op_pool, array_grow) {
 
 	op_pool_deinit(&pool);
 }
+
+Test(op_pool, reserve) {
+	OpPool pool;
+	op_pool_init_with_cap(&pool, 2, 2);
+	Operation *first = op_pool_new_entry(&pool);
+
+	op_pool_reserve(&pool, 10);
+	cr_assert(eq(sz, pool.ops_next_idx, 10));
+	cr_assert(eq(sz, pool.free_len, 9));
+
+	/* The reserved operations are handed out lowest pool_id first. */
+	Operation *ops[9];
+	for (size_t i = 0; i < 9; i++) {
+		ops[i] = op_pool_new_entry(&pool);
+		cr_assert(eq(sz, ops[i]->pool_id, i + 1));
+		cr_assert(eq(i32, ops[i]->client_fd, -1));
+	}
+	cr_assert(eq(sz, pool.ops_next_idx, 10));
+
+	/* All of them fit in the free list at once. */
+	op_pool_return(&pool, first);
+	for (size_t i = 0; i < 9; i++) op_pool_return(&pool, ops[i]);
+	cr_assert(eq(sz, pool.free_cap, 10));
+	op_pool_deinit(&pool);
+}
@@ -0,0 +1,102 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+
+#include "../groups.h"
+#include "../presence.h"
+
+Test(presence, coalesces_per_group) {
+	struct groups *g = groups_create(8);
+	groups_insert(g, 1, 100);
+	groups_insert(g, 2, 100);
+	struct grp *g1 = groups_find(g, 1);
+	struct grp *g2 = groups_find(g, 2);
+
+	PresenceQueue q;
+	presence_queue_init(&q);
+
+	/* A member flapping within the window is only recorded once. */
+	for (int i = 0; i < 10; i++) {
+		presence_mark(&q, g1, 100, 1000 + i);
+	}
+	presence_mark(&q, g1, 101, 1020);
+	presence_mark(&q, g2, 100, 1050);
+	cr_assert(eq(sz, q.len, 2));
+	cr_assert(eq(sz, presence_at(&q, 0)->changed.len, 2));
+	cr_assert(eq(u64, presence_at(&q, 0)->opened_ns, 1000));
+	cr_assert(eq(sz, g2->presence_idx, 2));
+
+	uint64_t next_due_ns;
+	cr_assert(eq(sz, presence_due(&q, 1099, 100, &next_due_ns), 0));
+	cr_assert(eq(u64, next_due_ns, 1));
+	cr_assert(eq(sz, presence_due(&q, 1100, 100, &next_due_ns), 1));
+	cr_assert(eq(u64, next_due_ns, 50));
+
+	/* g2 stays in its slot at the front and g1 starts over with an empty set. */
+	presence_pop(&q, 1);
+	cr_assert(eq(sz, q.len, 1));
+	cr_assert(eq(ptr, presence_at(&q, 0)->grp, g2));
+	cr_assert(eq(sz, g1->presence_idx, 0));
+	cr_assert(eq(sz, g2->presence_idx, 2));
+
+	presence_mark(&q, g1, 102, 2000);
+	cr_assert(eq(sz, q.len, 2));
+	struct presence_group *pg = presence_at(&q, 1);
+	cr_assert(eq(ptr, pg->grp, g1));
+	cr_assert(eq(sz, pg->changed.len, 1));
+	cr_assert(cid_set_exists(&pg->changed, 102));
+	cr_assert(not(cid_set_exists(&pg->changed, 100)));
+
+	/* Nothing due pops nothing. */
+	presence_pop(&q, 0);
+	cr_assert(eq(sz, q.len, 2));
+	cr_assert(eq(ptr, presence_at(&q, 0)->grp, g2));
+
+	/* A window of 0 flushes everything. */
+	cr_assert(eq(sz, presence_due(&q, 2000, 0, &next_due_ns), 2));
+	cr_assert(eq(u64, next_due_ns, 0));
+	presence_pop(&q, 2);
+	cr_assert(eq(sz, q.len, 0));
+	cr_assert(eq(sz, g2->presence_idx, 0));
+
+	presence_queue_deinit(&q);
+	groups_destroy(g);
+}
+
+Test(presence, grows_past_initial_cap) {
+	size_t n = 100;
+	struct groups *g = groups_create(8);
+	for (size_t i = 1; i <= n; i++) groups_insert(g, i, 7);
+
+	PresenceQueue q;
+	presence_queue_init(&q);
+	for (size_t i = 1; i <= n; i++) {
+		presence_mark(&q, groups_find(g, i), 7, i);
+	}
+	cr_assert(eq(sz, q.len, n));
+
+	uint64_t next_due_ns;
+	size_t due = presence_due(&q, 50 + 10, 10, &next_due_ns);
+	cr_assert(eq(sz, due, 50));
+	cr_assert(eq(u64, next_due_ns, 1));
+	presence_pop(&q, due);
+
+	/* Wraps around the ring, then grows it, keeping the order of the groups. */
+	for (size_t i = n + 1; i <= 3 * n; i++) groups_insert(g, i, 7);
+	for (size_t i = 1; i <= 3 * n; i++) {
+		presence_mark(&q, groups_find(g, i), 7, 1000 + i);
+	}
+	cr_assert(eq(sz, q.len, 3 * n));
+	for (size_t i = 0; i < q.len; i++) {
+		uint64_t gid = i < 50 ? 51 + i : i < 100 ? i - 49 : i + 1;
+		cr_assert(eq(u64, presence_at(&q, i)->grp->gid, gid));
+	}
+
+	/* The groups keep pointing at their entries. */
+	for (size_t i = 1; i <= 3 * n; i++) {
+		struct grp *grp = groups_find(g, i);
+		cr_assert(eq(ptr, q.groups[grp->presence_idx - 1].grp, grp));
+	}
+
+	presence_queue_deinit(&q);
+	groups_destroy(g);
+}
@@ -0,0 +1,69 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+
+#include "../ratelimit.h"
+
+Test(ratelimit, burst_then_refill) {
+	RateLimits rl;
+	rate_limits_init(&rl);
+	rate_limits_set(&rl, MSGT_SEND_TO_GROUP, 1000, 3);
+
+	TokenBuckets tb = {0};
+	uint64_t now = 5000000000ull;
+
+	/* Buckets start full. */
+	for (int i = 0; i < 3; i++) {
+		cr_assert(eq(u64, rate_take(&rl, &tb, MSGT_SEND_TO_GROUP, now), 0));
+	}
+	cr_assert(eq(u64, rate_take(&rl, &tb, MSGT_SEND_TO_GROUP, now), 1000000));
+
+	/* Other types are unlimited and don't share the bucket. */
+	cr_assert(eq(u64, rate_take(&rl, &tb, MSGT_CREATE_GROUP, now), 0));
+	cr_assert(eq(u64, tb.full_at_ns[MSGT_CREATE_GROUP], 0));
+
+	/* One token per ms. */
+	cr_assert(eq(u64, rate_take(&rl, &tb, MSGT_SEND_TO_GROUP, now + 400000), 600000));
+	cr_assert(eq(u64, rate_take(&rl, &tb, MSGT_SEND_TO_GROUP, now + 1000000), 0));
+	cr_assert(ne(u64, rate_take(&rl, &tb, MSGT_SEND_TO_GROUP, now + 1000000), 0));
+
+	/* Idle time refills at most burst tokens. */
+	now += 1000000000ull;
+	for (int i = 0; i < 3; i++) {
+		cr_assert(eq(u64, rate_take(&rl, &tb, MSGT_SEND_TO_GROUP, now), 0));
+	}
+	cr_assert(ne(u64, rate_take(&rl, &tb, MSGT_SEND_TO_GROUP, now), 0));
+}
+
+Test(ratelimit, parse) {
+	RateLimits rl;
+	rate_limits_init(&rl);
+
+	cr_assert(eq(int, rate_limits_parse(&rl, "send_to_group=1000/100,create_group=10/5"), 0));
+	cr_assert(eq(u64, rl.types[MSGT_SEND_TO_GROUP].interval_ns, 1000000));
+	cr_assert(eq(u64, rl.types[MSGT_SEND_TO_GROUP].burst_ns, 100000000));
+	cr_assert(eq(u64, rl.types[MSGT_CREATE_GROUP].interval_ns, 100000000));
+	cr_assert(eq(u64, rl.types[MSGT_SET_USERNAME].interval_ns, 0));
+
+	/* A rate of 0 lifts the limit. */
+	cr_assert(eq(int, rate_limits_parse(&rl, "create_group=0/5"), 0));
+	cr_assert(eq(u64, rl.types[MSGT_CREATE_GROUP].interval_ns, 0));
+
+	cr_assert(eq(int, rate_limits_parse(&rl, "no_such_msg=1/1"), -1));
+	cr_assert(eq(int, rate_limits_parse(&rl, "send_to_group=1000"), -1));
+	cr_assert(eq(int, rate_limits_parse(&rl, "send_to_group=/5"), -1));
+	cr_assert(eq(int, rate_limits_parse(&rl, "send_to_group=1/5x"), -1));
+}
+
+Test(ratelimit, single_limit) {
+	struct rate_limit lim;
+	cr_assert(eq(int, rate_limit_parse(&lim, "10/2"), 0));
+	cr_assert(eq(u64, lim.interval_ns, 100000000));
+
+	uint64_t full_at = 0;
+	cr_assert(eq(u64, rate_take_one(&lim, &full_at, 1000), 0));
+	cr_assert(eq(u64, rate_take_one(&lim, &full_at, 1000), 0));
+	cr_assert(eq(u64, rate_take_one(&lim, &full_at, 1000), 100000000));
+
+	cr_assert(eq(int, rate_limit_parse(&lim, "10/2,"), -1));
+	cr_assert(eq(int, rate_limit_parse(&lim, "10"), -1));
+}
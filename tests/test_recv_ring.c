@@ -0,0 +1,84 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <string.h>
+
+#include "../recv_ring.h"
+
+Test(recv_ring, mirrored_and_contiguous) {
+	RecvRing r;
+	cr_assert(recv_ring_init(&r, RECV_RING_SIZE));
+	cr_assert(r.size >= RECV_RING_SIZE);
+	cr_assert(eq(sz, recv_ring_free(&r), r.size));
+
+	/* Both halves share the same pages. */
+	r.base[0] = 'a';
+	cr_assert(eq(chr, r.base[r.size], 'a'));
+	r.base[r.size + 1] = 'b';
+	cr_assert(eq(chr, r.base[1], 'b'));
+
+	/* Leave 5 bytes before the end so that the next frame wraps around. */
+	recv_ring_commit(&r, r.size - 5);
+	recv_ring_consume(&r, r.size - 5);
+	cr_assert(eq(sz, recv_ring_len(&r), 0));
+
+	/* A 100 byte frame arriving in two parts ends up contiguous. */
+	char frame[100];
+	for (size_t i = 0; i < sizeof(frame); i++) frame[i] = i;
+
+	memcpy(recv_ring_write_ptr(&r), frame, 30);
+	recv_ring_commit(&r, 30);
+	cr_assert(eq(sz, recv_ring_len(&r), 30));
+
+	memcpy(recv_ring_write_ptr(&r), frame + 30, 70);
+	recv_ring_commit(&r, 70);
+	cr_assert(eq(sz, recv_ring_len(&r), 100));
+	cr_assert(eq(int, memcmp(recv_ring_read_ptr(&r), frame, sizeof(frame)), 0));
+
+	/* Parsed in place at the start of the ring. */
+	cr_assert(eq(ptr, recv_ring_read_ptr(&r), r.base + r.size - 5));
+	recv_ring_consume(&r, 100);
+	cr_assert(eq(ptr, recv_ring_read_ptr(&r), r.base + 95));
+	cr_assert(eq(sz, recv_ring_free(&r), r.size));
+
+	recv_ring_deinit(&r);
+}
+
+Test(recv_ring, pool_reuses_rings) {
+	RecvRingPool pool;
+	recv_ring_pool_init(&pool, RECV_RING_SIZE);
+
+	RecvRing *a = recv_ring_pool_acquire(&pool);
+	cr_assert(a != NULL);
+	recv_ring_commit(a, 10);
+	recv_ring_pool_release(&pool, a);
+	cr_assert(eq(sz, pool.free_len, 1));
+
+	/* Handed back empty. */
+	RecvRing *b = recv_ring_pool_acquire(&pool);
+	cr_assert(eq(ptr, b, a));
+	cr_assert(eq(sz, recv_ring_len(b), 0));
+	cr_assert(eq(sz, pool.free_len, 0));
+
+	RecvRing *c = recv_ring_pool_acquire(&pool);
+	cr_assert(c != NULL && c != b);
+
+	recv_ring_pool_release(&pool, b);
+	recv_ring_pool_release(&pool, c);
+	recv_ring_pool_deinit(&pool);
+}
+
+Test(recv_ring, pool_reserve) {
+	RecvRingPool pool;
+	recv_ring_pool_init(&pool, RECV_RING_SIZE);
+	cr_assert(eq(sz, recv_ring_pool_reserve(&pool, 100), 100));
+
+	/* Reserved rings are empty and mirrored like new ones. */
+	RecvRing *r = recv_ring_pool_acquire(&pool);
+	cr_assert(eq(sz, pool.free_len, 99));
+	cr_assert(eq(sz, recv_ring_len(r), 0));
+	r->base[0] = 'x';
+	cr_assert(eq(chr, r->base[r->size], 'x'));
+
+	recv_ring_pool_release(&pool, r);
+	recv_ring_pool_deinit(&pool);
+}
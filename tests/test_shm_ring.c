@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../shm_ring.h"
+
+/* Several times the size of the ring, so that the gateway has to wait for room. */
+#define STREAM_LEN (1 << 20)
+#define CHUNK_LEN 1024
+
+Test(shm_ring, attach_maps_the_same_rings) {
+	ShmConn srv;
+	int memfd = shm_conn_create(&srv, 0);
+	cr_assert(ge(int, memfd, 0));
+	size_t size = srv.in.ring.size;
+	cr_assert(eq(sz, size, (size_t)sysconf(_SC_PAGESIZE)));
+	cr_assert(srv.in.ring.shared);
+
+	ShmConn gw;
+	cr_assert(eq(int, shm_conn_attach(&gw, memfd), 0));
+	close(memfd);
+	cr_assert(eq(sz, gw.out.ring.size, size));
+
+	/* Leave 5 bytes before the end so that the frame wraps around. */
+	recv_ring_commit(&gw.out.ring, size - 5);
+	shm_ring_publish(&gw.out);
+	cr_assert(eq(sz, shm_ring_pull(&srv.in), size - 5));
+	recv_ring_consume(&srv.in.ring, size - 5);
+	shm_ring_release(&srv.in);
+	cr_assert(eq(sz, shm_ring_space(&gw.out), size));
+
+	char frame[100];
+	for (size_t i = 0; i < sizeof(frame); i++) frame[i] = i;
+	memcpy(recv_ring_write_ptr(&gw.out.ring), frame, sizeof(frame));
+	recv_ring_commit(&gw.out.ring, sizeof(frame));
+	cr_assert(not(shm_ring_publish(&gw.out)));
+
+	/* Contiguous on the other side, in its own mapping. */
+	cr_assert(eq(sz, shm_ring_pull(&srv.in), sizeof(frame)));
+	cr_assert(ne(ptr, recv_ring_read_ptr(&srv.in.ring), recv_ring_read_ptr(&gw.out.ring)));
+	cr_assert(eq(int, memcmp(recv_ring_read_ptr(&srv.in.ring), frame, sizeof(frame)), 0));
+
+	/* The other direction is a ring of its own. */
+	cr_assert(eq(sz, shm_ring_pull(&gw.in), 0));
+	recv_ring_commit(&srv.out.ring, 3);
+	shm_ring_publish(&srv.out);
+	cr_assert(eq(sz, shm_ring_pull(&gw.in), 3));
+
+	shm_conn_deinit(&gw);
+	shm_conn_deinit(&srv);
+}
+
+Test(shm_ring, sleep_flags) {
+	ShmConn srv;
+	int memfd = shm_conn_create(&srv, 0);
+	ShmConn gw;
+	cr_assert(eq(int, shm_conn_attach(&gw, memfd), 0));
+	close(memfd);
+
+	/* A consumer with nothing to read sleeps, and the next publish wakes it once. */
+	cr_assert(shm_ring_sleep_consumer(&srv.in));
+	recv_ring_commit(&gw.out.ring, 1);
+	cr_assert(shm_ring_publish(&gw.out));
+	recv_ring_commit(&gw.out.ring, 1);
+	cr_assert(not(shm_ring_publish(&gw.out)));
+
+	/* Bytes published before it looks again keep it awake. */
+	cr_assert(not(shm_ring_sleep_consumer(&srv.in)));
+	cr_assert(eq(sz, recv_ring_len(&srv.in.ring), 2));
+
+	/* Same for a producer waiting for room. */
+	size_t size = gw.out.ring.size;
+	cr_assert(shm_ring_sleep_producer(&gw.out, size));
+	recv_ring_consume(&srv.in.ring, 2);
+	cr_assert(shm_ring_release(&srv.in));
+	cr_assert(not(shm_ring_sleep_producer(&gw.out, size)));
+
+	shm_conn_deinit(&gw);
+	shm_conn_deinit(&srv);
+}
+
+Test(shm_ring, invalid_positions) {
+	ShmConn srv;
+	int memfd = shm_conn_create(&srv, 0);
+	ShmConn gw;
+	cr_assert(eq(int, shm_conn_attach(&gw, memfd), 0));
+	close(memfd);
+	size_t size = srv.in.ring.size;
+
+	recv_ring_commit(&gw.out.ring, 10);
+	shm_ring_publish(&gw.out);
+	cr_assert(eq(sz, shm_ring_pull(&srv.in), 10));
+	recv_ring_consume(&srv.in.ring, 4);
+	shm_ring_release(&srv.in);
+
+	/* A tail behind the last one, or more than the ring ahead of head, is refused. */
+	struct shm_ring_ctl *ctl = srv.in.ctl;
+	atomic_store(&ctl->tail, 9);
+	cr_assert(eq(int, (int)shm_ring_pull(&srv.in), -1));
+	atomic_store(&ctl->tail, 4 + size + 1);
+	cr_assert(eq(int, (int)shm_ring_pull(&srv.in), -1));
+	cr_assert(not(shm_ring_sleep_consumer(&srv.in)));
+	cr_assert(eq(sz, srv.in.ring.tail, 10));
+	atomic_store(&ctl->tail, 4 + size);
+	cr_assert(eq(sz, shm_ring_pull(&srv.in), size));
+
+	/* A head ahead of tail, or more than the ring behind it, too. */
+	recv_ring_commit(&srv.out.ring, 10);
+	shm_ring_publish(&srv.out);
+	ctl = srv.out.ctl;
+	atomic_store(&ctl->head, 11);
+	cr_assert(eq(int, (int)shm_ring_space(&srv.out), -1));
+	cr_assert(not(shm_ring_sleep_producer(&srv.out, 1)));
+	cr_assert(eq(sz, srv.out.ring.head, 0));
+	atomic_store(&ctl->head, 10);
+	cr_assert(eq(sz, shm_ring_space(&srv.out), size));
+
+	recv_ring_commit(&srv.out.ring, size + 5);
+	atomic_store(&ctl->head, 4);
+	cr_assert(eq(int, (int)shm_ring_space(&srv.out), -1));
+	atomic_store(&ctl->head, 15);
+	cr_assert(eq(sz, shm_ring_space(&srv.out), 0));
+
+	shm_conn_deinit(&gw);
+	shm_conn_deinit(&srv);
+}
+
+Test(shm_ring, attach_rejects_other_fds) {
+	int memfd = memfd_create("not_shm_ring", MFD_CLOEXEC);
+	cr_assert(ge(int, memfd, 0));
+	cr_assert(eq(int, ftruncate(memfd, 3 * sysconf(_SC_PAGESIZE)), 0));
+
+	ShmConn c;
+	cr_assert(eq(int, shm_conn_attach(&c, memfd), -1));
+	cr_assert(eq(int, errno, EPROTO));
+	close(memfd);
+}
+
+static void *run_gateway(void *arg) {
+	const char *path = arg;
+	ShmConn c;
+	int sock = shm_gateway_connect(path, &c);
+	cr_assert(ge(int, sock, 0));
+
+	char chunk[CHUNK_LEN];
+	for (size_t sent = 0; sent < STREAM_LEN; sent += CHUNK_LEN) {
+		for (size_t i = 0; i < CHUNK_LEN; i++) chunk[i] = (char)(sent + i);
+		cr_assert(eq(int, shm_gateway_write(&c, sock, chunk, CHUNK_LEN), 0));
+	}
+
+	/* The server acknowledges with a single byte once it has read everything. */
+	cr_assert(eq(int, (int)shm_gateway_wait(&c, sock), 1));
+	cr_assert(eq(chr, *recv_ring_read_ptr(&c.in.ring), 'k'));
+	shm_gateway_consume(&c, sock, 1);
+
+	shm_conn_deinit(&c);
+	close(sock);
+	return NULL;
+}
+
+Test(shm_ring, gateway_stream) {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/test_shm_ring.%d", getpid());
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strcpy(addr.sun_path, path);
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	cr_assert(eq(int, bind(lfd, (struct sockaddr *)&addr, sizeof(addr)), 0));
+	cr_assert(eq(int, listen(lfd, 1), 0));
+
+	pthread_t gateway;
+	pthread_create(&gateway, NULL, run_gateway, path);
+
+	int sock = accept(lfd, NULL, NULL);
+	cr_assert(ge(int, sock, 0));
+	ShmConn c;
+	int memfd = shm_conn_create(&c, 0);
+	cr_assert(eq(int, shm_send_fd(sock, memfd), 0));
+	close(memfd);
+
+	/* Reads the stream the way the server does, waiting for doorbells when idle. */
+	size_t received = 0;
+	while (received < STREAM_LEN) {
+		ssize_t len = shm_ring_pull(&c.in);
+		cr_assert(ge(long, len, 0));
+		if (len == 0) {
+			if (!shm_ring_sleep_consumer(&c.in)) continue;
+			char bell[64];
+			cr_assert(gt(int, (int)recv(sock, bell, sizeof(bell), 0), 0));
+			continue;
+		}
+
+		const char *p = recv_ring_read_ptr(&c.in.ring);
+		for (ssize_t i = 0; i < len; i++) cr_assert(eq(chr, p[i], (char)(received + i)));
+		received += len;
+		recv_ring_consume(&c.in.ring, len);
+		if (shm_ring_release(&c.in)) shm_doorbell(sock);
+	}
+
+	*recv_ring_write_ptr(&c.out.ring) = 'k';
+	recv_ring_commit(&c.out.ring, 1);
+	if (shm_ring_publish(&c.out)) shm_doorbell(sock);
+
+	pthread_join(gateway, NULL);
+	shm_conn_deinit(&c);
+	close(sock);
+	close(lfd);
+	unlink(path);
+}
@@ -77,3 +77,23 @@ Test(slab, ref_check) {
 	cr_assert(eq(sz, s.len, 2));
 	cr_assert(eq(sz, s.cap, 2));
 }
+
+Test(slab, reserve) {
+	Slab s;
+	slab_init_cap(&s, 64, 2);
+	slab_reserve(&s, 10);
+	cr_assert(eq(sz, s.len, 10));
+
+	/* Every buffer goes back without growing buf_refs. */
+	BufRef *bufs[10];
+	for (size_t i = 0; i < 10; i++) bufs[i] = slab_acquire(&s, 1);
+	cr_assert(eq(sz, s.len, 0));
+	for (size_t i = 0; i < 10; i++) slab_release(&s, bufs[i]);
+	cr_assert(eq(sz, s.len, 10));
+	cr_assert(eq(sz, s.cap, 10));
+
+	/* Never shrinks. */
+	slab_reserve(&s, 4);
+	cr_assert(eq(sz, s.len, 10));
+	slab_deinit(&s);
+}
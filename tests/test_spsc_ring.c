@@ -0,0 +1,63 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <string.h>
+
+#include "../spsc_ring.h"
+
+static size_t drained;
+
+static size_t count_drain(void *arg) {
+	SpscRing *r = arg;
+	size_t len = spsc_ring_len(r);
+	spsc_ring_consume(r, len);
+	drained += len;
+	return len;
+}
+
+Test(spsc_ring, wraps_around_and_drops_when_full) {
+	SpscRing r;
+	spsc_ring_init(&r, 16, count_drain, &r);
+
+	cr_assert(spsc_ring_push(&r, "abcdef", 6, "ghij", 4));
+	cr_assert(not(spsc_ring_push(&r, "klmnopq", 7, NULL, 0)));
+	cr_assert(eq(u64, r.dropped, 1));
+
+	char out[10];
+	spsc_ring_read(&r, out, 6);
+	cr_assert(eq(int, memcmp(out, "abcdef", 6), 0));
+
+	/* The next 10 bytes wrap around the end. */
+	cr_assert(spsc_ring_push(&r, "0123456789", 10, NULL, 0));
+	cr_assert(eq(sz, spsc_ring_len(&r), 14));
+
+	size_t span_len;
+	const char *span = spsc_ring_peek(&r, 14, &span_len);
+	cr_assert(eq(sz, span_len, 10));
+	cr_assert(eq(int, memcmp(span, "ghij012345", 10), 0));
+	spsc_ring_consume(&r, 4);
+
+	spsc_ring_read(&r, out, 10);
+	cr_assert(eq(int, memcmp(out, "0123456789", 10), 0));
+	cr_assert(eq(sz, spsc_ring_len(&r), 0));
+
+	/* Whatever is still pending is drained on deinit. */
+	drained = 0;
+	cr_assert(spsc_ring_push(&r, "xyz", 3, NULL, 0));
+	spsc_ring_deinit(&r);
+	cr_assert(eq(sz, drained, 3));
+}
+
+Test(spsc_ring, writer_thread) {
+	SpscRing r;
+	spsc_ring_init(&r, 1 << 12, count_drain, &r);
+	spsc_ring_start(&r, 1);
+
+	drained = 0;
+	uint64_t pushed = 0;
+	for (uint64_t i = 0; i < 100000; i++) {
+		if (spsc_ring_push(&r, &i, sizeof(i), NULL, 0)) pushed++;
+	}
+	spsc_ring_deinit(&r);
+	cr_assert(eq(u64, pushed + r.dropped, 100000));
+	cr_assert(eq(sz, drained, pushed * sizeof(uint64_t)));
+}
@@ -0,0 +1,48 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <unistd.h>
+
+#include "../trace.h"
+
+Test(trace, ring_wraps_and_skips_torn_events) {
+	char path[] = "/tmp/chat-trace-test-XXXXXX";
+	int fd = mkstemp(path);
+	cr_assert(fd >= 0);
+	close(fd);
+
+	TraceRing *r = trace_ring_create(path, 8);
+	cr_assert(r != NULL);
+
+	for (uint64_t i = 0; i < 20; i++) {
+		trace_ring_emit(r, TRACE_SUBMIT, 1, i, 100 + i, 1000 + i);
+	}
+	cr_assert(eq(u64, r->head, 20));
+
+	/* Readers map the ring on their own and only see the last cap events. */
+	const TraceRing *reader = trace_ring_open(path);
+	cr_assert(reader != NULL);
+	cr_assert(eq(u32, reader->cap, 8));
+
+	TraceEvent events[8];
+	size_t len = trace_ring_snapshot(reader, events);
+	cr_assert(eq(sz, len, 8));
+	for (size_t i = 0; i < len; i++) {
+		cr_assert(eq(u64, events[i].seq, 12 + i));
+		cr_assert(eq(u64, events[i].client_id, 112 + i));
+		cr_assert(eq(u64, events[i].arg, 1012 + i));
+		cr_assert(eq(u32, events[i].aux, 12 + i));
+		cr_assert(eq(u8, events[i].kind, TRACE_SUBMIT));
+		if (i > 0) cr_assert(events[i].tsc >= events[i - 1].tsc);
+	}
+
+	/* An event caught in the middle of a write is left out. */
+	r->events[15 & 7].seq = UINT64_MAX;
+	len = trace_ring_snapshot(reader, events);
+	cr_assert(eq(sz, len, 7));
+	cr_assert(eq(u64, events[2].seq, 14));
+	cr_assert(eq(u64, events[3].seq, 16));
+
+	trace_ring_close(reader);
+	trace_ring_close(r);
+	unlink(path);
+}
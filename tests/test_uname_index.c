@@ -0,0 +1,117 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+
+#include "../uname_index.h"
+
+Test(uname_index, set_find_get) {
+	UnameIndex ix;
+	uname_index_init(&ix, 4);
+
+	cr_assert(uname_index_set(&ix, 1, "alice", 5));
+	cr_assert(uname_index_set(&ix, 2, "bob", 3));
+
+	uint64_t cid;
+	cr_assert(uname_index_find(&ix, "alice", 5, &cid));
+	cr_assert(eq(u64, cid, 1));
+	cr_assert(not(uname_index_find(&ix, "ali", 3, &cid)));
+
+	const struct uname_entry *e = uname_index_get(&ix, 2);
+	cr_assert(ne(ptr, (void *)e, NULL));
+	cr_assert(eq(u8, e->len, 3));
+	cr_assert(eq(int, memcmp(e->name, "bob", 3), 0));
+	cr_assert(eq(ptr, (void *)uname_index_get(&ix, 3), NULL));
+
+	/* Names are unique but a client may set its own name again. */
+	cr_assert(not(uname_index_set(&ix, 2, "alice", 5)));
+	cr_assert(uname_index_set(&ix, 1, "alice", 5));
+	cr_assert(eq(sz, ix.len, 2));
+
+	/* Renaming frees the old name. */
+	cr_assert(uname_index_set(&ix, 1, "carol", 5));
+	cr_assert(not(uname_index_find(&ix, "alice", 5, &cid)));
+	cr_assert(uname_index_set(&ix, 2, "alice", 5));
+	cr_assert(uname_index_find(&ix, "carol", 5, &cid));
+	cr_assert(eq(u64, cid, 1));
+
+	uname_index_deinit(&ix);
+}
+
+Test(uname_index, grow_and_remove) {
+	UnameIndex ix;
+	uname_index_init(&ix, 1);
+
+	size_t n = 1000;
+	char name[16];
+	for (uint64_t cid = 1; cid <= n; cid++) {
+		int len = snprintf(name, sizeof(name), "user%lu", cid);
+		cr_assert(uname_index_set(&ix, cid, name, len));
+	}
+	cr_assert(eq(sz, ix.len, n));
+	cr_assert(ix.cap * 0.75 >= n);
+
+	/* Removing moves the last entry, which must stay reachable both ways. */
+	for (uint64_t cid = 1; cid <= n; cid += 2) {
+		cr_assert(uname_index_remove(&ix, cid));
+	}
+	cr_assert(not(uname_index_remove(&ix, 1)));
+	cr_assert(eq(sz, ix.len, n / 2));
+
+	for (uint64_t cid = 1; cid <= n; cid++) {
+		int len = snprintf(name, sizeof(name), "user%lu", cid);
+		uint64_t found;
+		bool exists = uname_index_find(&ix, name, len, &found);
+		const struct uname_entry *e = uname_index_get(&ix, cid);
+
+		cr_assert(eq(int, exists, cid % 2 == 0));
+		cr_assert(eq(int, e != NULL, cid % 2 == 0));
+		if (!exists) continue;
+
+		cr_assert(eq(u64, found, cid));
+		cr_assert(eq(u64, e->cid, cid));
+		cr_assert(eq(int, memcmp(e->name, name, len), 0));
+	}
+
+	uname_index_deinit(&ix);
+}
+
+Test(uname_index, get_batch) {
+	UnameIndex ix;
+	uname_index_init(&ix, 16);
+
+	uname_index_set(&ix, 10, "alice", 5);
+	uname_index_set(&ix, 20, "bob", 3);
+
+	uint64_t cids[3] = {20, 30, 10};
+	const struct uname_entry *entries[3];
+	uname_index_get_batch(&ix, 3, cids, entries);
+
+	cr_assert(eq(ptr, (void *)entries[0], (void *)uname_index_get(&ix, 20)));
+	cr_assert(eq(ptr, (void *)entries[1], NULL));
+	cr_assert(eq(ptr, (void *)entries[2], (void *)uname_index_get(&ix, 10)));
+
+	uname_index_deinit(&ix);
+}
+
+Test(uname_index, reserve) {
+	UnameIndex ix;
+	uname_index_init(&ix, 1);
+	uname_index_reserve(&ix, 1000);
+	cr_assert(ix.cap * 0.75 >= 1000);
+	cr_assert(eq(sz, ix.entries_cap, 1000));
+
+	/* Filling it up to what was reserved doesn't grow it. */
+	size_t cap = ix.cap;
+	struct uname_entry *entries = ix.entries;
+	char name[16];
+	for (uint64_t cid = 1; cid <= 1000; cid++) {
+		int len = snprintf(name, sizeof(name), "user%lu", cid);
+		cr_assert(uname_index_set(&ix, cid, name, len));
+	}
+	cr_assert(eq(sz, ix.cap, cap));
+	cr_assert(eq(ptr, ix.entries, entries));
+
+	uint64_t found;
+	cr_assert(uname_index_find(&ix, "user1000", 8, &found));
+	cr_assert(eq(u64, found, 1000));
+	uname_index_deinit(&ix);
+}
@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_CALIBRATE_MS 10
+
+volatile sig_atomic_t trace_enabled;
+
+static double cycles_per_ns = 1.0;
+
+static __thread TraceRing *thread_ring;
+static __thread bool thread_ring_failed;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t ring_size(uint32_t cap) {
+	return sizeof(TraceRing) + (size_t)cap * sizeof(TraceEvent);
+}
+
+void trace_init(bool enabled) {
+	uint64_t start_ns = now_ns();
+	uint64_t start = trace_tsc();
+	while (now_ns() - start_ns < TRACE_CALIBRATE_MS * 1000000ull);
+	cycles_per_ns = (double)(trace_tsc() - start) / (now_ns() - start_ns);
+
+	trace_enabled = enabled;
+}
+
+TraceRing *trace_ring_create(const char *path, uint32_t cap) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return NULL;
+
+	size_t size = ring_size(cap);
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	TraceRing *r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) return NULL;
+
+	r->magic = TRACE_MAGIC;
+	r->cap = cap;
+	r->pid = getpid();
+	r->tid = syscall(SYS_gettid);
+	r->cycles_per_ns = cycles_per_ns;
+	r->head = 0;
+	return r;
+}
+
+const TraceRing *trace_ring_open(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TraceRing)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	const TraceRing *r = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) return NULL;
+
+	if (r->magic != TRACE_MAGIC || ring_size(r->cap) != (size_t)st.st_size) {
+		munmap((void *)r, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	return r;
+}
+
+void trace_ring_close(const TraceRing *r) {
+	munmap((void *)r, ring_size(r->cap));
+}
+
+/**
+ * Single writer. seq is cleared before the fields are written and set after,
+ * so a reader which sees the same seq before and after copying an event knows
+ * it wasn't torn.
+ */
+void trace_ring_emit(TraceRing *r, uint8_t kind, uint8_t type, uint32_t aux,
+					 uint64_t client_id, uint64_t arg) {
+	uint64_t seq = r->head;
+	TraceEvent *e = &r->events[seq & (r->cap - 1)];
+
+	__atomic_store_n(&e->seq, UINT64_MAX, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	e->tsc = trace_tsc();
+	e->client_id = client_id;
+	e->arg = arg;
+	e->aux = aux;
+	e->kind = kind;
+	e->type = type;
+
+	__atomic_store_n(&e->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+void trace_emit(uint8_t kind, uint8_t type, uint32_t aux, uint64_t client_id, uint64_t arg) {
+	if (thread_ring == NULL) {
+		if (thread_ring_failed) return;
+
+		char path[128];
+		snprintf(path, sizeof(path), "%s/chat-trace-%d-%ld",
+			TRACE_DIR, getpid(), (long)syscall(SYS_gettid));
+		thread_ring = trace_ring_create(path, TRACE_RING_LEN);
+		if (thread_ring == NULL) {
+			perror("trace_emit: trace_ring_create");
+			thread_ring_failed = true;
+			return;
+		}
+	}
+	trace_ring_emit(thread_ring, kind, type, aux, client_id, arg);
+}
+
+size_t trace_ring_snapshot(const TraceRing *r, TraceEvent *out) {
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t start = head > r->cap ? head - r->cap : 0;
+
+	size_t len = 0;
+	for (uint64_t seq = start; seq < head; seq++) {
+		const TraceEvent *e = &r->events[seq & (r->cap - 1)];
+		if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq) continue;
+
+		out[len] = *e;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue;
+
+		out[len].seq = seq;
+		len++;
+	}
+	return len;
+}
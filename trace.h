@@ -0,0 +1,134 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Always compiled, runtime toggled tracing of the event loop.
+ *
+ * Every thread writes fixed-size binary events into its own ring, which is a
+ * file in TRACE_DIR mapped into memory. The ring is a flight recorder: once
+ * full, the oldest events are overwritten. tracedump reads the rings of a
+ * running or exited server and converts them into a Chrome trace.
+ *
+ * The writer never blocks or locks. Readers copy events while the writer keeps
+ * going and detect the ones overwritten in the meantime through their seq.
+ *
+ * When tracing is disabled TRACE costs a load and a predicted branch. USDT
+ * probes are compiled in as nops when <sys/sdt.h> is available, so tools like
+ * bpftrace can attach to chat_server:accept/recv/handle/send/free regardless.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_HAVE_SDT 1
+#endif
+#endif
+
+#ifndef TRACE_HAVE_SDT
+#define DTRACE_PROBE1(provider, name, a1) do {} while (0)
+#define DTRACE_PROBE2(provider, name, a1, a2) do {} while (0)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3) do {} while (0)
+#endif
+
+#define TRACE_DIR "/dev/shm"
+#define TRACE_MAGIC 0x45434152544d4843ull /* "CHMTRACE" */
+
+/* Events per thread. Must be a power of 2. */
+#define TRACE_RING_LEN (1u << 16)
+
+typedef enum {
+	/* SQE prepared. type is the OpType, aux the pool_id, arg the length. */
+	TRACE_SUBMIT,
+	/* CQE handled. type is the OpType, aux the pool_id, arg the result. */
+	TRACE_COMPLETE,
+	/* type is the MessageType, arg the seqid. */
+	TRACE_HANDLE_BEGIN,
+	TRACE_HANDLE_END,
+	/* client_id is the sender, aux the number of recipients, arg the gid. */
+	TRACE_FANOUT_BEGIN,
+	TRACE_FANOUT_END,
+	/* Operation returned to the pool. type is the OpType, aux the pool_id. */
+	TRACE_FREE,
+} TraceKind;
+
+typedef struct {
+	/* Position of the event in the ring's history. UINT64_MAX while being written. */
+	uint64_t seq;
+	uint64_t tsc;
+	uint64_t client_id;
+	uint64_t arg;
+	uint32_t aux;
+	uint8_t kind;
+	uint8_t type;
+	uint16_t reserved;
+} TraceEvent;
+
+typedef struct {
+	uint64_t magic;
+	uint32_t cap;
+	uint32_t pid;
+	uint32_t tid;
+	/* TSC ticks per ns, to convert tsc of the events. */
+	double cycles_per_ns;
+
+	/* Number of events written so far. Only the last cap are still in events. */
+	_Alignas(64) uint64_t head;
+	TraceEvent events[];
+} TraceRing;
+
+extern volatile sig_atomic_t trace_enabled;
+
+#define TRACE(kind, type, aux, client_id, arg) \
+	do { \
+		if (__builtin_expect(trace_enabled, 0)) { \
+			trace_emit((kind), (type), (aux), (client_id), (arg)); \
+		} \
+	} while (0)
+
+/**
+ * Calibrates the TSC against the monotonic clock, which takes TRACE_CALIBRATE_MS,
+ * and sets trace_enabled. Must be called once before any thread traces.
+ */
+void trace_init(bool enabled);
+
+/**
+ * Appends an event to the ring of the calling thread, which is created on the
+ * first call. Tracing is disabled for the thread if creating the ring fails.
+ */
+void trace_emit(uint8_t kind, uint8_t type, uint32_t aux, uint64_t client_id, uint64_t arg);
+
+/* Creates the ring file at path. cap must be a power of 2. Returns NULL on failure. */
+TraceRing *trace_ring_create(const char *path, uint32_t cap);
+
+/* Maps the ring file at path read-only. Returns NULL on failure. */
+const TraceRing *trace_ring_open(const char *path);
+
+void trace_ring_close(const TraceRing *r);
+
+void trace_ring_emit(TraceRing *r, uint8_t kind, uint8_t type, uint32_t aux,
+					 uint64_t client_id, uint64_t arg);
+
+/**
+ * Copies the events still in the ring into out, oldest first, and returns their
+ * number. out must have room for r->cap events. Events overwritten while they
+ * were being copied are left out.
+ */
+size_t trace_ring_snapshot(const TraceRing *r, TraceEvent *out);
+
+static inline uint64_t trace_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+#endif
@@ -0,0 +1,171 @@
+/**
+ * Converts trace rings written by the server into the Chrome trace event format,
+ * which chrome://tracing and https://ui.perfetto.dev show as a flame chart:
+ *
+ *   ./tracedump /dev/shm/chat-trace-<pid>-* > trace.json
+ *
+ * Every io_uring operation becomes a span from its SQE to its CQE on the lane
+ * of its client. Request handling and fan-out become spans on the lane of the
+ * event loop thread, with fan-out nested under the SEND_TO_GROUP that caused it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "op.h"
+#include "protocol.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Client lanes are offset so they don't collide with thread ids. */
+#define CLIENT_LANE_BASE 1000000000ull
+
+static const char *msgt_str(uint8_t msgt) {
+	switch (msgt) {
+		case MSGT_SET_USERNAME: return "SET_USERNAME";
+		case MSGT_CREATE_GROUP: return "CREATE_GROUP";
+		case MSGT_SEND_TO_GROUP: return "SEND_TO_GROUP";
+		default: return "UNKNOWN";
+	}
+}
+
+typedef struct {
+	/* tsc of the SQE in flight for each pool_id, 0 if none. */
+	uint64_t *submitted;
+	size_t submitted_cap;
+
+	uint64_t handle_start;
+	uint8_t handle_msgt;
+	uint64_t fanout_start;
+
+	bool first;
+} DumpState;
+
+static uint64_t *submitted_slot(DumpState *st, uint32_t pool_id) {
+	if (pool_id >= st->submitted_cap) {
+		size_t cap = st->submitted_cap == 0 ? 1024 : st->submitted_cap;
+		while (cap <= pool_id) cap *= 2;
+		st->submitted = must_realloc(st->submitted, cap * sizeof(uint64_t), "submitted_slot realloc");
+		memset(st->submitted + st->submitted_cap, 0, (cap - st->submitted_cap) * sizeof(uint64_t));
+		st->submitted_cap = cap;
+	}
+	return &st->submitted[pool_id];
+}
+
+static void emit_span(DumpState *st, const TraceRing *r, uint64_t base, const char *name,
+					  const char *cat, uint64_t lane, uint64_t start, uint64_t end,
+					  const char *args) {
+	double ts = (start - base) / r->cycles_per_ns / 1000.0;
+	double dur = (end - start) / r->cycles_per_ns / 1000.0;
+	printf("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+		"\"pid\":%u,\"tid\":%lu,\"args\":{%s}}",
+		st->first ? "" : ",", name, cat, ts, dur, r->pid, lane, args);
+	st->first = false;
+}
+
+static void dump_ring(DumpState *st, const TraceRing *r, const TraceEvent *events,
+					  size_t len, uint64_t base) {
+	printf("%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+		"\"args\":{\"name\":\"event loop %u\"}}",
+		st->first ? "" : ",", r->pid, r->tid, r->tid);
+	st->first = false;
+
+	char args[128];
+	for (size_t i = 0; i < len; i++) {
+		const TraceEvent *e = &events[i];
+		switch (e->kind) {
+			case TRACE_SUBMIT: {
+				/* A resumed recv or send extends the span of the first SQE. */
+				uint64_t *slot = submitted_slot(st, e->aux);
+				if (*slot == 0) *slot = e->tsc;
+				break;
+			}
+			case TRACE_COMPLETE: {
+				uint64_t *slot = submitted_slot(st, e->aux);
+				if (*slot == 0) break;
+
+				snprintf(args, sizeof(args), "\"pool_id\":%u,\"res\":%ld", e->aux, (int64_t)e->arg);
+				emit_span(st, r, base, op_type_str(e->type), "io",
+					CLIENT_LANE_BASE + e->client_id, *slot, e->tsc, args);
+				*slot = 0;
+				break;
+			}
+			case TRACE_FREE: {
+				*submitted_slot(st, e->aux) = 0;
+				break;
+			}
+			case TRACE_HANDLE_BEGIN: {
+				st->handle_start = e->tsc;
+				st->handle_msgt = e->type;
+				break;
+			}
+			case TRACE_HANDLE_END: {
+				if (st->handle_start == 0) break;
+				snprintf(args, sizeof(args), "\"client_id\":%lu,\"seqid\":%lu", e->client_id, e->arg);
+				emit_span(st, r, base, msgt_str(st->handle_msgt), "handle",
+					r->tid, st->handle_start, e->tsc, args);
+				st->handle_start = 0;
+				break;
+			}
+			case TRACE_FANOUT_BEGIN: {
+				st->fanout_start = e->tsc;
+				break;
+			}
+			case TRACE_FANOUT_END: {
+				if (st->fanout_start == 0) break;
+				snprintf(args, sizeof(args), "\"gid\":%lu,\"recipients\":%u", e->arg, e->aux);
+				emit_span(st, r, base, "fanout", "handle", r->tid, st->fanout_start, e->tsc, args);
+				st->fanout_start = 0;
+				break;
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s RING... > trace.json\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	/* Snapshot every ring first so that all of them share the same time base. */
+	size_t rings_len = argc - 1;
+	const TraceRing **rings = must_malloc(rings_len * sizeof(TraceRing *), "malloc rings");
+	TraceEvent **events = must_malloc(rings_len * sizeof(TraceEvent *), "malloc events");
+	size_t *events_len = must_malloc(rings_len * sizeof(size_t), "malloc events_len");
+	uint64_t base = UINT64_MAX;
+
+	for (size_t i = 0; i < rings_len; i++) {
+		rings[i] = trace_ring_open(argv[i + 1]);
+		if (rings[i] == NULL) {
+			perror(argv[i + 1]);
+			return EXIT_FAILURE;
+		}
+
+		events[i] = must_malloc(rings[i]->cap * sizeof(TraceEvent), "malloc ring events");
+		events_len[i] = trace_ring_snapshot(rings[i], events[i]);
+		if (events_len[i] > 0 && events[i][0].tsc < base) base = events[i][0].tsc;
+		fprintf(stderr, "%s: %zu events\n", argv[i + 1], events_len[i]);
+	}
+
+	DumpState st = { .first = true };
+	for (size_t i = 0; i < rings_len; i++) {
+		st.handle_start = 0;
+		st.fanout_start = 0;
+		memset(st.submitted, 0, st.submitted_cap * sizeof(uint64_t));
+		dump_ring(&st, rings[i], events[i], events_len[i], base);
+
+		free(events[i]);
+		trace_ring_close(rings[i]);
+	}
+
+	printf("\n]}\n");
+	free(st.submitted);
+	free(rings);
+	free(events);
+	free(events_len);
+	return EXIT_SUCCESS;
+}
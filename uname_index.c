@@ -0,0 +1,227 @@
+#include <string.h>
+
+#include "uname_index.h"
+#include "utils.h"
+
+#define LOAD_FACTOR 0.75
+#define HASH_MULT 11400714819323198485llu
+#define ENTRIES_INIT_CAP 64
+
+static inline size_t home(uint64_t key, size_t cap) {
+	return (key * HASH_MULT) & (cap - 1);
+}
+
+/* FNV-1a, names are at most UNAME_INDEX_MAX_LEN bytes. */
+static uint64_t name_hash(const char *name, size_t len) {
+	uint64_t h = 14695981039346656037llu;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 1099511628211llu;
+	}
+	return h;
+}
+
+/* Assumes there is at least one empty slot. */
+static void slot_put(struct uname_slot *slots, size_t cap, uint64_t key, uint32_t idx) {
+	size_t i = home(key, cap);
+	while (slots[i].idx != 0) {
+		i = (i + 1) & (cap - 1);
+	}
+	slots[i].key = key;
+	slots[i].idx = idx;
+}
+
+/* Returns the slot pointing at entry idx, which must exist. */
+static struct uname_slot *slot_of(
+	struct uname_slot *slots,
+	size_t cap,
+	uint64_t key,
+	uint32_t idx
+) {
+	size_t i = home(key, cap);
+	while (slots[i].idx != idx) {
+		i = (i + 1) & (cap - 1);
+	}
+	return &slots[i];
+}
+
+/* Same backward shift deletion as cid_set_remove. */
+static void slot_delete(struct uname_slot *slots, size_t cap, struct uname_slot *s) {
+	size_t mask = cap - 1;
+	size_t i = s - slots;
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (slots[j].idx == 0) break;
+
+		size_t k = home(slots[j].key, cap);
+		bool in_place = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+		if (in_place) continue;
+
+		slots[i] = slots[j];
+		i = j;
+	}
+
+	slots[i].idx = 0;
+}
+
+static struct uname_slot *find_cid(UnameIndex *ix, uint64_t cid) {
+	size_t i = home(cid, ix->cap);
+	while (ix->by_cid[i].idx != 0) {
+		if (ix->by_cid[i].key == cid) {
+			return &ix->by_cid[i];
+		}
+		i = (i + 1) & (ix->cap - 1);
+	}
+	return NULL;
+}
+
+static struct uname_entry *find_name(UnameIndex *ix, uint64_t h, const char *name, size_t len) {
+	size_t i = home(h, ix->cap);
+	while (ix->by_name[i].idx != 0) {
+		if (ix->by_name[i].key == h) {
+			struct uname_entry *e = &ix->entries[ix->by_name[i].idx - 1];
+			if (e->len == len && memcmp(e->name, name, len) == 0) return e;
+		}
+		i = (i + 1) & (ix->cap - 1);
+	}
+	return NULL;
+}
+
+/**
+ * Number of usernames is bounded by connections, so both tables are rebuilt from
+ * the entries at once.
+ */
+static void grow(UnameIndex *ix) {
+	free(ix->by_name);
+	free(ix->by_cid);
+
+	ix->cap *= 2;
+	ix->by_name = must_calloc(ix->cap, sizeof(struct uname_slot), "uname_index grow");
+	ix->by_cid = must_calloc(ix->cap, sizeof(struct uname_slot), "uname_index grow");
+
+	for (size_t i = 0; i < ix->len; i++) {
+		struct uname_entry *e = &ix->entries[i];
+		slot_put(ix->by_name, ix->cap, name_hash(e->name, e->len), i + 1);
+		slot_put(ix->by_cid, ix->cap, e->cid, i + 1);
+	}
+}
+
+void uname_index_init(UnameIndex *ix, size_t cap) {
+	ix->len = 0;
+	ix->entries_cap = ENTRIES_INIT_CAP;
+	ix->entries = must_malloc(ENTRIES_INIT_CAP * sizeof(struct uname_entry), "uname_index_init");
+
+	ix->cap = 1;
+	while (ix->cap < cap) ix->cap <<= 1;
+	ix->by_name = must_calloc(ix->cap, sizeof(struct uname_slot), "uname_index_init");
+	ix->by_cid = must_calloc(ix->cap, sizeof(struct uname_slot), "uname_index_init");
+}
+
+void uname_index_reserve(UnameIndex *ix, size_t n) {
+	if (n > ix->entries_cap) {
+		ix->entries_cap = n;
+		ix->entries = must_realloc(
+			ix->entries, ix->entries_cap * sizeof(struct uname_entry), "uname_index_reserve");
+	}
+	while ((double)n > ix->cap * LOAD_FACTOR) grow(ix);
+
+	prefault(ix->entries, ix->entries_cap * sizeof(struct uname_entry));
+	prefault(ix->by_name, ix->cap * sizeof(struct uname_slot));
+	prefault(ix->by_cid, ix->cap * sizeof(struct uname_slot));
+}
+
+void uname_index_deinit(UnameIndex *ix) {
+	free(ix->entries);
+	free(ix->by_name);
+	free(ix->by_cid);
+}
+
+bool uname_index_set(UnameIndex *ix, uint64_t cid, const char *name, size_t len) {
+	uint64_t h = name_hash(name, len);
+	struct uname_entry *owner = find_name(ix, h, name, len);
+	if (owner != NULL) return owner->cid == cid;
+
+	struct uname_slot *s = find_cid(ix, cid);
+	if (s != NULL) {
+		uint32_t idx = s->idx;
+		struct uname_entry *e = &ix->entries[idx - 1];
+		uint64_t old_h = name_hash(e->name, e->len);
+		slot_delete(ix->by_name, ix->cap, slot_of(ix->by_name, ix->cap, old_h, idx));
+
+		e->len = len;
+		memcpy(e->name, name, len);
+		slot_put(ix->by_name, ix->cap, h, idx);
+		return true;
+	}
+
+	if ((double)(ix->len + 1) > ix->cap * LOAD_FACTOR) grow(ix);
+	if (ix->len == ix->entries_cap) {
+		ix->entries_cap *= 2;
+		ix->entries = must_realloc(
+			ix->entries, ix->entries_cap * sizeof(struct uname_entry), "uname_index_set");
+	}
+
+	struct uname_entry *e = &ix->entries[ix->len];
+	e->cid = cid;
+	e->len = len;
+	memcpy(e->name, name, len);
+	ix->len++;
+
+	slot_put(ix->by_name, ix->cap, h, ix->len);
+	slot_put(ix->by_cid, ix->cap, cid, ix->len);
+	return true;
+}
+
+bool uname_index_remove(UnameIndex *ix, uint64_t cid) {
+	struct uname_slot *s = find_cid(ix, cid);
+	if (s == NULL) return false;
+
+	uint32_t idx = s->idx;
+	struct uname_entry *e = &ix->entries[idx - 1];
+	slot_delete(ix->by_cid, ix->cap, s);
+	slot_delete(ix->by_name, ix->cap,
+		slot_of(ix->by_name, ix->cap, name_hash(e->name, e->len), idx));
+
+	/* Moves the last entry into the hole and repoints its slots. */
+	uint32_t last = ix->len;
+	if (idx != last) {
+		struct uname_entry *moved = &ix->entries[last - 1];
+		slot_of(ix->by_cid, ix->cap, moved->cid, last)->idx = idx;
+		slot_of(ix->by_name, ix->cap, name_hash(moved->name, moved->len), last)->idx = idx;
+		*e = *moved;
+	}
+	ix->len--;
+	return true;
+}
+
+bool uname_index_find(UnameIndex *ix, const char *name, size_t len, uint64_t *cid) {
+	struct uname_entry *e = find_name(ix, name_hash(name, len), name, len);
+	if (e == NULL) return false;
+
+	*cid = e->cid;
+	return true;
+}
+
+const struct uname_entry *uname_index_get(UnameIndex *ix, uint64_t cid) {
+	struct uname_slot *s = find_cid(ix, cid);
+	if (s == NULL) return NULL;
+	return &ix->entries[s->idx - 1];
+}
+
+void uname_index_get_batch(
+	UnameIndex *ix,
+	size_t n,
+	const uint64_t cids[n],
+	const struct uname_entry *entries[n]
+) {
+	for (size_t i = 0; i < n; i++) {
+		__builtin_prefetch(&ix->by_cid[home(cids[i], ix->cap)]);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		struct uname_slot *s = find_cid(ix, cids[i]);
+		entries[i] = s == NULL ? NULL : &ix->entries[s->idx - 1];
+		if (s != NULL) __builtin_prefetch(entries[i]);
+	}
+}
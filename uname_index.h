@@ -0,0 +1,83 @@
+#ifndef UNAME_INDEX_H
+#define UNAME_INDEX_H
+
+/**
+ * Directory of usernames, mapping each name to the client which set it and each
+ * client to its name.
+ *
+ * Entries are kept densely in an array and two open addressing tables with linear
+ * probing point into it: by_name is keyed by a hash of the name and by_cid by the
+ * client_id. A slot carries its key so that probing only touches the entry of a
+ * matching key, and resolving a batch of client_ids costs about two cache misses
+ * per id. Removing an entry moves the last one into its place.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define UNAME_INDEX_MAX_LEN 15
+
+struct uname_entry {
+	uint64_t cid;
+	uint8_t len;
+	/* Not NULL terminated. */
+	char name[UNAME_INDEX_MAX_LEN];
+};
+
+/* Empty slots have an idx of 0, otherwise idx is the index of the entry + 1. */
+struct uname_slot {
+	uint64_t key;
+	uint32_t idx;
+};
+
+typedef struct {
+	size_t len;
+	size_t entries_cap;
+	struct uname_entry *entries;
+
+	/* cap of both tables, must remain a power of 2. */
+	size_t cap;
+	struct uname_slot *by_name;
+	struct uname_slot *by_cid;
+} UnameIndex;
+
+/* cap is rounded up to a power of 2. */
+void uname_index_init(UnameIndex *ix, size_t cap);
+void uname_index_deinit(UnameIndex *ix);
+
+/* Sizes and faults in the index so that setting n usernames doesn't allocate. */
+void uname_index_reserve(UnameIndex *ix, size_t n);
+
+/**
+ * Sets the username of cid, replacing the one it had. len must be in
+ * [1, UNAME_INDEX_MAX_LEN]. Returns false if another client has the name, in
+ * which case the index is left unchanged.
+ */
+bool uname_index_set(UnameIndex *ix, uint64_t cid, const char *name, size_t len);
+
+/* Returns false if cid didn't have a username. */
+bool uname_index_remove(UnameIndex *ix, uint64_t cid);
+
+/* Sets cid to the client with the given name. Returns false if there is none. */
+bool uname_index_find(UnameIndex *ix, const char *name, size_t len, uint64_t *cid);
+
+/**
+ * Returns the entry of cid or NULL if it has no username. The entry is only valid
+ * until the next call to uname_index_set or uname_index_remove.
+ */
+const struct uname_entry *uname_index_get(UnameIndex *ix, uint64_t cid);
+
+/**
+ * Sets entries[i] to uname_index_get(ix, cids[i]) for n client_ids. The slots of
+ * all the ids are prefetched before any of them is probed, and likewise their
+ * entries, so that the cache misses of the batch overlap.
+ */
+void uname_index_get_batch(
+	UnameIndex *ix,
+	size_t n,
+	const uint64_t cids[n],
+	const struct uname_entry *entries[n]
+);
+
+#endif
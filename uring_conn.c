@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uring_conn.h"
+#include "utils.h"
+
+void out_buf_init(OutBuf *out, size_t cap) {
+	out->buf = must_malloc(cap, "out_buf_init malloc");
+	out->cap = cap;
+	out->len = 0;
+	out->sending = 0;
+}
+
+void out_buf_deinit(OutBuf *out) {
+	free(out->buf);
+	out->buf = NULL;
+}
+
+struct io_uring_sqe *conn_get_sqe(struct io_uring *ring) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	if (sqe != NULL) return sqe;
+
+	int ret = io_uring_submit(ring);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	sqe = io_uring_get_sqe(ring);
+	if (sqe == NULL) {
+		fprintf(stderr, "SQ is full\n");
+		exit(EXIT_FAILURE);
+	}
+	return sqe;
+}
+
+void out_buf_flush(struct io_uring *ring, OutBuf *out, int fd, size_t conn_idx) {
+	if (out->sending > 0 || out->len == 0) return;
+
+	struct io_uring_sqe *sqe = conn_get_sqe(ring);
+	io_uring_prep_send(sqe, fd, out->buf, out->len, 0);
+	io_uring_sqe_set_data64(sqe, USER_DATA(conn_idx, EV_SEND));
+	out->sending = out->len;
+}
+
+void out_buf_sent(OutBuf *out, size_t sent) {
+	memmove(out->buf, out->buf + sent, out->len - sent);
+	out->len -= sent;
+	out->sending = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef URING_CONN_H
+#define URING_CONN_H
+
+/**
+ * Connections of the client tools, loadgen and replay, which drive many of them
+ * through one io_uring per thread.
+ */
+
+#include <liburing.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+	EV_CONNECT,
+	EV_SEND,
+	EV_RECV,
+} EventType;
+
+/* user_data packs the index of the connection and the EventType. */
+#define USER_DATA(conn_idx, ev) (((uint64_t)(conn_idx) << 2) | (ev))
+#define USER_DATA_CONN(ud) ((ud) >> 2)
+#define USER_DATA_EV(ud) ((ud) & 3)
+
+/**
+ * Frames not yet handed to the kernel, buf[0..len). sending is the number of
+ * bytes covered by the send in flight.
+ */
+typedef struct {
+	char *buf;
+	size_t cap;
+	size_t len;
+	size_t sending;
+} OutBuf;
+
+void out_buf_init(OutBuf *out, size_t cap);
+void out_buf_deinit(OutBuf *out);
+
+/* Submits what's queued if the SQ is full, instead of giving up. */
+struct io_uring_sqe *conn_get_sqe(struct io_uring *ring);
+
+/* Hands every queued frame to the kernel unless a send is already in flight. */
+void out_buf_flush(struct io_uring *ring, OutBuf *out, int fd, size_t conn_idx);
+
+/* Drops the sent bytes of the send in flight. Frames queued meanwhile move to the front. */
+void out_buf_sent(OutBuf *out, size_t sent);
+
+#endif
@@ -6,6 +6,10 @@
 #include <stdbool.h>
 #include <fcntl.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 void fatal_error(const char *msg) {
 	perror(msg);
 	exit(EXIT_FAILURE);
@@ -48,16 +52,84 @@ void write_int_to_buffer(char *buf, int value) {
 	memcpy(buf, &network_value, sizeof(int));
 }
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-uint64_t htonll(uint64_t val) {
-    return ((uint64_t)htonl(val >> 32)) | ((uint64_t)htonl(val & 0xFFFFFFFF) << 32);
+/**
+ * Swapping bytes is the same operation in both directions, so all bulk conversions
+ * go through bswap64_copy. dst and src may be unaligned but must not overlap.
+ */
+static void bswap64_copy_scalar(size_t n, char *dst, const char *src) {
+	for (size_t i = 0; i < n; i++) {
+		uint64_t v;
+		memcpy(&v, src + i * sizeof(uint64_t), sizeof(v));
+		v = htonll(v);
+		memcpy(dst + i * sizeof(uint64_t), &v, sizeof(v));
+	}
 }
-uint64_t ntohll(uint64_t val) {
-    return ((uint64_t)ntohl(val >> 32)) | ((uint64_t)ntohl(val & 0xFFFFFFFF) << 32);
+
+#if defined(__x86_64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+__attribute__((target("avx2")))
+static void bswap64_copy_avx2(size_t n, char *dst, const char *src) {
+	/* Reverses the bytes of each 64-bit lane. The shuffle works per 128-bit half. */
+	const __m256i rev = _mm256_setr_epi8(
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+	);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i * sizeof(uint64_t)));
+		v = _mm256_shuffle_epi8(v, rev);
+		_mm256_storeu_si256((__m256i *)(dst + i * sizeof(uint64_t)), v);
+	}
+
+	bswap64_copy_scalar(n - i, dst + i * sizeof(uint64_t), src + i * sizeof(uint64_t));
+}
+
+#endif
+
+typedef void (*bswap64_copy_fn)(size_t, char *, const char *);
+
+static void bswap64_copy_resolve(size_t n, char *dst, const char *src);
+
+/* Resolved to the best implementation for this CPU on the first call. */
+static bswap64_copy_fn bswap64_copy = bswap64_copy_resolve;
+
+static void bswap64_copy_resolve(size_t n, char *dst, const char *src) {
+	bswap64_copy_fn impl = bswap64_copy_scalar;
+#if defined(__x86_64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		impl = bswap64_copy_avx2;
+	}
+#endif
+	bswap64_copy = impl;
+	impl(n, dst, src);
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+void ntohll_bulk(size_t n, uint64_t dst[n], const char *src) {
+	bswap64_copy(n, (char *)dst, src);
+}
+
+void htonll_bulk(size_t n, char *dst, const uint64_t src[n]) {
+	bswap64_copy(n, dst, (const char *)src);
+}
+
+void ntohll_bulk_scalar(size_t n, uint64_t dst[n], const char *src) {
+	bswap64_copy_scalar(n, (char *)dst, src);
 }
 #else
-uint64_t htonll(uint64_t val) { return val; }
-uint64_t ntohll(uint64_t val) { return val; }
+void ntohll_bulk(size_t n, uint64_t dst[n], const char *src) {
+	memcpy(dst, src, n * sizeof(uint64_t));
+}
+
+void htonll_bulk(size_t n, char *dst, const uint64_t src[n]) {
+	memcpy(dst, src, n * sizeof(uint64_t));
+}
+
+void ntohll_bulk_scalar(size_t n, uint64_t dst[n], const char *src) {
+	memcpy(dst, src, n * sizeof(uint64_t));
+}
 #endif
 
 bool is_prime(size_t n) {
@@ -87,3 +159,9 @@ void set_nonblocking(int fd) {
 		fatal_error("fcntl(F_SETFL, O_NONBLOCK)");
 }
 
+void prefault(void *p, size_t len) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	volatile char *c = p;
+	for (size_t i = 0; i < len; i += page) c[i] = c[i];
+	if (len > 0) c[len - 1] = c[len - 1];
+}
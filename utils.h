@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #define ROUND_UP_POW_2(x) \
 	(((x) < 1) ? 1 : ({ \
@@ -24,9 +25,32 @@ void must_close(int fd, const char *msg);
 void must_shutdown(int fd, const char *msg);
 int read_int_from_buffer(const char *buf);
 void write_int_to_buffer(char *buf, int value);
-uint64_t htonll(uint64_t val);
-uint64_t ntohll(uint64_t val);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline uint64_t htonll(uint64_t val) { return __builtin_bswap64(val); }
+static inline uint64_t ntohll(uint64_t val) { return __builtin_bswap64(val); }
+#else
+static inline uint64_t htonll(uint64_t val) { return val; }
+static inline uint64_t ntohll(uint64_t val) { return val; }
+#endif
+
+/**
+ * Bulk conversion of n 64-bit ids between network and host byte order. The
+ * network side doesn't need to be aligned. Byte swaps 4 ids per instruction
+ * with AVX2 when the CPU supports it, which is detected on the first call.
+ */
+void ntohll_bulk(size_t n, uint64_t dst[n], const char *src);
+void htonll_bulk(size_t n, char *dst, const uint64_t src[n]);
+
+/* One id at a time with __builtin_bswap64. Exposed for tests and benchmarks. */
+void ntohll_bulk_scalar(size_t n, uint64_t dst[n], const char *src);
 size_t closest_prime(size_t n);
 void set_nonblocking(int fd);
 
+/**
+ * Touches every page of [p, p + len), keeping its contents, so that they are
+ * faulted in now rather than on first use.
+ */
+void prefault(void *p, size_t len);
+
 #endif